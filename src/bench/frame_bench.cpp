@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "tiny_camera.hpp"
+#include "frame_bench.h"
+#include "log.h"
+
+/*
+ * Per frame cost of the C++ binding against the same loops written in C.
+ * Replays a recording unpaced, so the numbers are the API overhead plus the
+ * replay backend, with the identical backend cost in every row.
+ *
+ *   frame_bench recording [frames per pass] [passes]
+ */
+
+using clock_type = std::chrono::steady_clock;
+
+#define BENCH_MODES     (5)
+
+struct result {
+    const char          *name;
+    std::vector<double> ns;                 /* Per frame, one entry per pass */
+    uint64_t            sum;
+};
+
+/* Passes of all modes are interleaved so drift and noise hit every mode alike. */
+template <class... F>
+static void measure(tiny_camera::Camera &cam, uint64_t frames, int passes, const char *const *names, F... pass)
+{
+    result results[BENCH_MODES];
+    int i, m;
+
+    for (m = 0; m < BENCH_MODES; m++) {
+        results[m].name = names[m];
+        results[m].ns.reserve(passes);
+        results[m].sum = 0;
+    }
+    /* Pass 0 warms up caches and page tables. */
+    for (i = 0; i <= passes; i++) {
+        m = 0;
+        ([&] {
+            auto start = clock_type::now();
+            uint64_t sum = pass(cam, frames);
+            auto ns = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+            if (i) {
+                results[m].ns.push_back(ns / frames);
+                results[m].sum += sum;
+            }
+            m++;
+        }(), ...);
+    }
+    printf("%-16s %12s %12s %s\n", "", "min ns/frame", "median", "checksum");
+    for (m = 0; m < BENCH_MODES; m++) {
+        std::sort(results[m].ns.begin(), results[m].ns.end());
+        printf("%-16s %12.1f %12.1f %llu\n", results[m].name, results[m].ns.front(),
+                results[m].ns[results[m].ns.size() / 2], (unsigned long long)results[m].sum);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t frames = argc > 2 ? strtoull(argv[2], NULL, 0) : 30;
+    int passes = argc > 3 ? atoi(argv[3]) : 1000;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s recording [frames per pass] [passes]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    set_log_level(ERROR);
+    try {
+        tiny_camera::Camera cam(argv[1], { .replay_speed = 0 });
+        static const char *const names[BENCH_MODES] = {
+            "C steps", "C++ Frame", "C++ generator", "C stream", "C++ Stream",
+        };
+
+        measure(cam, frames, passes, names,
+            [](tiny_camera::Camera &cam, uint64_t n) {
+                cam.start();
+                uint64_t sum = bench_c_steps(cam.get(), n);
+                cam.stop();
+                return sum;
+            },
+            [](tiny_camera::Camera &cam, uint64_t n) {
+                uint64_t sum = 0;
+                cam.start();
+                for (uint64_t i = 0; i < n; i++) {
+                    tiny_camera::Frame frame = cam.dequeue();
+                    sum += uint8_t(frame.data()[frame.data().size() / 2]);
+                }
+                cam.stop();
+                return sum;
+            },
+            [](tiny_camera::Camera &cam, uint64_t n) {
+                uint64_t sum = 0;
+                cam.start();
+                for (tiny_camera::Frame &frame : cam.frames(n))
+                    sum += uint8_t(frame.data()[frame.data().size() / 2]);
+                cam.stop();
+                return sum;
+            },
+            [](tiny_camera::Camera &cam, uint64_t n) {
+                struct camera_stream *stream = bench_c_stream_create(cam.get());
+                camera_stream_start(stream);
+                uint64_t sum = bench_c_stream(stream, n);
+                camera_stream_stop(stream);
+                camera_stream_destroy(stream);
+                return sum;
+            },
+            [](tiny_camera::Camera &cam, uint64_t n) {
+                uint64_t sum = 0;
+                tiny_camera::Stream stream(cam, [&sum](std::span<const std::byte> data, const v4l2_buffer &) {
+                    sum += uint8_t(data[data.size() / 2]);
+                });
+                stream.run(n);
+                return sum;
+            });
+    } catch (const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#ifndef _FRAME_BENCH_
+#define _FRAME_BENCH_
+
+#include "camera.h"
+#include "stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint64_t bench_c_steps(struct v4l2_camera *cam, uint64_t frames);
+uint64_t bench_c_stream(struct camera_stream *stream, uint64_t frames);
+struct camera_stream *bench_c_stream_create(struct v4l2_camera *cam);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+#include "camera.h"
+#include "api.h"
+#include "stream.h"
+#include "frame_bench.h"
+
+/* The loops a C application writes by hand, the baseline for the C++ binding. */
+
+uint64_t bench_c_steps(struct v4l2_camera *cam, uint64_t frames)
+{
+    struct v4l2_buffer buffer_info;
+    struct buffer buffer;
+    uint64_t i, sum = 0;
+
+    for (i = 0; i < frames; i++) {
+        if (camera_dequeue_buffer(cam, &buffer_info) ||
+                camera_get_buffer(cam, &buffer_info, &buffer))
+            break;
+        sum += ((const uint8_t *)buffer.addr)[buffer.size / 2];
+        if (camera_queue_buffer(cam, &buffer_info))
+            break;
+    }
+    return sum;
+}
+
+static int sum_frame(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info, struct buffer buffer, void *priv)
+{
+    *(uint64_t *)priv += ((const uint8_t *)buffer.addr)[buffer.size / 2];
+    return CAMERA_RETURN_SUCCESS;
+}
+
+uint64_t bench_c_stream(struct camera_stream *stream, uint64_t frames)
+{
+    uint64_t sum = 0;
+
+    stream->priv = &sum;
+    camera_stream_run(stream, frames);
+    return sum;
+}
+
+struct camera_stream *bench_c_stream_create(struct v4l2_camera *cam)
+{
+    return camera_stream_create(cam, sum_frame, NULL, 0);
+}
@@ -0,0 +1,165 @@
+#include <math.h>
+#include <time.h>
+
+#include "camera.h"
+#include "tnr.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Per pixel cost of the temporal noise reduction at 1080p and 4K, and how
+ * much of the sensor noise it takes out of a static scene. Frames are a
+ * flat gradient with Gaussian noise and a moving square, cycled from a
+ * small set so generating them stays out of the timing.
+ *
+ *   tnr_bench [frames per pass] [passes] [strength,threshold]
+ */
+
+#define BENCH_SOURCES       (8)
+#define BENCH_NOISE         (4.0)           /* Sigma in levels */
+#define BENCH_SQUARE        (128)
+
+struct bench_size {
+    const char  *name;
+    uint32_t    width;
+    uint32_t    height;
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double gaussian(unsigned *seed)
+{
+    double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0), v = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+/* Noise free value of byte i, chroma bytes are flat. */
+static uint8_t clean_value(struct v4l2_pix_format *pix, size_t i, int frame)
+{
+    uint32_t x, y, luma_size = pix->width * pix->height;
+
+    if (pix->pixelformat == V4L2_PIX_FMT_YUYV) {
+        if (i & 1)
+            return 128;
+        x = (i / 2) % pix->width;
+        y = (i / 2) / pix->width;
+    } else {
+        if (i >= luma_size)
+            return 128;
+        x = i % pix->width;
+        y = i / pix->width;
+    }
+    if (x - frame * 16 < BENCH_SQUARE && y < BENCH_SQUARE)
+        return 230;
+    return 40 + (x + y) * 150 / (pix->width + pix->height);
+}
+
+static void make_frames(struct v4l2_pix_format *pix, uint8_t **frames)
+{
+    unsigned seed = 1;
+    size_t i;
+    int f, v;
+
+    for (f = 0; f < BENCH_SOURCES; f++) {
+        for (i = 0; i < pix->sizeimage; i++) {
+            v = clean_value(pix, i, f) + lrint(gaussian(&seed) * BENCH_NOISE);
+            frames[f][i] = v < 0 ? 0 : v > 255 ? 255 : v;
+        }
+    }
+}
+
+/* Luma noise left outside the moving square, against the clean frame. */
+static double residual_noise(struct v4l2_pix_format *pix, const uint8_t *frame, int index)
+{
+    size_t i, n = 0, step = pix->pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+    size_t luma = (size_t)pix->width * pix->height * step;
+    double sum = 0, d;
+
+    for (i = (size_t)pix->width * step * (BENCH_SQUARE + 8); i < luma; i += step) {
+        d = frame[i] - clean_value(pix, i, index);
+        sum += d * d;
+        n++;
+    }
+    return sqrt(sum / n);
+}
+
+static int run(const struct bench_size *size, uint32_t pixelformat, struct tnr_config *config,
+        int frames, int passes)
+{
+    struct v4l2_pix_format pix = {
+        .width          = size->width,
+        .height         = size->height,
+        .pixelformat    = pixelformat,
+    };
+    uint8_t *source[BENCH_SOURCES];
+    double best = 0, ns, before, after;
+    struct buffer buffer;
+    struct tnr *tnr;
+    int f, i, p;
+
+    pix.bytesperline = pixelformat == V4L2_PIX_FMT_YUYV ? pix.width * 2 : pix.width;
+    pix.sizeimage = pixelformat == V4L2_PIX_FMT_YUYV ? pix.bytesperline * pix.height :
+        pix.bytesperline * pix.height * 3 / 2;
+    for (f = 0; f < BENCH_SOURCES; f++) {
+        source[f] = malloc(pix.sizeimage);
+        if (!source[f])
+            return EXIT_FAILURE;
+    }
+    make_frames(&pix, source);
+    tnr = tnr_create(&pix, pix.sizeimage, config);
+    if (!tnr)
+        return EXIT_FAILURE;
+    /* Pass 0 warms up caches and page tables. */
+    for (p = 0; p <= passes; p++) {
+        ns = now_ns();
+        for (i = 0; i < frames; i++) {
+            buffer.addr = source[i % BENCH_SOURCES];
+            buffer.size = pix.sizeimage;
+            tnr_process(tnr, &buffer);
+        }
+        ns = (now_ns() - ns) / frames;
+        if (p && (!best || ns < best))
+            best = ns;
+    }
+    f = (frames - 1) % BENCH_SOURCES;
+    before = residual_noise(&pix, source[f], f);
+    after = residual_noise(&pix, buffer.addr, f);
+    printf("%-6s %-5s %10.3f %12.3f %10.2f %10.2f\n", size->name, fmt2desc(pixelformat), best / 1e6,
+            best / (pix.width * pix.height), before, after);
+    tnr_destroy(tnr);
+    for (f = 0; f < BENCH_SOURCES; f++)
+        free(source[f]);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct bench_size sizes[] = {
+        { "1080p", 1920, 1080 },
+        { "4K", 3840, 2160 },
+    };
+    static const uint32_t formats[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12 };
+    int frames = argc > 1 ? atoi(argv[1]) : 32;
+    int passes = argc > 2 ? atoi(argv[2]) : 10;
+    struct tnr_config config;
+    size_t s, f;
+
+    if (tnr_parse_config(&config, argc > 3 ? argv[3] : "3") || frames < 1 || passes < 1) {
+        fprintf(stderr, "Usage: %s [frames per pass] [passes] [strength,threshold]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    set_log_level(ERROR);
+    printf("%-6s %-5s %10s %12s %10s %10s\n", "", "", "ms/frame", "ns/pixel", "noise in", "noise out");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+            if (run(&sizes[s], formats[f], &config, frames, passes))
+                return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#ifndef _AE_
+#define _AE_
+
+#include "camera.h"
+#include "stats.h"
+
+#define AE_DEFAULT_TARGET       (110)       /* Mean luma, mid grey after gamma */
+#define AE_DEFAULT_INTERVAL     (4)         /* Frames between adjustments, lets the sensor settle */
+#define AE_DEFAULT_TOLERANCE    (8)         /* Luma deadband around the target */
+#define AE_DEFAULT_MAX_STEP     (1.5)       /* Largest exposure ratio per adjustment */
+#define AE_DEFAULT_CLIP_LIMIT   (0.02)      /* Clipped ratio that forces the exposure down */
+
+/* Parsed from "target[,interval[,step]]", step is the statistics subsampling. */
+struct ae_config {
+    int                 target;
+    int                 interval;
+    int                 tolerance;
+    double              max_step;
+    double              clip_limit;
+    struct stats_config stats;
+};
+
+struct ae_control {
+    uint32_t            id;
+    int                 present;
+    int                 minimum;
+    int                 maximum;
+    int                 step;
+    int                 value;
+};
+
+/*
+ * Software auto exposure on top of the luma statistics. Without writable
+ * exposure or gain controls, e.g. on replay, it only measures.
+ */
+struct auto_exposure {
+    struct ae_config    config;
+    struct ae_control   exposure;
+    struct ae_control   gain;
+    struct ae_control   exposure_auto;      /* Driver modes we turned off, value is the old mode */
+    struct ae_control   autogain;
+    struct luma_stats   stats;
+    int                 enabled;
+    int                 frame;
+};
+
+int ae_parse_config(struct ae_config *config, const char *spec);
+int ae_init(struct auto_exposure *ae, struct v4l2_camera *cam, struct ae_config *config);
+int ae_process(struct auto_exposure *ae, struct v4l2_camera *cam, struct buffer buffer);
+void ae_destroy(struct auto_exposure *ae, struct v4l2_camera *cam);
+
+#endif
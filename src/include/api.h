@@ -2,9 +2,14 @@
 #define __TINY_CAMERA_API_
 #include <linux/videodev2.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct v4l2_camera *camera_create_object();
 int camera_free_object(struct v4l2_camera *cam);
 int camera_dequeue_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info);
+int camera_dequeue_latest(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info);
 int camera_queue_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info);
 int camera_start_capturing(struct v4l2_camera *cam);
 int camera_stop_capturing(struct v4l2_camera *cam);
@@ -13,11 +18,28 @@ int camera_request_and_map_buffer(struct v4l2_camera *cam);
 int camera_return_and_unmap_buffer(struct v4l2_camera *cam);
 int camera_open_device(struct v4l2_camera *cam);
 int camera_close_device(struct v4l2_camera *cam);
+int camera_shutdown(struct v4l2_camera *cam);
 int camera_query_cap(struct v4l2_camera *cam);
 int camera_query_support_control(struct v4l2_camera *cam);
 int camera_query_support_format(struct v4l2_camera *cam);
+int camera_load_profile(struct v4l2_camera *cam, const char *dir);
+int camera_save_profile(struct v4l2_camera *cam, const char *dir);
 int camera_get_output_format(struct v4l2_camera *cam);
 int camera_set_output_format(struct v4l2_camera *cam);
 int camera_get_control(struct v4l2_camera *cam, struct v4l2_control *ctrl);
 int camera_set_control(struct v4l2_camera *cam, struct v4l2_control *ctrl);
+int camera_get_cached_control(struct v4l2_camera *cam, struct v4l2_control *ctrl);
+int camera_subscribe_events(struct v4l2_camera *cam, uint32_t mask, camera_event_func func, void *priv);
+int camera_dispatch_events(struct v4l2_camera *cam);
+int camera_get_poll_fd(struct v4l2_camera *cam, int *fd);
+int camera_set_roi(struct v4l2_camera *cam, const struct v4l2_rect *roi);
+int camera_get_roi_view(struct v4l2_camera *cam, struct buffer buffer, struct image_view *view);
+int camera_set_frame_rate(struct v4l2_camera *cam, double *fps);
+int camera_recover(struct v4l2_camera *cam, int action);
+int camera_prepare_mode(struct v4l2_camera *cam, struct v4l2_pix_format *pix);
+int camera_switch_mode(struct v4l2_camera *cam);
+
+#ifdef __cplusplus
+}
+#endif
 #endif
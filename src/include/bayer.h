@@ -0,0 +1,54 @@
+#ifndef _BAYER_
+#define _BAYER_
+
+#include <stdint.h>
+#include "camera.h"
+
+#define BAYER_PAD           (2)             /* Mirrored pixels left and right of a line */
+#define BAYER_RAW_LINES     (8)             /* Ring of normalized lines, covers the 7 line window */
+#define BAYER_GREEN_LINES   (4)             /* Ring of interpolated green lines */
+
+/* Unpacked Bayer formats, samples wider than 8 bits sit in little endian 16 bit words. */
+struct bayer_format {
+    uint32_t            pixelformat;
+    int                 red_x;              /* Position of red in the 2x2 tile */
+    int                 red_y;
+    int                 bits;
+};
+
+enum demosaic_method {
+    DEMOSAIC_BILINEAR,
+    DEMOSAIC_EDGE,                          /* Green along the smaller gradient, color differences for red and blue */
+    DEMOSAIC_HALF,                          /* One pixel per 2x2 tile, the preview fast path */
+};
+
+/*
+ * Demosaic to RGB24 or YUYV (BT.601 limited range), a line at a time. Lines
+ * are normalized to 8 bits into a small ring, mirrored at the borders so
+ * the color phase holds, and the kernels run on whole vectors per line.
+ */
+struct demosaic {
+    struct bayer_format format;
+    int                 method;
+    uint32_t            out_format;
+    uint32_t            width;              /* Input, even */
+    uint32_t            height;
+    uint32_t            out_width;
+    uint32_t            out_height;
+    size_t              out_size;           /* Bytes written by demosaic_process */
+    size_t              line_size;          /* Bytes per ring line, padding and vector slack included */
+    uint8_t             *raw[BAYER_RAW_LINES];
+    int                 raw_y[BAYER_RAW_LINES];
+    uint8_t             *green[BAYER_GREEN_LINES];
+    int                 green_y[BAYER_GREEN_LINES];
+    uint8_t             *plane[3];          /* One output line as R, G, B planes */
+    const struct image_view *src;           /* Frame of the running demosaic_process */
+};
+
+int bayer_lookup(uint32_t pixelformat, struct bayer_format *format);
+struct demosaic *demosaic_create(uint32_t pixelformat, uint32_t width, uint32_t height, int method, uint32_t out_format);
+int demosaic_parse_method(const char *name);
+int demosaic_process(struct demosaic *d, const struct image_view *src, struct buffer *dst);
+void demosaic_destroy(struct demosaic *d);
+
+#endif
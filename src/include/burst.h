@@ -0,0 +1,48 @@
+#ifndef _BURST_
+#define _BURST_
+
+#include <stdint.h>
+#include "camera.h"
+
+#define BURST_MAX_FRAMES        (4096)
+#define BURST_BUDGET_PERCENT    (75)        /* Share of MemAvailable a burst takes without an explicit budget */
+#define BURST_EXT_SIZE          (16)
+
+struct burst_frame {
+    struct v4l2_buffer  info;
+    size_t              size;               /* Bytes used in the slot */
+    uint32_t            restarts;           /* Sequence restarts before this frame */
+};
+
+/*
+ * Bursts of consecutive frames captured to RAM. The whole region is
+ * reserved, faulted in and locked if allowed before stream on, so the
+ * capture path only copies, with streaming stores that leave the caches
+ * alone. Disk I/O waits for burst_flush() after stream off, which writes
+ * the frames in parallel. Drops are counted from v4l2_buffer.sequence, a
+ * sequence going backwards is a restarted stream, whose drops can't be told.
+ */
+struct burst {
+    struct v4l2_pix_format  pix;
+    size_t                  slot_size;      /* Page aligned */
+    uint32_t                capacity;
+    uint32_t                count;
+    uint8_t                 *base;
+    size_t                  map_size;
+    int                     hugepage;
+    int                     locked;
+    struct burst_frame      *frame;
+    uint32_t                drops;          /* Sequence gaps between burst frames */
+    uint32_t                restarts;       /* Sequence went backwards, the stream restarted */
+    uint32_t                errors;         /* Frames the driver flagged corrupt */
+    int                     failed;         /* Flush errors, set by the writers */
+    char                    ext[BURST_EXT_SIZE];    /* File extension, copied for the writers */
+};
+
+int burst_parse_options(const char *spec, uint32_t *count, uint64_t *budget);
+struct burst *burst_create(struct v4l2_pix_format *pix, size_t frame_size, uint32_t count, uint64_t budget);
+int burst_add(struct burst *burst, struct v4l2_buffer *buffer_info, struct buffer buffer);
+int burst_flush(struct burst *burst, const char *ext, int threads);
+void burst_destroy(struct burst *burst);
+
+#endif
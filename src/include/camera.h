@@ -7,12 +7,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <linux/videodev2.h>
+#include "fault.h"
 
 #define MAX_BUFFER_NUM (8)
 #define MIN_BUFFER_NUM (2)
@@ -21,6 +23,10 @@
 #define DEFAULT_IMAGE_HEIGHT    (1280)
 #define DEFAULT_DEVICE          "/dev/video0"
 
+#define MAX_FORMAT_NUM          (32)
+#define MAX_CONTROL_NUM         (64)
+#define MAX_VIDEO_NODE          (64)        /* /dev/videoN searched for a reconnected device */
+
 #define ZAP(x) memset (&(x), 0, sizeof (x))
 
 enum camera_return_type {
@@ -43,14 +49,100 @@ enum camera_state_type {
 #undef __CONVERT__
 };
 
+/* Escalating ways back to streaming after an error, see camera_recover(). */
+enum camera_recover_action {
+    CAMERA_RECOVER_REQUEUE,                 /* Give buffers lost on an error back to the driver */
+    CAMERA_RECOVER_RESTART,                 /* STREAMOFF and STREAMON, the mappings are kept */
+    CAMERA_RECOVER_REOPEN,                  /* Find the device again by bus_info and rebuild */
+    CAMERA_RECOVER_MAX,
+};
+
 struct buffer {
     void        *addr;                      /* Data start addr */
     size_t      size;                       /* Data size */
 };
 
+/* Zero-copy window into a frame, rows are stride bytes apart. */
+struct image_view {
+    uint8_t     *addr;                      /* First byte of the top left pixel */
+    uint8_t     *chroma;                    /* Interleaved chroma of NV12/NV21, else NULL */
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    stride;
+    uint32_t    pixelformat;
+};
+
 struct buffer_queue {
     struct buffer       *buf;               /* Array of struct buffer point */
     int                 count;              /* Total buffer number */
+    int                 base;               /* V4L2 index of buf[0] */
+};
+
+/* Result of format and control enumeration, cacheable per device. */
+struct camera_profile {
+    int                     format_count;
+    struct v4l2_fmtdesc     format[MAX_FORMAT_NUM];
+    int                     control_count;
+    struct v4l2_queryctrl   control[MAX_CONTROL_NUM];
+};
+
+/* Streaming statistics, fed into the metrics registry. */
+struct camera_stats {
+    uint64_t                frames;
+    uint32_t                last_sequence;
+    struct timeval          last_timestamp;
+    double                  fps;
+    int                     held;           /* Buffers dequeued by the application */
+    uint64_t                delivered;      /* Frames handed to the consumer */
+    uint32_t                last_delivered; /* Sequence of the last frame handed out */
+};
+
+/* V4L2 events followed by camera_subscribe_events(). */
+enum camera_event_type {
+    CAMERA_EVENT_SOURCE_CHANGE  = 1 << 0,   /* Resolution or signal change, the buffers are reallocated */
+    CAMERA_EVENT_CTRL           = 1 << 1,   /* Control value, range or flags change, the cache follows */
+    CAMERA_EVENT_EOS            = 1 << 2,   /* The driver has no more frames */
+    CAMERA_EVENT_ALL            = (1 << 3) - 1,
+};
+
+struct v4l2_camera;
+
+/*
+ * Return anything but CAMERA_RETURN_SUCCESS to end the stream. A source
+ * change is reported once the buffers fit the new cam->fmt.
+ */
+typedef int (*camera_event_func)(struct v4l2_camera *cam, const struct v4l2_event *ev, void *priv);
+
+/* Frame source backend, V4L2 device or replay of a recorded file. */
+struct camera_ops {
+    int     (*open_device)(struct v4l2_camera *cam);
+    void    (*close_device)(struct v4l2_camera *cam);
+    int     (*query_cap)(struct v4l2_camera *cam);
+    void    (*query_support_control)(struct v4l2_camera *cam);
+    void    (*query_support_format)(struct v4l2_camera *cam);
+    int     (*get_output_format)(struct v4l2_camera *cam);
+    int     (*set_output_format)(struct v4l2_camera *cam);
+    int     (*request_and_map_buffer)(struct v4l2_camera *cam);
+    void    (*return_and_unmap_buffer)(struct v4l2_camera *cam);
+    int     (*start_capturing)(struct v4l2_camera *cam);
+    void    (*stop_capturing)(struct v4l2_camera *cam);
+    int     (*dequeue_buffer)(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info);
+    int     (*buffer_ready)(struct v4l2_camera *cam);   /* Would dequeue_buffer return at once */
+    int     (*poll_fd)(struct v4l2_camera *cam);        /* Readable while a buffer is ready */
+    int     (*set_crop)(struct v4l2_camera *cam, struct v4l2_rect *rect);  /* Driver adjusts rect, NULL for the default crop */
+    int     (*get_frame_interval)(struct v4l2_camera *cam, struct v4l2_fract *interval);
+    int     (*set_frame_interval)(struct v4l2_camera *cam, struct v4l2_fract *interval);   /* Driver adjusts */
+    int     (*enum_frame_interval)(struct v4l2_camera *cam, struct v4l2_frmivalenum *ival);  /* At fmt, by ival->index */
+    int     (*queue_buffer)(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info);
+    int     (*requeue_all)(struct v4l2_camera *cam);    /* Queue every buffer the driver doesn't own */
+    int     (*reopen)(struct v4l2_camera *cam);         /* Close, locate the same device and open it */
+    int     (*prepare_mode)(struct v4l2_camera *cam);   /* Adjust alt_fmt, allocate alt_bufq if possible */
+    int     (*switch_mode)(struct v4l2_camera *cam, int *fast); /* Swap fmt and alt_fmt, not streaming */
+    int     (*get_control)(struct v4l2_camera *cam, struct v4l2_control *ctrl);
+    int     (*set_control)(struct v4l2_camera *cam, struct v4l2_control *ctrl);
+    int     (*subscribe_event)(struct v4l2_camera *cam, struct v4l2_event_subscription *sub);
+    int     (*dequeue_event)(struct v4l2_camera *cam, struct v4l2_event *ev);  /* -ENOENT when none is pending */
+    int     (*update_source)(struct v4l2_camera *cam);  /* Pick up fmt after a source change, no buffers */
 };
 
 struct v4l2_camera {
@@ -58,14 +150,34 @@ struct v4l2_camera {
     char                    *dev_name;      /* Device name */
     int                     fd;
     int                     state;          /* Current state */
+    int                     error_state;    /* State the last error happened in */
     struct v4l2_format      fmt;            /* Output format */
     struct v4l2_capability  cap;
     struct buffer_queue     bufq;
+    struct camera_profile   profile;        /* Supported formats and controls */
+    struct camera_stats     stats;
+    const struct camera_ops *ops;           /* Frame source backend */
+    void                    *source;        /* Backend private data */
+    float                   replay_speed;   /* Replay pacing factor, 0 for no pacing */
+    struct v4l2_rect        roi;            /* Region of interest, zero size for the full frame */
+    struct v4l2_rect        sensor_crop;    /* Crop applied by the driver, zero size for none */
+    uint32_t                request_width;  /* Format size asked for before the sensor crop replaced it */
+    uint32_t                request_height;
+    struct v4l2_fract       frame_interval; /* Set by camera_set_frame_rate, zero for the default */
+    struct v4l2_fract       default_interval;   /* Before camera_set_frame_rate, put back at close */
+    char                    dev_path[32];   /* dev_name points here once a reopen moved the device */
+    struct v4l2_format      alt_fmt;        /* Alternate mode of camera_switch_mode, zero type for none */
+    struct buffer_queue     alt_bufq;       /* Buffers preallocated for alt_fmt, may be empty */
+    uint32_t                event_mask;     /* CAMERA_EVENT_* subscribed */
+    camera_event_func       event_func;
+    void                    *event_priv;
+    int32_t                 control_value[MAX_CONTROL_NUM];    /* Of profile.control[i], kept by V4L2_EVENT_CTRL */
+    uint64_t                control_cached; /* Bit i set while control_value[i] is current */
 
     void                    *priv;          /* user spec data */
 };
 
-static inline char * camera_state_to_string(enum camera_state_type type)
+static inline const char * camera_state_to_string(enum camera_state_type type)
 {
     switch (type) {
 #define __CONVERT__(x) case x: return #x;
@@ -75,9 +187,20 @@ static inline char * camera_state_to_string(enum camera_state_type type)
     return "CAMERA_STATE_ERROR";
 }
 
+static inline const char *camera_recover_to_string(int action)
+{
+    static const char *name[CAMERA_RECOVER_MAX] = { "requeue", "restart", "reopen" };
+
+    return action >= 0 && action < CAMERA_RECOVER_MAX ? name[action] : "none";
+}
+
 static inline int xioctl(int fd,int request,void *arg)
 {
     int r;
+    if (fault_on() && (r = fault_inject(request))) {
+        errno = r;
+        return -1;
+    }
     do{ r = ioctl(fd, request, arg); }
     while(-1 == r && EINTR == errno);
     return r;
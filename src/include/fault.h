@@ -0,0 +1,61 @@
+#ifndef _FAULT_
+#define _FAULT_
+
+#include <stdint.h>
+
+#define FAULT_ENV               "TINY_CAMERA_FAULT"
+#define FAULT_SEED_ENV          "TINY_CAMERA_FAULT_SEED"
+#define FAULT_MAX_RULES         (16)
+
+enum fault_delay {
+    FAULT_DELAY_NONE,
+    FAULT_DELAY_FIXED,                      /* a us */
+    FAULT_DELAY_UNIFORM,                    /* a to b us */
+    FAULT_DELAY_NORMAL,                     /* Mean a, deviation b us, clamped at 0 */
+    FAULT_DELAY_EXP,                        /* Exponential with mean a us */
+};
+
+struct fault_rule {
+    unsigned int        request;            /* VIDIOC_*, 0 for every request */
+    const char          *name;
+    int                 delay;
+    double              a;
+    double              b;
+    int                 error;              /* errno the ioctl fails with, 0 for a delay only */
+    double              probability;        /* Per call chance the rule fires */
+    uint32_t            burst;              /* Consecutive calls that fail once the error fires */
+    uint64_t            after;              /* Calls passed through untouched first */
+    uint64_t            calls;
+    uint32_t            burst_left;
+    int                 metric;
+};
+
+/*
+ * Latency and error injection for the ioctls of the V4L2 backend and the
+ * matching replay operations, configured from the FAULT_ENV environment
+ * variable so every user of the library picks it up, e.g.
+ *
+ *   TINY_CAMERA_FAULT="DQBUF,delay=exp:8000,p=0.2;DQBUF,error=EIO,p=0.01,burst=3;STREAMON,delay=300000"
+ *
+ * Rules are separated by ';'. Each names a request, without the VIDIOC_
+ * prefix, or '*' for all, then any of:
+ *   delay=us | delay=min-max | delay=normal:mean/dev | delay=exp:mean
+ *   error=EIO|EAGAIN|... or an errno number
+ *   p=probability, default 1
+ *   burst=calls the error repeats for, default 1
+ *   after=calls to let through first
+ * Draws come from a generator seeded by FAULT_SEED_ENV, default 1, so a
+ * run is reproducible as long as the calls arrive in the same order.
+ */
+extern int fault_enabled;
+
+static inline int fault_on(void)
+{
+    return __builtin_expect(fault_enabled, 0);
+}
+
+void fault_init(void);
+int fault_parse(const char *spec);
+int fault_inject(unsigned int request);
+
+#endif
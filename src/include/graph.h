@@ -0,0 +1,97 @@
+#ifndef _GRAPH_
+#define _GRAPH_
+
+#include <pthread.h>
+#include "camera.h"
+#include "pool.h"
+#include "rt.h"
+
+#define GRAPH_MAX_NODES         (16)
+#define GRAPH_MAX_CHILDREN      (4)
+#define GRAPH_FRAME_HEADER      (256)       /* Pool frame bytes in front of the data, keeps it cache line aligned */
+#define GRAPH_POOL_CACHE        (4)         /* Frames each graph thread keeps out of the shared pool */
+
+/* What a threaded node does when a frame arrives at its full queue. */
+enum graph_policy {
+    GRAPH_DROP_NEWEST,                      /* Keep the queued frames, drop the new one */
+    GRAPH_DROP_OLDEST,                      /* Latest wins, e.g. display and publish */
+    GRAPH_BLOCK,                            /* Lossless, holds up everything upstream */
+};
+
+/*
+ * A frame travelling through the graph, shared by reference between
+ * branches. The capture buffer itself is only borrowed for the inline
+ * nodes, it is copied into the pool once, the first time a frame has to
+ * queue for a node thread, so the V4L2 buffer is back with the driver as
+ * soon as graph_push() returns.
+ */
+struct graph_frame {
+    struct graph            *graph;
+    struct v4l2_buffer      info;
+    struct buffer           buffer;
+    struct v4l2_pix_format  pix;            /* Format of buffer, derived frames may differ */
+    int                     refs;
+    int                     borrowed;       /* buffer is the capture buffer */
+    struct graph_frame      *copy;          /* Pool copy of a borrowed frame */
+};
+
+struct graph_node;
+
+/*
+ * Returns the frame for the children: the input to pass it on, a frame from
+ * graph_frame_alloc() which the graph then owns, or NULL to end the branch.
+ */
+typedef struct graph_frame *(*graph_node_func)(struct graph_node *node, struct graph_frame *frame);
+
+/* Runs on the thread of its parent with depth 0, else on its own thread behind a queue of depth frames. */
+struct graph_node {
+    struct graph            *graph;
+    const char              *name;          /* Also the stage label of its latency */
+    graph_node_func         func;
+    void                    *priv;
+    int                     depth;
+    int                     policy;
+    int                     enabled;
+    struct graph_node       *child[GRAPH_MAX_CHILDREN];
+    int                     children;
+
+    /* Threaded nodes only */
+    pthread_t               thread;
+    pthread_mutex_t         lock;
+    pthread_cond_t          not_empty;
+    pthread_cond_t          not_full;
+    struct graph_frame      **queue;
+    int                     head;
+    int                     count;
+    int                     stopping;
+
+    uint64_t                processed;
+    uint64_t                dropped;
+    int                     dropped_id;
+};
+
+struct graph {
+    struct v4l2_pix_format  pix;
+    size_t                  frame_size;
+    struct rt_profile       *rt;
+    struct frame_pool       *pool;
+    struct graph_node       root;           /* Not a stage, holds the top level nodes */
+    struct graph_node       *node[GRAPH_MAX_NODES];
+    int                     nodes;
+    int                     running;
+};
+
+struct graph *graph_create(struct v4l2_pix_format *pix, size_t frame_size, struct rt_profile *rt);
+struct graph_node *graph_add_node(struct graph *graph, struct graph_node *parent, const char *name,
+        graph_node_func func, void *priv, int depth, int policy);
+void graph_node_enable(struct graph_node *node, int enabled);
+int graph_start(struct graph *graph);
+int graph_push(struct graph *graph, struct v4l2_buffer *buffer_info, struct buffer buffer);
+struct graph_frame *graph_frame_alloc(struct graph *graph, struct graph_frame *like, size_t size);
+void graph_frame_ref(struct graph_frame *frame);
+void graph_frame_unref(struct graph_frame *frame);
+void graph_stop(struct graph *graph);
+void graph_dump_stats(struct graph *graph);
+void graph_destroy(struct graph *graph);
+
+#endif
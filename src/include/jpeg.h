@@ -0,0 +1,23 @@
+#ifndef _JPEG_
+#define _JPEG_
+
+#include "camera.h"
+
+#define JPEG_DEFAULT_QUALITY    (85)
+
+enum jpeg_subsampling {
+    JPEG_SUBSAMPLING_444,
+    JPEG_SUBSAMPLING_422,
+    JPEG_SUBSAMPLING_420,
+};
+
+struct jpeg_options {
+    int                 quality;            /* 1-100 */
+    int                 subsampling;
+};
+
+int jpeg_parse_options(struct jpeg_options *opts, const char *spec);
+int jpeg_encode_yuyv(struct v4l2_pix_format *pix, struct buffer src, struct jpeg_options *opts,
+        struct buffer *dst);
+
+#endif
@@ -14,6 +14,10 @@ enum {
     LOG_LEVEL_END,
 };
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define DUMP_ERROR (1)
 #define DUMP_NONE  (0)
 
@@ -33,4 +37,8 @@ void __camera_log(int, int, const char *, ...);
 
 void set_log_level(int l);
 int get_log_level();
+
+#ifdef __cplusplus
+}
+#endif
 #endif
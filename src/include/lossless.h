@@ -0,0 +1,20 @@
+#ifndef _LOSSLESS_
+#define _LOSSLESS_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LOSSLESS_MAX_LINE       (16384)     /* Bytes per line, 8192 YUYV pixels */
+
+/*
+ * Lossless YUYV codec: every byte is predicted from its own channel with the
+ * LOCO-I median of left, up and up-left, residuals are Rice coded with one
+ * adaptive parameter per channel. No side information, frames decode on
+ * their own.
+ */
+int lossless_encode_yuyv(const uint8_t *src, int width, int height, size_t stride,
+        uint8_t *dst, size_t dst_size, size_t *out_size);
+int lossless_decode_yuyv(const uint8_t *src, size_t size, int width, int height, size_t stride,
+        uint8_t *dst);
+
+#endif
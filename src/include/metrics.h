@@ -0,0 +1,40 @@
+#ifndef _METRICS_
+#define _METRICS_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define METRICS_MAX             (64)
+#define METRICS_EXPORT_INTERVAL (1000)      /* ms between file rewrites */
+#define METRICS_CLIENT_TIMEOUT  (1000)      /* ms a socket scraper may stall the exporter */
+
+enum metric_type {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_SUMMARY,                         /* Latency in us, exported in seconds */
+};
+
+struct metric {
+    const char          *name;
+    const char          *label;             /* Value of the "stage" label, or NULL */
+    const char          *help;
+    int                 type;
+    uint64_t            gauge;              /* Gauge value, double bits */
+};
+
+/* Written by its owner thread only, summed over all threads on read. */
+struct metrics_shard {
+    uint64_t                value[METRICS_MAX];     /* Counter value or summary sum */
+    uint64_t                count[METRICS_MAX];     /* Summary count */
+    struct metrics_shard    *next;
+};
+
+int metrics_register(const char *name, const char *label, const char *help, int type);
+void metrics_add(int id, uint64_t value);
+void metrics_set(int id, double value);
+void metrics_observe(int id, uint64_t usec);
+void metrics_dump(FILE *fp);
+int metrics_export_start(const char *target);
+void metrics_export_stop(void);
+
+#endif
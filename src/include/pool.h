@@ -0,0 +1,46 @@
+#ifndef _POOL_
+#define _POOL_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "camera.h"
+
+#define FRAME_POOL_MAX          (8)         /* Pools alive at the same time */
+#define FRAME_POOL_CACHE        (8)         /* Largest per thread cache */
+
+#define FRAME_POOL_HUGEPAGE     (1 << 0)
+
+/*
+ * Preallocated scratch frames sized from the negotiated format. Frames are
+ * page aligned, free frames are linked through their first bytes. With a
+ * cache each thread keeps up to that many frames in a private free list and
+ * only takes the lock to refill or spill half of it, so count must cover a
+ * full cache for every thread that frees into the pool. A thread's caches
+ * go back to their pools when it exits. An empty pool grows by one frame
+ * and counts it as a heap allocation, which must stay at zero in steady
+ * state.
+ */
+struct frame_pool {
+    int                 id;
+    uint32_t            generation;         /* Invalidates stale thread caches */
+    size_t              frame_size;         /* Page aligned */
+    int                 count;
+    int                 cache_size;         /* Per thread cache limit, 0 for none */
+    int                 hugepage;
+    uint8_t             *base;
+    size_t              map_size;
+    pthread_mutex_t     lock;
+    void                *free;              /* Shared free list */
+    void                *grown;             /* Mappings added after creation */
+    uint64_t            heap_allocs;
+};
+
+size_t frame_pool_format_size(struct v4l2_pix_format *pix);
+struct frame_pool *frame_pool_create(size_t frame_size, int count, int cache, int flags);
+void *frame_pool_get(struct frame_pool *pool);
+void frame_pool_put(struct frame_pool *pool, void *frame);
+void frame_pool_flush(struct frame_pool *pool);
+uint64_t frame_pool_heap_allocs(struct frame_pool *pool);
+void frame_pool_destroy(struct frame_pool *pool);
+
+#endif
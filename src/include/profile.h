@@ -0,0 +1,25 @@
+#ifndef _PROFILE_
+#define _PROFILE_
+
+#include <stdint.h>
+
+#include "camera.h"
+
+#define PROFILE_MAGIC       (0x46505443)    /* "CTPF" */
+#define PROFILE_VERSION     (1)
+
+/* Cache file content, key fields guard against hash collision and stale data. */
+struct profile_file {
+    uint32_t                magic;
+    uint32_t                version;
+    uint8_t                 driver[16];
+    uint8_t                 card[32];
+    uint8_t                 bus_info[32];
+    uint32_t                driver_version;
+    struct camera_profile   profile;
+};
+
+int profile_load(struct v4l2_camera *cam, const char *dir);
+int profile_save(struct v4l2_camera *cam, const char *dir);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef _PUBLISH_
+#define _PUBLISH_
+
+#include <stdint.h>
+#include "camera.h"
+
+#define PUBLISH_MAGIC               (0x54435348)    /* "HSCT" */
+#define PUBLISH_VERSION             (2)
+#define PUBLISH_SLOT_NUM            (4)
+#define PUBLISH_MAX_SUBSCRIBER      (8)
+
+/*
+ * Shared memory layout, the frame data of each slot follows the header page
+ * aligned. Sealed against writable mappings, only the publisher writes it.
+ */
+struct publish_slot {
+    uint32_t                seq;            /* Odd while the slot is written */
+    uint32_t                sequence;       /* v4l2_buffer.sequence */
+    uint64_t                frame;          /* Publish counter of the data in slot */
+    int64_t                 tv_sec;         /* v4l2_buffer.timestamp */
+    int64_t                 tv_usec;
+    uint64_t                bytesused;
+};
+
+/* A page of its own per subscriber, the one place a subscriber writes. */
+struct publish_subscriber_stat {
+    uint32_t                active;
+    uint32_t                pid;
+    uint64_t                last_frame;     /* Last frame read by the subscriber */
+    uint64_t                frames;         /* Frames read */
+    uint64_t                drops;          /* Frames overwritten before being read */
+};
+
+struct publish_header {
+    uint32_t                magic;
+    uint32_t                version;
+    uint32_t                slot_count;
+    uint32_t                reserved;
+    uint64_t                slot_size;      /* Max frame data size per slot */
+    uint64_t                data_offset;    /* Offset of slot 0 data */
+    uint64_t                frame;          /* Latest published frame, 0 if none */
+    struct v4l2_pix_format  pix;
+    struct publish_slot     slot[PUBLISH_SLOT_NUM];
+};
+
+/* Handshake message sent with the ring and the stat memfd attached, in that order. */
+struct publish_hello {
+    uint32_t                magic;
+    uint32_t                index;          /* Subscriber number, for the logs */
+    uint64_t                map_size;
+};
+
+/* Geometry is kept here, what is in shared memory is never read back. */
+struct publisher {
+    char                    *path;
+    int                     listen_fd;
+    int                     memfd;
+    int                     client_fd[PUBLISH_MAX_SUBSCRIBER];
+    struct publish_subscriber_stat *stat[PUBLISH_MAX_SUBSCRIBER];
+    struct publish_header   *hdr;
+    uint8_t                 *data;
+    size_t                  map_size;
+    size_t                  slot_size;
+    uint64_t                frame;          /* Latest published frame */
+};
+
+/* Geometry checked and copied at connect time, the header mapping is read only. */
+struct subscriber {
+    int                     fd;
+    int                     index;
+    const struct publish_header *hdr;
+    const uint8_t           *data;
+    size_t                  map_size;
+    uint32_t                slot_count;
+    size_t                  slot_size;
+    struct publish_subscriber_stat *stat;
+    uint64_t                next_frame;
+};
+
+/* A frame read in place from the shared ring, valid until subscriber_release. */
+struct publish_frame {
+    struct buffer           buffer;
+    uint64_t                frame;
+    uint32_t                sequence;
+    struct timeval          timestamp;
+    uint32_t                slot;
+    uint32_t                seq;
+};
+
+struct publisher *publisher_create(const char *path, struct v4l2_pix_format *pix, size_t frame_size);
+int publisher_publish(struct publisher *pub, struct v4l2_buffer *buffer_info, struct buffer buffer);
+void publisher_poll(struct publisher *pub);
+void publisher_dump_stats(struct publisher *pub);
+void publisher_destroy(struct publisher *pub);
+
+struct subscriber *subscriber_connect(const char *path);
+int subscriber_wait(struct subscriber *sub, int timeout_ms);
+int subscriber_acquire(struct subscriber *sub, struct publish_frame *frame);
+int subscriber_release(struct subscriber *sub, struct publish_frame *frame);
+void subscriber_disconnect(struct subscriber *sub);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _RECORD_
+#define _RECORD_
+
+#include <stdint.h>
+#include "camera.h"
+#include "pool.h"
+#include "worker.h"
+
+#define RECORD_MAGIC        (0x52434354)    /* "TCCR" */
+#define RECORD_VERSION      (2)
+#define RECORD_PREFETCH     (4)             /* Frames read ahead during replay */
+
+#define RECORD_FLAG_CLOSED  (1 << 0)         /* frame_count is final, set by recorder_close */
+
+enum record_codec {
+    RECORD_CODEC_RAW,
+    RECORD_CODEC_LOSSLESS,                  /* lossless.h, YUYV only */
+};
+
+/*
+ * File layout, every part page aligned:
+ *   struct record_header
+ *   struct record_frame index[frame_capacity]
+ *   frame data, found through index[].offset
+ *
+ * Raw recordings keep one record_size slot per frame. Compressed ones
+ * append frames in the order workers finish them, the index keeps them
+ * seekable in capture order. A frame that doesn't shrink is stored raw.
+ * Version 1 recordings, raw only and without the codec fields, still replay.
+ *
+ * frame_count is only written at close. Replay of a recording that never
+ * got there counts the frames whose index entry made it to the file.
+ */
+struct record_header {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            frame_count;        /* Frames actually recorded */
+    uint32_t            frame_capacity;     /* Frames preallocated */
+    uint64_t            record_size;        /* Data bytes reserved per frame */
+    uint64_t            index_offset;
+    uint64_t            data_offset;
+    uint32_t            codec;              /* Codec requested for the recording */
+    uint32_t            flags;              /* RECORD_FLAG_* */
+    struct v4l2_format  fmt;
+};
+
+struct record_frame {
+    int64_t             tv_sec;             /* v4l2_buffer.timestamp */
+    int64_t             tv_usec;
+    uint32_t            sequence;           /* v4l2_buffer.sequence */
+    uint32_t            bytesused;
+    uint32_t            flags;
+    uint32_t            field;
+    uint64_t            offset;             /* File offset of the stored frame */
+    uint32_t            size;               /* Stored bytes */
+    uint32_t            codec;              /* Codec of this frame */
+};
+
+struct recorder_options {
+    int                 codec;
+    int                 threads;            /* Compression workers */
+    struct rt_profile   *rt;
+};
+
+struct recorder {
+    struct record_header    hdr;
+    int                     fd;
+    uint64_t                cursor;         /* Append offset for compressed frames */
+    uint64_t                raw_bytes;
+    uint64_t                stored_bytes;
+    struct frame_pool       *pool;          /* Frames waiting for a worker */
+    struct frame_pool       *out_pool;      /* Compressed output */
+    struct worker_pool      *workers;
+    uint32_t                failed;         /* Compressed frames lost to write errors */
+};
+
+struct recorder *recorder_create(const char *path, struct v4l2_format *fmt, size_t frame_size, uint32_t capacity,
+        struct recorder_options *opts);
+int recorder_write(struct recorder *rec, struct v4l2_buffer *buffer_info, struct buffer buffer);
+int recorder_close(struct recorder *rec);
+
+/* Replay backend, picked by camera_open_device when dev_name is a recording. */
+extern const struct camera_ops replay_ops;
+int replay_probe(const char *path);
+
+#endif
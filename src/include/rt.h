@@ -0,0 +1,62 @@
+#ifndef _RT_
+#define _RT_
+
+#include <stdint.h>
+#include <time.h>
+#include "camera.h"
+
+#define RT_JITTER_RESOLUTION    (10)        /* us per histogram bucket */
+#define RT_JITTER_BUCKETS       (10000)     /* Up to 100ms, longer goes to the last bucket */
+
+enum rt_role {
+    RT_ROLE_CAPTURE,
+    RT_ROLE_WORKER,
+    RT_ROLE_WRITER,
+    RT_ROLE_MAX,
+};
+
+enum rt_policy {
+    RT_POLICY_OTHER,
+    RT_POLICY_FIFO,
+    RT_POLICY_DEADLINE,
+};
+
+/*
+ * Scheduling profile, parsed from a spec like
+ * "capture=2,worker=3,writer=4,fifo=80,lock,prefault" or
+ * "deadline=5000/33333,lock" (runtime/period in us).
+ */
+struct rt_profile {
+    int                 cpu[RT_ROLE_MAX];   /* -1 to leave the thread unpinned */
+    int                 policy;             /* Capture thread only */
+    int                 priority;           /* SCHED_FIFO priority */
+    unsigned long       runtime;            /* SCHED_DEADLINE runtime in us */
+    unsigned long       period;             /* SCHED_DEADLINE period and deadline in us */
+    int                 lock_memory;        /* mlockall and lock the queue buffers */
+    int                 prefault;           /* Touch working buffers before STREAMON */
+};
+
+struct rt_histogram {
+    uint64_t            count;
+    uint64_t            max;
+    uint32_t            bucket[RT_JITTER_BUCKETS];
+};
+
+/* DQBUF to QBUF hold time and DQBUF to DQBUF interval of the capture loop. */
+struct rt_jitter {
+    struct timespec     last_dequeue;
+    struct rt_histogram hold;
+    struct rt_histogram interval;
+};
+
+void rt_profile_init(struct rt_profile *profile);
+int rt_profile_parse(struct rt_profile *profile, const char *spec);
+int rt_lock_memory(struct rt_profile *profile);
+int rt_enter_thread(struct rt_profile *profile, int role);
+void rt_prefault(void *addr, size_t size, int lock);
+void rt_prepare_buffers(struct rt_profile *profile, struct v4l2_camera *cam);
+void rt_jitter_dequeue(struct rt_jitter *jitter);
+void rt_jitter_queue(struct rt_jitter *jitter);
+void rt_jitter_report(struct rt_jitter *jitter);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _SCALE_
+#define _SCALE_
+
+#include <stdint.h>
+#include "camera.h"
+
+struct scaler {
+    int                 src_stride;     /* Source bytes per line */
+    struct v4l2_rect    crop;           /* Source region to scale */
+    int                 dst_width;
+    int                 dst_height;
+    uint32_t            *x_left;        /* Per output byte: left sample offset */
+    uint32_t            *x_right;       /* Per output byte: right sample offset */
+    uint16_t            *x_weight;      /* Per output byte: right sample weight, 0-256 */
+    uint8_t             *row[2];        /* Horizontally scaled source rows */
+    int                 row_y[2];       /* Source line held by row[] */
+    size_t              out_size;       /* Bytes written by scaler_process */
+};
+
+struct scaler *scaler_create(struct v4l2_pix_format *pix, struct v4l2_rect *crop, int dst_width, int dst_height);
+int scaler_process(struct scaler *s, struct buffer src, struct buffer *dst);
+void scaler_destroy(struct scaler *s);
+
+#endif
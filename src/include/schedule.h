@@ -0,0 +1,51 @@
+#ifndef _SCHEDULE_
+#define _SCHEDULE_
+
+#include "camera.h"
+#include "stream.h"
+
+#define SCHEDULE_RESTART_FACTOR (4)         /* Stream off between shots when the interval exceeds this many restarts */
+
+enum schedule_mode {
+    SCHEDULE_ALL,                           /* Every frame, as fast as they arrive */
+    SCHEDULE_DECIMATE,                      /* Evenly spaced frames at a lower output rate */
+    SCHEDULE_TIMELAPSE,                     /* One shot every interval */
+};
+
+enum schedule_policy {
+    SCHEDULE_AUTO,                          /* Pick from the measured restart cost */
+    SCHEDULE_KEEP_STREAMING,
+    SCHEDULE_STREAM_OFF,                    /* STREAMOFF between shots */
+};
+
+/*
+ * Parsed from "rate=fps" or "every=seconds[,align][,keep|off]". align puts
+ * time-lapse shots on wall clock multiples of the interval.
+ */
+struct schedule {
+    int                 mode;
+    int                 policy;
+    double              rate;
+    uint64_t            interval_us;
+    int                 align;
+
+    /* Run state */
+    stream_frame_func   func;
+    void                *priv;
+    int                 ret;
+    int                 accepted;
+    int64_t             next_us;            /* Decimation: timestamp of the next frame to keep */
+    int64_t             last_us;
+    int64_t             source_us;          /* Decimation: measured source frame period */
+    int64_t             due_us;             /* Time-lapse: monotonic time of the next shot */
+    int64_t             start_us;           /* Stream on time of a stream-off shot */
+    uint64_t            restart_us;         /* Stream on to first frame, averaged */
+    uint64_t            delivered;
+    uint64_t            skipped;
+    uint64_t            restarts;
+};
+
+int schedule_parse(struct schedule *sched, const char *spec);
+int schedule_run(struct schedule *sched, struct camera_stream *stream, uint64_t count);
+
+#endif
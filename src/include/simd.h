@@ -0,0 +1,59 @@
+#ifndef _SIMD_
+#define _SIMD_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Kernels are written once against GCC vector extensions, the compiler
+ * lowers them to SSE2/AVX2 on x86 and NEON on ARM.
+ */
+#define SIMD_BYTES  (16)
+
+typedef uint8_t     vec_u8  __attribute__((vector_size(SIMD_BYTES)));
+typedef uint16_t    vec_u16 __attribute__((vector_size(SIMD_BYTES * 2)));
+typedef int16_t     vec_s16 __attribute__((vector_size(SIMD_BYTES * 2)));
+
+/* Widen/narrow are macros, wide vectors must not cross a call boundary. */
+#define vec_widen_u8(v)     __builtin_convertvector((v), vec_u16)
+#define vec_narrow_u16(v)   __builtin_convertvector((v), vec_u8)
+#define vec_widen_s16(v)    __builtin_convertvector((v), vec_s16)
+#define vec_narrow_s16(v)   __builtin_convertvector((v), vec_u8)    /* Clamp to 0-255 first */
+
+/* Lanes of a where the comparison mask is set, else of b. */
+#define vec_select(mask, a, b)  (((mask) & (a)) | (~(mask) & (b)))
+
+static inline __attribute__((always_inline)) vec_u8 vec_load_u8(const uint8_t *p)
+{
+    vec_u8 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline __attribute__((always_inline)) void vec_store_u8(uint8_t *p, vec_u8 v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/*
+ * Stores that bypass the caches, for data nothing reads again soon. p must
+ * be SIMD_BYTES aligned, vec_stream_fence() orders them before later
+ * stores. Other targets fall back to regular stores.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define vec_stream_u8(p, v)     _mm_stream_si128((__m128i *)(p), (__m128i)(v))
+#define vec_stream_fence()      _mm_sfence()
+#else
+#define vec_stream_u8(p, v)     vec_store_u8((p), (v))
+#define vec_stream_fence()      __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+/* Build an AVX2 variant next to the baseline one, picked at load time. */
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_KERNEL
+#endif
+
+#endif
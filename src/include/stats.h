@@ -0,0 +1,35 @@
+#ifndef _STATS_
+#define _STATS_
+
+#include <stdint.h>
+#include "camera.h"
+
+#define STATS_BINS              (256)
+#define STATS_DEFAULT_STEP      (4)         /* Every 4th line and every 4th pixel */
+#define STATS_DEFAULT_CLIP      (250)
+
+struct stats_config {
+    int                 step_x;             /* Histogram pixel step */
+    int                 step_y;             /* Line step for everything */
+    uint8_t             clip;               /* Luma at or above counts as clipped */
+};
+
+/*
+ * Mean and clipped ratio cover every pixel of the sampled lines, the
+ * histogram only the step_x grid on them.
+ */
+struct luma_stats {
+    uint32_t            hist[STATS_BINS];
+    uint32_t            hist_count;
+    uint64_t            sum;
+    uint64_t            count;
+    uint64_t            clipped;
+    double              mean;               /* 0-255 */
+    double              clipped_ratio;      /* 0-1 */
+};
+
+void stats_default_config(struct stats_config *config);
+int stats_luma(struct v4l2_pix_format *pix, struct buffer buffer, struct stats_config *config,
+        struct luma_stats *stats);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _STREAM_
+#define _STREAM_
+
+#include "camera.h"
+
+#define STREAM_BATCH            (8)         /* Frames handled per dispatch before returning to the caller */
+#define STREAM_STALL_FRAMES     (5)         /* Frame intervals without a frame before a restart */
+#define STREAM_STALL_MIN        (100)       /* ms, lower bound of the stall timeout */
+#define STREAM_FIRST_FRAME      (5000)      /* ms to wait for the first frame after stream on */
+#define STREAM_RECONNECT        (30000)     /* ms to wait for a device that is gone */
+#define STREAM_RETRY            (250)       /* ms between reopen attempts */
+
+enum stream_flags {
+    STREAM_LATEST       = 1 << 0,           /* Drain ready buffers, only hand out the newest */
+    STREAM_RECOVER      = 1 << 1,           /* camera_stream_run() recovers instead of failing */
+};
+
+/* Return anything but CAMERA_RETURN_SUCCESS to end the stream. */
+typedef int (*stream_frame_func)(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info,
+        struct buffer buffer, void *priv);
+
+/*
+ * Event driven capture. The library owns the dequeue, callback, requeue
+ * cycle. Either let camera_stream_run() block on it, or add the fd from
+ * camera_stream_get_fd() to an existing poll/epoll loop and call
+ * camera_stream_dispatch() whenever it is readable. The fd is an epoll
+ * set holding the device and an eventfd for camera_stream_wakeup().
+ * Events from camera_subscribe_events() are handled in the same loop, a
+ * source change reallocates the buffers and the stream goes on.
+ *
+ * With STREAM_RECOVER, camera_stream_run() requeues after I/O errors,
+ * restarts a stalled stream and reopens a device that went away, see
+ * camera_stream_recover(). Dispatch callers get the error instead and
+ * may call it themselves.
+ */
+struct camera_stream {
+    struct v4l2_camera  *cam;
+    stream_frame_func   func;
+    void                *priv;
+    int                 flags;
+    int                 epoll_fd;
+    int                 wake_fd;
+    int                 cam_fd;
+    int                 woken;
+    uint64_t            frames;             /* Delivered to func */
+    uint64_t            errors;             /* Buffers the driver flagged corrupt */
+    int64_t             last_us;            /* Monotonic arrival of the last frame, 0 after stream on */
+    int64_t             interval_us;        /* Frame arrival interval, averaged */
+    int                 last_action;        /* Recovery without a frame since, -1 for none */
+    uint64_t            recoveries;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct camera_stream *camera_stream_create(struct v4l2_camera *cam, stream_frame_func func, void *priv, int flags);
+int camera_stream_get_fd(struct camera_stream *stream);
+int camera_stream_start(struct camera_stream *stream);
+int camera_stream_dispatch(struct camera_stream *stream, int max);
+int camera_stream_run(struct camera_stream *stream, uint64_t count);
+int camera_stream_recover(struct camera_stream *stream, int err);
+void camera_stream_wakeup(struct camera_stream *stream);
+int camera_stream_stop(struct camera_stream *stream);
+void camera_stream_destroy(struct camera_stream *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,367 @@
+#ifndef _TINY_CAMERA_HPP_
+#define _TINY_CAMERA_HPP_
+
+/*
+ * Header only C++20 binding. Every call goes straight to the C API, frames
+ * are handed out by value and nothing is allocated per frame. The C state
+ * machine allows one dequeued buffer at a time, so a Frame must be gone
+ * before the next one is dequeued, and before its Camera.
+ */
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "camera.h"
+#include "api.h"
+#include "stream.h"
+
+namespace tiny_camera {
+
+class error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+inline void check(int ret, const char *what)
+{
+    if (ret != CAMERA_RETURN_SUCCESS)
+        throw error(std::string(what) + " failed");
+}
+
+/* Owns one dequeued buffer, requeues it when destroyed. */
+class Frame {
+public:
+    Frame() noexcept = default;
+    Frame(struct v4l2_camera *cam, const struct v4l2_buffer &info, struct buffer buffer) noexcept
+        : cam_(cam), info_(info), buffer_(buffer) {}
+    Frame(Frame &&other) noexcept
+        : cam_(std::exchange(other.cam_, nullptr)), info_(other.info_), buffer_(other.buffer_) {}
+    Frame &operator=(Frame &&other) noexcept
+    {
+        if (this != &other) {
+            requeue();
+            cam_ = std::exchange(other.cam_, nullptr);
+            info_ = other.info_;
+            buffer_ = other.buffer_;
+        }
+        return *this;
+    }
+    Frame(const Frame &) = delete;
+    Frame &operator=(const Frame &) = delete;
+    ~Frame() { requeue(); }
+
+    explicit operator bool() const noexcept { return cam_ != nullptr; }
+    std::span<const std::byte> data() const noexcept
+    {
+        return { static_cast<const std::byte *>(buffer_.addr), buffer_.size };
+    }
+    const struct v4l2_buffer &info() const noexcept { return info_; }
+    uint32_t sequence() const noexcept { return info_.sequence; }
+    struct timeval timestamp() const noexcept { return info_.timestamp; }
+
+    /* Hand the buffer back early, false when the driver refused it. */
+    bool requeue() noexcept
+    {
+        if (!cam_)
+            return true;
+        return camera_queue_buffer(std::exchange(cam_, nullptr), &info_) == CAMERA_RETURN_SUCCESS;
+    }
+
+private:
+    struct v4l2_camera  *cam_ = nullptr;
+    struct v4l2_buffer  info_ = {};
+    struct buffer       buffer_ = {};
+};
+
+/* Single pass generator of frames, the coroutine frame is its only allocation. */
+class FrameGenerator {
+public:
+    struct promise_type {
+        Frame               *current = nullptr;
+        std::exception_ptr  error;
+
+        FrameGenerator get_return_object() noexcept
+        {
+            return FrameGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(Frame &frame) noexcept
+        {
+            current = &frame;
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { error = std::current_exception(); }
+    };
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    class iterator {
+    public:
+        using value_type = Frame;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() noexcept = default;
+        explicit iterator(handle_type handle) noexcept : handle_(handle) {}
+        Frame &operator*() const noexcept { return *handle_.promise().current; }
+        Frame *operator->() const noexcept { return handle_.promise().current; }
+        iterator &operator++()
+        {
+            /* Resuming destroys the yielded frame, which requeues it. */
+            resume(handle_);
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const noexcept { return !handle_ || handle_.done(); }
+
+    private:
+        handle_type handle_;
+    };
+
+    explicit FrameGenerator(handle_type handle) noexcept : handle_(handle) {}
+    FrameGenerator(FrameGenerator &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    FrameGenerator &operator=(FrameGenerator &&other) noexcept
+    {
+        if (this != &other) {
+            if (handle_)
+                handle_.destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    FrameGenerator(const FrameGenerator &) = delete;
+    FrameGenerator &operator=(const FrameGenerator &) = delete;
+    ~FrameGenerator()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    iterator begin()
+    {
+        resume(handle_);
+        return iterator(handle_);
+    }
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+private:
+    static void resume(handle_type handle)
+    {
+        handle.resume();
+        if (handle.done() && handle.promise().error)
+            std::rethrow_exception(std::exchange(handle.promise().error, nullptr));
+    }
+
+    handle_type handle_;
+};
+
+/* Opened, configured and mapped on construction, torn down in reverse on destruction. */
+class Camera {
+public:
+    struct Options {
+        uint32_t    width = DEFAULT_IMAGE_WIDTH;
+        uint32_t    height = DEFAULT_IMAGE_HEIGHT;
+        uint32_t    pixelformat = V4L2_PIX_FMT_YUYV;
+        float       replay_speed = 1.0f;    /* Recordings only, 0 for no pacing */
+    };
+
+    explicit Camera(std::string device) : Camera(std::move(device), Options()) {}
+    Camera(std::string device, const Options &options)
+        : device_(std::make_unique<char[]>(device.size() + 1))
+    {
+        device.copy(device_.get(), device.size());
+        cam_ = camera_create_object();
+        if (!cam_)
+            throw std::bad_alloc();
+        cam_->dev_name = device_.get();
+        cam_->fmt.fmt.pix.width = options.width;
+        cam_->fmt.fmt.pix.height = options.height;
+        cam_->fmt.fmt.pix.pixelformat = options.pixelformat;
+        cam_->replay_speed = options.replay_speed;
+        try {
+            check(camera_open_device(cam_), "camera_open_device");
+            check(camera_query_cap(cam_), "camera_query_cap");
+            if (!(cam_->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(cam_->cap.capabilities & V4L2_CAP_STREAMING))
+                throw error(device + " is no streaming capture device");
+            check(camera_set_output_format(cam_), "camera_set_output_format");
+            camera_get_output_format(cam_);
+            check(camera_request_and_map_buffer(cam_), "camera_request_and_map_buffer");
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+    Camera(Camera &&other) noexcept
+        : device_(std::move(other.device_)), cam_(std::exchange(other.cam_, nullptr)) {}
+    Camera &operator=(Camera &&other) noexcept
+    {
+        if (this != &other) {
+            release();
+            device_ = std::move(other.device_);
+            cam_ = std::exchange(other.cam_, nullptr);
+        }
+        return *this;
+    }
+    Camera(const Camera &) = delete;
+    Camera &operator=(const Camera &) = delete;
+    ~Camera() { release(); }
+
+    struct v4l2_camera *get() const noexcept { return cam_; }
+    const struct v4l2_pix_format &format() const noexcept { return cam_->fmt.fmt.pix; }
+    bool streaming() const noexcept { return cam_->state >= CAMREA_STATE_STREAM_ON && cam_->state != CAMERA_STATE_ERROR; }
+
+    void start() { check(camera_start_capturing(cam_), "camera_start_capturing"); }
+    void stop() { check(camera_stop_capturing(cam_), "camera_stop_capturing"); }
+
+    /* Blocks until a frame is ready, an empty Frame on errors and at the end of a recording. */
+    Frame try_dequeue(bool latest = false) noexcept
+    {
+        Frame frame;
+
+        next(frame, latest);
+        return frame;
+    }
+    Frame dequeue(bool latest = false)
+    {
+        Frame frame = try_dequeue(latest);
+
+        if (!frame)
+            throw error("camera_dequeue_buffer failed");
+        return frame;
+    }
+
+    /* Frames until count, 0 for no limit, or the end of a recording. Needs a started camera. */
+    FrameGenerator frames(uint64_t count = 0, bool latest = false)
+    {
+        for (uint64_t n = 0; !count || n < count; n++) {
+            Frame frame;
+            int ret = next(frame, latest);
+
+            if (ret == -ENODATA)
+                co_return;
+            if (!frame)
+                throw error("camera_dequeue_buffer failed");
+            co_yield frame;
+        }
+    }
+
+private:
+    /* The library's return, -ENODATA at the end of a recording. */
+    int next(Frame &frame, bool latest) noexcept
+    {
+        struct v4l2_buffer info;
+        struct buffer buffer;
+        int ret;
+
+        do
+            ret = latest ? camera_dequeue_latest(cam_, &info) : camera_dequeue_buffer(cam_, &info);
+        while (ret == -EAGAIN);
+        if (ret != CAMERA_RETURN_SUCCESS)
+            return ret;
+        ret = camera_get_buffer(cam_, &info, &buffer);
+        if (ret == CAMERA_RETURN_SUCCESS)
+            frame = Frame(cam_, info, buffer);
+        return ret;
+    }
+
+    void release() noexcept
+    {
+        if (!cam_)
+            return;
+        camera_shutdown(cam_);
+        camera_free_object(std::exchange(cam_, nullptr));
+    }
+
+    std::unique_ptr<char[]> device_;        /* dev_name points here, stable across moves */
+    struct v4l2_camera      *cam_ = nullptr;
+};
+
+/*
+ * Event driven capture, see stream.h. Starts capturing on construction and
+ * stops on destruction, so the Camera must not be started. func is called as
+ * func(std::span<const std::byte>, const v4l2_buffer &) and may return bool,
+ * false ends the stream. Exceptions from func end the stream and are
+ * rethrown from run() or dispatch(). Pinned in memory, the C side keeps a
+ * pointer to it.
+ */
+template <class F>
+class Stream {
+public:
+    Stream(Camera &cam, F func, int flags = 0) : func_(std::move(func))
+    {
+        stream_ = camera_stream_create(cam.get(), &Stream::trampoline, this, flags);
+        if (!stream_)
+            throw error("camera_stream_create failed");
+        if (camera_stream_start(stream_) != CAMERA_RETURN_SUCCESS) {
+            camera_stream_destroy(stream_);
+            throw error("camera_stream_start failed");
+        }
+    }
+    Stream(const Stream &) = delete;
+    Stream &operator=(const Stream &) = delete;
+    ~Stream()
+    {
+        camera_stream_stop(stream_);
+        camera_stream_destroy(stream_);
+    }
+
+    int fd() const noexcept { return camera_stream_get_fd(stream_); }
+    uint64_t frames() const noexcept { return stream_->frames; }
+    void wakeup() noexcept { camera_stream_wakeup(stream_); }
+
+    /* Frames handled, or a negative errno like camera_stream_dispatch(). */
+    int dispatch(int max = 0)
+    {
+        int ret = camera_stream_dispatch(stream_, max);
+
+        rethrow();
+        return ret;
+    }
+    void run(uint64_t count = 0)
+    {
+        int ret = camera_stream_run(stream_, count);
+
+        rethrow();
+        check(ret, "camera_stream_run");
+    }
+
+private:
+    static int trampoline(struct v4l2_camera *, struct v4l2_buffer *info, struct buffer buffer, void *priv)
+    {
+        Stream *self = static_cast<Stream *>(priv);
+        std::span<const std::byte> data(static_cast<const std::byte *>(buffer.addr), buffer.size);
+
+        try {
+            if constexpr (std::is_same_v<std::invoke_result_t<F &, std::span<const std::byte>, const struct v4l2_buffer &>, void>) {
+                self->func_(data, *info);
+                return CAMERA_RETURN_SUCCESS;
+            } else {
+                return self->func_(data, *info) ? CAMERA_RETURN_SUCCESS : CAMERA_RETURN_FAILURE;
+            }
+        } catch (...) {
+            self->error_ = std::current_exception();
+            return CAMERA_RETURN_FAILURE;
+        }
+    }
+    void rethrow()
+    {
+        if (error_)
+            std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+
+    F                       func_;
+    struct camera_stream    *stream_ = nullptr;
+    std::exception_ptr      error_;
+};
+
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _TNR_
+#define _TNR_
+
+#include "camera.h"
+#include "pool.h"
+
+#define TNR_DEFAULT_STRENGTH    (3)         /* Static pixels take 1/8 of the new frame */
+#define TNR_MAX_STRENGTH        (5)
+#define TNR_DEFAULT_THRESHOLD   (24)        /* Difference in levels that counts as motion */
+#define TNR_WEIGHT_BITS         (5)         /* Blend weights are 0..32 */
+#define TNR_FRACTION_BITS       (2)         /* Extra precision of the history */
+
+/* Parsed from "strength[,threshold]". */
+struct tnr_config {
+    int                 strength;
+    int                 threshold;
+};
+
+/*
+ * Recursive temporal noise reduction, an exponential moving average per
+ * byte of packed YUV 4:2:2, NV12, NV21 or GREY frames, luma and chroma alike. The weight of
+ * the new frame rises with the difference to the history, from
+ * 1 / 2^strength on static pixels to all of it at threshold, so motion
+ * doesn't leave trails. The history keeps two fractional bits, small
+ * weights would otherwise never converge on slow changes. Every byte costs
+ * the same, there are no data dependent paths.
+ */
+struct tnr {
+    struct tnr_config   config;
+    uint32_t            pixelformat;
+    size_t              size;               /* Bytes of the frame in the history */
+    size_t              capacity;
+    uint16_t            *history;
+    int                 primed;
+    int                 base;               /* Weight of static pixels */
+    int                 slope;              /* Weight per level of difference, 4 fractional bits */
+    struct frame_pool   *pool;              /* Output frame, the capture buffer may be read only */
+    void                *out;
+};
+
+int tnr_parse_config(struct tnr_config *config, const char *spec);
+struct tnr *tnr_create(struct v4l2_pix_format *pix, size_t size, struct tnr_config *config);
+int tnr_process(struct tnr *tnr, struct buffer *buffer);
+void tnr_reset(struct tnr *tnr);
+void tnr_destroy(struct tnr *tnr);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _TRACE_
+#define _TRACE_
+
+#include <stdint.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#define TRACE_DEFAULT_EVENTS    (1 << 16)   /* Ring of the latest events, a few thousand frames */
+#define TRACE_DUMP_SIGNAL       (SIGUSR1)
+#define TRACE_NO_FRAME          (-1)
+
+/* One span or instant, on the CLOCK_MONOTONIC timeline of V4L2 buffer timestamps. */
+struct trace_event {
+    const char          *name;              /* Not copied, must outlive the tracer */
+    int64_t             ts;                 /* us */
+    uint32_t            dur;                /* us, 0 for an instant */
+    int32_t             frame;              /* v4l2_buffer.sequence or TRACE_NO_FRAME */
+    uint32_t            tid;
+    uint32_t            instant;
+    uint64_t            stamp;              /* Published last, 1 + the write index that filled the slot */
+};
+
+/*
+ * Per frame tracer. Events go to a ring allocated up front, claimed with a
+ * single atomic add, so the tracer allocates nothing and takes no lock
+ * while streaming. Each thread tags its events with the sequence of the
+ * frame it is working on. The ring is written as Chrome trace event JSON,
+ * which chrome://tracing and Perfetto load, on trace_stop() and each time
+ * TRACE_DUMP_SIGNAL arrives.
+ */
+extern int trace_enabled;
+
+static inline int trace_on(void)
+{
+    return __builtin_expect(trace_enabled, 0);
+}
+
+int trace_start(const char *path, uint32_t events);
+void trace_stop(void);
+int trace_dump(void);
+int64_t trace_now(void);
+void trace_set_frame(int32_t frame);
+void trace_span(const char *name, int64_t start, int64_t end);
+void trace_span_timeval(const char *name, const struct timeval *start, const struct timeval *end);
+void trace_instant(const char *name, int64_t ts);
+
+#endif
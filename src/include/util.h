@@ -17,11 +17,34 @@ enum {
     TR_END,
 };
 
+#define TIME_BREAKDOWN_MAX  (16)
+
+/* Per step durations of a multi step sequence such as time to first frame. */
+struct time_breakdown {
+    struct timeval start;
+    struct timeval last;
+    int count;
+    const char *name[TIME_BREAKDOWN_MAX];
+    long usec[TIME_BREAKDOWN_MAX];
+};
+
+static inline size_t page_align(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
 void help(void);
 char *fmt2desc(int fmt);
 int save_buffer(struct buffer buffer, char *ext);
+int save_view(struct image_view *view, char *ext);
+int image_get_view(const struct v4l2_pix_format *pix, struct buffer buffer, const struct v4l2_rect *rect,
+        struct image_view *view);
 void time_recorder_start(struct time_recorder *tr);
 void time_recorder_end(struct time_recorder *tr);
 void time_recorder_print_time(struct time_recorder *tr, const char *msg);
+void time_breakdown_start(struct time_breakdown *tb);
+void time_breakdown_mark(struct time_breakdown *tb, const char *name);
+void time_breakdown_print(struct time_breakdown *tb, const char *msg);
 
 #endif
@@ -0,0 +1,48 @@
+#ifndef _WORKER_
+#define _WORKER_
+
+#include <pthread.h>
+#include "camera.h"
+#include "rt.h"
+
+#define WORKER_MAX_THREADS      (32)
+#define WORKER_NAME_SIZE        (16)        /* Thread name limit, the terminator included */
+
+struct worker_task;
+typedef void (*worker_func)(struct worker_task *task);
+
+/* Tasks are copied into the queue, submitting never allocates. */
+struct worker_task {
+    worker_func         func;
+    void                *ctx;               /* Shared by all tasks of one kind */
+    struct buffer       buffer;
+    struct v4l2_buffer  info;
+    uint64_t            arg;                /* Per task value, e.g. a frame number */
+};
+
+struct worker_pool {
+    char                name[WORKER_NAME_SIZE];
+    int                 named;              /* Threads that took their name */
+    int                 threads;
+    pthread_t           thread[WORKER_MAX_THREADS];
+    struct rt_profile   *rt;
+    int                 role;
+    pthread_mutex_t     lock;
+    pthread_cond_t      not_empty;
+    pthread_cond_t      not_full;
+    pthread_cond_t      idle;
+    struct worker_task  *task;              /* Ring of depth entries */
+    int                 depth;
+    int                 head;
+    int                 count;
+    int                 busy;
+    int                 stopping;
+};
+
+int worker_default_threads(void);
+struct worker_pool *worker_pool_create(const char *name, int threads, int depth, struct rt_profile *rt, int role);
+void worker_pool_submit(struct worker_pool *pool, struct worker_task *task);
+void worker_pool_wait(struct worker_pool *pool);
+void worker_pool_destroy(struct worker_pool *pool);
+
+#endif
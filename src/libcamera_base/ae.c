@@ -0,0 +1,266 @@
+#include <math.h>
+#include "camera.h"
+#include "api.h"
+#include "ae.h"
+#include "metrics.h"
+#include "log.h"
+
+static struct {
+    int mean;
+    int clipped;
+    int exposure;
+    int gain;
+    int adjustments;
+} metric_id;
+
+static void ae_metrics_init(void)
+{
+    metric_id.mean = metrics_register("tiny_camera_luma_mean", NULL, "Mean luma of the last frame", METRIC_GAUGE);
+    metric_id.clipped = metrics_register("tiny_camera_luma_clipped_ratio", NULL,
+            "Share of clipped luma samples in the last frame", METRIC_GAUGE);
+    metric_id.exposure = metrics_register("tiny_camera_ae_exposure", NULL, "Exposure set by auto exposure", METRIC_GAUGE);
+    metric_id.gain = metrics_register("tiny_camera_ae_gain", NULL, "Gain set by auto exposure", METRIC_GAUGE);
+    metric_id.adjustments = metrics_register("tiny_camera_ae_adjustments_total", NULL,
+            "Control writes issued by auto exposure", METRIC_COUNTER);
+}
+
+int ae_parse_config(struct ae_config *config, const char *spec)
+{
+    int step = STATS_DEFAULT_STEP;
+
+    config->target = AE_DEFAULT_TARGET;
+    config->interval = AE_DEFAULT_INTERVAL;
+    config->tolerance = AE_DEFAULT_TOLERANCE;
+    config->max_step = AE_DEFAULT_MAX_STEP;
+    config->clip_limit = AE_DEFAULT_CLIP_LIMIT;
+    stats_default_config(&config->stats);
+    if (sscanf(spec, "%d,%d,%d", &config->target, &config->interval, &step) < 1 ||
+            config->target < 1 || config->target > 254 || config->interval < 1 || step < 1) {
+        LOGE(DUMP_NONE, "Invalid auto exposure options '%s'\n", spec);
+        return CAMERA_RETURN_FAILURE;
+    }
+    config->stats.step_x = config->stats.step_y = step;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static struct v4l2_queryctrl *find_control(struct v4l2_camera *cam, uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < cam->profile.control_count; i++)
+        if (cam->profile.control[i].id == id)
+            return &cam->profile.control[i];
+    return NULL;
+}
+
+static void setup_control(struct v4l2_camera *cam, struct ae_control *c, uint32_t id)
+{
+    struct v4l2_queryctrl *query = find_control(cam, id);
+    struct v4l2_control ctrl = { .id = id };
+
+    ZAP(*c);
+    c->id = id;
+    if (!query || query->flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_READ_ONLY))
+        return;
+    if (camera_get_control(cam, &ctrl) != CAMERA_RETURN_SUCCESS)
+        return;
+    c->present = 1;
+    c->minimum = query->minimum;
+    c->maximum = query->maximum;
+    c->step = query->step > 0 ? query->step : 1;
+    c->value = ctrl.value;
+}
+
+/* Switch a driver auto mode to manual, remembering the old mode in c for ae_destroy(). */
+static void disable_auto(struct v4l2_camera *cam, struct ae_control *c, uint32_t id, int manual)
+{
+    struct v4l2_control ctrl = { .id = id };
+
+    ZAP(*c);
+    c->id = id;
+    if (!find_control(cam, id) || camera_get_control(cam, &ctrl) || ctrl.value == manual)
+        return;
+    c->value = ctrl.value;
+    ctrl.value = manual;
+    if (camera_set_control(cam, &ctrl) == CAMERA_RETURN_SUCCESS)
+        c->present = 1;
+}
+
+int ae_init(struct auto_exposure *ae, struct v4l2_camera *cam, struct ae_config *config)
+{
+    ZAP(*ae);
+    ae->config = *config;
+    ae_metrics_init();
+    if (!cam->profile.control_count)
+        camera_query_support_control(cam);
+    setup_control(cam, &ae->exposure, V4L2_CID_EXPOSURE_ABSOLUTE);
+    setup_control(cam, &ae->gain, V4L2_CID_GAIN);
+    ae->enabled = ae->exposure.present || ae->gain.present;
+    if (!ae->enabled) {
+        LOGI("No exposure or gain control, luma statistics only\n");
+        return CAMERA_RETURN_SUCCESS;
+    }
+    /* Only the modes that would fight the controls we drive. */
+    if (ae->exposure.present)
+        disable_auto(cam, &ae->exposure_auto, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL);
+    if (ae->gain.present)
+        disable_auto(cam, &ae->autogain, V4L2_CID_AUTOGAIN, 0);
+    metrics_set(metric_id.exposure, ae->exposure.value);
+    metrics_set(metric_id.gain, ae->gain.value);
+    LOGI("Auto exposure: target %d, exposure %d [%d, %d], gain %d [%d, %d]\n", config->target,
+            ae->exposure.value, ae->exposure.minimum, ae->exposure.maximum,
+            ae->gain.value, ae->gain.minimum, ae->gain.maximum);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Give the driver back the auto modes ae_init() turned off. */
+void ae_destroy(struct auto_exposure *ae, struct v4l2_camera *cam)
+{
+    struct ae_control *mode;
+    struct v4l2_control ctrl;
+    int i;
+
+    if (!ae)
+        return;
+    for (i = 0; i < 2; i++) {
+        mode = i ? &ae->autogain : &ae->exposure_auto;
+        if (!mode->present)
+            continue;
+        ctrl.id = mode->id;
+        ctrl.value = mode->value;
+        if (camera_set_control(cam, &ctrl))
+            LOGE(DUMP_NONE, "Restore auto mode of control 0x%x failed\n", ctrl.id);
+        mode->present = 0;
+    }
+}
+
+/* Controls are scaled from their minimum, so a gain range starting at 0 still scales. */
+static double level_of(struct ae_control *c)
+{
+    return c->value - c->minimum + 1;
+}
+
+static int to_value(struct ae_control *c, double level)
+{
+    long v = c->minimum + lround((level - 1) / c->step) * c->step;
+
+    if (v < c->minimum)
+        return c->minimum;
+    if (v > c->maximum)
+        return c->maximum;
+    return v;
+}
+
+/*
+ * Scale one control by ratio, returns the part of ratio it could not absorb.
+ * A coarse step may overshoot, the rest never turns the other way then.
+ */
+static double scale_control(struct ae_control *c, int *value, double ratio)
+{
+    double old = level_of(c), rest;
+
+    if (!c->present)
+        return ratio;
+    *value = to_value(c, old * ratio);
+    rest = ratio * old / (*value - c->minimum + 1);
+    if (ratio > 1)
+        return rest > 1 ? rest : 1;
+    return rest < 1 ? rest : 1;
+}
+
+static int write_control(struct auto_exposure *ae, struct v4l2_camera *cam, struct ae_control *c, int value)
+{
+    struct v4l2_control ctrl = { .id = c->id, .value = value };
+
+    if (!c->present || value == c->value)
+        return CAMERA_RETURN_SUCCESS;
+    if (camera_set_control(cam, &ctrl) != CAMERA_RETURN_SUCCESS) {
+        LOGE(DUMP_NONE, "Auto exposure disabled\n");
+        ae->enabled = 0;
+        return CAMERA_RETURN_FAILURE;
+    }
+    c->value = value;
+    metrics_add(metric_id.adjustments, 1);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/*
+ * Another tool may have moved the control. Cached values come from the
+ * control events, volatile controls are read from the driver.
+ */
+static void sync_control(struct v4l2_camera *cam, struct ae_control *c)
+{
+    struct v4l2_control ctrl = { .id = c->id };
+
+    if (c->present && camera_get_control(cam, &ctrl) == CAMERA_RETURN_SUCCESS)
+        c->value = ctrl.value;
+}
+
+/*
+ * Brighter: longer exposure first, gain only once exposure is at its limit.
+ * Darker: the other way round, so noise is traded away before motion blur.
+ */
+static void adjust(struct auto_exposure *ae, struct v4l2_camera *cam, double ratio)
+{
+    int exposure, gain;
+
+    sync_control(cam, &ae->exposure);
+    sync_control(cam, &ae->gain);
+    exposure = ae->exposure.value;
+    gain = ae->gain.value;
+    if (ratio > 1)
+        scale_control(&ae->gain, &gain, scale_control(&ae->exposure, &exposure, ratio));
+    else
+        scale_control(&ae->exposure, &exposure, scale_control(&ae->gain, &gain, ratio));
+    if (write_control(ae, cam, &ae->exposure, exposure) || write_control(ae, cam, &ae->gain, gain))
+        return;
+    metrics_set(metric_id.exposure, ae->exposure.value);
+    metrics_set(metric_id.gain, ae->gain.value);
+    LOGD("Auto exposure: mean %.1f, clipped %.3f, exposure %d, gain %d\n", ae->stats.mean,
+            ae->stats.clipped_ratio, ae->exposure.value, ae->gain.value);
+}
+
+int ae_process(struct auto_exposure *ae, struct v4l2_camera *cam, struct buffer buffer)
+{
+    struct ae_config *config = &ae->config;
+    struct v4l2_pix_format pix = cam->fmt.fmt.pix;
+    struct image_view view;
+    double mean, ratio;
+    int ret;
+
+    /* Meter the ROI only, in place. */
+    ret = camera_get_roi_view(cam, buffer, &view);
+    if (ret != CAMERA_RETURN_SUCCESS)
+        return ret;
+    pix.width = view.width;
+    pix.height = view.height;
+    pix.bytesperline = view.stride;
+    buffer.size -= view.addr - (uint8_t *)buffer.addr;
+    buffer.addr = view.addr;
+    ret = stats_luma(&pix, buffer, &config->stats, &ae->stats);
+    if (ret != CAMERA_RETURN_SUCCESS)
+        return ret;
+    metrics_set(metric_id.mean, ae->stats.mean);
+    metrics_set(metric_id.clipped, ae->stats.clipped_ratio);
+    if (!ae->enabled || ++ae->frame < config->interval)
+        return CAMERA_RETURN_SUCCESS;
+    ae->frame = 0;
+
+    mean = ae->stats.mean > 1 ? ae->stats.mean : 1;
+    if (ae->stats.clipped_ratio > config->clip_limit) {
+        /* The mean hides how far over the highlights are, step down regardless. */
+        ratio = 1 / config->max_step;
+        if (mean < config->target)
+            ratio = 1 - ae->stats.clipped_ratio;
+    } else if (mean < config->target - config->tolerance || mean > config->target + config->tolerance) {
+        ratio = config->target / mean;
+    } else {
+        return CAMERA_RETURN_SUCCESS;
+    }
+    if (ratio > config->max_step)
+        ratio = config->max_step;
+    if (ratio < 1 / config->max_step)
+        ratio = 1 / config->max_step;
+    adjust(ae, cam, ratio);
+    return CAMERA_RETURN_SUCCESS;
+}
@@ -0,0 +1,382 @@
+#include "camera.h"
+#include "bayer.h"
+#include "simd.h"
+#include "log.h"
+
+static const struct bayer_format formats[] = {
+    { V4L2_PIX_FMT_SRGGB8,  0, 0, 8 },
+    { V4L2_PIX_FMT_SGRBG8,  1, 0, 8 },
+    { V4L2_PIX_FMT_SGBRG8,  0, 1, 8 },
+    { V4L2_PIX_FMT_SBGGR8,  1, 1, 8 },
+    { V4L2_PIX_FMT_SRGGB10, 0, 0, 10 },
+    { V4L2_PIX_FMT_SGRBG10, 1, 0, 10 },
+    { V4L2_PIX_FMT_SGBRG10, 0, 1, 10 },
+    { V4L2_PIX_FMT_SBGGR10, 1, 1, 10 },
+    { V4L2_PIX_FMT_SRGGB12, 0, 0, 12 },
+    { V4L2_PIX_FMT_SGRBG12, 1, 0, 12 },
+    { V4L2_PIX_FMT_SGBRG12, 0, 1, 12 },
+    { V4L2_PIX_FMT_SBGGR12, 1, 1, 12 },
+    { V4L2_PIX_FMT_SRGGB16, 0, 0, 16 },
+    { V4L2_PIX_FMT_SGRBG16, 1, 0, 16 },
+    { V4L2_PIX_FMT_SGBRG16, 0, 1, 16 },
+    { V4L2_PIX_FMT_SBGGR16, 1, 1, 16 },
+};
+
+static const vec_s16 even_lanes = { -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0 };
+
+int bayer_lookup(uint32_t pixelformat, struct bayer_format *format)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        if (formats[i].pixelformat == pixelformat) {
+            if (format)
+                *format = formats[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int demosaic_parse_method(const char *name)
+{
+    if (!strcmp(name, "bilinear"))
+        return DEMOSAIC_BILINEAR;
+    if (!strcmp(name, "edge"))
+        return DEMOSAIC_EDGE;
+    if (!strcmp(name, "half"))
+        return DEMOSAIC_HALF;
+    LOGE(DUMP_NONE, "Unknown demosaic method %s\n", name);
+    return -1;
+}
+
+struct demosaic *demosaic_create(uint32_t pixelformat, uint32_t width, uint32_t height, int method, uint32_t out_format)
+{
+    struct demosaic *d;
+    uint8_t *mem;
+    int i;
+
+    d = calloc(1, sizeof(struct demosaic));
+    if (!d) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    if (!bayer_lookup(pixelformat, &d->format) || width < 4 || height < 4 || ((width | height) & 1) ||
+            method < DEMOSAIC_BILINEAR || method > DEMOSAIC_HALF ||
+            (out_format != V4L2_PIX_FMT_RGB24 && out_format != V4L2_PIX_FMT_YUYV)) {
+        LOGE(DUMP_NONE, "Can't demosaic %ux%u %c%c%c%c\n", width, height, pixelformat & 0xff,
+                (pixelformat >> 8) & 0xff, (pixelformat >> 16) & 0xff, pixelformat >> 24);
+        free(d);
+        return NULL;
+    }
+    d->method = method;
+    d->out_format = out_format;
+    d->width = width;
+    d->height = height;
+    d->out_width = method == DEMOSAIC_HALF ? width / 2 : width;
+    d->out_height = method == DEMOSAIC_HALF ? height / 2 : height;
+    if (out_format == V4L2_PIX_FMT_YUYV)
+        d->out_width &= ~1;
+    d->out_size = (size_t)d->out_width * d->out_height * (out_format == V4L2_PIX_FMT_YUYV ? 2 : 3);
+    /* Vector loads run up to a vector past the last pixel. */
+    d->line_size = width + BAYER_PAD * 2 + SIMD_BYTES * 2;
+    mem = calloc(BAYER_RAW_LINES + BAYER_GREEN_LINES + 3, d->line_size);
+    if (!mem) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        free(d);
+        return NULL;
+    }
+    for (i = 0; i < BAYER_RAW_LINES; i++, mem += d->line_size)
+        d->raw[i] = mem;
+    for (i = 0; i < BAYER_GREEN_LINES; i++, mem += d->line_size)
+        d->green[i] = mem;
+    for (i = 0; i < 3; i++, mem += d->line_size)
+        d->plane[i] = mem;
+    return d;
+}
+
+/* Mirror around the first and last line, which keeps the color phase. */
+static int reflect(int i, int n)
+{
+    if (i < 0)
+        i = -i;
+    if (i >= n)
+        i = 2 * (n - 1) - i;
+    return i;
+}
+
+static void pad_line(uint8_t *line, uint32_t width)
+{
+    line[BAYER_PAD - 1] = line[BAYER_PAD + 1];
+    line[BAYER_PAD - 2] = line[BAYER_PAD + 2];
+    line[BAYER_PAD + width] = line[BAYER_PAD + width - 2];
+    line[BAYER_PAD + width + 1] = line[BAYER_PAD + width - 3];
+}
+
+/* Line y of the frame in 8 bits, normalized once and kept while the window needs it. */
+static const uint8_t *raw_line(struct demosaic *d, int y)
+{
+    const struct image_view *src = d->src;
+    const uint16_t *in;
+    int slot, shift = d->format.bits - 8;
+    uint8_t *line;
+    uint32_t x, v;
+
+    y = reflect(y, d->height);
+    slot = y % BAYER_RAW_LINES;
+    line = d->raw[slot];
+    if (d->raw_y[slot] == y)
+        return line + BAYER_PAD;
+    if (d->format.bits == 8) {
+        memcpy(line + BAYER_PAD, src->addr + (size_t)src->stride * y, d->width);
+    } else {
+        in = (const uint16_t *)(src->addr + (size_t)src->stride * y);
+        for (x = 0; x < d->width; x++) {
+            v = in[x] >> shift;
+            line[BAYER_PAD + x] = v > 255 ? 255 : v;
+        }
+    }
+    pad_line(line, d->width);
+    d->raw_y[slot] = y;
+    return line + BAYER_PAD;
+}
+
+/* Whether the red or blue sample of line y sits on odd columns. */
+static int color_odd(struct demosaic *d, int y)
+{
+    int red_line = (y & 1) == d->format.red_y;
+
+    return red_line ? d->format.red_x : !d->format.red_x;
+}
+
+#define LOAD_S16(p)     vec_widen_s16(vec_load_u8(p))
+#define CLAMP_U8(v)     vec_select((v) < 0, (vec_s16){ 0 }, vec_select((v) > 255, (vec_s16){ 0 } + 255, (v)))
+
+/*
+ * Lanes on red or blue take the plain neighbor averages: green from the
+ * cross, the other color from the diagonals. Lanes on green take their own
+ * color from the left and right, the other from above and below.
+ */
+SIMD_KERNEL
+static void bilinear_line(const uint8_t *n, const uint8_t *c, const uint8_t *s,
+        uint8_t *own, uint8_t *green, uint8_t *other, uint32_t width, int odd)
+{
+    const vec_s16 mask = odd ? ~even_lanes : even_lanes;
+    uint32_t x;
+
+    for (x = 0; x < width; x += SIMD_BYTES) {
+        vec_s16 C = LOAD_S16(c + x), N = LOAD_S16(n + x), S = LOAD_S16(s + x);
+        vec_s16 W = LOAD_S16(c + x - 1), E = LOAD_S16(c + x + 1);
+        vec_s16 D = (LOAD_S16(n + x - 1) + LOAD_S16(n + x + 1) + LOAD_S16(s + x - 1) + LOAD_S16(s + x + 1) + 2) >> 2;
+        vec_s16 H = (W + E + 1) >> 1, V = (N + S + 1) >> 1, X = (N + S + W + E + 2) >> 2;
+
+        vec_store_u8(green + x, vec_narrow_s16(vec_select(mask, X, C)));
+        vec_store_u8(own + x, vec_narrow_s16(vec_select(mask, C, H)));
+        vec_store_u8(other + x, vec_narrow_s16(vec_select(mask, D, V)));
+    }
+}
+
+/*
+ * Green at red and blue interpolated along the direction with the smaller
+ * gradient, with a second order correction from the center color
+ * (Hamilton-Adams), so it follows edges instead of zippering across them.
+ */
+SIMD_KERNEL
+static void green_kernel(const uint8_t *n2, const uint8_t *n, const uint8_t *c, const uint8_t *s,
+        const uint8_t *s2, uint8_t *green, uint32_t width, int odd)
+{
+    const vec_s16 mask = odd ? ~even_lanes : even_lanes;
+    uint32_t x;
+
+    for (x = 0; x < width; x += SIMD_BYTES) {
+        vec_s16 C = LOAD_S16(c + x), W = LOAD_S16(c + x - 1), E = LOAD_S16(c + x + 1);
+        vec_s16 N = LOAD_S16(n + x), S = LOAD_S16(s + x);
+        vec_s16 lh = C * 2 - LOAD_S16(c + x - 2) - LOAD_S16(c + x + 2);
+        vec_s16 lv = C * 2 - LOAD_S16(n2 + x) - LOAD_S16(s2 + x);
+        vec_s16 gh = ((W + E) * 2 + lh + 2) >> 2, gv = ((N + S) * 2 + lv + 2) >> 2;
+        vec_s16 dh = W - E, dv = N - S;
+
+        dh = (dh ^ (dh >> 15)) - (dh >> 15) + ((lh ^ (lh >> 15)) - (lh >> 15));
+        dv = (dv ^ (dv >> 15)) - (dv >> 15) + ((lv ^ (lv >> 15)) - (lv >> 15));
+        gh = vec_select(dh < dv, gh, vec_select(dv < dh, gv, (gh + gv + 1) >> 1));
+        vec_store_u8(green + x, vec_narrow_s16(vec_select(mask, CLAMP_U8(gh), C)));
+    }
+}
+
+/* Red and blue from the bilinear color differences to the full green lines. */
+SIMD_KERNEL
+static void color_kernel(const uint8_t *n, const uint8_t *c, const uint8_t *s, const uint8_t *gn,
+        const uint8_t *gc, const uint8_t *gs, uint8_t *own, uint8_t *green, uint8_t *other,
+        uint32_t width, int odd)
+{
+    const vec_s16 mask = odd ? ~even_lanes : even_lanes;
+    uint32_t x;
+
+    for (x = 0; x < width; x += SIMD_BYTES) {
+        vec_s16 G = LOAD_S16(gc + x), C = LOAD_S16(c + x);
+        vec_s16 dw = LOAD_S16(c + x - 1) - LOAD_S16(gc + x - 1), de = LOAD_S16(c + x + 1) - LOAD_S16(gc + x + 1);
+        vec_s16 dn = LOAD_S16(n + x) - LOAD_S16(gn + x), ds = LOAD_S16(s + x) - LOAD_S16(gs + x);
+        vec_s16 dd = LOAD_S16(n + x - 1) - LOAD_S16(gn + x - 1) + LOAD_S16(n + x + 1) - LOAD_S16(gn + x + 1) +
+            LOAD_S16(s + x - 1) - LOAD_S16(gs + x - 1) + LOAD_S16(s + x + 1) - LOAD_S16(gs + x + 1);
+        vec_s16 H = CLAMP_U8(G + ((dw + de) >> 1)), V = CLAMP_U8(G + ((dn + ds) >> 1));
+        vec_s16 D = CLAMP_U8(G + (dd >> 2));
+
+        vec_store_u8(green + x, vec_narrow_s16(G));
+        vec_store_u8(own + x, vec_narrow_s16(vec_select(mask, C, H)));
+        vec_store_u8(other + x, vec_narrow_s16(vec_select(mask, D, V)));
+    }
+}
+
+/* One pixel per 2x2 tile, top is the line holding red. */
+SIMD_KERNEL
+static void half_line(const uint8_t *top, const uint8_t *bottom, uint8_t *r, uint8_t *g, uint8_t *b,
+        uint32_t out_width, int red_x)
+{
+    const vec_u16 low = (vec_u16){ 0 } + 0xff;
+    vec_u16 t, u;
+    uint32_t x;
+
+    for (x = 0; x < out_width; x += SIMD_BYTES) {
+        memcpy(&t, top + x * 2, sizeof(t));
+        memcpy(&u, bottom + x * 2, sizeof(u));
+        if (red_x) {
+            vec_store_u8(r + x, vec_narrow_u16(t >> 8));
+            vec_store_u8(g + x, vec_narrow_u16(((t & low) + (u >> 8) + 1) >> 1));
+            vec_store_u8(b + x, vec_narrow_u16(u & low));
+        } else {
+            vec_store_u8(r + x, vec_narrow_u16(t & low));
+            vec_store_u8(g + x, vec_narrow_u16(((t >> 8) + (u & low) + 1) >> 1));
+            vec_store_u8(b + x, vec_narrow_u16(u >> 8));
+        }
+    }
+}
+
+/* BT.601 limited range in place, the planes become Y, U and V. */
+SIMD_KERNEL
+static void rgb_to_yuv(uint8_t *r, uint8_t *g, uint8_t *b, uint32_t width)
+{
+    uint32_t x;
+
+    for (x = 0; x < width; x += SIMD_BYTES) {
+        vec_u16 R = vec_widen_u8(vec_load_u8(r + x)), G = vec_widen_u8(vec_load_u8(g + x));
+        vec_u16 B = vec_widen_u8(vec_load_u8(b + x));
+
+        /* Offsets are added before the subtractions, so nothing wraps in 16 bits. */
+        vec_store_u8(r + x, vec_narrow_u16(((R * 66 + G * 129 + B * 25 + 128) >> 8) + 16));
+        vec_store_u8(g + x, vec_narrow_u16((B * 112 + 32896 - R * 38 - G * 74) >> 8));
+        vec_store_u8(b + x, vec_narrow_u16((R * 112 + 32896 - G * 94 - B * 18) >> 8));
+    }
+}
+
+static void pack_rgb(uint8_t **plane, uint8_t *dst, uint32_t width)
+{
+    uint32_t x;
+
+    for (x = 0; x < width; x++, dst += 3) {
+        dst[0] = plane[0][x];
+        dst[1] = plane[1][x];
+        dst[2] = plane[2][x];
+    }
+}
+
+static void pack_yuyv(uint8_t **plane, uint8_t *dst, uint32_t width)
+{
+    uint32_t x;
+
+    for (x = 0; x < width; x += 2, dst += 4) {
+        dst[0] = plane[0][x];
+        dst[1] = (plane[1][x] + plane[1][x + 1] + 1) >> 1;
+        dst[2] = plane[0][x + 1];
+        dst[3] = (plane[2][x] + plane[2][x + 1] + 1) >> 1;
+    }
+}
+
+static const uint8_t *green_line(struct demosaic *d, int y)
+{
+    int slot;
+    uint8_t *line;
+
+    y = reflect(y, d->height);
+    slot = y % BAYER_GREEN_LINES;
+    line = d->green[slot];
+    if (d->green_y[slot] != y) {
+        green_kernel(raw_line(d, y - 2), raw_line(d, y - 1), raw_line(d, y), raw_line(d, y + 1),
+                raw_line(d, y + 2), line + BAYER_PAD, d->width, color_odd(d, y));
+        pad_line(line, d->width);
+        d->green_y[slot] = y;
+    }
+    return line + BAYER_PAD;
+}
+
+static void demosaic_line(struct demosaic *d, int y)
+{
+    const uint8_t *gn, *gc, *gs, *top, *bottom;
+    int red_line = (y & 1) == d->format.red_y;
+    uint8_t *own = d->plane[red_line ? 0 : 2], *other = d->plane[red_line ? 2 : 0];
+
+    switch (d->method) {
+        case DEMOSAIC_HALF:
+            top = raw_line(d, y * 2);
+            bottom = raw_line(d, y * 2 + 1);
+            if (d->format.red_y)
+                half_line(bottom, top, d->plane[0], d->plane[1], d->plane[2], d->out_width, d->format.red_x);
+            else
+                half_line(top, bottom, d->plane[0], d->plane[1], d->plane[2], d->out_width, d->format.red_x);
+            break;
+        case DEMOSAIC_BILINEAR:
+            bilinear_line(raw_line(d, y - 1), raw_line(d, y), raw_line(d, y + 1),
+                    own, d->plane[1], other, d->width, color_odd(d, y));
+            break;
+        default:
+            /* Green lines first, they pull in the raw lines two above and below. */
+            gn = green_line(d, y - 1);
+            gc = green_line(d, y);
+            gs = green_line(d, y + 1);
+            color_kernel(raw_line(d, y - 1), raw_line(d, y), raw_line(d, y + 1), gn, gc, gs,
+                    own, d->plane[1], other, d->width, color_odd(d, y));
+    }
+}
+
+/* src may be larger, e.g. a ROI view rounded up, its top left width x height is used. */
+int demosaic_process(struct demosaic *d, const struct image_view *src, struct buffer *dst)
+{
+    size_t out_stride = (size_t)d->out_width * (d->out_format == V4L2_PIX_FMT_YUYV ? 2 : 3);
+    uint8_t *out = dst->addr;
+    uint32_t y;
+    int i;
+
+    if (src->pixelformat != d->format.pixelformat || src->width < d->width || src->height < d->height ||
+            src->stride < d->width * (d->format.bits > 8 ? 2 : 1)) {
+        LOGE(DUMP_NONE, "Frame doesn't match the demosaic setup\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (dst->size < d->out_size) {
+        LOGE(DUMP_NONE, "Demosaic output needs %zu bytes, got %zu\n", d->out_size, dst->size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    d->src = src;
+    for (i = 0; i < BAYER_RAW_LINES; i++)
+        d->raw_y[i] = -1;
+    for (i = 0; i < BAYER_GREEN_LINES; i++)
+        d->green_y[i] = -1;
+    for (y = 0; y < d->out_height; y++, out += out_stride) {
+        demosaic_line(d, y);
+        if (d->out_format == V4L2_PIX_FMT_YUYV) {
+            rgb_to_yuv(d->plane[0], d->plane[1], d->plane[2], d->out_width);
+            pack_yuyv(d->plane, out, d->out_width);
+        } else {
+            pack_rgb(d->plane, out, d->out_width);
+        }
+    }
+    d->src = NULL;
+    dst->size = d->out_size;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+void demosaic_destroy(struct demosaic *d)
+{
+    if (!d)
+        return;
+    free(d->raw[0]);
+    free(d);
+}
@@ -0,0 +1,252 @@
+#include "camera.h"
+#include "burst.h"
+#include "worker.h"
+#include "simd.h"
+#include "util.h"
+#include "log.h"
+
+#define HUGEPAGE_SIZE       (2UL << 20)
+
+/* Parsed from "count[,budget]", the budget in MiB, 0 for a share of MemAvailable. */
+int burst_parse_options(const char *spec, uint32_t *count, uint64_t *budget)
+{
+    unsigned long long mib = 0;
+    int n = 0;
+
+    if (sscanf(spec, "%d,%llu", &n, &mib) < 1 || n < 1 || n > BURST_MAX_FRAMES) {
+        LOGE(DUMP_NONE, "Invalid burst '%s', 1 to %d frames\n", spec, BURST_MAX_FRAMES);
+        return CAMERA_RETURN_FAILURE;
+    }
+    *count = n;
+    *budget = mib << 20;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static uint64_t mem_available(void)
+{
+    unsigned long long kb = 0;
+    char line[128];
+    FILE *fp;
+
+    fp = fopen("/proc/meminfo", "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb << 10;
+}
+
+/* A page fault in the middle of the burst costs more than a frame interval, so everything is faulted in here. */
+static int map_region(struct burst *burst)
+{
+    size_t size = burst->slot_size * burst->capacity;
+
+    burst->map_size = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+    burst->base = mmap(NULL, burst->map_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (burst->base != MAP_FAILED) {
+        burst->hugepage = 1;
+    } else {
+        burst->map_size = size;
+        burst->base = mmap(NULL, burst->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (burst->base == MAP_FAILED) {
+            LOGE(DUMP_ERROR, "Map %zu bytes failed\n", burst->map_size);
+            burst->base = NULL;
+            return CAMERA_RETURN_FAILURE;
+        }
+        madvise(burst->base, burst->map_size, MADV_HUGEPAGE);
+        memset(burst->base, 0, burst->map_size);
+    }
+    /* Locking needs RLIMIT_MEMLOCK or CAP_IPC_LOCK, without it the pages may still be swapped out. */
+    burst->locked = !mlock(burst->base, burst->map_size);
+    if (!burst->locked)
+        LOGI("Burst memory not locked: %s\n", strerror(errno));
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/*
+ * count frames of up to frame_size bytes. budget caps the region in bytes,
+ * 0 for BURST_BUDGET_PERCENT of MemAvailable, and the region never takes
+ * more than is available.
+ */
+struct burst *burst_create(struct v4l2_pix_format *pix, size_t frame_size, uint32_t count, uint64_t budget)
+{
+    uint64_t need, avail = mem_available();
+    struct burst *burst;
+
+    if (!count || count > BURST_MAX_FRAMES) {
+        LOGE(DUMP_NONE, "Burst of %u frames, 1 to %d allowed\n", count, BURST_MAX_FRAMES);
+        return NULL;
+    }
+    need = (uint64_t)page_align(frame_size) * count;
+    if (!budget)
+        budget = avail * BURST_BUDGET_PERCENT / 100;
+    if (!avail) {
+        LOGI("No MemAvailable, burst budget unchecked\n");
+    } else if (need > budget || need > avail) {
+        LOGE(DUMP_NONE, "Burst of %u frames needs %llu MiB, budget %llu MiB of %llu MiB available\n", count,
+                (unsigned long long)(need >> 20), (unsigned long long)(budget >> 20),
+                (unsigned long long)(avail >> 20));
+        return NULL;
+    }
+
+    burst = calloc(1, sizeof(struct burst));
+    if (!burst) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    burst->pix = *pix;
+    burst->slot_size = page_align(frame_size);
+    burst->capacity = count;
+    burst->frame = calloc(count, sizeof(struct burst_frame));
+    if (!burst->frame) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        goto err_free;
+    }
+    if (map_region(burst))
+        goto err_free;
+    LOGI("Burst of %u frames, %llu MiB reserved%s%s\n", count, (unsigned long long)(burst->map_size >> 20),
+            burst->hugepage ? ", hugetlb" : "", burst->locked ? ", locked" : "");
+    return burst;
+
+err_free:
+    free(burst->frame);
+    free(burst);
+    return NULL;
+}
+
+/* Nothing reads a burst frame before the flush, so the copy must not evict what the capture path uses. */
+static void copy_stream(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    size_t i, n = size & ~(size_t)(4 * SIMD_BYTES - 1);
+    vec_u8 a, b, c, d;
+
+    for (i = 0; i < n; i += 4 * SIMD_BYTES) {
+        a = vec_load_u8(src + i);
+        b = vec_load_u8(src + i + SIMD_BYTES);
+        c = vec_load_u8(src + i + 2 * SIMD_BYTES);
+        d = vec_load_u8(src + i + 3 * SIMD_BYTES);
+        vec_stream_u8(dst + i, a);
+        vec_stream_u8(dst + i + SIMD_BYTES, b);
+        vec_stream_u8(dst + i + 2 * SIMD_BYTES, c);
+        vec_stream_u8(dst + i + 3 * SIMD_BYTES, d);
+    }
+    memcpy(dst + n, src + n, size - n);
+    vec_stream_fence();
+}
+
+int burst_add(struct burst *burst, struct v4l2_buffer *buffer_info, struct buffer buffer)
+{
+    struct burst_frame *frame;
+    uint32_t last;
+
+    if (burst->count >= burst->capacity) {
+        LOGE(DUMP_NONE, "Burst is full\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (buffer.size > burst->slot_size) {
+        LOGE(DUMP_NONE, "Frame size %zu exceeds burst slot\n", buffer.size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (burst->count) {
+        last = burst->frame[burst->count - 1].info.sequence;
+        if (buffer_info->sequence > last + 1)
+            burst->drops += buffer_info->sequence - last - 1;
+        else if (buffer_info->sequence <= last)
+            burst->restarts++;
+    }
+    if (buffer_info->flags & V4L2_BUF_FLAG_ERROR)
+        burst->errors++;
+    frame = &burst->frame[burst->count];
+    copy_stream(burst->base + burst->slot_size * burst->count, buffer.addr, buffer.size);
+    frame->info = *buffer_info;
+    frame->size = buffer.size;
+    frame->restarts = burst->restarts;
+    burst->count++;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static void write_task(struct worker_task *task)
+{
+    struct burst *burst = task->ctx;
+    char name[64];
+    int fd;
+
+    /* The sequence starts over with a restarted stream, the names mustn't. */
+    if (task->arg)
+        snprintf(name, sizeof(name), "burst_%llu_%08u.%s", (unsigned long long)task->arg, task->info.sequence,
+                burst->ext);
+    else
+        snprintf(name, sizeof(name), "burst_%08u.%s", task->info.sequence, burst->ext);
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || write(fd, task->buffer.addr, task->buffer.size) != (ssize_t)task->buffer.size) {
+        LOGE(DUMP_ERROR, "Write %s failed\n", name);
+        __atomic_store_n(&burst->failed, 1, __ATOMIC_RELAXED);
+    }
+    if (fd != -1)
+        close(fd);
+}
+
+/* After stream off, one file per frame named by its sequence, written by threads writers. */
+int burst_flush(struct burst *burst, const char *ext, int threads)
+{
+    struct worker_pool *writers;
+    struct worker_task task;
+    struct time_recorder tr;
+    uint64_t bytes = 0;
+    double ms;
+    uint32_t i;
+
+    if (!burst->count) {
+        LOGI("Burst is empty\n");
+        return CAMERA_RETURN_SUCCESS;
+    }
+    if (burst->restarts)
+        LOGE(DUMP_NONE, "Burst of %u frames, stream restarted %u times, lost at least %u, %u corrupt\n",
+                burst->count, burst->restarts, burst->drops, burst->errors);
+    else if (burst->drops || burst->errors)
+        LOGE(DUMP_NONE, "Burst of %u frames, sequence %u to %u, lost %u, %u corrupt\n", burst->count,
+                burst->frame[0].info.sequence, burst->frame[burst->count - 1].info.sequence, burst->drops,
+                burst->errors);
+    else
+        LOGI("Burst of %u frames, sequence %u to %u, no drops\n", burst->count, burst->frame[0].info.sequence,
+                burst->frame[burst->count - 1].info.sequence);
+
+    /* ext may be a per thread buffer such as fmt2desc()'s, the writers can't read it. */
+    snprintf(burst->ext, sizeof(burst->ext), "%s", ext);
+    writers = worker_pool_create("burst", threads, threads * 2, NULL, RT_ROLE_WRITER);
+    if (!writers)
+        return CAMERA_RETURN_FAILURE;
+    time_recorder_start(&tr);
+    ZAP(task);
+    task.func = write_task;
+    task.ctx = burst;
+    for (i = 0; i < burst->count; i++) {
+        task.buffer.addr = burst->base + burst->slot_size * i;
+        task.buffer.size = burst->frame[i].size;
+        task.info = burst->frame[i].info;
+        task.arg = burst->frame[i].restarts;
+        worker_pool_submit(writers, &task);
+        bytes += task.buffer.size;
+    }
+    worker_pool_wait(writers);
+    worker_pool_destroy(writers);
+    time_recorder_end(&tr);
+    time_recorder_print_time(&tr, "Burst flush");
+    ms = tr.end.tv_sec * 1e3 + tr.end.tv_usec / 1e3 - tr.start.tv_sec * 1e3 - tr.start.tv_usec / 1e3;
+    LOGI("Flushed %u frames, %llu MiB in %.0fms on %d threads\n", burst->count,
+            (unsigned long long)(bytes >> 20), ms, threads);
+    return burst->failed ? CAMERA_RETURN_FAILURE : CAMERA_RETURN_SUCCESS;
+}
+
+void burst_destroy(struct burst *burst)
+{
+    if (!burst)
+        return;
+    if (burst->base)
+        munmap(burst->base, burst->map_size);
+    free(burst->frame);
+    free(burst);
+}
@@ -1,6 +1,14 @@
+#include <math.h>
+#include <poll.h>
+
 #include "camera.h"
 #include "util.h"
 #include "log.h"
+#include "record.h"
+#include "profile.h"
+#include "metrics.h"
+#include "trace.h"
+#include "bayer.h"
 
 static int v4l2_queue_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info)
 {
@@ -22,8 +30,12 @@ static int v4l2_dequeue_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buff
         {
             case EAGAIN:
                 return -EAGAIN;
+            case ENODEV:
+            case ENXIO:
+                LOGE(DUMP_ERROR, "Device is gone\n");
+                return -ENODEV;
             case EIO:
-                /* Could ignore EIO, see spec. */
+                /* Buffers may be lost or the queue broken, see camera_recover(). */
                 /* fall through */
             default:
                 LOGE(DUMP_ERROR, "dequeue buffer failed\n");
@@ -33,16 +45,28 @@ static int v4l2_dequeue_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buff
     return CAMERA_RETURN_SUCCESS;
 }
 
+static int v4l2_buffer_ready(struct v4l2_camera *cam)
+{
+    struct pollfd pfd = { cam->fd, POLLIN, 0 };
+
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+static int v4l2_poll_fd(struct v4l2_camera *cam)
+{
+    return cam->fd;
+}
+
 static int v4l2_get_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info, struct buffer *buffer)
 {
     // Just get the buffer address and size, don't change it directly.
-    assert(buffer_info->index < cam->bufq.count);
-    buffer->addr = cam->bufq.buf[buffer_info->index].addr;
+    assert(buffer_info->index - cam->bufq.base < cam->bufq.count);
+    buffer->addr = cam->bufq.buf[buffer_info->index - cam->bufq.base].addr;
     // For compressed format such as MJPEG, it will not use whole buffer.
     if (buffer_info->bytesused)
         buffer->size = buffer_info->bytesused;
     else
-        buffer->size = cam->bufq.buf[buffer_info->index].size;
+        buffer->size = cam->bufq.buf[buffer_info->index - cam->bufq.base].size;
     return CAMERA_RETURN_SUCCESS;
 }
 
@@ -59,7 +83,7 @@ static int v4l2_start_capturing(struct v4l2_camera *cam)
         ZAP(buffer_info);
         buffer_info.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buffer_info.memory      = V4L2_MEMORY_MMAP;
-        buffer_info.index       = i;
+        buffer_info.index       = cam->bufq.base + i;
         if (v4l2_queue_buffer(cam, &buffer_info))
             return CAMERA_RETURN_FAILURE;
     }
@@ -82,62 +106,81 @@ static void v4l2_stop_capturing (struct v4l2_camera *cam)
     }
 }
 
-static int v4l2_request_and_map_buffer(struct v4l2_camera *cam)
+/* Query and map count buffers from V4L2 index base on into bufq. */
+static int map_buffers(struct v4l2_camera *cam, struct buffer_queue *bufq, int base, int count)
 {
-    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buffer_info;
     int i;
 
-    LOGI("Request and map buffer\n");
-    ZAP(req);
-    req.count               = MAX_BUFFER_NUM;
-    req.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory              = V4L2_MEMORY_MMAP;
-    if(xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
-        LOGE(DUMP_ERROR, "Request buffer failed\n");
-        return CAMERA_RETURN_FAILURE;
-    }
-    LOGI("Buffer count: %d\n", req.count);
-    if(req.count < MIN_BUFFER_NUM)
-    {
-        LOGE(DUMP_NONE, "Insufficient buffer memory on %s\n", cam->dev_name);
-        return CAMERA_RETURN_FAILURE;
-    }
-    cam->bufq.buf = calloc(req.count, sizeof(struct buffer));
-    if(!cam->bufq.buf)
-    {
+    bufq->buf = calloc(count, sizeof(struct buffer));
+    if (!bufq->buf) {
         LOGE(DUMP_NONE, "Out of memory\n");
-        goto out_return_buffer;
+        return CAMERA_RETURN_FAILURE;
     }
-    cam->bufq.count = req.count;
-    for(i = 0; i < req.count; i++)
-    {
-        struct v4l2_buffer buffer_info;
+    for (i = 0; i < count; i++) {
         ZAP(buffer_info);
         buffer_info.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buffer_info.memory      = V4L2_MEMORY_MMAP;
-        buffer_info.index       = i;
-        if(xioctl(cam->fd, VIDIOC_QUERYBUF, &buffer_info)) {
-            LOGE(DUMP_ERROR, "Query [%d] buffer failed\n", i);
+        buffer_info.index       = base + i;
+        if (xioctl(cam->fd, VIDIOC_QUERYBUF, &buffer_info)) {
+            LOGE(DUMP_ERROR, "Query [%d] buffer failed\n", base + i);
             goto out_unmap_buffer;
         }
-        cam->bufq.buf[i].size = buffer_info.length;
-        cam->bufq.buf[i].addr = mmap(NULL /* start anywhere */,
+        bufq->buf[i].size = buffer_info.length;
+        bufq->buf[i].addr = mmap(NULL /* start anywhere */,
                 buffer_info.length,
                 PROT_READ | PROT_WRITE /* required */,
                 MAP_SHARED /* recommended */,
                 cam->fd, buffer_info.m.offset);
-        if(MAP_FAILED == cam->bufq.buf[i].addr) {
+        if (MAP_FAILED == bufq->buf[i].addr) {
             LOGE(DUMP_ERROR, "Mmap failed\n");
             goto out_unmap_buffer;
         }
     }
+    bufq->base = base;
+    bufq->count = count;
     return CAMERA_RETURN_SUCCESS;
 out_unmap_buffer:
-    while(--i >= 0) {
-        munmap(cam->bufq.buf[i].addr, cam->bufq.buf[i].size);
+    while (--i >= 0)
+        munmap(bufq->buf[i].addr, bufq->buf[i].size);
+    free(bufq->buf);
+    bufq->buf = NULL;
+    return CAMERA_RETURN_FAILURE;
+}
+
+static void unmap_buffers(struct buffer_queue *bufq)
+{
+    int i;
+
+    for (i = 0; i < bufq->count; i++)
+        munmap(bufq->buf[i].addr, bufq->buf[i].size);
+    free(bufq->buf);
+    bufq->buf = NULL;
+    bufq->base = 0;
+    bufq->count = 0;
+}
+
+static int v4l2_request_and_map_buffer(struct v4l2_camera *cam)
+{
+    struct v4l2_requestbuffers req;
+
+    LOGI("Request and map buffer\n");
+    ZAP(req);
+    req.count               = MAX_BUFFER_NUM;
+    req.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory              = V4L2_MEMORY_MMAP;
+    if(xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
+        LOGE(DUMP_ERROR, "Request buffer failed\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    LOGI("Buffer count: %d\n", req.count);
+    if(req.count < MIN_BUFFER_NUM)
+    {
+        LOGE(DUMP_NONE, "Insufficient buffer memory on %s\n", cam->dev_name);
+        return CAMERA_RETURN_FAILURE;
     }
-    free(cam->bufq.buf);
-out_return_buffer:
+    if (map_buffers(cam, &cam->bufq, 0, req.count) == CAMERA_RETURN_SUCCESS)
+        return CAMERA_RETURN_SUCCESS;
     req.count = 0;
     if(xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
         LOGE(DUMP_ERROR, "Return buffer failed\n");
@@ -146,14 +189,14 @@ out_return_buffer:
     return CAMERA_RETURN_FAILURE;
 }
 
+/* The set of the other mode goes too, REQBUFS frees every buffer of the queue. */
 static void v4l2_return_and_unmap_buffer(struct v4l2_camera *cam)
 {
-    unsigned int i;
     struct v4l2_requestbuffers req;
 
     LOGI("Return and unmap buffer\n");
-    for(i = 0; i < cam->bufq.count; i++)
-        munmap(cam->bufq.buf[i].addr, cam->bufq.buf[i].size);
+    unmap_buffers(&cam->bufq);
+    unmap_buffers(&cam->alt_bufq);
     ZAP(req);
     req.count               = 0;
     req.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -162,9 +205,107 @@ static void v4l2_return_and_unmap_buffer(struct v4l2_camera *cam)
         LOGE(DUMP_ERROR, "Return buffer failed\n");
     }
     LOGI("Buffer count: %d\n", req.count);
-    if (cam->bufq.buf) {
-        free(cam->bufq.buf);
+}
+
+/*
+ * Buffers for the alternate format, added to the queue next to the active
+ * set with VIDIOC_CREATE_BUFS. Without it the mode still switches, only by
+ * reallocating. So does a driver that refuses S_FMT while buffers exist,
+ * which most vb2 drivers do, extra buffers would only be freed unused.
+ */
+static int v4l2_prepare_mode(struct v4l2_camera *cam)
+{
+    struct v4l2_create_buffers create;
+    struct v4l2_format fmt = cam->fmt;
+
+    if (xioctl(cam->fd, VIDIOC_TRY_FMT, &cam->alt_fmt)) {
+        LOGE(DUMP_ERROR, "Try format failed\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    /* Setting the current format again changes nothing where it is allowed. */
+    if (xioctl(cam->fd, VIDIOC_S_FMT, &fmt) && errno == EBUSY) {
+        LOGI("No format change with buffers allocated, mode switches reallocate\n");
+        return CAMERA_RETURN_SUCCESS;
     }
+    ZAP(create);
+    create.count            = cam->bufq.count;
+    create.memory           = V4L2_MEMORY_MMAP;
+    create.format           = cam->alt_fmt;
+    if (xioctl(cam->fd, VIDIOC_CREATE_BUFS, &create)) {
+        LOGI("No VIDIOC_CREATE_BUFS: %s, mode switches reallocate\n", strerror(errno));
+        return CAMERA_RETURN_SUCCESS;
+    }
+    if (create.count < MIN_BUFFER_NUM) {
+        /* Can't be freed alone, they go with the next REQBUFS. */
+        LOGI("Only %u buffers for the alternate mode, mode switches reallocate\n", create.count);
+        return CAMERA_RETURN_SUCCESS;
+    }
+    LOGI("Created %u buffers for %ux%u %s\n", create.count, cam->alt_fmt.fmt.pix.width,
+            cam->alt_fmt.fmt.pix.height, fmt2desc(cam->alt_fmt.fmt.pix.pixelformat));
+    return map_buffers(cam, &cam->alt_bufq, create.index, create.count);
+}
+
+static int v4l2_set_output_format(struct v4l2_camera *cam);
+
+/*
+ * Not streaming here. With preallocated buffers only S_FMT runs between
+ * STREAMOFF and STREAMON, but most vb2 drivers refuse S_FMT while any
+ * buffer exists, then it is REQBUFS(0), S_FMT and REQBUFS on the open fd.
+ */
+static int v4l2_switch_mode(struct v4l2_camera *cam, int *fast)
+{
+    struct v4l2_format fmt = cam->alt_fmt, old = cam->fmt;
+    struct buffer_queue bufq;
+
+    *fast = 0;
+    if (cam->alt_bufq.count) {
+        if (xioctl(cam->fd, VIDIOC_S_FMT, &fmt)) {
+            LOGI("Format change with buffers allocated failed: %s, reallocate\n", strerror(errno));
+        } else if (fmt.fmt.pix.sizeimage > cam->alt_bufq.buf[0].size) {
+            LOGI("Frames of %u bytes don't fit the preallocated buffers, reallocate\n", fmt.fmt.pix.sizeimage);
+        } else {
+            bufq = cam->bufq;
+            cam->bufq = cam->alt_bufq;
+            cam->alt_bufq = bufq;
+            cam->fmt = fmt;
+            cam->alt_fmt = old;
+            *fast = 1;
+            return CAMERA_RETURN_SUCCESS;
+        }
+    }
+    v4l2_return_and_unmap_buffer(cam);
+    cam->fmt = cam->alt_fmt;
+    if (v4l2_set_output_format(cam)) {
+        cam->fmt = old;
+        return CAMERA_RETURN_FAILURE;
+    }
+    cam->alt_fmt = old;
+    return v4l2_request_and_map_buffer(cam);
+}
+
+/* After an error nobody knows which buffers the driver still has, so ask it. */
+static int v4l2_requeue_all(struct v4l2_camera *cam)
+{
+    struct v4l2_buffer buffer_info;
+    int i, requeued = 0;
+
+    for (i = 0; i < cam->bufq.count; i++) {
+        ZAP(buffer_info);
+        buffer_info.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer_info.memory      = V4L2_MEMORY_MMAP;
+        buffer_info.index       = cam->bufq.base + i;
+        if (xioctl(cam->fd, VIDIOC_QUERYBUF, &buffer_info)) {
+            LOGE(DUMP_ERROR, "Query [%d] buffer failed\n", buffer_info.index);
+            return CAMERA_RETURN_FAILURE;
+        }
+        if (buffer_info.flags & (V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE))
+            continue;
+        if (v4l2_queue_buffer(cam, &buffer_info))
+            return CAMERA_RETURN_FAILURE;
+        requeued++;
+    }
+    LOGI("Requeued %d buffers\n", requeued);
+    return CAMERA_RETURN_SUCCESS;
 }
 
 static int v4l2_open_device(struct v4l2_camera *cam)
@@ -182,7 +323,7 @@ static int v4l2_open_device(struct v4l2_camera *cam)
         LOGE(DUMP_NONE, "%s is not char device\n", cam->dev_name);
         return CAMERA_RETURN_FAILURE;
     }
-    cam->fd = open(cam->dev_name, O_RDWR /* required */ , 0);
+    cam->fd = open(cam->dev_name, O_RDWR /* required */ | O_CLOEXEC, 0);
     if(-1 == cam->fd)
     {
         LOGE(DUMP_ERROR, "Cannot open '%s'\n", cam->dev_name);
@@ -200,6 +341,52 @@ static void v4l2_close_device(struct v4l2_camera *cam)
     cam->fd = -1;
 }
 
+/*
+ * A replugged device may come back under another node, bus_info and card
+ * still identify it. Candidates are only queried through a non blocking
+ * probe fd, the device is opened for real once it matched.
+ */
+static int v4l2_reopen(struct v4l2_camera *cam)
+{
+    struct v4l2_capability cap;
+    char path[sizeof(cam->dev_path)];
+    uint32_t caps;
+    int i, fd;
+
+    if (cam->fd != -1)
+        v4l2_close_device(cam);
+    for (i = -1; i < MAX_VIDEO_NODE; i++) {
+        if (i < 0)
+            snprintf(path, sizeof(path), "%s", cam->dev_name);
+        else
+            snprintf(path, sizeof(path), "/dev/video%d", i);
+        fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        ZAP(cap);
+        caps = 0;
+        if (!xioctl(fd, VIDIOC_QUERYCAP, &cap))
+            caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ? cap.device_caps : cap.capabilities;
+        close(fd);
+        if ((caps & V4L2_CAP_VIDEO_CAPTURE) && !strcmp((char *)cap.bus_info, (char *)cam->cap.bus_info) &&
+                !strcmp((char *)cap.card, (char *)cam->cap.card)) {
+            cam->fd = open(path, O_RDWR | O_CLOEXEC);
+            if (cam->fd == -1) {
+                LOGE(DUMP_ERROR, "Cannot open '%s'\n", path);
+                return CAMERA_RETURN_FAILURE;
+            }
+            if (strcmp(path, cam->dev_name)) {
+                snprintf(cam->dev_path, sizeof(cam->dev_path), "%s", path);
+                cam->dev_name = cam->dev_path;
+                LOGI("%s is back as %s\n", cam->cap.card, cam->dev_name);
+            }
+            return CAMERA_RETURN_SUCCESS;
+        }
+    }
+    LOGD("%s at %s is not back yet\n", cam->cap.card, cam->cap.bus_info);
+    return CAMERA_RETURN_FAILURE;
+}
+
 static int v4l2_query_cap(struct v4l2_camera *cam)
 {
     if(xioctl(cam->fd, VIDIOC_QUERYCAP, &cam->cap))
@@ -255,14 +442,14 @@ static void dump_output_format(struct v4l2_camera *cam)
     LOGI("\tcolorspace      %d\n", cam->fmt.fmt.pix.colorspace);
 }
 
-static void v4l2_get_output_format(struct v4l2_camera *cam)
+static int v4l2_get_output_format(struct v4l2_camera *cam)
 {
     if (xioctl(cam->fd, VIDIOC_G_FMT, &cam->fmt))
     {
         LOGE(DUMP_ERROR, "Get format failed\n");
-        return;
+        return CAMERA_RETURN_FAILURE;
     }
-    dump_output_format(cam);
+    return CAMERA_RETURN_SUCCESS;
 }
 
 static int v4l2_set_output_format(struct v4l2_camera *cam)
@@ -275,15 +462,114 @@ static int v4l2_set_output_format(struct v4l2_camera *cam)
     return CAMERA_RETURN_SUCCESS;
 }
 
+/* The crop a driver starts out with, which need not be the whole sensor. */
+static int v4l2_reset_crop(struct v4l2_camera *cam)
+{
+    struct v4l2_selection sel;
+    struct v4l2_cropcap cropcap;
+    struct v4l2_crop crop;
+
+    ZAP(sel);
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+    if (!xioctl(cam->fd, VIDIOC_G_SELECTION, &sel)) {
+        sel.target = V4L2_SEL_TGT_CROP;
+        if (!xioctl(cam->fd, VIDIOC_S_SELECTION, &sel))
+            return CAMERA_RETURN_SUCCESS;
+    }
+    ZAP(cropcap);
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    ZAP(crop);
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (!xioctl(cam->fd, VIDIOC_CROPCAP, &cropcap)) {
+        crop.c = cropcap.defrect;
+        if (!xioctl(cam->fd, VIDIOC_S_CROP, &crop))
+            return CAMERA_RETURN_SUCCESS;
+    }
+    LOGD("Driver can't reset the crop\n");
+    return CAMERA_RETURN_FAILURE;
+}
+
+/* Selection API first, the older crop ioctls for drivers that predate it. */
+static int v4l2_set_crop(struct v4l2_camera *cam, struct v4l2_rect *rect)
+{
+    struct v4l2_selection sel;
+    struct v4l2_crop crop;
+
+    if (!rect)
+        return v4l2_reset_crop(cam);
+    ZAP(sel);
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP;
+    sel.flags = V4L2_SEL_FLAG_GE;
+    sel.r = *rect;
+    if (!xioctl(cam->fd, VIDIOC_S_SELECTION, &sel)) {
+        *rect = sel.r;
+        return CAMERA_RETURN_SUCCESS;
+    }
+    ZAP(crop);
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    crop.c = *rect;
+    if (!xioctl(cam->fd, VIDIOC_S_CROP, &crop) && !xioctl(cam->fd, VIDIOC_G_CROP, &crop)) {
+        *rect = crop.c;
+        return CAMERA_RETURN_SUCCESS;
+    }
+    LOGD("Driver can't crop\n");
+    return CAMERA_RETURN_FAILURE;
+}
+
+static int v4l2_get_frame_interval(struct v4l2_camera *cam, struct v4l2_fract *interval)
+{
+    struct v4l2_streamparm parm;
+
+    ZAP(parm);
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(cam->fd, VIDIOC_G_PARM, &parm) || !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        LOGD("Driver can't set the frame rate\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    *interval = parm.parm.capture.timeperframe;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int v4l2_set_frame_interval(struct v4l2_camera *cam, struct v4l2_fract *interval)
+{
+    struct v4l2_streamparm parm;
+
+    ZAP(parm);
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe = *interval;
+    if (xioctl(cam->fd, VIDIOC_S_PARM, &parm)) {
+        LOGE(DUMP_ERROR, "Set frame interval failed\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    *interval = parm.parm.capture.timeperframe;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int v4l2_enum_frame_interval(struct v4l2_camera *cam, struct v4l2_frmivalenum *ival)
+{
+    ival->pixel_format = cam->fmt.fmt.pix.pixelformat;
+    ival->width = cam->fmt.fmt.pix.width;
+    ival->height = cam->fmt.fmt.pix.height;
+    if (xioctl(cam->fd, VIDIOC_ENUM_FRAMEINTERVALS, ival))
+        return CAMERA_RETURN_FAILURE;
+    return CAMERA_RETURN_SUCCESS;
+}
+
 static void v4l2_query_support_format(struct v4l2_camera *cam)
 {
     struct v4l2_fmtdesc fmtdesc;
 
+    ZAP(fmtdesc);
     fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     fmtdesc.index = 0;
+    cam->profile.format_count = 0;
     LOGD("Query support format:\n");
     while (xioctl(cam->fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
         LOGD("Support pixel format[%d]: %s\n", fmtdesc.index, fmtdesc.description);
+        if (cam->profile.format_count < MAX_FORMAT_NUM)
+            cam->profile.format[cam->profile.format_count++] = fmtdesc;
         fmtdesc.index++;
     }
 }
@@ -312,7 +598,10 @@ static void v4l2_query_support_control(struct v4l2_camera *cam)
 
     ZAP(ctrl);
     ctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+    cam->profile.control_count = 0;
     while (!ioctl(cam->fd, VIDIOC_QUERYCTRL, &ctrl)) {
+        if (cam->profile.control_count < MAX_CONTROL_NUM)
+            cam->profile.control[cam->profile.control_count++] = ctrl;
         LOGD("[0x%X]Control %s: min %d, max %d, default value %d, step %d, flags 0x%x\n",
                 ctrl.id, ctrl.name, ctrl.minimum, ctrl.maximum,
                 ctrl.default_value, ctrl.step, ctrl.flags);
@@ -326,6 +615,80 @@ static void v4l2_query_support_control(struct v4l2_camera *cam)
     }
 }
 
+static int v4l2_subscribe_event(struct v4l2_camera *cam, struct v4l2_event_subscription *sub)
+{
+    if (xioctl(cam->fd, VIDIOC_SUBSCRIBE_EVENT, sub)) {
+        LOGD("Subscribe event %u/0x%x failed: %s\n", sub->type, sub->id, strerror(errno));
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* DQEVENT blocks on a blocking fd, so it only runs once POLLPRI says an event is pending. */
+static int v4l2_dequeue_event(struct v4l2_camera *cam, struct v4l2_event *ev)
+{
+    struct pollfd pfd = { cam->fd, POLLPRI, 0 };
+
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLPRI))
+        return -ENOENT;
+    ZAP(*ev);
+    if (xioctl(cam->fd, VIDIOC_DQEVENT, ev)) {
+        if (errno == ENOENT)
+            return -ENOENT;
+        LOGE(DUMP_ERROR, "Dequeue event failed\n");
+        return -EIO;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* A DV receiver only follows the signal once the detected timings are set, others just report the new format. */
+static int v4l2_update_source(struct v4l2_camera *cam)
+{
+    struct v4l2_dv_timings timings;
+
+    ZAP(timings);
+    if (!xioctl(cam->fd, VIDIOC_QUERY_DV_TIMINGS, &timings) && xioctl(cam->fd, VIDIOC_S_DV_TIMINGS, &timings))
+        LOGE(DUMP_ERROR, "Set DV timings failed\n");
+    if (xioctl(cam->fd, VIDIOC_G_FMT, &cam->fmt)) {
+        LOGE(DUMP_ERROR, "Get format failed\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int v4l2_get_control(struct v4l2_camera *cam, struct v4l2_control *ctrl);
+static int v4l2_set_control(struct v4l2_camera *cam, struct v4l2_control *ctrl);
+
+static const struct camera_ops v4l2_ops = {
+    .open_device                = v4l2_open_device,
+    .close_device               = v4l2_close_device,
+    .query_cap                  = v4l2_query_cap,
+    .query_support_control      = v4l2_query_support_control,
+    .query_support_format       = v4l2_query_support_format,
+    .get_output_format          = v4l2_get_output_format,
+    .set_output_format          = v4l2_set_output_format,
+    .request_and_map_buffer     = v4l2_request_and_map_buffer,
+    .return_and_unmap_buffer    = v4l2_return_and_unmap_buffer,
+    .start_capturing            = v4l2_start_capturing,
+    .stop_capturing             = v4l2_stop_capturing,
+    .dequeue_buffer             = v4l2_dequeue_buffer,
+    .buffer_ready               = v4l2_buffer_ready,
+    .poll_fd                    = v4l2_poll_fd,
+    .set_crop                   = v4l2_set_crop,
+    .get_frame_interval         = v4l2_get_frame_interval,
+    .set_frame_interval         = v4l2_set_frame_interval,
+    .enum_frame_interval        = v4l2_enum_frame_interval,
+    .queue_buffer               = v4l2_queue_buffer,
+    .requeue_all                = v4l2_requeue_all,
+    .reopen                     = v4l2_reopen,
+    .prepare_mode               = v4l2_prepare_mode,
+    .switch_mode                = v4l2_switch_mode,
+    .get_control                = v4l2_get_control,
+    .set_control                = v4l2_set_control,
+    .subscribe_event            = v4l2_subscribe_event,
+    .dequeue_event              = v4l2_dequeue_event,
+    .update_source              = v4l2_update_source,
+};
 
 static struct v4l2_camera *v4l2_alloc_camera_object()
 {
@@ -342,6 +705,8 @@ static struct v4l2_camera *v4l2_alloc_camera_object()
     cam->fmt.fmt.pix.height        = DEFAULT_IMAGE_HEIGHT;
     cam->fmt.fmt.pix.pixelformat   = V4L2_PIX_FMT_YUYV;
     cam->fmt.fmt.pix.field         = V4L2_FIELD_ANY;
+    cam->ops                       = &v4l2_ops;
+    cam->replay_speed              = 1.0;
     return cam;
 }
 
@@ -371,6 +736,87 @@ static int v4l2_set_control(struct v4l2_camera *cam, struct v4l2_control *ctrl)
     return CAMERA_RETURN_SUCCESS;
 }
 
+static struct {
+    int frames;
+    int drops;
+    int errors;
+    int fps;
+    int skipped;
+    int queued;
+    int dequeued;
+} metric_id;
+
+static void camera_metrics_init(void)
+{
+    metric_id.frames = metrics_register("tiny_camera_frames_total", NULL, "Frames dequeued", METRIC_COUNTER);
+    metric_id.drops = metrics_register("tiny_camera_sequence_drops_total", NULL,
+            "Frames lost by the driver, from v4l2_buffer.sequence gaps", METRIC_COUNTER);
+    metric_id.errors = metrics_register("tiny_camera_dequeue_errors_total", NULL, "Failed dequeues", METRIC_COUNTER);
+    metric_id.skipped = metrics_register("tiny_camera_frames_skipped_total", NULL,
+            "Frames never handed to the consumer, from sequence gaps between delivered frames", METRIC_COUNTER);
+    metric_id.fps = metrics_register("tiny_camera_fps", NULL, "Frame rate from buffer timestamps", METRIC_GAUGE);
+    metric_id.queued = metrics_register("tiny_camera_buffers_queued", NULL, "Buffers owned by the driver", METRIC_GAUGE);
+    metric_id.dequeued = metrics_register("tiny_camera_buffers_dequeued", NULL, "Buffers held by the application", METRIC_GAUGE);
+}
+
+static void account_occupancy(struct v4l2_camera *cam, int delta)
+{
+    cam->stats.held += delta;
+    metrics_set(metric_id.dequeued, cam->stats.held);
+    metrics_set(metric_id.queued, cam->bufq.count - cam->stats.held);
+}
+
+static void account_frame(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info)
+{
+    struct camera_stats *stats = &cam->stats;
+    long delta;
+
+    metrics_add(metric_id.frames, 1);
+    if (stats->frames) {
+        if (buffer_info->sequence > stats->last_sequence + 1)
+            metrics_add(metric_id.drops, buffer_info->sequence - stats->last_sequence - 1);
+        delta = (buffer_info->timestamp.tv_sec - stats->last_timestamp.tv_sec) * 1000000L +
+            (buffer_info->timestamp.tv_usec - stats->last_timestamp.tv_usec);
+        if (delta > 0) {
+            /* Exponential moving average over roughly the last 10 frames. */
+            stats->fps = stats->fps ? stats->fps * 0.9 + 1e6 / delta * 0.1 : 1e6 / delta;
+            metrics_set(metric_id.fps, stats->fps);
+        }
+    }
+    stats->frames++;
+    stats->last_sequence = buffer_info->sequence;
+    stats->last_timestamp = buffer_info->timestamp;
+    account_occupancy(cam, 1);
+}
+
+/* Skips seen by the consumer include driver drops and frames drained unseen. */
+static void account_delivery(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info)
+{
+    struct camera_stats *stats = &cam->stats;
+
+    if (stats->delivered && buffer_info->sequence > stats->last_delivered + 1)
+        metrics_add(metric_id.skipped, buffer_info->sequence - stats->last_delivered - 1);
+    stats->delivered++;
+    stats->last_delivered = buffer_info->sequence;
+}
+
+/* Tags this thread with the frame, the kernel stamps it at capture on the same clock as the trace. */
+static void trace_dequeue(struct v4l2_buffer *buffer_info, int64_t start)
+{
+    int64_t now, kernel;
+
+    if (!trace_on())
+        return;
+    now = trace_now();
+    trace_set_frame(buffer_info->sequence);
+    trace_span("DQBUF", start, now);
+    if ((buffer_info->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        return;
+    kernel = buffer_info->timestamp.tv_sec * 1000000LL + buffer_info->timestamp.tv_usec;
+    if (kernel <= now && now - kernel < 1000000)
+        trace_instant("Kernel timestamp", kernel);
+}
+
 //API part
 #define STATE_EQ(x) do { \
     if (cam->state != (x)) { \
@@ -389,14 +835,28 @@ static int v4l2_set_control(struct v4l2_camera *cam, struct v4l2_control *ctrl)
 #define CHECK_RET(x) do { \
     if ((x) != CAMERA_RETURN_SUCCESS) { \
         LOGE(DUMP_NONE, "Set camera state to CAMERA_STATE_ERROR\n");\
+        cam->error_state = cam->state; \
         cam->state = CAMERA_STATE_ERROR; \
         return CAMERA_RETURN_FAILURE; \
     }\
 }while(0)
 
+/* Like CHECK_RET, but passes the backend error such as -ENODEV on for recovery. */
+#define CHECK_ERR(x) do { \
+    int __err = (x); \
+    if (__err != CAMERA_RETURN_SUCCESS) { \
+        LOGE(DUMP_NONE, "Set camera state to CAMERA_STATE_ERROR\n");\
+        cam->error_state = cam->state; \
+        cam->state = CAMERA_STATE_ERROR; \
+        return __err < 0 ? __err : CAMERA_RETURN_FAILURE; \
+    }\
+}while(0)
+
 struct v4l2_camera *camera_create_object()
 {
     struct v4l2_camera *cam = v4l2_alloc_camera_object();
+    camera_metrics_init();
+    fault_init();
     if (cam)
         cam->state = CAMREA_STATE_INIT;
     return cam;
@@ -408,19 +868,79 @@ int camera_free_object(struct v4l2_camera *cam)
 }
 int camera_dequeue_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info)
 {
+    int64_t start = trace_on() ? trace_now() : 0;
     int ret;
     STATE_EQ(CAMREA_STATE_STREAM_ON);
-    ret = v4l2_dequeue_buffer(cam, buffer_info);
-    CHECK_RET(ret);
+    ret = cam->ops->dequeue_buffer(cam, buffer_info);
+    if (ret == -EAGAIN)
+        return ret;     /* No frame yet, still streaming */
+    if (ret != CAMERA_RETURN_SUCCESS)
+        metrics_add(metric_id.errors, 1);
+    CHECK_ERR(ret);
+    account_frame(cam, buffer_info);
+    account_delivery(cam, buffer_info);
+    trace_dequeue(buffer_info, start);
+    cam->state = CAMREA_STATE_BUFFER_LOCKED;
+    return ret;
+}
+/*
+ * Low latency dequeue: wait for one buffer, then drain whatever else is
+ * ready, requeue all but the newest and hand that one out. An error while
+ * draining gives every buffer still held back to the driver and fails,
+ * rather than handing out a stale frame.
+ */
+int camera_dequeue_latest(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info)
+{
+    int64_t start = trace_on() ? trace_now() : 0;
+    struct v4l2_buffer next;
+    int ret;
+    STATE_EQ(CAMREA_STATE_STREAM_ON);
+    ret = cam->ops->dequeue_buffer(cam, buffer_info);
+    if (ret == -EAGAIN)
+        return ret;     /* No frame yet, still streaming */
+    if (ret != CAMERA_RETURN_SUCCESS)
+        metrics_add(metric_id.errors, 1);
+    CHECK_ERR(ret);
+    account_frame(cam, buffer_info);
+    while (cam->ops->buffer_ready(cam)) {
+        ret = cam->ops->dequeue_buffer(cam, &next);
+        if (ret == -EAGAIN) {
+            ret = CAMERA_RETURN_SUCCESS;
+            break;
+        }
+        if (ret != CAMERA_RETURN_SUCCESS) {
+            metrics_add(metric_id.errors, 1);
+            if (cam->ops->queue_buffer(cam, buffer_info) == CAMERA_RETURN_SUCCESS)
+                account_occupancy(cam, -1);
+            CHECK_ERR(ret);
+        }
+        account_frame(cam, &next);
+        ret = cam->ops->queue_buffer(cam, buffer_info);
+        if (ret != CAMERA_RETURN_SUCCESS) {
+            if (cam->ops->queue_buffer(cam, &next) == CAMERA_RETURN_SUCCESS)
+                account_occupancy(cam, -1);
+            CHECK_ERR(ret);
+        }
+        account_occupancy(cam, -1);
+        *buffer_info = next;
+    }
+    account_delivery(cam, buffer_info);
+    trace_dequeue(buffer_info, start);
     cam->state = CAMREA_STATE_BUFFER_LOCKED;
     return ret;
 }
 int camera_queue_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info)
 {
+    int64_t start = trace_on() ? trace_now() : 0;
     int ret;
     STATE_EQ(CAMREA_STATE_BUFFER_LOCKED);
-    ret = v4l2_queue_buffer(cam, buffer_info);
+    ret = cam->ops->queue_buffer(cam, buffer_info);
     CHECK_RET(ret);
+    account_occupancy(cam, -1);
+    if (trace_on()) {
+        trace_span("QBUF", start, trace_now());
+        trace_set_frame(TRACE_NO_FRAME);
+    }
     cam->state = CAMREA_STATE_STREAM_ON;
     return ret;
 }
@@ -428,15 +948,17 @@ int camera_start_capturing(struct v4l2_camera *cam)
 {
     int ret;
     STATE_EQ(CAMREA_STATE_BUFFER_MAPPED);
-    ret = v4l2_start_capturing(cam);
+    ret = cam->ops->start_capturing(cam);
     CHECK_RET(ret);
+    ZAP(cam->stats);
+    account_occupancy(cam, 0);
     cam->state = CAMREA_STATE_STREAM_ON;
     return ret;
 }
 int camera_stop_capturing(struct v4l2_camera *cam)
 {
     STATE_EQ(CAMREA_STATE_STREAM_ON);
-    v4l2_stop_capturing(cam);
+    cam->ops->stop_capturing(cam);
     cam->state = CAMREA_STATE_BUFFER_MAPPED;
     return CAMERA_RETURN_SUCCESS;
 }
@@ -452,7 +974,7 @@ int camera_request_and_map_buffer(struct v4l2_camera *cam)
 {
     int ret;
     STATE_EQ(CAMREA_STATE_CONFIGURED);
-    ret = v4l2_request_and_map_buffer(cam);
+    ret = cam->ops->request_and_map_buffer(cam);
     CHECK_RET(ret);
     cam->state = CAMREA_STATE_BUFFER_MAPPED;
     return ret;
@@ -460,7 +982,7 @@ int camera_request_and_map_buffer(struct v4l2_camera *cam)
 int camera_return_and_unmap_buffer(struct v4l2_camera *cam)
 {
     STATE_EQ(CAMREA_STATE_BUFFER_MAPPED);
-    v4l2_return_and_unmap_buffer(cam);
+    cam->ops->return_and_unmap_buffer(cam);
     cam->state = CAMREA_STATE_OPENED;
     return CAMERA_RETURN_SUCCESS;
 }
@@ -468,15 +990,64 @@ int camera_open_device(struct v4l2_camera *cam)
 {
     int ret;
     STATE_EQ(CAMREA_STATE_INIT);
-    ret = v4l2_open_device(cam);
+    cam->ops = replay_probe(cam->dev_name) ? &replay_ops : &v4l2_ops;
+    ret = cam->ops->open_device(cam);
     CHECK_RET(ret);
     cam->state = CAMREA_STATE_OPENED;
     return ret;
 }
+/* A sensor crop outlives the fd, the next user of the device would inherit it. */
+static void reset_roi(struct v4l2_camera *cam)
+{
+    if (cam->sensor_crop.width && cam->ops->set_crop(cam, NULL))
+        LOGI("Sensor crop left at %ux%u@(%d,%d)\n", cam->sensor_crop.width, cam->sensor_crop.height,
+                cam->sensor_crop.left, cam->sensor_crop.top);
+    ZAP(cam->sensor_crop);
+    ZAP(cam->roi);
+}
+/* Like the crop, the frame rate stays with the device. */
+static void reset_frame_rate(struct v4l2_camera *cam)
+{
+    struct v4l2_fract interval = cam->default_interval;
+
+    if (interval.numerator && cam->ops->set_frame_interval(cam, &interval))
+        LOGI("Frame interval left at %u/%u\n", cam->frame_interval.numerator, cam->frame_interval.denominator);
+    ZAP(cam->frame_interval);
+    ZAP(cam->default_interval);
+}
 int camera_close_device(struct v4l2_camera *cam)
 {
     STATE_GE(CAMREA_STATE_OPENED);
-    v4l2_close_device(cam);
+    reset_roi(cam);
+    reset_frame_rate(cam);
+    cam->ops->close_device(cam);
+    /* Subscriptions belong to the fd. */
+    cam->event_mask = 0;
+    cam->control_cached = 0;
+    cam->state = CAMREA_STATE_INIT;
+    return CAMERA_RETURN_SUCCESS;
+}
+/*
+ * Back to CAMREA_STATE_INIT from any state, CAMERA_STATE_ERROR included,
+ * releasing whatever the camera had got to before the error. For bindings
+ * that tear down without knowing how the last call ended.
+ */
+int camera_shutdown(struct v4l2_camera *cam)
+{
+    int state = cam->state == CAMERA_STATE_ERROR ? cam->error_state : cam->state;
+
+    /* A failed reopen has already given up the buffers and the device. */
+    if (state >= CAMREA_STATE_OPENED && cam->fd != -1) {
+        if (state >= CAMREA_STATE_STREAM_ON)
+            cam->ops->stop_capturing(cam);
+        if (state >= CAMREA_STATE_BUFFER_MAPPED)
+            cam->ops->return_and_unmap_buffer(cam);
+        reset_roi(cam);
+        reset_frame_rate(cam);
+        cam->ops->close_device(cam);
+    }
+    cam->event_mask = 0;
+    cam->control_cached = 0;
     cam->state = CAMREA_STATE_INIT;
     return CAMERA_RETURN_SUCCESS;
 }
@@ -484,51 +1055,607 @@ int camera_query_cap(struct v4l2_camera *cam)
 {
     int ret;
     STATE_GE(CAMREA_STATE_OPENED);
-    ret = v4l2_query_cap(cam);
+    ret = cam->ops->query_cap(cam);
     return ret;
 }
 int camera_query_support_control(struct v4l2_camera *cam)
 {
     STATE_GE(CAMREA_STATE_OPENED);
-    v4l2_query_support_control(cam);
+    cam->ops->query_support_control(cam);
+    cam->control_cached = 0;
     return CAMERA_RETURN_SUCCESS;
 }
 int camera_query_support_format(struct v4l2_camera *cam)
 {
     STATE_GE(CAMREA_STATE_OPENED);
-    v4l2_query_support_format(cam);
+    cam->ops->query_support_format(cam);
     return CAMERA_RETURN_SUCCESS;
 }
+int camera_load_profile(struct v4l2_camera *cam, const char *dir)
+{
+    STATE_GE(CAMREA_STATE_OPENED);
+    cam->control_cached = 0;
+    return profile_load(cam, dir);
+}
+int camera_save_profile(struct v4l2_camera *cam, const char *dir)
+{
+    STATE_GE(CAMREA_STATE_OPENED);
+    return profile_save(cam, dir);
+}
 int camera_get_output_format(struct v4l2_camera *cam)
 {
     STATE_GE(CAMREA_STATE_OPENED);
-    if (cam->state == CAMREA_STATE_CONFIGURED)
-        v4l2_get_output_format(cam);
-    else
-        dump_output_format(cam);
+    /* The format S_FMT returned stays, there is nothing new to dump. */
+    if (cam->state == CAMREA_STATE_CONFIGURED && cam->ops->get_output_format(cam))
+        return CAMERA_RETURN_FAILURE;
+    dump_output_format(cam);
     return CAMERA_RETURN_SUCCESS;
 }
 int camera_set_output_format(struct v4l2_camera *cam)
 {
     int ret;
     STATE_EQ(CAMREA_STATE_OPENED);
-    ret = v4l2_set_output_format(cam);
+    ret = cam->ops->set_output_format(cam);
+    /* ROI offsets are taken in sensor pixels, a driver that scales the crop breaks them. */
+    if (ret == CAMERA_RETURN_SUCCESS && cam->sensor_crop.width &&
+            (cam->fmt.fmt.pix.width != cam->sensor_crop.width || cam->fmt.fmt.pix.height != cam->sensor_crop.height)) {
+        LOGI("Driver scales the %ux%u sensor crop to %ux%u, use a software ROI\n", cam->sensor_crop.width,
+                cam->sensor_crop.height, cam->fmt.fmt.pix.width, cam->fmt.fmt.pix.height);
+        cam->ops->set_crop(cam, NULL);
+        ZAP(cam->sensor_crop);
+        cam->fmt.fmt.pix.width = cam->request_width;
+        cam->fmt.fmt.pix.height = cam->request_height;
+        ret = cam->ops->set_output_format(cam);
+    }
     CHECK_RET(ret);
     cam->state = CAMREA_STATE_CONFIGURED;
     return ret;
 }
+static int control_index(struct v4l2_camera *cam, uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < cam->profile.control_count; i++)
+        if (cam->profile.control[i].id == id)
+            return i;
+    return -1;
+}
+/* Never touches the device, fails for controls without a current cached value. */
+int camera_get_cached_control(struct v4l2_camera *cam, struct v4l2_control *ctrl)
+{
+    int i = control_index(cam, ctrl->id);
+
+    if (i < 0 || !(cam->control_cached & (1ULL << i)))
+        return CAMERA_RETURN_FAILURE;
+    ctrl->value = cam->control_value[i];
+    return CAMERA_RETURN_SUCCESS;
+}
+/* Controls followed by V4L2_EVENT_CTRL are answered from the cache, volatile and the rest ask the driver. */
 int camera_get_control(struct v4l2_camera *cam, struct v4l2_control *ctrl)
 {
     int ret;
     STATE_GE(CAMREA_STATE_OPENED);
-    ret = v4l2_get_control(cam, ctrl);
+    if (camera_get_cached_control(cam, ctrl) == CAMERA_RETURN_SUCCESS)
+        return CAMERA_RETURN_SUCCESS;
+    ret = cam->ops->get_control(cam, ctrl);
     return ret;
 }
+/* Our own writes raise no event, the cache takes the value the driver settled on. */
 int camera_set_control(struct v4l2_camera *cam, struct v4l2_control *ctrl)
 {
-    int ret;
+    int ret, i;
     STATE_GE(CAMREA_STATE_OPENED);
-    ret = v4l2_set_control(cam, ctrl);
+    ret = cam->ops->set_control(cam, ctrl);
+    i = control_index(cam, ctrl->id);
+    if (ret == CAMERA_RETURN_SUCCESS && i >= 0 && (cam->control_cached & (1ULL << i)))
+        cam->control_value[i] = ctrl->value;
     return ret;
 }
+/* For poll/epoll, readable whenever camera_dequeue_buffer would not block. */
+int camera_get_poll_fd(struct v4l2_camera *cam, int *fd)
+{
+    STATE_GE(CAMREA_STATE_OPENED);
+    *fd = cam->ops->poll_fd(cam);
+    return *fd < 0 ? CAMERA_RETURN_FAILURE : CAMERA_RETURN_SUCCESS;
+}
+/* An odd offset from the crop to the ROI would swap the colors of a view that keeps the fourcc. */
+static int bayer_phase_shift(struct v4l2_camera *cam, struct v4l2_rect *crop)
+{
+    if (!bayer_lookup(cam->fmt.fmt.pix.pixelformat, NULL) || !((cam->roi.left - crop->left) & 1 ||
+                (cam->roi.top - crop->top) & 1))
+        return 0;
+    LOGI("Sensor crop at (%d,%d) shifts the Bayer pattern\n", crop->left, crop->top);
+    return 1;
+}
+
+static int contains(const struct v4l2_rect *outer, const struct v4l2_rect *inner)
+{
+    return inner->left >= outer->left && inner->top >= outer->top &&
+        inner->left + inner->width <= outer->left + outer->width &&
+        inner->top + inner->height <= outer->top + outer->height;
+}
+
+/*
+ * Crop on the sensor when the driver can, so readout, bus and buffers shrink
+ * with the ROI, and the output format becomes the crop size. Whatever the
+ * driver can't cut exactly is left to camera_get_roi_view(). NULL clears
+ * the ROI and puts back the default crop if this camera had changed it, a
+ * crop set by anyone else is left alone.
+ */
+int camera_set_roi(struct v4l2_camera *cam, const struct v4l2_rect *roi)
+{
+    struct v4l2_rect rect;
+    int ret;
+
+    STATE_EQ(CAMREA_STATE_OPENED);
+    reset_roi(cam);
+    if (!roi)
+        return CAMERA_RETURN_SUCCESS;
+    if (roi->left < 0 || roi->top < 0 || roi->width < 2 || !roi->height) {
+        LOGE(DUMP_NONE, "Invalid ROI %ux%u@(%d,%d)\n", roi->width, roi->height, roi->left, roi->top);
+        return CAMERA_RETURN_FAILURE;
+    }
+    /* Chroma is shared by pixel pairs in every YUV format we view. */
+    cam->roi = *roi;
+    cam->roi.left &= ~1;
+    cam->roi.top &= ~1;
+    cam->roi.width &= ~1;
+    rect = cam->roi;
+    ret = cam->ops->set_crop(cam, &rect);
+    if (ret == CAMERA_RETURN_SUCCESS && contains(&rect, &cam->roi) && !bayer_phase_shift(cam, &rect)) {
+        cam->sensor_crop = rect;
+        cam->request_width = cam->fmt.fmt.pix.width;
+        cam->request_height = cam->fmt.fmt.pix.height;
+        cam->fmt.fmt.pix.width = rect.width;
+        cam->fmt.fmt.pix.height = rect.height;
+        LOGI("Sensor crop %ux%u@(%d,%d)\n", rect.width, rect.height, rect.left, rect.top);
+    } else {
+        /* The crop the driver took is of no use, it mustn't outlive the fd either. */
+        if (ret == CAMERA_RETURN_SUCCESS)
+            cam->ops->set_crop(cam, NULL);
+        LOGI("Software ROI %ux%u@(%d,%d)\n", cam->roi.width, cam->roi.height, cam->roi.left, cam->roi.top);
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* The ROI inside a frame of the current format, clamped to what was delivered. */
+int camera_get_roi_view(struct v4l2_camera *cam, struct buffer buffer, struct image_view *view)
+{
+    struct v4l2_rect rect = cam->roi;
+
+    STATE_GE(CAMREA_STATE_BUFFER_MAPPED);
+    rect.left -= cam->sensor_crop.left;
+    rect.top -= cam->sensor_crop.top;
+    return image_get_view(&cam->fmt.fmt.pix, buffer, cam->roi.width ? &rect : NULL, view);
+}
+static double interval_fps(struct v4l2_fract *interval)
+{
+    return interval->numerator ? (double)interval->denominator / interval->numerator : 0;
+}
+
+static double interval_seconds(const struct v4l2_fract *interval)
+{
+    return interval->denominator ? (double)interval->numerator / interval->denominator : 0;
+}
+
+/*
+ * The longest interval the driver lists at the current format that is still
+ * no longer than 1 / fps. -ERANGE when every one is too slow, failure when
+ * the driver lists none.
+ */
+static int pick_frame_interval(struct v4l2_camera *cam, double fps, struct v4l2_fract *interval)
+{
+    struct v4l2_frmivalenum ival;
+    double target = 1 / (fps * 0.999), best = 0, min, max, step, seconds;
+    uint32_t index;
+
+    for (index = 0; ; index++) {
+        ZAP(ival);
+        ival.index = index;
+        if (cam->ops->enum_frame_interval(cam, &ival) != CAMERA_RETURN_SUCCESS)
+            break;
+        if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            seconds = interval_seconds(&ival.discrete);
+            if (seconds && seconds <= target && seconds > best) {
+                best = seconds;
+                *interval = ival.discrete;
+            }
+            continue;
+        }
+        /* Continuous or stepwise, the one entry covers the whole range. */
+        min = interval_seconds(&ival.stepwise.min);
+        max = interval_seconds(&ival.stepwise.max);
+        step = ival.type == V4L2_FRMIVAL_TYPE_STEPWISE ? interval_seconds(&ival.stepwise.step) : 0;
+        if (!min || min > target)
+            return -ERANGE;
+        if (max <= target) {
+            *interval = ival.stepwise.max;
+            return CAMERA_RETURN_SUCCESS;
+        }
+        seconds = step ? min + floor((1 / fps - min) / step) * step : 1 / fps;
+        if (seconds < min)
+            seconds = min;
+        interval->numerator = seconds * 1000000 + 0.5;
+        interval->denominator = 1000000;
+        return CAMERA_RETURN_SUCCESS;
+    }
+    if (best)
+        return CAMERA_RETURN_SUCCESS;
+    return index ? -ERANGE : CAMERA_RETURN_FAILURE;
+}
+
+/*
+ * Slow the sensor down to the lowest rate the driver offers at or above *fps,
+ * so frames that would be dropped are never read out or sent. *fps returns
+ * the rate in effect, untouched when the driver can't change it. The rate
+ * the device had before is put back at close.
+ */
+int camera_set_frame_rate(struct v4l2_camera *cam, double *fps)
+{
+    struct v4l2_fract old, interval;
+    int ret = CAMERA_RETURN_FAILURE;
+
+    STATE_GE(CAMREA_STATE_OPENED);
+    if (cam->state >= CAMREA_STATE_STREAM_ON) {
+        LOGE(DUMP_NONE, "Can't change the frame rate while streaming\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (*fps <= 0 || cam->ops->get_frame_interval(cam, &old) != CAMERA_RETURN_SUCCESS)
+        return CAMERA_RETURN_FAILURE;
+    if (cam->ops->enum_frame_interval)
+        ret = pick_frame_interval(cam, *fps, &interval);
+    if (ret == -ERANGE) {
+        LOGI("No frame rate at or above %.2f\n", *fps);
+        interval = old;
+    } else {
+        /* Without a list, ask for the rate itself and see what the driver rounds it to. */
+        if (ret != CAMERA_RETURN_SUCCESS) {
+            interval.numerator = 1000;
+            interval.denominator = *fps * 1000 + 0.5;
+        }
+        if (cam->ops->set_frame_interval(cam, &interval) != CAMERA_RETURN_SUCCESS)
+            return CAMERA_RETURN_FAILURE;
+        if (!cam->default_interval.numerator)
+            cam->default_interval = old;
+        /* Drivers round to the nearest rate, below the request is too slow to decimate from. */
+        if (interval_fps(&interval) < *fps * 0.999) {
+            interval = old;
+            cam->ops->set_frame_interval(cam, &interval);
+        }
+    }
+    cam->frame_interval = interval;
+    *fps = interval_fps(&interval);
+    LOGI("Frame rate %.2f\n", *fps);
+    return CAMERA_RETURN_SUCCESS;
+}
+/*
+ * Preallocate for the alternate mode, e.g. full resolution stills next to
+ * the preview, so camera_switch_mode() can flip between the two. pix is
+ * adjusted like S_FMT would. Once created the buffers stay until the next
+ * camera_return_and_unmap_buffer().
+ */
+int camera_prepare_mode(struct v4l2_camera *cam, struct v4l2_pix_format *pix)
+{
+    int ret;
+
+    STATE_GE(CAMREA_STATE_BUFFER_MAPPED);
+    if (!cam->ops->prepare_mode) {
+        LOGE(DUMP_NONE, "The backend can't switch modes\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (cam->alt_bufq.count) {
+        LOGE(DUMP_NONE, "Alternate mode already prepared\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    ZAP(cam->alt_fmt);
+    cam->alt_fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->alt_fmt.fmt.pix = *pix;
+    cam->alt_fmt.fmt.pix.field = V4L2_FIELD_ANY;
+    ret = cam->ops->prepare_mode(cam);
+    if (ret != CAMERA_RETURN_SUCCESS) {
+        ZAP(cam->alt_fmt);
+        return ret;
+    }
+    *pix = cam->alt_fmt.fmt.pix;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/*
+ * Swap the current and the alternate mode, streaming or not. Buffers of
+ * the old mode must be queued back first, consumers sized for it see the
+ * new cam->fmt from the next frame on.
+ */
+int camera_switch_mode(struct v4l2_camera *cam)
+{
+    struct timespec start, end;
+    int ret, fast, streaming = cam->state == CAMREA_STATE_STREAM_ON;
+    uint64_t us;
+
+    if (!streaming)
+        STATE_EQ(CAMREA_STATE_BUFFER_MAPPED);
+    if (!cam->alt_fmt.type) {
+        LOGE(DUMP_NONE, "No alternate mode prepared\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (streaming)
+        cam->ops->stop_capturing(cam);
+    ret = cam->ops->switch_mode(cam, &fast);
+    CHECK_RET(ret);
+    cam->state = CAMREA_STATE_BUFFER_MAPPED;
+    if (streaming) {
+        ret = cam->ops->start_capturing(cam);
+        CHECK_RET(ret);
+        ZAP(cam->stats);
+        account_occupancy(cam, 0);
+        cam->state = CAMREA_STATE_STREAM_ON;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    us = (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+    metrics_observe(metrics_register("tiny_camera_stage_seconds", "Mode switch", "Per stage latency",
+                METRIC_SUMMARY), us);
+    LOGI("Mode switch to %ux%u %s in %.1fms, %s buffers\n", cam->fmt.fmt.pix.width, cam->fmt.fmt.pix.height,
+            fmt2desc(cam->fmt.fmt.pix.pixelformat), us / 1000.0, fast ? "preallocated" : "reallocated");
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Buttons, classes and controls wider than 32 bits have no value to cache. */
+static int control_has_value(struct v4l2_queryctrl *ctrl)
+{
+    switch (ctrl->type) {
+        case V4L2_CTRL_TYPE_INTEGER:
+        case V4L2_CTRL_TYPE_BOOLEAN:
+        case V4L2_CTRL_TYPE_MENU:
+        case V4L2_CTRL_TYPE_INTEGER_MENU:
+        case V4L2_CTRL_TYPE_BITMASK:
+            return !(ctrl->flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_WRITE_ONLY));
+        default:
+            return 0;
+    }
+}
+
+/* The driver raises no value events for volatile controls, their last value would be stale. */
+static int control_cacheable(struct v4l2_queryctrl *ctrl)
+{
+    return control_has_value(ctrl) && !(ctrl->flags & V4L2_CTRL_FLAG_VOLATILE);
+}
+
+/* Per fd, so a reopen runs it again. SEND_INITIAL fills the control cache on the first dispatch. */
+static int subscribe_events(struct v4l2_camera *cam)
+{
+    struct v4l2_event_subscription sub;
+    int i, subscribed = 0;
+
+    cam->control_cached = 0;
+    if (cam->event_mask & CAMERA_EVENT_SOURCE_CHANGE) {
+        ZAP(sub);
+        sub.type = V4L2_EVENT_SOURCE_CHANGE;
+        subscribed += cam->ops->subscribe_event(cam, &sub) == CAMERA_RETURN_SUCCESS;
+    }
+    if (cam->event_mask & CAMERA_EVENT_EOS) {
+        ZAP(sub);
+        sub.type = V4L2_EVENT_EOS;
+        subscribed += cam->ops->subscribe_event(cam, &sub) == CAMERA_RETURN_SUCCESS;
+    }
+    for (i = 0; (cam->event_mask & CAMERA_EVENT_CTRL) && i < cam->profile.control_count; i++) {
+        if (!control_has_value(&cam->profile.control[i]))
+            continue;
+        ZAP(sub);
+        sub.type = V4L2_EVENT_CTRL;
+        sub.id = cam->profile.control[i].id;
+        sub.flags = V4L2_EVENT_SUB_FL_SEND_INITIAL;
+        subscribed += cam->ops->subscribe_event(cam, &sub) == CAMERA_RETURN_SUCCESS;
+    }
+    LOGI("Subscribed to %d events\n", subscribed);
+    return subscribed ? CAMERA_RETURN_SUCCESS : CAMERA_RETURN_FAILURE;
+}
+
+/*
+ * Follow the events in mask, func is called for each one dequeued by
+ * camera_dispatch_events(). Controls must be enumerated first, by
+ * camera_query_support_control() or a loaded profile. Fails when the
+ * backend or the driver supports none of them.
+ */
+int camera_subscribe_events(struct v4l2_camera *cam, uint32_t mask, camera_event_func func, void *priv)
+{
+    STATE_GE(CAMREA_STATE_OPENED);
+    if (!cam->ops->subscribe_event) {
+        LOGI("%s has no events\n", cam->dev_name);
+        return CAMERA_RETURN_FAILURE;
+    }
+    cam->event_mask = mask & CAMERA_EVENT_ALL;
+    cam->event_func = func;
+    cam->event_priv = priv;
+    if (subscribe_events(cam) == CAMERA_RETURN_SUCCESS)
+        return CAMERA_RETURN_SUCCESS;
+    cam->event_mask = 0;
+    return CAMERA_RETURN_FAILURE;
+}
+
+static void update_control(struct v4l2_camera *cam, const struct v4l2_event *ev)
+{
+    const struct v4l2_event_ctrl *c = &ev->u.ctrl;
+    struct v4l2_queryctrl *query;
+    int i = control_index(cam, ev->id);
+
+    if (i < 0)
+        return;
+    query = &cam->profile.control[i];
+    if (c->changes & V4L2_EVENT_CTRL_CH_FLAGS)
+        query->flags = c->flags;
+    if (c->changes & V4L2_EVENT_CTRL_CH_RANGE) {
+        query->minimum = c->minimum;
+        query->maximum = c->maximum;
+        query->step = c->step;
+        query->default_value = c->default_value;
+    }
+    if ((c->changes & V4L2_EVENT_CTRL_CH_VALUE) && control_cacheable(query)) {
+        cam->control_value[i] = c->value;
+        cam->control_cached |= 1ULL << i;
+    } else if (!control_cacheable(query)) {
+        cam->control_cached &= ~(1ULL << i);
+    }
+    LOGD("Control %s: value %d, changes 0x%x\n", query->name, c->value, c->changes);
+}
+
+/*
+ * Only the buffers go, the fd, the controls and the subscriptions stay. A
+ * prepared alternate mode was for the old source and is dropped.
+ */
+static int source_change(struct v4l2_camera *cam)
+{
+    struct timespec start, end;
+    int ret, streaming = cam->state == CAMREA_STATE_STREAM_ON;
+    uint64_t us;
+
+    if (cam->state == CAMREA_STATE_OPENED)
+        return CAMERA_RETURN_SUCCESS;
+    if (cam->state == CAMREA_STATE_CONFIGURED)
+        return cam->ops->update_source(cam);
+    if (!streaming)
+        STATE_EQ(CAMREA_STATE_BUFFER_MAPPED);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (streaming)
+        cam->ops->stop_capturing(cam);
+    cam->ops->return_and_unmap_buffer(cam);
+    ZAP(cam->alt_fmt);
+    cam->state = CAMREA_STATE_OPENED;
+    ret = cam->ops->update_source(cam);
+    CHECK_RET(ret);
+    ret = cam->ops->request_and_map_buffer(cam);
+    CHECK_RET(ret);
+    cam->state = CAMREA_STATE_BUFFER_MAPPED;
+    if (streaming) {
+        ret = cam->ops->start_capturing(cam);
+        CHECK_RET(ret);
+        ZAP(cam->stats);
+        account_occupancy(cam, 0);
+        cam->state = CAMREA_STATE_STREAM_ON;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    us = (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+    metrics_observe(metrics_register("tiny_camera_stage_seconds", "Source change", "Per stage latency",
+                METRIC_SUMMARY), us);
+    LOGI("Source changed to %ux%u %s, %d buffers in %.1fms\n", cam->fmt.fmt.pix.width, cam->fmt.fmt.pix.height,
+            fmt2desc(cam->fmt.fmt.pix.pixelformat), cam->bufq.count, us / 1000.0);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/*
+ * Handle every pending event, call it when the poll fd signals POLLPRI
+ * (EPOLLPRI), never with a buffer dequeued. Control events update the
+ * cache, source changes reallocate the buffers for the new format, once
+ * for a burst of them, and streaming goes on. Returns the CAMERA_EVENT_*
+ * seen, -ECANCELED when the callback ended the stream, -ENODATA at the
+ * end of the stream and -EIO on errors.
+ */
+int camera_dispatch_events(struct v4l2_camera *cam)
+{
+    struct v4l2_event ev, change;
+    int ret, seen = 0, cancel = 0;
+
+    if (!cam->event_mask)
+        return 0;
+    while ((ret = cam->ops->dequeue_event(cam, &ev)) == CAMERA_RETURN_SUCCESS) {
+        switch (ev.type) {
+            case V4L2_EVENT_CTRL:
+                update_control(cam, &ev);
+                seen |= CAMERA_EVENT_CTRL;
+                break;
+            case V4L2_EVENT_SOURCE_CHANGE:
+                change = ev;
+                seen |= CAMERA_EVENT_SOURCE_CHANGE;
+                continue;
+            case V4L2_EVENT_EOS:
+                LOGI("End of stream on %s\n", cam->dev_name);
+                seen |= CAMERA_EVENT_EOS;
+                break;
+            default:
+                continue;
+        }
+        if (cam->event_func && cam->event_func(cam, &ev, cam->event_priv) != CAMERA_RETURN_SUCCESS)
+            cancel = 1;
+    }
+    if (ret != -ENOENT)
+        return -EIO;
+    if (seen & CAMERA_EVENT_SOURCE_CHANGE) {
+        if (source_change(cam) != CAMERA_RETURN_SUCCESS)
+            return -EIO;
+        if (cam->event_func && cam->event_func(cam, &change, cam->event_priv) != CAMERA_RETURN_SUCCESS)
+            cancel = 1;
+    }
+    if (cancel)
+        return -ECANCELED;
+    return seen & CAMERA_EVENT_EOS ? -ENODATA : seen;
+}
+
+/* Rebuild what a reconnect lost, consumers are sized for the format so it must come back unchanged. */
+static int reopen(struct v4l2_camera *cam)
+{
+    struct v4l2_format fmt = cam->fmt;
+    struct v4l2_rect crop = cam->sensor_crop;
+    struct v4l2_fract interval = cam->frame_interval;
+
+    if (cam->bufq.count)
+        cam->ops->return_and_unmap_buffer(cam);
+    if (cam->ops->reopen(cam))
+        return CAMERA_RETURN_FAILURE;
+    if (cam->event_mask && subscribe_events(cam))
+        LOGI("Events lost on reopen\n");
+    if (crop.width && cam->ops->set_crop(cam, &crop))
+        LOGI("Sensor crop lost on reopen\n");
+    if (cam->ops->set_output_format(cam))
+        return CAMERA_RETURN_FAILURE;
+    if (cam->fmt.fmt.pix.width != fmt.fmt.pix.width || cam->fmt.fmt.pix.height != fmt.fmt.pix.height ||
+            cam->fmt.fmt.pix.pixelformat != fmt.fmt.pix.pixelformat ||
+            cam->fmt.fmt.pix.sizeimage > fmt.fmt.pix.sizeimage) {
+        LOGE(DUMP_NONE, "Format changed on reopen to %ux%u %s\n", cam->fmt.fmt.pix.width,
+                cam->fmt.fmt.pix.height, fmt2desc(cam->fmt.fmt.pix.pixelformat));
+        cam->fmt = fmt;
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (interval.numerator && cam->ops->set_frame_interval(cam, &interval))
+        LOGI("Frame rate lost on reopen\n");
+    if (cam->ops->request_and_map_buffer(cam))
+        return CAMERA_RETURN_FAILURE;
+    return cam->ops->start_capturing(cam);
+}
+
+/*
+ * Back to streaming after an error while streaming, trying action first and
+ * escalating from there. A buffer the application still held is requeued
+ * too. Returns the action that worked, or -1 with the camera left in
+ * CAMERA_STATE_ERROR, ready for another try.
+ */
+int camera_recover(struct v4l2_camera *cam, int action)
+{
+    int ret = CAMERA_RETURN_FAILURE;
+
+    if (cam->state != CAMREA_STATE_STREAM_ON && cam->state != CAMREA_STATE_BUFFER_LOCKED &&
+            (cam->state != CAMERA_STATE_ERROR || cam->error_state < CAMREA_STATE_STREAM_ON)) {
+        LOGE(DUMP_NONE, "Can't do %s in %s state\n", __func__, camera_state_to_string(cam->state));
+        return -1;
+    }
+    cam->state = CAMERA_STATE_ERROR;
+    cam->error_state = CAMREA_STATE_STREAM_ON;
+    for (; action < CAMERA_RECOVER_MAX && ret != CAMERA_RETURN_SUCCESS; action++) {
+        LOGD("Recover by %s\n", camera_recover_to_string(action));
+        switch (action) {
+            case CAMERA_RECOVER_REQUEUE:
+                ret = cam->ops->requeue_all(cam);
+                break;
+            case CAMERA_RECOVER_RESTART:
+                cam->ops->stop_capturing(cam);
+                ret = cam->ops->start_capturing(cam);
+                break;
+            default:
+                ret = reopen(cam);
+        }
+    }
+    if (ret != CAMERA_RETURN_SUCCESS)
+        return -1;
+    account_occupancy(cam, -cam->stats.held);
+    cam->state = CAMREA_STATE_STREAM_ON;
+    return action - 1;
+}
 //API part end
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "camera.h"
+#include "fault.h"
+#include "metrics.h"
+#include "log.h"
+
+int fault_enabled;
+
+static struct {
+    struct fault_rule   rule[FAULT_MAX_RULES];
+    int                 count;
+    uint64_t            seed;
+    pthread_mutex_t     lock;
+    pthread_once_t      once;
+} faults = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+#define FAULT_REQUEST(x) { #x, VIDIOC_##x }
+static const struct {
+    const char      *name;
+    unsigned int    request;
+} requests[] = {
+    FAULT_REQUEST(QUERYCAP), FAULT_REQUEST(ENUM_FMT), FAULT_REQUEST(G_FMT), FAULT_REQUEST(S_FMT),
+    FAULT_REQUEST(TRY_FMT), FAULT_REQUEST(REQBUFS), FAULT_REQUEST(CREATE_BUFS), FAULT_REQUEST(QUERYBUF),
+    FAULT_REQUEST(EXPBUF), FAULT_REQUEST(QBUF), FAULT_REQUEST(DQBUF), FAULT_REQUEST(STREAMON),
+    FAULT_REQUEST(STREAMOFF), FAULT_REQUEST(G_PARM), FAULT_REQUEST(S_PARM), FAULT_REQUEST(QUERYCTRL),
+    FAULT_REQUEST(G_CTRL), FAULT_REQUEST(S_CTRL), FAULT_REQUEST(G_SELECTION), FAULT_REQUEST(S_SELECTION),
+    FAULT_REQUEST(SUBSCRIBE_EVENT), FAULT_REQUEST(DQEVENT), FAULT_REQUEST(QUERY_DV_TIMINGS),
+    FAULT_REQUEST(S_DV_TIMINGS), FAULT_REQUEST(ENUM_FRAMESIZES), FAULT_REQUEST(ENUM_FRAMEINTERVALS),
+};
+#undef FAULT_REQUEST
+
+#define FAULT_ERRNO(x) { #x, x }
+static const struct {
+    const char      *name;
+    int             error;
+} errors[] = {
+    FAULT_ERRNO(EIO), FAULT_ERRNO(EAGAIN), FAULT_ERRNO(EINVAL), FAULT_ERRNO(EBUSY), FAULT_ERRNO(ENODEV),
+    FAULT_ERRNO(ENXIO), FAULT_ERRNO(ENOMEM), FAULT_ERRNO(EPIPE), FAULT_ERRNO(ETIMEDOUT), FAULT_ERRNO(EPERM),
+    FAULT_ERRNO(ENOSPC), FAULT_ERRNO(EFAULT),
+};
+#undef FAULT_ERRNO
+
+/* xorshift64*, uniform in [0, 1). Callers hold the lock. */
+static double next_random(void)
+{
+    faults.seed ^= faults.seed >> 12;
+    faults.seed ^= faults.seed << 25;
+    faults.seed ^= faults.seed >> 27;
+    return ((faults.seed * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static double draw_delay(struct fault_rule *rule)
+{
+    double u, v;
+
+    switch (rule->delay) {
+        case FAULT_DELAY_FIXED:
+            return rule->a;
+        case FAULT_DELAY_UNIFORM:
+            return rule->a + (rule->b - rule->a) * next_random();
+        case FAULT_DELAY_NORMAL:
+            /* Box-Muller */
+            u = 1.0 - next_random();
+            v = next_random();
+            u = rule->a + rule->b * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+            return u > 0 ? u : 0;
+        case FAULT_DELAY_EXP:
+            return -rule->a * log(1.0 - next_random());
+    }
+    return 0;
+}
+
+static int parse_delay(struct fault_rule *rule, const char *value)
+{
+    char *end;
+
+    if (!strncmp(value, "exp:", 4)) {
+        rule->delay = FAULT_DELAY_EXP;
+        rule->a = strtod(value + 4, &end);
+    } else if (!strncmp(value, "normal:", 7)) {
+        rule->delay = FAULT_DELAY_NORMAL;
+        if (sscanf(value + 7, "%lf/%lf", &rule->a, &rule->b) != 2)
+            return CAMERA_RETURN_FAILURE;
+        return rule->a >= 0 && rule->b >= 0 ? CAMERA_RETURN_SUCCESS : CAMERA_RETURN_FAILURE;
+    } else {
+        rule->delay = FAULT_DELAY_FIXED;
+        rule->a = strtod(value, &end);
+        if (*end == '-') {
+            rule->delay = FAULT_DELAY_UNIFORM;
+            rule->b = strtod(end + 1, &end);
+            if (rule->b < rule->a)
+                return CAMERA_RETURN_FAILURE;
+        }
+    }
+    return *end || end == value || rule->a < 0 ? CAMERA_RETURN_FAILURE : CAMERA_RETURN_SUCCESS;
+}
+
+static int parse_error(struct fault_rule *rule, const char *value)
+{
+    char *end;
+    size_t i;
+
+    for (i = 0; i < sizeof(errors) / sizeof(errors[0]); i++) {
+        if (!strcasecmp(value, errors[i].name)) {
+            rule->error = errors[i].error;
+            return CAMERA_RETURN_SUCCESS;
+        }
+    }
+    rule->error = strtol(value, &end, 0);
+    return *end || rule->error <= 0 ? CAMERA_RETURN_FAILURE : CAMERA_RETURN_SUCCESS;
+}
+
+static int parse_request(struct fault_rule *rule, const char *name)
+{
+    size_t i;
+
+    if (!strncasecmp(name, "VIDIOC_", 7))
+        name += 7;
+    if (!strcmp(name, "*")) {
+        rule->name = "*";
+        return CAMERA_RETURN_SUCCESS;
+    }
+    for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        if (!strcasecmp(name, requests[i].name)) {
+            rule->request = requests[i].request;
+            rule->name = requests[i].name;
+            return CAMERA_RETURN_SUCCESS;
+        }
+    }
+    return CAMERA_RETURN_FAILURE;
+}
+
+static int parse_rule(struct fault_rule *rule, char *text)
+{
+    char *field, *value, *save;
+    int ret = CAMERA_RETURN_SUCCESS;
+
+    ZAP(*rule);
+    rule->probability = 1;
+    rule->burst = 1;
+    field = strtok_r(text, ",", &save);
+    if (!field || parse_request(rule, field)) {
+        LOGE(DUMP_NONE, "Unknown fault request '%s'\n", field ? field : "");
+        return CAMERA_RETURN_FAILURE;
+    }
+    while (!ret && (field = strtok_r(NULL, ",", &save))) {
+        value = strchr(field, '=');
+        if (!value) {
+            ret = CAMERA_RETURN_FAILURE;
+            break;
+        }
+        *value++ = '\0';
+        if (!strcmp(field, "delay"))
+            ret = parse_delay(rule, value);
+        else if (!strcmp(field, "error"))
+            ret = parse_error(rule, value);
+        else if (!strcmp(field, "p"))
+            ret = sscanf(value, "%lf", &rule->probability) != 1 || rule->probability < 0 || rule->probability > 1;
+        else if (!strcmp(field, "burst"))
+            ret = sscanf(value, "%u", &rule->burst) != 1 || !rule->burst;
+        else if (!strcmp(field, "after"))
+            ret = sscanf(value, "%" SCNu64, &rule->after) != 1;
+        else
+            ret = CAMERA_RETURN_FAILURE;
+    }
+    if (ret) {
+        LOGE(DUMP_NONE, "Invalid fault '%s' for %s\n", field, rule->name);
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (!rule->delay && !rule->error) {
+        LOGE(DUMP_NONE, "Fault for %s has neither delay nor error\n", rule->name);
+        return CAMERA_RETURN_FAILURE;
+    }
+    rule->metric = metrics_register("tiny_camera_faults_injected_total", rule->name,
+            "Delays and errors injected into ioctls", METRIC_COUNTER);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Replaces the rules, an empty spec turns injection off. All or nothing on errors. */
+int fault_parse(const char *spec)
+{
+    struct fault_rule rule[FAULT_MAX_RULES];
+    char *copy, *text, *save;
+    int count = 0, ret = CAMERA_RETURN_SUCCESS;
+
+    copy = strdup(spec);
+    if (!copy) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    for (text = strtok_r(copy, ";", &save); text; text = strtok_r(NULL, ";", &save)) {
+        if (count == FAULT_MAX_RULES) {
+            LOGE(DUMP_NONE, "More than %d fault rules\n", FAULT_MAX_RULES);
+            ret = CAMERA_RETURN_FAILURE;
+            break;
+        }
+        ret = parse_rule(&rule[count], text);
+        if (ret)
+            break;
+        count++;
+    }
+    free(copy);
+    if (ret)
+        return CAMERA_RETURN_FAILURE;
+
+    pthread_mutex_lock(&faults.lock);
+    memcpy(faults.rule, rule, sizeof(struct fault_rule) * count);
+    faults.count = count;
+    __atomic_store_n(&fault_enabled, count > 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&faults.lock);
+    if (count)
+        LOGI("Injecting faults: %s\n", spec);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static void init_once(void)
+{
+    const char *spec = getenv(FAULT_ENV), *seed = getenv(FAULT_SEED_ENV);
+
+    faults.seed = seed ? strtoull(seed, NULL, 0) : 1;
+    if (!faults.seed)
+        faults.seed = 1;
+    if (spec && *spec && fault_parse(spec))
+        LOGE(DUMP_NONE, "%s ignored\n", FAULT_ENV);
+}
+
+/* Reads FAULT_ENV on the first call of the process. */
+void fault_init(void)
+{
+    pthread_once(&faults.once, init_once);
+}
+
+static void sleep_us(double us)
+{
+    struct timespec ts = { (time_t)(us / 1e6), (long)fmod(us, 1e6) * 1000 };
+
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+/*
+ * Called in place of the ioctl. Sleeps for the drawn delay, then returns
+ * the errno the call should fail with, or 0 to go ahead.
+ */
+int fault_inject(unsigned int request)
+{
+    struct fault_rule *rule;
+    double delay = 0;
+    int i, error = 0;
+
+    pthread_mutex_lock(&faults.lock);
+    for (i = 0; i < faults.count; i++) {
+        rule = &faults.rule[i];
+        if (rule->request && rule->request != request)
+            continue;
+        if (++rule->calls <= rule->after)
+            continue;
+        if (rule->burst_left) {
+            rule->burst_left--;
+        } else if (next_random() < rule->probability) {
+            delay += draw_delay(rule);
+            rule->burst_left = rule->error ? rule->burst - 1 : 0;
+        } else {
+            continue;
+        }
+        if (rule->error && !error)
+            error = rule->error;
+        metrics_add(rule->metric, 1);
+    }
+    pthread_mutex_unlock(&faults.lock);
+    if (delay > 0)
+        sleep_us(delay);
+    if (error)
+        LOGD("Inject %s into ioctl 0x%x after %.0fus\n", strerror(error), request, delay);
+    return error;
+}
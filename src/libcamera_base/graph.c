@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include "camera.h"
+#include "graph.h"
+#include "util.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+
+/*
+ * Frames fan out by reference. Inline nodes run on the thread that hands
+ * them the frame, threaded nodes take it from their own bounded queue, so
+ * a slow branch only ever fills its own queue and then drops by its policy.
+ * Only GRAPH_BLOCK lets a branch hold up its parent, and through it capture.
+ */
+
+_Static_assert(sizeof(struct graph_frame) <= GRAPH_FRAME_HEADER, "graph frame header too small");
+
+struct graph *graph_create(struct v4l2_pix_format *pix, size_t frame_size, struct rt_profile *rt)
+{
+    struct graph *graph;
+
+    graph = calloc(1, sizeof(struct graph));
+    if (!graph) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    graph->pix = *pix;
+    graph->frame_size = frame_size;
+    graph->rt = rt;
+    graph->root.graph = graph;
+    graph->root.name = "Root";
+    graph->root.enabled = 1;
+    return graph;
+}
+
+struct graph_node *graph_add_node(struct graph *graph, struct graph_node *parent, const char *name,
+        graph_node_func func, void *priv, int depth, int policy)
+{
+    struct graph_node *node;
+
+    if (!parent)
+        parent = &graph->root;
+    if (graph->running || graph->nodes == GRAPH_MAX_NODES || parent->children == GRAPH_MAX_CHILDREN || depth < 0) {
+        LOGE(DUMP_NONE, "Can't add graph node %s\n", name);
+        return NULL;
+    }
+    node = calloc(1, sizeof(struct graph_node));
+    if (!node || (depth && !(node->queue = calloc(depth, sizeof(struct graph_frame *))))) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        free(node);
+        return NULL;
+    }
+    node->graph = graph;
+    node->name = name;
+    node->func = func;
+    node->priv = priv;
+    node->depth = depth;
+    node->policy = policy;
+    node->enabled = 1;
+    pthread_mutex_init(&node->lock, NULL);
+    pthread_cond_init(&node->not_empty, NULL);
+    pthread_cond_init(&node->not_full, NULL);
+    node->dropped_id = metrics_register("tiny_camera_graph_dropped_total", name,
+            "Frames dropped at a full node queue", METRIC_COUNTER);
+    parent->child[parent->children++] = node;
+    /* Parents always come first, which is the order to drain in. */
+    graph->node[graph->nodes++] = node;
+    return node;
+}
+
+/* Applies to frames handed to the node from now on, queued ones still run. */
+void graph_node_enable(struct graph_node *node, int enabled)
+{
+    __atomic_store_n(&node->enabled, enabled, __ATOMIC_RELAXED);
+}
+
+struct graph_frame *graph_frame_alloc(struct graph *graph, struct graph_frame *like, size_t size)
+{
+    struct graph_frame *frame;
+
+    if (size > graph->frame_size) {
+        LOGE(DUMP_NONE, "Graph frame of %zu bytes exceeds %zu\n", size, graph->frame_size);
+        return NULL;
+    }
+    frame = frame_pool_get(graph->pool);
+    if (!frame)
+        return NULL;
+    frame->graph = graph;
+    if (like) {
+        frame->info = like->info;
+        frame->pix = like->pix;
+    } else {
+        ZAP(frame->info);
+        frame->pix = graph->pix;
+    }
+    frame->buffer.addr = (uint8_t *)frame + GRAPH_FRAME_HEADER;
+    frame->buffer.size = size;
+    frame->refs = 1;
+    frame->borrowed = 0;
+    frame->copy = NULL;
+    return frame;
+}
+
+void graph_frame_ref(struct graph_frame *frame)
+{
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+}
+
+void graph_frame_unref(struct graph_frame *frame)
+{
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) || frame->borrowed)
+        return;
+    frame_pool_put(frame->graph->pool, frame);
+}
+
+/* The capture buffer goes back to the driver, whatever has to wait gets a copy, made once per frame. */
+static struct graph_frame *queueable(struct graph_frame *frame)
+{
+    struct time_recorder tr;
+
+    if (!frame->borrowed)
+        return frame;
+    if (!frame->copy) {
+        time_recorder_start(&tr);
+        frame->copy = graph_frame_alloc(frame->graph, frame, frame->buffer.size);
+        if (!frame->copy)
+            return NULL;
+        memcpy(frame->copy->buffer.addr, frame->buffer.addr, frame->buffer.size);
+        time_recorder_end(&tr);
+        time_recorder_print_time(&tr, "Graph copy");
+    }
+    return frame->copy;
+}
+
+static void drop(struct graph_node *node)
+{
+    __atomic_add_fetch(&node->dropped, 1, __ATOMIC_RELAXED);
+    metrics_add(node->dropped_id, 1);
+}
+
+static void run_node(struct graph_node *node, struct graph_frame *frame);
+
+static void enqueue(struct graph_node *node, struct graph_frame *frame)
+{
+    struct graph_frame *old = NULL;
+
+    if (!node->depth) {
+        run_node(node, frame);
+        return;
+    }
+    frame = queueable(frame);
+    if (!frame) {
+        drop(node);
+        return;
+    }
+    pthread_mutex_lock(&node->lock);
+    while (node->count == node->depth && node->policy == GRAPH_BLOCK && !node->stopping)
+        pthread_cond_wait(&node->not_full, &node->lock);
+    if (node->count == node->depth) {
+        if (node->policy != GRAPH_DROP_OLDEST) {
+            pthread_mutex_unlock(&node->lock);
+            drop(node);
+            return;
+        }
+        old = node->queue[node->head];
+        node->head = (node->head + 1) % node->depth;
+        node->count--;
+    }
+    graph_frame_ref(frame);
+    node->queue[(node->head + node->count) % node->depth] = frame;
+    node->count++;
+    pthread_cond_signal(&node->not_empty);
+    pthread_mutex_unlock(&node->lock);
+    if (old) {
+        graph_frame_unref(old);
+        drop(node);
+    }
+}
+
+static void emit(struct graph_node *node, struct graph_frame *frame)
+{
+    int i;
+
+    for (i = 0; i < node->children; i++)
+        if (__atomic_load_n(&node->child[i]->enabled, __ATOMIC_RELAXED))
+            enqueue(node->child[i], frame);
+}
+
+static void run_node(struct graph_node *node, struct graph_frame *frame)
+{
+    struct time_recorder tr;
+    struct graph_frame *out;
+
+    trace_set_frame(frame->info.sequence);
+    time_recorder_start(&tr);
+    out = node->func(node, frame);
+    time_recorder_end(&tr);
+    time_recorder_print_time(&tr, node->name);
+    __atomic_add_fetch(&node->processed, 1, __ATOMIC_RELAXED);
+    if (!out)
+        return;
+    emit(node, out);
+    if (out != frame)
+        graph_frame_unref(out);
+}
+
+static void *node_thread(void *arg)
+{
+    struct graph_node *node = arg;
+    struct graph_frame *frame;
+    char name[16];
+
+    snprintf(name, sizeof(name), "graph:%s", node->name);
+    pthread_setname_np(pthread_self(), name);
+    rt_enter_thread(node->graph->rt, RT_ROLE_WORKER);
+    pthread_mutex_lock(&node->lock);
+    while (1) {
+        while (!node->count && !node->stopping)
+            pthread_cond_wait(&node->not_empty, &node->lock);
+        if (!node->count)
+            break;
+        frame = node->queue[node->head];
+        node->head = (node->head + 1) % node->depth;
+        node->count--;
+        pthread_cond_signal(&node->not_full);
+        pthread_mutex_unlock(&node->lock);
+
+        run_node(node, frame);
+        graph_frame_unref(frame);
+
+        pthread_mutex_lock(&node->lock);
+    }
+    pthread_mutex_unlock(&node->lock);
+    frame_pool_flush(node->graph->pool);
+    return NULL;
+}
+
+static void stop_node(struct graph_node *node)
+{
+    pthread_mutex_lock(&node->lock);
+    node->stopping = 1;
+    pthread_cond_broadcast(&node->not_empty);
+    pthread_cond_broadcast(&node->not_full);
+    pthread_mutex_unlock(&node->lock);
+    pthread_join(node->thread, NULL);
+}
+
+int graph_start(struct graph *graph)
+{
+    struct graph_node *node;
+    int i, frames = 2 + GRAPH_POOL_CACHE;
+
+    /*
+     * A full queue, the frame in work and a full cache per thread, the frame
+     * being pushed, one derived frame and the cache of the pushing thread.
+     */
+    for (i = 0; i < graph->nodes; i++)
+        if (graph->node[i]->depth)
+            frames += graph->node[i]->depth + 1 + GRAPH_POOL_CACHE;
+    graph->pool = frame_pool_create(GRAPH_FRAME_HEADER + graph->frame_size, frames, GRAPH_POOL_CACHE, 0);
+    if (!graph->pool)
+        return CAMERA_RETURN_FAILURE;
+    for (i = 0; i < graph->nodes; i++) {
+        node = graph->node[i];
+        if (node->depth && pthread_create(&node->thread, NULL, node_thread, node)) {
+            LOGE(DUMP_NONE, "Create graph thread %s failed\n", node->name);
+            goto err_stop;
+        }
+    }
+    graph->running = 1;
+    return CAMERA_RETURN_SUCCESS;
+
+err_stop:
+    while (--i >= 0)
+        if (graph->node[i]->depth)
+            stop_node(graph->node[i]);
+    frame_pool_destroy(graph->pool);
+    graph->pool = NULL;
+    return CAMERA_RETURN_FAILURE;
+}
+
+/* Runs the inline nodes, queues for the threaded ones and returns, the buffer is free again then. */
+int graph_push(struct graph *graph, struct v4l2_buffer *buffer_info, struct buffer buffer)
+{
+    struct graph_frame frame = {
+        .graph      = graph,
+        .info       = *buffer_info,
+        .buffer     = buffer,
+        .pix        = graph->pix,
+        .refs       = 1,
+        .borrowed   = 1,
+    };
+
+    if (!graph->running)
+        return CAMERA_RETURN_FAILURE;
+    emit(&graph->root, &frame);
+    if (frame.copy)
+        graph_frame_unref(frame.copy);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Drains every queue, parents first so their last frames still reach the children. */
+void graph_stop(struct graph *graph)
+{
+    int i;
+
+    if (!graph->running)
+        return;
+    for (i = 0; i < graph->nodes; i++)
+        if (graph->node[i]->depth)
+            stop_node(graph->node[i]);
+    frame_pool_flush(graph->pool);
+    graph->running = 0;
+}
+
+void graph_dump_stats(struct graph *graph)
+{
+    struct graph_node *node;
+    int i;
+
+    for (i = 0; i < graph->nodes; i++) {
+        node = graph->node[i];
+        LOGI("Graph node %s: %llu frames, %llu dropped\n", node->name,
+                (unsigned long long)node->processed, (unsigned long long)node->dropped);
+    }
+}
+
+void graph_destroy(struct graph *graph)
+{
+    struct graph_node *node;
+    int i;
+
+    if (!graph)
+        return;
+    graph_stop(graph);
+    for (i = 0; i < graph->nodes; i++) {
+        node = graph->node[i];
+        pthread_cond_destroy(&node->not_full);
+        pthread_cond_destroy(&node->not_empty);
+        pthread_mutex_destroy(&node->lock);
+        free(node->queue);
+        free(node);
+    }
+    frame_pool_destroy(graph->pool);
+    free(graph);
+}
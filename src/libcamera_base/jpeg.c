@@ -0,0 +1,197 @@
+#include "camera.h"
+#include "jpeg.h"
+#include "log.h"
+
+int jpeg_parse_options(struct jpeg_options *opts, const char *spec)
+{
+    int subsampling = 420;
+
+    opts->quality = JPEG_DEFAULT_QUALITY;
+    if (sscanf(spec, "%d,%d", &opts->quality, &subsampling) < 1 ||
+            opts->quality < 1 || opts->quality > 100) {
+        LOGE(DUMP_NONE, "Invalid jpeg options '%s'\n", spec);
+        return CAMERA_RETURN_FAILURE;
+    }
+    switch (subsampling) {
+        case 444:
+            opts->subsampling = JPEG_SUBSAMPLING_444;
+            break;
+        case 422:
+            opts->subsampling = JPEG_SUBSAMPLING_422;
+            break;
+        case 420:
+            opts->subsampling = JPEG_SUBSAMPLING_420;
+            break;
+        default:
+            LOGE(DUMP_NONE, "Unsupported subsampling %d\n", subsampling);
+            return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+#ifdef __HAS_JPEG__
+#include <pthread.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+/*
+ * YUYV to JPEG. Every thread keeps its own compressor, scanline and output
+ * buffer across frames, so encoding in a worker pool scales with cores and
+ * allocates nothing once the output buffer has grown to size.
+ */
+
+struct jpeg_encoder {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr       jerr;
+    jmp_buf                     jump;       /* Where error_exit returns to instead of exiting */
+    uint8_t                     *line;      /* One YCbCr 4:4:4 scanline */
+    size_t                      line_size;
+    unsigned char               *out;
+    unsigned long               out_size;
+};
+
+static pthread_key_t encoder_key;
+static pthread_once_t encoder_once = PTHREAD_ONCE_INIT;
+
+static void encoder_free(void *arg)
+{
+    struct jpeg_encoder *enc = arg;
+
+    jpeg_destroy_compress(&enc->cinfo);
+    free(enc->line);
+    free(enc->out);
+    free(enc);
+}
+
+/* The default handler calls exit(), from a worker thread in the middle of a capture. */
+static void encoder_error_exit(j_common_ptr cinfo)
+{
+    struct jpeg_encoder *enc = (struct jpeg_encoder *)cinfo;
+    char msg[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, msg);
+    LOGE(DUMP_NONE, "JPEG encode failed: %s\n", msg);
+    longjmp(enc->jump, 1);
+}
+
+static void encoder_key_create(void)
+{
+    pthread_key_create(&encoder_key, encoder_free);
+}
+
+static struct jpeg_encoder *get_encoder(void)
+{
+    struct jpeg_encoder *enc;
+
+    pthread_once(&encoder_once, encoder_key_create);
+    enc = pthread_getspecific(encoder_key);
+    if (enc)
+        return enc;
+    enc = calloc(1, sizeof(struct jpeg_encoder));
+    if (!enc) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    enc->cinfo.err = jpeg_std_error(&enc->jerr);
+    enc->jerr.error_exit = encoder_error_exit;
+    jpeg_create_compress(&enc->cinfo);
+    pthread_setspecific(encoder_key, enc);
+    return enc;
+}
+
+/* Expand Y0 U Y1 V into two YCbCr triplets, libjpeg downsamples chroma as configured. */
+static void yuyv_to_ycbcr(const uint8_t *src, uint8_t *dst, int width)
+{
+    int i;
+
+    for (i = 0; i < width / 2; i++, src += 4, dst += 6) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[3];
+        dst[3] = src[2];
+        dst[4] = src[1];
+        dst[5] = src[3];
+    }
+}
+
+int jpeg_encode_yuyv(struct v4l2_pix_format *pix, struct buffer src, struct jpeg_options *opts,
+        struct buffer *dst)
+{
+    static const int h_samp[] = { 1, 2, 2 }, v_samp[] = { 1, 1, 2 };
+    struct jpeg_encoder *enc = get_encoder();
+    struct jpeg_compress_struct *cinfo;
+    size_t stride = pix->bytesperline ? pix->bytesperline : pix->width * 2;
+    unsigned char *out;
+    unsigned long out_size;
+    JSAMPROW row;
+
+    if (!enc)
+        return CAMERA_RETURN_FAILURE;
+    if (src.size < stride * (pix->height - 1) + pix->width * 2) {
+        LOGE(DUMP_NONE, "Source buffer too small: %zu\n", src.size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (enc->line_size < pix->width * 3) {
+        free(enc->line);
+        enc->line_size = pix->width * 3;
+        enc->line = malloc(enc->line_size);
+        if (!enc->line) {
+            enc->line_size = 0;
+            LOGE(DUMP_NONE, "Out of memory\n");
+            return CAMERA_RETURN_FAILURE;
+        }
+    }
+
+    /* One byte per pixel covers all but near lossless settings, so libjpeg rarely has to grow it. */
+    if (enc->out_size < (unsigned long)pix->width * pix->height) {
+        free(enc->out);
+        enc->out_size = (unsigned long)pix->width * pix->height;
+        enc->out = malloc(enc->out_size);
+        if (!enc->out) {
+            enc->out_size = 0;
+            LOGE(DUMP_NONE, "Out of memory\n");
+            return CAMERA_RETURN_FAILURE;
+        }
+    }
+
+    cinfo = &enc->cinfo;
+    if (setjmp(enc->jump)) {
+        /* Only libjpeg state changed since, the encoder is reusable after the abort. */
+        jpeg_abort_compress(cinfo);
+        return CAMERA_RETURN_FAILURE;
+    }
+    /* mem_dest reallocates when the frame doesn't fit, keep whatever it ends up with. */
+    out = enc->out;
+    out_size = enc->out_size;
+    jpeg_mem_dest(cinfo, &out, &out_size);
+    cinfo->image_width = pix->width;
+    cinfo->image_height = pix->height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, opts->quality, TRUE);
+    cinfo->comp_info[0].h_samp_factor = h_samp[opts->subsampling];
+    cinfo->comp_info[0].v_samp_factor = v_samp[opts->subsampling];
+    cinfo->comp_info[1].h_samp_factor = cinfo->comp_info[1].v_samp_factor = 1;
+    cinfo->comp_info[2].h_samp_factor = cinfo->comp_info[2].v_samp_factor = 1;
+    cinfo->dct_method = JDCT_ISLOW;
+
+    jpeg_start_compress(cinfo, TRUE);
+    row = enc->line;
+    while (cinfo->next_scanline < cinfo->image_height) {
+        yuyv_to_ycbcr((const uint8_t *)src.addr + stride * cinfo->next_scanline, enc->line, pix->width);
+        jpeg_write_scanlines(cinfo, &row, 1);
+    }
+    jpeg_finish_compress(cinfo);
+
+    /* Grown by libjpeg, only the used length is known to fit. */
+    if (out != enc->out) {
+        free(enc->out);
+        enc->out = out;
+        enc->out_size = out_size;
+    }
+    dst->addr = out;
+    dst->size = out_size;
+    return CAMERA_RETURN_SUCCESS;
+}
+#endif
@@ -0,0 +1,234 @@
+#include "camera.h"
+#include "lossless.h"
+#include "simd.h"
+#include "log.h"
+
+#define RICE_MAX_K      (7)
+#define RICE_ESCAPE     (24)                /* Unary prefix that escapes to 8 raw bits */
+#define RICE_RESET      (64)                /* Halve the statistics every RESET samples */
+
+typedef int8_t vec_s8 __attribute__((vector_size(SIMD_BYTES)));
+
+struct rice_state {
+    uint32_t            a;                  /* Sum of coded values */
+    uint32_t            n;                  /* Number of coded values */
+};
+
+struct bit_writer {
+    uint8_t             *p;
+    uint8_t             *end;
+    uint64_t            acc;
+    int                 bits;
+};
+
+struct bit_reader {
+    const uint8_t       *p;
+    const uint8_t       *end;
+    uint64_t            acc;                /* Left aligned */
+    int                 bits;
+};
+
+/* Y sits on even bytes with its left neighbour 2 bytes back, U and V 4 bytes back. */
+static inline int channel(int i)
+{
+    return (i & 1) ? 1 + ((i >> 1) & 1) : 0;
+}
+
+static inline int left_distance(int i)
+{
+    return (i & 1) ? 4 : 2;
+}
+
+static inline uint8_t median(uint8_t a, uint8_t b, uint8_t c)
+{
+    uint8_t mx = a > b ? a : b, mn = a > b ? b : a;
+
+    if (c >= mx)
+        return mn;
+    if (c <= mn)
+        return mx;
+    return a + b - c;
+}
+
+static inline uint8_t predict(const uint8_t *row, const uint8_t *prev, int i)
+{
+    int d = left_distance(i);
+    uint8_t a, b, c;
+
+    a = i >= d ? row[i - d] : (prev ? prev[i] : 0);
+    b = prev ? prev[i] : a;
+    c = prev && i >= d ? prev[i - d] : b;
+    return median(a, b, c);
+}
+
+static inline uint8_t zigzag(uint8_t r)
+{
+    return (r << 1) ^ (uint8_t)((int8_t)r >> 7);
+}
+
+static inline uint8_t unzigzag(uint8_t m)
+{
+    return (m >> 1) ^ (uint8_t)-(m & 1);
+}
+
+/* Mapped residuals of one line, vectorized wherever all neighbours exist. */
+SIMD_KERNEL
+static void residual_line(const uint8_t *row, const uint8_t *prev, int line, uint8_t *out)
+{
+    const vec_u8 ymask = { 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0 };
+    int i = 0;
+
+    if (prev) {
+        for (; i < 4 && i < line; i++)
+            out[i] = zigzag(row[i] - predict(row, prev, i));
+        for (; i + SIMD_BYTES <= line; i += SIMD_BYTES) {
+            vec_u8 cur = vec_load_u8(row + i), b = vec_load_u8(prev + i);
+            vec_u8 a = (vec_load_u8(row + i - 2) & ymask) | (vec_load_u8(row + i - 4) & ~ymask);
+            vec_u8 c = (vec_load_u8(prev + i - 2) & ymask) | (vec_load_u8(prev + i - 4) & ~ymask);
+            vec_u8 gt = (vec_u8)(a > b);
+            vec_u8 mx = (a & gt) | (b & ~gt), mn = (b & gt) | (a & ~gt);
+            vec_u8 hi = (vec_u8)(c >= mx), lo = (vec_u8)(c <= mn);
+            vec_u8 pred = (mn & hi) | (mx & lo & ~hi) | ((a + b - c) & ~hi & ~lo);
+            vec_u8 r = cur - pred;
+
+            vec_store_u8(out + i, (r << 1) ^ (vec_u8)((vec_s8)r >> 7));
+        }
+    }
+    for (; i < line; i++)
+        out[i] = zigzag(row[i] - predict(row, prev, i));
+}
+
+static inline int rice_k(struct rice_state *s)
+{
+    int k = 0;
+
+    while (k < RICE_MAX_K && (s->n << k) < s->a)
+        k++;
+    return k;
+}
+
+static inline void rice_update(struct rice_state *s, uint8_t m)
+{
+    s->a += m;
+    if (++s->n == RICE_RESET) {
+        s->a >>= 1;
+        s->n >>= 1;
+    }
+}
+
+static inline int put_bits(struct bit_writer *w, uint32_t code, int n)
+{
+    w->acc = (w->acc << n) | code;
+    w->bits += n;
+    while (w->bits >= 8) {
+        if (w->p == w->end)
+            return -1;
+        w->bits -= 8;
+        *w->p++ = w->acc >> w->bits;
+    }
+    return 0;
+}
+
+static inline int get_bits(struct bit_reader *r, int n)
+{
+    int v;
+
+    while (r->bits <= 56 && r->p < r->end) {
+        r->acc |= (uint64_t)*r->p++ << (56 - r->bits);
+        r->bits += 8;
+    }
+    if (r->bits < n)
+        return -1;
+    v = n ? r->acc >> (64 - n) : 0;
+    r->acc <<= n;
+    r->bits -= n;
+    return v;
+}
+
+static inline int get_unary(struct bit_reader *r)
+{
+    int q;
+
+    while (r->bits <= 56 && r->p < r->end) {
+        r->acc |= (uint64_t)*r->p++ << (56 - r->bits);
+        r->bits += 8;
+    }
+    q = ~r->acc ? __builtin_clzll(~r->acc) : 64;
+    if (q >= RICE_ESCAPE)
+        q = RICE_ESCAPE;
+    if (q + (q < RICE_ESCAPE) > r->bits)
+        return -1;
+    r->acc <<= q + (q < RICE_ESCAPE);
+    r->bits -= q + (q < RICE_ESCAPE);
+    return q;
+}
+
+int lossless_encode_yuyv(const uint8_t *src, int width, int height, size_t stride,
+        uint8_t *dst, size_t dst_size, size_t *out_size)
+{
+    struct rice_state state[3] = { { 4, 1 }, { 4, 1 }, { 4, 1 } };
+    struct bit_writer w = { dst, dst + dst_size, 0, 0 };
+    uint8_t residual[LOSSLESS_MAX_LINE];
+    int line = width * 2, y, i, k, q;
+
+    if (line > LOSSLESS_MAX_LINE) {
+        LOGE(DUMP_NONE, "Line of %d bytes is too long\n", line);
+        return CAMERA_RETURN_FAILURE;
+    }
+    for (y = 0; y < height; y++) {
+        const uint8_t *row = src + stride * y;
+
+        residual_line(row, y ? row - stride : NULL, line, residual);
+        for (i = 0; i < line; i++) {
+            struct rice_state *s = &state[channel(i)];
+            uint8_t m = residual[i];
+
+            k = rice_k(s);
+            q = m >> k;
+            if (q < RICE_ESCAPE) {
+                if (put_bits(&w, ((((1u << q) - 1) << 1) << k) | (m & ((1u << k) - 1)), q + 1 + k))
+                    return CAMERA_RETURN_FAILURE;
+            } else if (put_bits(&w, (((1u << RICE_ESCAPE) - 1) << 8) | m, RICE_ESCAPE + 8)) {
+                return CAMERA_RETURN_FAILURE;
+            }
+            rice_update(s, m);
+        }
+    }
+    if (w.bits && put_bits(&w, 0, 8 - w.bits))
+        return CAMERA_RETURN_FAILURE;
+    *out_size = w.p - dst;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+int lossless_decode_yuyv(const uint8_t *src, size_t size, int width, int height, size_t stride,
+        uint8_t *dst)
+{
+    struct rice_state state[3] = { { 4, 1 }, { 4, 1 }, { 4, 1 } };
+    struct bit_reader r = { src, src + size, 0, 0 };
+    int line = width * 2, y, i, k, q, low;
+
+    for (y = 0; y < height; y++) {
+        uint8_t *row = dst + stride * y, *prev = y ? row - stride : NULL;
+
+        for (i = 0; i < line; i++) {
+            struct rice_state *s = &state[channel(i)];
+            uint8_t m;
+
+            k = rice_k(s);
+            q = get_unary(&r);
+            if (q < 0)
+                goto err_truncated;
+            low = get_bits(&r, q < RICE_ESCAPE ? k : 8);
+            if (low < 0)
+                goto err_truncated;
+            m = q < RICE_ESCAPE ? (q << k) | low : low;
+            rice_update(s, m);
+            row[i] = predict(row, prev, i) + unzigzag(m);
+        }
+    }
+    return CAMERA_RETURN_SUCCESS;
+
+err_truncated:
+    LOGE(DUMP_NONE, "Truncated frame at line %d\n", y);
+    return CAMERA_RETURN_FAILURE;
+}
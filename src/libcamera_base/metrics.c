@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "camera.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * Metrics registry. Hot paths only touch a thread local shard with relaxed
+ * stores, readers sum all shards. Registration is rare and takes the lock,
+ * lookups of registered metrics are lock free.
+ */
+
+#define METRICS_UNIX_PREFIX     "unix:"
+
+static struct metric metrics[METRICS_MAX];
+static int metrics_count;
+static struct metrics_shard *shards;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct metrics_shard *local_shard;
+
+static struct {
+    pthread_t           thread;
+    int                 running;
+    int                 stop_fd;
+    int                 listen_fd;
+    char                *path;
+} exporter = { .stop_fd = -1, .listen_fd = -1 };
+
+static int label_equal(const char *a, const char *b)
+{
+    return (!a && !b) || (a && b && !strcmp(a, b));
+}
+
+static int metrics_find(const char *name, const char *label, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (!strcmp(metrics[i].name, name) && label_equal(metrics[i].label, label))
+            return i;
+    return -1;
+}
+
+int metrics_register(const char *name, const char *label, const char *help, int type)
+{
+    int id, count = __atomic_load_n(&metrics_count, __ATOMIC_ACQUIRE);
+
+    id = metrics_find(name, label, count);
+    if (id >= 0)
+        return id;
+    pthread_mutex_lock(&metrics_lock);
+    id = metrics_find(name, label, metrics_count);
+    if (id < 0 && metrics_count < METRICS_MAX) {
+        id = metrics_count;
+        metrics[id].name = strdup(name);
+        metrics[id].label = label ? strdup(label) : NULL;
+        metrics[id].help = help;
+        metrics[id].type = type;
+        __atomic_store_n(&metrics_count, id + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    if (id < 0)
+        LOGE(DUMP_NONE, "Too many metrics, drop %s\n", name);
+    return id;
+}
+
+static struct metrics_shard *get_shard(void)
+{
+    if (local_shard)
+        return local_shard;
+    local_shard = calloc(1, sizeof(struct metrics_shard));
+    if (!local_shard)
+        return NULL;
+    /* Shards outlive their thread so totals never go backwards. */
+    pthread_mutex_lock(&metrics_lock);
+    local_shard->next = shards;
+    __atomic_store_n(&shards, local_shard, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metrics_lock);
+    return local_shard;
+}
+
+void metrics_add(int id, uint64_t value)
+{
+    struct metrics_shard *shard = get_shard();
+
+    if (id < 0 || !shard)
+        return;
+    __atomic_store_n(&shard->value[id], shard->value[id] + value, __ATOMIC_RELAXED);
+}
+
+void metrics_set(int id, double value)
+{
+    uint64_t bits;
+
+    if (id < 0)
+        return;
+    memcpy(&bits, &value, sizeof(bits));
+    __atomic_store_n(&metrics[id].gauge, bits, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(int id, uint64_t usec)
+{
+    struct metrics_shard *shard = get_shard();
+
+    if (id < 0 || !shard)
+        return;
+    __atomic_store_n(&shard->value[id], shard->value[id] + usec, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->count[id], shard->count[id] + 1, __ATOMIC_RELAXED);
+}
+
+static void metrics_sum(int id, uint64_t *value, uint64_t *count)
+{
+    struct metrics_shard *shard;
+
+    *value = *count = 0;
+    for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+        *value += __atomic_load_n(&shard->value[id], __ATOMIC_RELAXED);
+        *count += __atomic_load_n(&shard->count[id], __ATOMIC_RELAXED);
+    }
+}
+
+static void dump_label(FILE *fp, struct metric *m)
+{
+    if (m->label)
+        fprintf(fp, "{stage=\"%s\"}", m->label);
+}
+
+static void dump_metric(FILE *fp, struct metric *m, int id)
+{
+    uint64_t value, n;
+    double gauge;
+
+    switch (m->type) {
+        case METRIC_COUNTER:
+            metrics_sum(id, &value, &n);
+            fprintf(fp, "%s", m->name);
+            dump_label(fp, m);
+            fprintf(fp, " %llu\n", (unsigned long long)value);
+            break;
+        case METRIC_GAUGE:
+            value = __atomic_load_n(&m->gauge, __ATOMIC_RELAXED);
+            memcpy(&gauge, &value, sizeof(gauge));
+            fprintf(fp, "%s", m->name);
+            dump_label(fp, m);
+            fprintf(fp, " %g\n", gauge);
+            break;
+        case METRIC_SUMMARY:
+            metrics_sum(id, &value, &n);
+            fprintf(fp, "%s_sum", m->name);
+            dump_label(fp, m);
+            fprintf(fp, " %.6f\n", value / 1e6);
+            fprintf(fp, "%s_count", m->name);
+            dump_label(fp, m);
+            fprintf(fp, " %llu\n", (unsigned long long)n);
+            break;
+    }
+}
+
+/* Prometheus text exposition format, labelled metrics grouped under one family header. */
+void metrics_dump(FILE *fp)
+{
+    static const char *type_name[] = { "counter", "gauge", "summary" };
+    int i, j, count = __atomic_load_n(&metrics_count, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < i; j++)
+            if (!strcmp(metrics[j].name, metrics[i].name))
+                break;
+        if (j < i)
+            continue;
+        fprintf(fp, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+        fprintf(fp, "# TYPE %s %s\n", metrics[i].name, type_name[metrics[i].type]);
+        for (j = i; j < count; j++)
+            if (!strcmp(metrics[j].name, metrics[i].name))
+                dump_metric(fp, &metrics[j], j);
+    }
+}
+
+/* Rewrite aside and rename so a scraper never reads a partial file. */
+static void export_file(const char *path)
+{
+    char tmp[256];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    if (!fp)
+        return;
+    metrics_dump(fp);
+    if (fclose(fp) || rename(tmp, path))
+        unlink(tmp);
+}
+
+/* A scraper that stops reading is dropped after METRICS_CLIENT_TIMEOUT, not waited for. */
+static void export_client(int listen_fd)
+{
+    struct timeval timeout = { METRICS_CLIENT_TIMEOUT / 1000, METRICS_CLIENT_TIMEOUT % 1000 * 1000 };
+    FILE *fp;
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+            close(fd);
+            continue;
+        }
+        fp = fdopen(fd, "w");
+        if (!fp) {
+            close(fd);
+            continue;
+        }
+        metrics_dump(fp);
+        fclose(fp);
+    }
+}
+
+static void *export_thread(void *arg)
+{
+    struct pollfd pfd[2] = {
+        { exporter.stop_fd, POLLIN, 0 },
+        { exporter.listen_fd, POLLIN, 0 },
+    };
+
+    pthread_setname_np(pthread_self(), "metrics");
+    while (1) {
+        int ret = poll(pfd, exporter.listen_fd == -1 ? 1 : 2,
+                exporter.listen_fd == -1 ? METRICS_EXPORT_INTERVAL : -1);
+        if (ret < 0 && errno != EINTR)
+            break;
+        if (pfd[0].revents)
+            break;
+        if (exporter.listen_fd != -1)
+            export_client(exporter.listen_fd);
+        else
+            export_file(exporter.path);
+    }
+    if (exporter.listen_fd == -1)
+        export_file(exporter.path);
+    return NULL;
+}
+
+/* target is a file rewritten every METRICS_EXPORT_INTERVAL, or unix:<path> served on connect. */
+int metrics_export_start(const char *target)
+{
+    struct sockaddr_un addr;
+
+    exporter.stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (exporter.stop_fd == -1) {
+        LOGE(DUMP_ERROR, "Create eventfd failed\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (!strncmp(target, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX))) {
+        target += strlen(METRICS_UNIX_PREFIX);
+        ZAP(addr);
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", target);
+        exporter.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        unlink(target);
+        if (exporter.listen_fd == -1 || bind(exporter.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+                listen(exporter.listen_fd, 4)) {
+            LOGE(DUMP_ERROR, "Listen on %s failed\n", target);
+            goto err_close;
+        }
+    }
+    exporter.path = strdup(target);
+    if (pthread_create(&exporter.thread, NULL, export_thread, NULL)) {
+        LOGE(DUMP_NONE, "Create metrics thread failed\n");
+        goto err_close;
+    }
+    exporter.running = 1;
+    LOGI("Export metrics to %s%s\n", exporter.listen_fd == -1 ? "" : METRICS_UNIX_PREFIX, target);
+    return CAMERA_RETURN_SUCCESS;
+
+err_close:
+    metrics_export_stop();
+    return CAMERA_RETURN_FAILURE;
+}
+
+void metrics_export_stop(void)
+{
+    uint64_t one = 1;
+
+    if (exporter.running) {
+        if (write(exporter.stop_fd, &one, sizeof(one)) != sizeof(one))
+            LOGE(DUMP_ERROR, "Stop metrics thread failed\n");
+        pthread_join(exporter.thread, NULL);
+        exporter.running = 0;
+    }
+    if (exporter.listen_fd != -1) {
+        close(exporter.listen_fd);
+        unlink(exporter.path);
+    }
+    if (exporter.stop_fd != -1)
+        close(exporter.stop_fd);
+    free(exporter.path);
+    exporter.path = NULL;
+    exporter.listen_fd = exporter.stop_fd = -1;
+}
@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include "camera.h"
+#include "pool.h"
+#include "util.h"
+#include "metrics.h"
+#include "log.h"
+
+#define HUGEPAGE_SIZE       (2UL << 20)
+
+struct pool_cache {
+    struct frame_pool   *pool;
+    uint32_t            generation;
+    int                 count;
+    void                *frame[FRAME_POOL_CACHE];
+};
+
+static struct frame_pool *pools[FRAME_POOL_MAX];
+static uint32_t pool_generation;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct pool_cache caches[FRAME_POOL_MAX];
+static __thread int caches_in_use;
+static pthread_key_t caches_key;
+static pthread_once_t caches_once = PTHREAD_ONCE_INIT;
+static int heap_allocs_id = -1;
+
+static inline void *next_free(void *frame)
+{
+    return *(void **)frame;
+}
+
+static inline void set_next_free(void *frame, void *next)
+{
+    *(void **)frame = next;
+}
+
+size_t frame_pool_format_size(struct v4l2_pix_format *pix)
+{
+    size_t size = (size_t)pix->bytesperline * pix->height;
+
+    if (pix->sizeimage > size)
+        size = pix->sizeimage;
+    return size;
+}
+
+static int map_frames(struct frame_pool *pool, int flags)
+{
+    size_t size = pool->frame_size * pool->count;
+
+    if (flags & FRAME_POOL_HUGEPAGE) {
+        pool->map_size = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+        pool->base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (pool->base != MAP_FAILED) {
+            pool->hugepage = 1;
+            return CAMERA_RETURN_SUCCESS;
+        }
+        LOGI("No hugetlb pages, fall back to transparent hugepages\n");
+    }
+    pool->map_size = size;
+    pool->base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool->base == MAP_FAILED) {
+        LOGE(DUMP_ERROR, "Map %zu bytes failed\n", pool->map_size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (flags & FRAME_POOL_HUGEPAGE)
+        madvise(pool->base, pool->map_size, MADV_HUGEPAGE);
+    /* Fault everything in now rather than on the first frames. */
+    memset(pool->base, 0, pool->map_size);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* cache is the per thread cache, up to FRAME_POOL_CACHE, below 2 for none. */
+struct frame_pool *frame_pool_create(size_t frame_size, int count, int cache, int flags)
+{
+    struct frame_pool *pool;
+    int i;
+
+    pool = calloc(1, sizeof(struct frame_pool));
+    if (!pool) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    pool->frame_size = page_align(frame_size);
+    pool->count = count;
+    pool->cache_size = cache < FRAME_POOL_CACHE ? cache : FRAME_POOL_CACHE;
+    if (pool->cache_size < 2)
+        pool->cache_size = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    if (map_frames(pool, flags))
+        goto err_free;
+    for (i = count - 1; i >= 0; i--) {
+        set_next_free(pool->base + pool->frame_size * i, pool->free);
+        pool->free = pool->base + pool->frame_size * i;
+    }
+
+    pthread_mutex_lock(&pools_lock);
+    for (i = 0; i < FRAME_POOL_MAX && pools[i]; i++);
+    if (i < FRAME_POOL_MAX) {
+        pool->id = i;
+        pool->generation = ++pool_generation;
+        pools[i] = pool;
+    }
+    pthread_mutex_unlock(&pools_lock);
+    if (i == FRAME_POOL_MAX) {
+        LOGE(DUMP_NONE, "Too many frame pools\n");
+        munmap(pool->base, pool->map_size);
+        goto err_free;
+    }
+    if (heap_allocs_id < 0)
+        heap_allocs_id = metrics_register("tiny_camera_pool_heap_allocs_total", NULL,
+                "Frames allocated after a pool ran dry", METRIC_COUNTER);
+    LOGI("Frame pool %d: %d frames of %zu bytes, cache %d%s\n", pool->id, count, pool->frame_size,
+            pool->cache_size, pool->hugepage ? ", hugetlb" : "");
+    return pool;
+
+err_free:
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    return NULL;
+}
+
+static void spill(struct frame_pool *pool, struct pool_cache *cache, int keep)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (cache->count > keep) {
+        set_next_free(cache->frame[--cache->count], pool->free);
+        pool->free = cache->frame[cache->count];
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Thread exit, whatever the thread cached goes back to the pools still alive. */
+static void flush_caches(void *arg)
+{
+    struct pool_cache *cache;
+    int i;
+
+    (void) arg;
+    pthread_mutex_lock(&pools_lock);
+    for (i = 0; i < FRAME_POOL_MAX; i++) {
+        cache = &caches[i];
+        if (cache->count && pools[i] == cache->pool && pools[i]->generation == cache->generation)
+            spill(cache->pool, cache, 0);
+        cache->count = 0;
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+static void create_caches_key(void)
+{
+    if (pthread_key_create(&caches_key, flush_caches))
+        LOGE(DUMP_NONE, "Create frame pool key failed, exiting threads strand cached frames\n");
+}
+
+static struct pool_cache *get_cache(struct frame_pool *pool)
+{
+    struct pool_cache *cache = &caches[pool->id];
+
+    /* The destructor only runs for threads that set a value. */
+    if (!caches_in_use) {
+        pthread_once(&caches_once, create_caches_key);
+        pthread_setspecific(caches_key, caches);
+        caches_in_use = 1;
+    }
+    /* Slot reused by a newer pool, whatever was cached is gone with the old one. */
+    if (cache->pool != pool || cache->generation != pool->generation) {
+        cache->pool = pool;
+        cache->generation = pool->generation;
+        cache->count = 0;
+    }
+    return cache;
+}
+
+static void *grow(struct frame_pool *pool)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint8_t *map;
+
+    /* One page in front keeps the mapping list, the frame stays page aligned. */
+    map = mmap(NULL, pool->frame_size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        LOGE(DUMP_ERROR, "Grow frame pool %d failed\n", pool->id);
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    set_next_free(map, pool->grown);
+    pool->grown = map;
+    pool->heap_allocs++;
+    pthread_mutex_unlock(&pool->lock);
+    metrics_add(heap_allocs_id, 1);
+    LOGD("Frame pool %d ran dry, grow by one frame\n", pool->id);
+    return map + page;
+}
+
+static void *get_shared(struct frame_pool *pool)
+{
+    void *frame;
+
+    pthread_mutex_lock(&pool->lock);
+    frame = pool->free;
+    if (frame)
+        pool->free = next_free(frame);
+    pthread_mutex_unlock(&pool->lock);
+    return frame ? frame : grow(pool);
+}
+
+static void put_shared(struct frame_pool *pool, void *frame)
+{
+    pthread_mutex_lock(&pool->lock);
+    set_next_free(frame, pool->free);
+    pool->free = frame;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *frame_pool_get(struct frame_pool *pool)
+{
+    struct pool_cache *cache;
+
+    if (!pool->cache_size)
+        return get_shared(pool);
+    cache = get_cache(pool);
+    if (!cache->count) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->free && cache->count < pool->cache_size / 2) {
+            cache->frame[cache->count++] = pool->free;
+            pool->free = next_free(pool->free);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (!cache->count)
+            return grow(pool);
+    }
+    return cache->frame[--cache->count];
+}
+
+void frame_pool_put(struct frame_pool *pool, void *frame)
+{
+    struct pool_cache *cache;
+
+    if (!frame)
+        return;
+    if (!pool->cache_size) {
+        put_shared(pool, frame);
+        return;
+    }
+    cache = get_cache(pool);
+    if (cache->count == pool->cache_size)
+        spill(pool, cache, pool->cache_size / 2);
+    cache->frame[cache->count++] = frame;
+}
+
+void frame_pool_flush(struct frame_pool *pool)
+{
+    if (!pool->cache_size)
+        return;
+    spill(pool, get_cache(pool), 0);
+}
+
+uint64_t frame_pool_heap_allocs(struct frame_pool *pool)
+{
+    uint64_t n;
+
+    pthread_mutex_lock(&pool->lock);
+    n = pool->heap_allocs;
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+void frame_pool_destroy(struct frame_pool *pool)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    void *map, *next;
+
+    if (!pool)
+        return;
+    if (pool->heap_allocs)
+        LOGI("Frame pool %d grew by %llu frames, consider a larger pool\n", pool->id,
+                (unsigned long long)pool->heap_allocs);
+    pthread_mutex_lock(&pools_lock);
+    pools[pool->id] = NULL;
+    pthread_mutex_unlock(&pools_lock);
+    for (map = pool->grown; map; map = next) {
+        next = next_free(map);
+        munmap(map, pool->frame_size + page);
+    }
+    munmap(pool->base, pool->map_size);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
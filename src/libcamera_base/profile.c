@@ -0,0 +1,141 @@
+#include <limits.h>
+
+#include "camera.h"
+#include "profile.h"
+#include "log.h"
+
+/*
+ * Persist format and control enumeration per device so a restart can skip
+ * ENUM_FMT/QUERYCTRL/QUERYMENU. Devices are told apart by driver, card,
+ * bus_info and driver version from QUERYCAP, which stays cheap.
+ */
+
+#define PROFILE_DIR_NAME    "tiny_camera"
+
+static uint32_t profile_hash(struct v4l2_capability *cap)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    const uint8_t *fields[] = { cap->driver, cap->card, cap->bus_info };
+    size_t sizes[] = { sizeof(cap->driver), sizeof(cap->card), sizeof(cap->bus_info) };
+    size_t i, j;
+
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+        for (j = 0; j < sizes[i] && fields[i][j]; j++)
+            hash = (hash ^ fields[i][j]) * 16777619u;
+    return (hash ^ cap->version) * 16777619u;
+}
+
+static int make_dirs(char *path)
+{
+    char *p;
+
+    for (p = path + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(path, 0755) && errno != EEXIST) {
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+    }
+    return (mkdir(path, 0755) && errno != EEXIST) ? -1 : 0;
+}
+
+/* Default to $XDG_CACHE_HOME/tiny_camera or ~/.cache/tiny_camera. */
+static int profile_path(struct v4l2_camera *cam, const char *dir, char *path, size_t size, int create)
+{
+    char base[PATH_MAX];
+    const char *env;
+
+    if (dir) {
+        snprintf(base, sizeof(base), "%s", dir);
+    } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        snprintf(base, sizeof(base), "%s/%s", env, PROFILE_DIR_NAME);
+    } else if ((env = getenv("HOME")) && *env) {
+        snprintf(base, sizeof(base), "%s/.cache/%s", env, PROFILE_DIR_NAME);
+    } else {
+        LOGE(DUMP_NONE, "No cache directory\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (create && make_dirs(base)) {
+        LOGE(DUMP_ERROR, "Create %s failed\n", base);
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (snprintf(path, size, "%s/%08x.profile", base, profile_hash(&cam->cap)) >= size) {
+        LOGE(DUMP_NONE, "Profile path too long\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int profile_match(struct profile_file *file, struct v4l2_capability *cap)
+{
+    return file->magic == PROFILE_MAGIC && file->version == PROFILE_VERSION &&
+        !memcmp(file->driver, cap->driver, sizeof(file->driver)) &&
+        !memcmp(file->card, cap->card, sizeof(file->card)) &&
+        !memcmp(file->bus_info, cap->bus_info, sizeof(file->bus_info)) &&
+        file->driver_version == cap->version;
+}
+
+int profile_load(struct v4l2_camera *cam, const char *dir)
+{
+    struct profile_file file;
+    char path[PATH_MAX];
+    FILE *fp;
+    size_t n;
+
+    if (profile_path(cam, dir, path, sizeof(path), 0))
+        return CAMERA_RETURN_FAILURE;
+    fp = fopen(path, "rb");
+    if (!fp) {
+        LOGI("No profile cache %s\n", path);
+        return CAMERA_RETURN_FAILURE;
+    }
+    n = fread(&file, sizeof(file), 1, fp);
+    fclose(fp);
+    if (n != 1 || !profile_match(&file, &cam->cap)) {
+        LOGI("Stale profile cache %s\n", path);
+        return CAMERA_RETURN_FAILURE;
+    }
+    cam->profile = file.profile;
+    LOGI("Load profile %s: %d formats, %d controls\n", path,
+            cam->profile.format_count, cam->profile.control_count);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+int profile_save(struct v4l2_camera *cam, const char *dir)
+{
+    struct profile_file file;
+    char path[PATH_MAX], tmp[PATH_MAX + 4];
+    FILE *fp;
+    size_t n;
+
+    if (profile_path(cam, dir, path, sizeof(path), 1))
+        return CAMERA_RETURN_FAILURE;
+    ZAP(file);
+    file.magic = PROFILE_MAGIC;
+    file.version = PROFILE_VERSION;
+    memcpy(file.driver, cam->cap.driver, sizeof(file.driver));
+    memcpy(file.card, cam->cap.card, sizeof(file.card));
+    memcpy(file.bus_info, cam->cap.bus_info, sizeof(file.bus_info));
+    file.driver_version = cam->cap.version;
+    file.profile = cam->profile;
+
+    /* Write aside and rename, a concurrent start never sees a partial file. */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        LOGE(DUMP_ERROR, "Can't open %s\n", tmp);
+        return CAMERA_RETURN_FAILURE;
+    }
+    n = fwrite(&file, sizeof(file), 1, fp);
+    if (fclose(fp) || n != 1 || rename(tmp, path)) {
+        LOGE(DUMP_ERROR, "Save profile %s failed\n", path);
+        unlink(tmp);
+        return CAMERA_RETURN_FAILURE;
+    }
+    LOGI("Save profile %s\n", path);
+    return CAMERA_RETURN_SUCCESS;
+}
@@ -0,0 +1,485 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "camera.h"
+#include "publish.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Frames are copied once into a memfd backed ring, subscribers map the same
+ * memfd and read in place. Each slot carries a sequence counter which is odd
+ * while the publisher writes it, a reader validates it after use to detect a
+ * slot overwritten under its feet. Nobody ever waits for a slow subscriber.
+ *
+ * The ring is sealed against writable mappings and resizing once the
+ * publisher has mapped it, so a subscriber can't corrupt what others read
+ * or fault the publisher. Each subscriber writes its counters into a
+ * memfd of its own.
+ */
+
+#define PUBLISH_SEALS   (F_SEAL_FUTURE_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+static int make_address(const char *path, struct sockaddr_un *addr)
+{
+    ZAP(*addr);
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        LOGE(DUMP_NONE, "Socket path too long: %s\n", path);
+        return CAMERA_RETURN_FAILURE;
+    }
+    strcpy(addr->sun_path, path);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+struct publisher *publisher_create(const char *path, struct v4l2_pix_format *pix, size_t frame_size)
+{
+    struct publisher *pub = NULL;
+    struct sockaddr_un addr;
+    size_t slot_size, header_size;
+    int i;
+
+    if (make_address(path, &addr))
+        return NULL;
+    pub = calloc(1, sizeof(struct publisher));
+    if (!pub) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    pub->listen_fd = -1;
+    pub->memfd = -1;
+    for (i = 0; i < PUBLISH_MAX_SUBSCRIBER; i++)
+        pub->client_fd[i] = -1;
+
+    header_size = page_align(sizeof(struct publish_header));
+    slot_size = page_align(frame_size);
+    pub->map_size = header_size + slot_size * PUBLISH_SLOT_NUM;
+    pub->memfd = memfd_create("tiny_camera_frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (pub->memfd == -1) {
+        LOGE(DUMP_ERROR, "Create memfd failed\n");
+        goto err_destroy;
+    }
+    if (ftruncate(pub->memfd, pub->map_size)) {
+        LOGE(DUMP_ERROR, "Resize memfd failed\n");
+        goto err_destroy;
+    }
+    pub->hdr = mmap(NULL, pub->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, pub->memfd, 0);
+    if (pub->hdr == MAP_FAILED) {
+        pub->hdr = NULL;
+        LOGE(DUMP_ERROR, "Mmap memfd failed\n");
+        goto err_destroy;
+    }
+    if (fcntl(pub->memfd, F_ADD_SEALS, PUBLISH_SEALS)) {
+        LOGE(DUMP_ERROR, "Seal memfd failed\n");
+        goto err_destroy;
+    }
+    pub->data = (uint8_t *)pub->hdr + header_size;
+    pub->slot_size = slot_size;
+    pub->hdr->magic = PUBLISH_MAGIC;
+    pub->hdr->version = PUBLISH_VERSION;
+    pub->hdr->slot_count = PUBLISH_SLOT_NUM;
+    pub->hdr->slot_size = slot_size;
+    pub->hdr->data_offset = header_size;
+    pub->hdr->pix = *pix;
+
+    pub->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (pub->listen_fd == -1) {
+        LOGE(DUMP_ERROR, "Create socket failed\n");
+        goto err_destroy;
+    }
+    unlink(path);
+    if (bind(pub->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(pub->listen_fd, PUBLISH_MAX_SUBSCRIBER)) {
+        LOGE(DUMP_ERROR, "Listen on %s failed\n", path);
+        goto err_destroy;
+    }
+    pub->path = strdup(path);
+    LOGI("Publish frames on %s, %d slots of %zu bytes\n", path, PUBLISH_SLOT_NUM, slot_size);
+    return pub;
+
+err_destroy:
+    publisher_destroy(pub);
+    return NULL;
+}
+
+static struct publish_subscriber_stat *create_stat(int *memfd)
+{
+    struct publish_subscriber_stat *stat;
+    size_t size = page_align(sizeof(*stat));
+
+    *memfd = memfd_create("tiny_camera_subscriber", MFD_CLOEXEC);
+    if (*memfd == -1 || ftruncate(*memfd, size)) {
+        LOGE(DUMP_ERROR, "Create subscriber memfd failed\n");
+        goto err_close;
+    }
+    stat = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *memfd, 0);
+    if (stat == MAP_FAILED) {
+        LOGE(DUMP_ERROR, "Mmap subscriber memfd failed\n");
+        goto err_close;
+    }
+    return stat;
+
+err_close:
+    if (*memfd != -1)
+        close(*memfd);
+    *memfd = -1;
+    return NULL;
+}
+
+static void accept_subscriber(struct publisher *pub, int fd)
+{
+    struct publish_subscriber_stat *stat;
+    struct publish_hello hello;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    int i, fds[2];
+
+    for (i = 0; i < PUBLISH_MAX_SUBSCRIBER; i++)
+        if (pub->client_fd[i] == -1)
+            break;
+    if (i == PUBLISH_MAX_SUBSCRIBER) {
+        LOGE(DUMP_NONE, "Too many subscribers\n");
+        close(fd);
+        return;
+    }
+    stat = create_stat(&fds[1]);
+    if (!stat) {
+        close(fd);
+        return;
+    }
+    fds[0] = pub->memfd;
+
+    ZAP(hello);
+    hello.magic = PUBLISH_MAGIC;
+    hello.index = i;
+    hello.map_size = pub->map_size;
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    ZAP(msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+        stat->pid = cred.pid;
+    stat->last_frame = pub->frame;
+    __atomic_store_n(&stat->active, 1, __ATOMIC_RELEASE);
+    /* The subscriber has its own reference once sent. */
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+        LOGE(DUMP_ERROR, "Send memfd failed\n");
+        munmap(stat, page_align(sizeof(*stat)));
+        close(fds[1]);
+        close(fd);
+        return;
+    }
+    close(fds[1]);
+    pub->client_fd[i] = fd;
+    pub->stat[i] = stat;
+    LOGI("Subscriber %d connected, pid %u\n", i, stat->pid);
+}
+
+static void drop_subscriber(struct publisher *pub, int i)
+{
+    struct publish_subscriber_stat *stat = pub->stat[i];
+
+    LOGI("Subscriber %d disconnected: frames %llu, drops %llu\n", i,
+            (unsigned long long)stat->frames, (unsigned long long)stat->drops);
+    close(pub->client_fd[i]);
+    pub->client_fd[i] = -1;
+    munmap(stat, page_align(sizeof(*stat)));
+    pub->stat[i] = NULL;
+}
+
+void publisher_poll(struct publisher *pub)
+{
+    char c;
+    int fd, i;
+    ssize_t ret;
+
+    while ((fd = accept4(pub->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+        accept_subscriber(pub, fd);
+    for (i = 0; i < PUBLISH_MAX_SUBSCRIBER; i++) {
+        if (pub->client_fd[i] == -1)
+            continue;
+        /* Subscribers never talk, readable means hang up. */
+        ret = recv(pub->client_fd[i], &c, 1, MSG_DONTWAIT);
+        if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            drop_subscriber(pub, i);
+    }
+}
+
+int publisher_publish(struct publisher *pub, struct v4l2_buffer *buffer_info, struct buffer buffer)
+{
+    struct publish_header *hdr = pub->hdr;
+    struct publish_slot *slot;
+    uint64_t frame = pub->frame + 1;
+    uint32_t index = frame % PUBLISH_SLOT_NUM;
+    char wakeup = 0;
+    int i;
+
+    if (buffer.size > pub->slot_size) {
+        LOGE(DUMP_NONE, "Frame size %zu exceeds slot size %zu\n", buffer.size, pub->slot_size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    slot = &hdr->slot[index];
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(pub->data + (size_t)index * pub->slot_size, buffer.addr, buffer.size);
+    slot->frame = frame;
+    slot->sequence = buffer_info->sequence;
+    slot->tv_sec = buffer_info->timestamp.tv_sec;
+    slot->tv_usec = buffer_info->timestamp.tv_usec;
+    slot->bytesused = buffer.size;
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->frame, frame, __ATOMIC_RELEASE);
+    pub->frame = frame;
+
+    /*
+     * One byte per frame wakes subscribers up, what was published is read from
+     * the header. A full socket just means it already has a pending wakeup.
+     */
+    for (i = 0; i < PUBLISH_MAX_SUBSCRIBER; i++)
+        if (pub->client_fd[i] != -1)
+            send(pub->client_fd[i], &wakeup, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+void publisher_dump_stats(struct publisher *pub)
+{
+    uint64_t frame = pub->frame;
+    int i;
+
+    LOGI("Published frames: %llu\n", (unsigned long long)frame);
+    for (i = 0; i < PUBLISH_MAX_SUBSCRIBER; i++) {
+        struct publish_subscriber_stat *stat = pub->stat[i];
+        if (!stat)
+            continue;
+        LOGI("\tsubscriber %d pid %u: frames %llu, drops %llu, lag %llu\n", i, stat->pid,
+                (unsigned long long)stat->frames, (unsigned long long)stat->drops,
+                (unsigned long long)(frame - stat->last_frame));
+    }
+}
+
+void publisher_destroy(struct publisher *pub)
+{
+    int i;
+
+    if (!pub)
+        return;
+    for (i = 0; i < PUBLISH_MAX_SUBSCRIBER; i++)
+        if (pub->client_fd[i] != -1)
+            drop_subscriber(pub, i);
+    if (pub->listen_fd != -1)
+        close(pub->listen_fd);
+    if (pub->path) {
+        unlink(pub->path);
+        free(pub->path);
+    }
+    if (pub->hdr)
+        munmap(pub->hdr, pub->map_size);
+    if (pub->memfd != -1)
+        close(pub->memfd);
+    free(pub);
+}
+
+struct subscriber *subscriber_connect(const char *path)
+{
+    struct subscriber *sub = NULL;
+    struct sockaddr_un addr;
+    struct publish_hello hello;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    int fds[2] = { -1, -1 }, n = 0, i;
+    void *map;
+
+    if (make_address(path, &addr))
+        return NULL;
+    sub = calloc(1, sizeof(struct subscriber));
+    if (!sub) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    sub->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sub->fd == -1 || connect(sub->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        LOGE(DUMP_ERROR, "Connect to %s failed\n", path);
+        goto err_free;
+    }
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    ZAP(msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    /* Take every fd first, so none leaks whatever is wrong with the hello. */
+    if (recvmsg(sub->fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello))
+        goto err_handshake;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        for (i = 0; (size_t)i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (n < 2)
+                fds[n++] = fd;
+            else
+                close(fd);
+        }
+    }
+    if (hello.magic != PUBLISH_MAGIC || n != 2 || hello.index >= PUBLISH_MAX_SUBSCRIBER ||
+            hello.map_size < sizeof(struct publish_header) ||
+            fstat(fds[0], &st) || (uint64_t)st.st_size < hello.map_size)
+        goto err_handshake;
+
+    sub->map_size = hello.map_size;
+    map = mmap(NULL, sub->map_size, PROT_READ, MAP_SHARED, fds[0], 0);
+    if (map == MAP_FAILED) {
+        LOGE(DUMP_ERROR, "Mmap memfd failed\n");
+        goto err_close;
+    }
+    sub->hdr = map;
+    map = mmap(NULL, page_align(sizeof(*sub->stat)), PROT_READ | PROT_WRITE, MAP_SHARED, fds[1], 0);
+    if (map == MAP_FAILED) {
+        LOGE(DUMP_ERROR, "Mmap subscriber memfd failed\n");
+        goto err_close;
+    }
+    sub->stat = map;
+    close(fds[0]);
+    close(fds[1]);
+    fds[0] = fds[1] = -1;
+
+    if (sub->hdr->magic != PUBLISH_MAGIC || sub->hdr->version != PUBLISH_VERSION) {
+        LOGE(DUMP_NONE, "Unsupported publish version %u\n", sub->hdr->version);
+        goto err_free;
+    }
+    /* Copy the geometry once, the checks below must hold for as long as it is used. */
+    sub->slot_count = sub->hdr->slot_count;
+    sub->slot_size = sub->hdr->slot_size;
+    if (sub->slot_count == 0 || sub->slot_count > PUBLISH_SLOT_NUM || sub->slot_size != sub->hdr->slot_size ||
+            sub->hdr->data_offset < sizeof(struct publish_header) || sub->hdr->data_offset > sub->map_size ||
+            (sub->slot_size && sub->slot_count > (sub->map_size - sub->hdr->data_offset) / sub->slot_size)) {
+        LOGE(DUMP_NONE, "Bad ring geometry from %s\n", path);
+        goto err_free;
+    }
+    sub->data = (const uint8_t *)sub->hdr + sub->hdr->data_offset;
+    sub->index = hello.index;
+    return sub;
+
+err_handshake:
+    LOGE(DUMP_NONE, "Bad handshake from %s\n", path);
+err_close:
+    if (fds[0] != -1)
+        close(fds[0]);
+    if (fds[1] != -1)
+        close(fds[1]);
+err_free:
+    subscriber_disconnect(sub);
+    return NULL;
+}
+
+int subscriber_wait(struct subscriber *sub, int timeout_ms)
+{
+    struct pollfd pfd = { sub->fd, POLLIN, 0 };
+    char wakeup[64];
+    uint64_t latest;
+    int ret;
+
+    latest = __atomic_load_n(&sub->hdr->frame, __ATOMIC_ACQUIRE);
+    if (latest && latest >= sub->next_frame)
+        return CAMERA_RETURN_SUCCESS;
+    ret = poll(&pfd, 1, timeout_ms);
+    if (ret == 0)
+        return -EAGAIN;
+    if (ret < 0)
+        return (errno == EINTR) ? -EAGAIN : CAMERA_RETURN_FAILURE;
+    /* Drain the wakeups, several frames may have been published since. */
+    if (recv(sub->fd, wakeup, sizeof(wakeup), MSG_DONTWAIT) == 0) {
+        LOGI("Publisher closed\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+int subscriber_acquire(struct subscriber *sub, struct publish_frame *frame)
+{
+    const struct publish_header *hdr = sub->hdr;
+    struct publish_subscriber_stat *stat = sub->stat;
+    const struct publish_slot *slot;
+    uint64_t latest, oldest;
+    uint32_t index, seq;
+
+    latest = __atomic_load_n(&hdr->frame, __ATOMIC_ACQUIRE);
+    if (!latest)
+        return -EAGAIN;
+    if (!sub->next_frame)
+        sub->next_frame = latest;
+    if (latest < sub->next_frame)
+        return -EAGAIN;
+    /* The slot after the latest one may be under write already. */
+    oldest = (latest + 2 > sub->slot_count) ? latest + 2 - sub->slot_count : 1;
+    if (sub->next_frame < oldest) {
+        stat->drops += oldest - sub->next_frame;
+        sub->next_frame = oldest;
+    }
+    index = sub->next_frame % sub->slot_count;
+    slot = &hdr->slot[index];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || __atomic_load_n(&slot->frame, __ATOMIC_RELAXED) != sub->next_frame)
+        return -EAGAIN;
+
+    frame->frame = sub->next_frame;
+    frame->slot = index;
+    frame->seq = seq;
+    frame->sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    frame->timestamp.tv_sec = __atomic_load_n(&slot->tv_sec, __ATOMIC_RELAXED);
+    frame->timestamp.tv_usec = __atomic_load_n(&slot->tv_usec, __ATOMIC_RELAXED);
+    frame->buffer.addr = (void *)(sub->data + (size_t)index * sub->slot_size);
+    frame->buffer.size = __atomic_load_n(&slot->bytesused, __ATOMIC_RELAXED);
+    if (frame->buffer.size > sub->slot_size)
+        return -EAGAIN;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+int subscriber_release(struct subscriber *sub, struct publish_frame *frame)
+{
+    struct publish_subscriber_stat *stat = sub->stat;
+    int valid;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    valid = __atomic_load_n(&sub->hdr->slot[frame->slot].seq, __ATOMIC_RELAXED) == frame->seq;
+    if (valid)
+        stat->frames++;
+    else
+        stat->drops++;
+    stat->last_frame = frame->frame;
+    sub->next_frame = frame->frame + 1;
+    return valid ? CAMERA_RETURN_SUCCESS : CAMERA_RETURN_FAILURE;
+}
+
+void subscriber_disconnect(struct subscriber *sub)
+{
+    if (!sub)
+        return;
+    if (sub->hdr)
+        munmap((void *)sub->hdr, sub->map_size);
+    if (sub->stat)
+        munmap(sub->stat, page_align(sizeof(*sub->stat)));
+    if (sub->fd != -1)
+        close(sub->fd);
+    free(sub);
+}
@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include "camera.h"
+#include "record.h"
+#include "lossless.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Raw recording with fixed size records. The whole file is reserved with
+ * fallocate up front so writing a frame never waits for block allocation,
+ * and every frame sits at a page aligned offset for mmap replay. Lossless
+ * recordings compress on worker threads and append, see record.h.
+ */
+
+static int write_header(struct recorder *rec)
+{
+    struct record_header hdr = rec->hdr;
+
+    if (pwrite(rec->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        LOGE(DUMP_ERROR, "Write record header failed\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int write_frame(struct recorder *rec, uint32_t n, struct v4l2_buffer *buffer_info,
+        const void *data, uint32_t size, uint32_t bytesused, uint32_t codec, uint64_t offset)
+{
+    struct record_frame frame;
+
+    ZAP(frame);
+    frame.tv_sec = buffer_info->timestamp.tv_sec;
+    frame.tv_usec = buffer_info->timestamp.tv_usec;
+    frame.sequence = buffer_info->sequence;
+    frame.bytesused = bytesused;
+    frame.flags = buffer_info->flags;
+    frame.field = buffer_info->field;
+    frame.offset = offset;
+    frame.size = size;
+    frame.codec = codec;
+    if (pwrite(rec->fd, data, size, offset) != size ||
+            pwrite(rec->fd, &frame, sizeof(frame), rec->hdr.index_offset + sizeof(frame) * n) != sizeof(frame)) {
+        LOGE(DUMP_ERROR, "Write frame %u failed\n", n);
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static void compress_task(struct worker_task *task)
+{
+    struct recorder *rec = task->ctx;
+    struct v4l2_pix_format *pix = &rec->hdr.fmt.fmt.pix;
+    size_t stride = pix->bytesperline ? pix->bytesperline : pix->width * 2, size;
+    uint8_t *out = frame_pool_get(rec->out_pool);
+    const void *data = out;
+    uint32_t codec = RECORD_CODEC_LOSSLESS;
+    struct time_recorder tr;
+    uint64_t offset;
+
+    time_recorder_start(&tr);
+    if (!out || lossless_encode_yuyv(task->buffer.addr, pix->width, pix->height, stride,
+                out, task->buffer.size, &size) || size >= task->buffer.size) {
+        data = task->buffer.addr;
+        size = task->buffer.size;
+        codec = RECORD_CODEC_RAW;
+    }
+    time_recorder_end(&tr);
+    time_recorder_print_time(&tr, "Compress frame");
+    offset = __atomic_fetch_add(&rec->cursor, size, __ATOMIC_RELAXED);
+    if (write_frame(rec, task->arg, &task->info, data, size, task->buffer.size, codec, offset)) {
+        /* Give the space back unless a later frame was appended behind it already. */
+        size += offset;
+        __atomic_compare_exchange_n(&rec->cursor, &size, offset, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&rec->failed, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&rec->raw_bytes, task->buffer.size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&rec->stored_bytes, size, __ATOMIC_RELAXED);
+    }
+    frame_pool_put(rec->out_pool, out);
+    frame_pool_put(rec->pool, task->buffer.addr);
+}
+
+static int start_workers(struct recorder *rec, struct recorder_options *opts)
+{
+    if (rec->hdr.fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV) {
+        LOGE(DUMP_NONE, "Lossless recording needs YUYV\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    /* Every worker busy, a full queue and the frame being copied. Recording sized frames aren't cached. */
+    rec->pool = frame_pool_create(rec->hdr.record_size, opts->threads * 3 + 1, 0, 0);
+    rec->out_pool = frame_pool_create(rec->hdr.record_size, opts->threads, 0, 0);
+    if (!rec->pool || !rec->out_pool)
+        return CAMERA_RETURN_FAILURE;
+    rec->workers = worker_pool_create("rec-writer", opts->threads, opts->threads * 2, opts->rt, RT_ROLE_WORKER);
+    return rec->workers ? CAMERA_RETURN_SUCCESS : CAMERA_RETURN_FAILURE;
+}
+
+struct recorder *recorder_create(const char *path, struct v4l2_format *fmt, size_t frame_size, uint32_t capacity,
+        struct recorder_options *opts)
+{
+    struct recorder *rec = NULL;
+    uint64_t total;
+
+    rec = calloc(1, sizeof(struct recorder));
+    if (!rec) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    rec->hdr = (struct record_header) {
+        .magic          = RECORD_MAGIC,
+        .version        = RECORD_VERSION,
+        .frame_capacity = capacity,
+        .record_size    = page_align(frame_size),
+        .index_offset   = page_align(sizeof(struct record_header)),
+        .codec          = opts ? opts->codec : RECORD_CODEC_RAW,
+        .fmt            = *fmt,
+    };
+    rec->hdr.data_offset = rec->hdr.index_offset + page_align((size_t)capacity * sizeof(struct record_frame));
+    rec->cursor = rec->hdr.data_offset;
+    /* Compressed frames can't outgrow raw ones, so the same worst case holds. */
+    total = rec->hdr.data_offset + rec->hdr.record_size * capacity;
+
+    rec->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rec->fd == -1) {
+        LOGE(DUMP_ERROR, "Cannot open '%s'\n", path);
+        free(rec);
+        return NULL;
+    }
+    if (fallocate(rec->fd, 0, 0, total)) {
+        /* Not every filesystem supports it, recording still works without. */
+        LOGE(DUMP_ERROR, "Preallocate %llu bytes failed\n", (unsigned long long)total);
+    }
+    if (write_header(rec) || (rec->hdr.codec != RECORD_CODEC_RAW && start_workers(rec, opts))) {
+        recorder_close(rec);
+        return NULL;
+    }
+    LOGI("Record to %s, %u frames of %llu bytes%s\n", path, capacity, (unsigned long long)rec->hdr.record_size,
+            rec->hdr.codec == RECORD_CODEC_LOSSLESS ? ", lossless" : "");
+    return rec;
+}
+
+int recorder_write(struct recorder *rec, struct v4l2_buffer *buffer_info, struct buffer buffer)
+{
+    struct worker_task task;
+    uint32_t n = rec->hdr.frame_count;
+
+    if (n >= rec->hdr.frame_capacity) {
+        LOGE(DUMP_NONE, "Recording is full\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (buffer.size > rec->hdr.record_size) {
+        LOGE(DUMP_NONE, "Frame size %zu exceeds record size\n", buffer.size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (rec->hdr.codec == RECORD_CODEC_RAW) {
+        if (write_frame(rec, n, buffer_info, buffer.addr, buffer.size, buffer.size, RECORD_CODEC_RAW,
+                    rec->hdr.data_offset + rec->hdr.record_size * n))
+            return CAMERA_RETURN_FAILURE;
+        rec->hdr.frame_count++;
+        return CAMERA_RETURN_SUCCESS;
+    }
+
+    /* The capture buffer goes back to the driver, the worker owns a copy. */
+    ZAP(task);
+    task.func = compress_task;
+    task.ctx = rec;
+    task.buffer.addr = frame_pool_get(rec->pool);
+    task.buffer.size = buffer.size;
+    task.info = *buffer_info;
+    task.arg = n;
+    if (!task.buffer.addr)
+        return CAMERA_RETURN_FAILURE;
+    memcpy(task.buffer.addr, buffer.addr, buffer.size);
+    worker_pool_submit(rec->workers, &task);
+    rec->hdr.frame_count++;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Frames whose write failed left a zeroed index slot, which replay rejects. Close the gaps. */
+static void compact_index(struct recorder *rec)
+{
+    size_t size = sizeof(struct record_frame) * rec->hdr.frame_count;
+    struct record_frame *index;
+    uint32_t i, n = 0;
+
+    LOGE(DUMP_NONE, "Lost %u of %u frames to write errors\n", rec->failed, rec->hdr.frame_count);
+    index = malloc(size);
+    if (!index || pread(rec->fd, index, size, rec->hdr.index_offset) != (ssize_t)size) {
+        LOGE(DUMP_ERROR, "Read recording index failed\n");
+        free(index);
+        return;
+    }
+    for (i = 0; i < rec->hdr.frame_count; i++)
+        if (index[i].offset >= rec->hdr.data_offset)
+            index[n++] = index[i];
+    if (pwrite(rec->fd, index, sizeof(struct record_frame) * n, rec->hdr.index_offset) !=
+            (ssize_t)(sizeof(struct record_frame) * n))
+        LOGE(DUMP_ERROR, "Write recording index failed\n");
+    else
+        rec->hdr.frame_count = n;
+    free(index);
+}
+
+/* Fails if any frame was lost to a write error, the recording still holds the rest. */
+int recorder_close(struct recorder *rec)
+{
+    uint64_t end;
+    int ret;
+
+    if (!rec)
+        return CAMERA_RETURN_SUCCESS;
+    /* Finishes every queued frame first. */
+    worker_pool_destroy(rec->workers);
+    frame_pool_destroy(rec->out_pool);
+    frame_pool_destroy(rec->pool);
+    if (rec->failed)
+        compact_index(rec);
+    if (rec->hdr.codec == RECORD_CODEC_RAW)
+        end = rec->hdr.data_offset + rec->hdr.record_size * rec->hdr.frame_count;
+    else
+        end = rec->cursor;
+    /* Give back the space reserved for frames never captured or compressed away. */
+    if (ftruncate(rec->fd, end))
+        LOGE(DUMP_ERROR, "Truncate recording failed\n");
+    rec->hdr.flags |= RECORD_FLAG_CLOSED;
+    write_header(rec);
+    LOGI("Recorded %u frames\n", rec->hdr.frame_count);
+    if (rec->stored_bytes)
+        LOGI("Stored %llu of %llu bytes, ratio %.2f\n", (unsigned long long)rec->stored_bytes,
+                (unsigned long long)rec->raw_bytes, (double)rec->raw_bytes / rec->stored_bytes);
+    close(rec->fd);
+    ret = rec->failed ? CAMERA_RETURN_FAILURE : CAMERA_RETURN_SUCCESS;
+    free(rec);
+    return ret;
+}
@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "camera.h"
+#include "record.h"
+#include "lossless.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Replay a recording through the regular camera API. The file is mapped
+ * once, dequeue hands out pointers into the mapping and sleeps until the
+ * frame is due according to its original timestamp scaled by replay_speed.
+ * Compressed frames are decoded into private buffers instead. A timerfd
+ * armed for the next due frame stands in for the device fd in poll loops.
+ */
+
+struct replay {
+    int                     fd;
+    int                     timer_fd;       /* Expires when the next frame is due */
+    uint8_t                 *map;
+    size_t                  map_size;
+    struct record_header    *hdr;
+    struct record_frame     *index;
+    struct record_header    header;         /* Private copy hdr points to */
+    struct record_frame     *converted;     /* index of an older version */
+    uint32_t                next;           /* Next frame to hand out */
+    uint32_t                queued;         /* Bitmask of buffers owned by the "driver" */
+    uint8_t                 *decode;        /* One record_size buffer per queue slot */
+    struct timespec         start;          /* Monotonic time of stream on */
+};
+
+/* Version 1, raw only, before the codec and the frame offsets. */
+struct record_header_v1 {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            frame_count;
+    uint32_t            frame_capacity;
+    uint64_t            record_size;
+    uint64_t            index_offset;
+    uint64_t            data_offset;
+    struct v4l2_format  fmt;
+};
+
+struct record_frame_v1 {
+    int64_t             tv_sec;
+    int64_t             tv_usec;
+    uint32_t            sequence;
+    uint32_t            bytesused;
+    uint32_t            flags;
+    uint32_t            field;
+};
+
+int replay_probe(const char *path)
+{
+    struct stat st;
+
+    return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+static struct replay *to_replay(struct v4l2_camera *cam)
+{
+    return (struct replay *)cam->source;
+}
+
+static void prefetch(struct replay *rp, uint32_t first, uint32_t count)
+{
+    uint64_t start, end, page = sysconf(_SC_PAGESIZE);
+
+    if (first >= rp->hdr->frame_count)
+        return;
+    if (first + count > rp->hdr->frame_count)
+        count = rp->hdr->frame_count - first;
+    start = rp->index[first].offset;
+    end = rp->index[first + count - 1].offset + rp->index[first + count - 1].size;
+    /* Compressed frames are appended out of order, skip windows that aren't contiguous. */
+    start &= ~(page - 1);
+    if (end > start)
+        madvise(rp->map + start, end - start, MADV_WILLNEED);
+}
+
+static int valid_frame(struct replay *rp, const struct record_frame *frame)
+{
+    return frame->offset >= rp->hdr->data_offset && frame->offset <= rp->map_size &&
+            frame->size <= rp->map_size - frame->offset &&
+            frame->bytesused <= rp->hdr->record_size && frame->codec <= RECORD_CODEC_LOSSLESS &&
+            (frame->codec == RECORD_CODEC_RAW || rp->hdr->codec != RECORD_CODEC_RAW) &&
+            (frame->codec != RECORD_CODEC_RAW || frame->size >= frame->bytesused);
+}
+
+static int valid_index(struct replay *rp)
+{
+    uint32_t i;
+
+    for (i = 0; i < rp->hdr->frame_count; i++)
+        if (!valid_frame(rp, &rp->index[i]))
+            return 0;
+    return 1;
+}
+
+/*
+ * The recorder died before writing frame_count. Frames are written before
+ * their index entry and unwritten entries are zero, so the frames up to
+ * the first entry missing are all there. Compressed frames finish out of
+ * order, any written after that gap are lost.
+ */
+static void recover_frame_count(struct replay *rp)
+{
+    uint32_t n = rp->hdr->frame_count, max = rp->hdr->frame_capacity;
+
+    if (max > (rp->map_size - rp->hdr->index_offset) / sizeof(struct record_frame))
+        max = (rp->map_size - rp->hdr->index_offset) / sizeof(struct record_frame);
+    while (n < max && rp->index[n].size && valid_frame(rp, &rp->index[n]))
+        n++;
+    LOGI("Recording was not closed, recovered %u frames\n", n);
+    rp->header.frame_count = n;
+}
+
+/* Decoded frames are written stride * height into a record_size slot, the header must agree. */
+static int valid_geometry(struct replay *rp)
+{
+    struct v4l2_pix_format *pix = &rp->hdr->fmt.fmt.pix;
+    uint64_t line = (uint64_t)pix->width * 2, stride = pix->bytesperline ? pix->bytesperline : line;
+
+    if (rp->hdr->codec == RECORD_CODEC_RAW)
+        return 1;
+    return pix->width && pix->height && stride >= line && stride * pix->height <= rp->hdr->record_size;
+}
+
+/* Builds the current header and index for a version 1 recording, the rest of replay reads only those. */
+static int convert_v1(struct replay *rp)
+{
+    const struct record_header_v1 *v1 = (const struct record_header_v1 *)rp->map;
+    const struct record_frame_v1 *frame;
+    uint32_t i;
+
+    if (v1->index_offset > rp->map_size || v1->data_offset > rp->map_size ||
+            v1->frame_count > (rp->map_size - v1->index_offset) / sizeof(*frame) ||
+            (v1->record_size && v1->frame_count > (rp->map_size - v1->data_offset) / v1->record_size))
+        return CAMERA_RETURN_FAILURE;
+    rp->converted = calloc(v1->frame_count ? v1->frame_count : 1, sizeof(struct record_frame));
+    if (!rp->converted) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    rp->header = (struct record_header) {
+        .magic          = v1->magic,
+        .version        = v1->version,
+        .frame_count    = v1->frame_count,
+        .frame_capacity = v1->frame_capacity,
+        .record_size    = v1->record_size,
+        .index_offset   = v1->index_offset,
+        .data_offset    = v1->data_offset,
+        .codec          = RECORD_CODEC_RAW,
+        .fmt            = v1->fmt,
+    };
+    frame = (const struct record_frame_v1 *)(rp->map + v1->index_offset);
+    for (i = 0; i < v1->frame_count; i++) {
+        rp->converted[i] = (struct record_frame) {
+            .tv_sec     = frame[i].tv_sec,
+            .tv_usec    = frame[i].tv_usec,
+            .sequence   = frame[i].sequence,
+            .bytesused  = frame[i].bytesused,
+            .flags      = frame[i].flags,
+            .field      = frame[i].field,
+            .offset     = v1->data_offset + v1->record_size * i,
+            .size       = v1->record_size,
+            .codec      = RECORD_CODEC_RAW,
+        };
+    }
+    rp->index = rp->converted;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int valid_header(struct replay *rp)
+{
+    rp->header = *(struct record_header *)rp->map;
+    rp->hdr = &rp->header;
+    if (rp->hdr->magic != RECORD_MAGIC)
+        return 0;
+    if (rp->hdr->version == 1)
+        return convert_v1(rp) == CAMERA_RETURN_SUCCESS;
+    rp->index = (struct record_frame *)(rp->map + rp->hdr->index_offset);
+    if (rp->hdr->version != RECORD_VERSION || rp->hdr->index_offset > rp->map_size ||
+            rp->hdr->frame_count > (rp->map_size - rp->hdr->index_offset) / sizeof(struct record_frame))
+        return 0;
+    if (!(rp->hdr->flags & RECORD_FLAG_CLOSED))
+        recover_frame_count(rp);
+    return 1;
+}
+
+static int replay_open_device(struct v4l2_camera *cam)
+{
+    struct replay *rp;
+    struct stat st;
+
+    LOGI("Open recording %s\n", cam->dev_name);
+    rp = calloc(1, sizeof(struct replay));
+    if (!rp) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    rp->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    rp->fd = open(cam->dev_name, O_RDONLY | O_CLOEXEC);
+    if (rp->fd == -1 || fstat(rp->fd, &st)) {
+        LOGE(DUMP_ERROR, "Cannot open '%s'\n", cam->dev_name);
+        goto err_free;
+    }
+    if (rp->timer_fd == -1) {
+        LOGE(DUMP_ERROR, "Create timer failed\n");
+        goto err_free;
+    }
+    if (st.st_size < sizeof(struct record_header)) {
+        LOGE(DUMP_NONE, "%s is not a recording\n", cam->dev_name);
+        goto err_free;
+    }
+    rp->map_size = st.st_size;
+    rp->map = mmap(NULL, rp->map_size, PROT_READ, MAP_SHARED, rp->fd, 0);
+    if (rp->map == MAP_FAILED) {
+        LOGE(DUMP_ERROR, "Mmap recording failed\n");
+        goto err_free;
+    }
+    if (!valid_header(rp) || !valid_geometry(rp) || !valid_index(rp)) {
+        LOGE(DUMP_NONE, "%s is not a valid recording\n", cam->dev_name);
+        munmap(rp->map, rp->map_size);
+        goto err_free;
+    }
+    madvise(rp->map, rp->map_size, MADV_SEQUENTIAL);
+    cam->fd = rp->fd;
+    cam->source = rp;
+    return CAMERA_RETURN_SUCCESS;
+
+err_free:
+    if (rp->fd != -1)
+        close(rp->fd);
+    if (rp->timer_fd != -1)
+        close(rp->timer_fd);
+    free(rp->converted);
+    free(rp);
+    return CAMERA_RETURN_FAILURE;
+}
+
+static void replay_close_device(struct v4l2_camera *cam)
+{
+    struct replay *rp = to_replay(cam);
+
+    LOGI("Close recording\n");
+    munmap(rp->map, rp->map_size);
+    close(rp->fd);
+    close(rp->timer_fd);
+    free(rp->converted);
+    free(rp);
+    cam->source = NULL;
+    cam->fd = -1;
+}
+
+static int replay_query_cap(struct v4l2_camera *cam)
+{
+    ZAP(cam->cap);
+    snprintf((char *)cam->cap.driver, sizeof(cam->cap.driver), "replay");
+    snprintf((char *)cam->cap.card, sizeof(cam->cap.card), "%s", cam->dev_name);
+    snprintf((char *)cam->cap.bus_info, sizeof(cam->cap.bus_info), "file:%s", cam->dev_name);
+    cam->cap.capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+    cam->cap.device_caps = cam->cap.capabilities;
+    LOGD("Replay %u frames\n", to_replay(cam)->hdr->frame_count);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static void replay_query_support_control(struct v4l2_camera *cam)
+{
+    cam->profile.control_count = 0;
+    LOGD("Replay has no control\n");
+}
+
+static void replay_query_support_format(struct v4l2_camera *cam)
+{
+    struct v4l2_fmtdesc *fmtdesc = &cam->profile.format[0];
+    uint32_t pixelformat = to_replay(cam)->hdr->fmt.fmt.pix.pixelformat;
+
+    ZAP(*fmtdesc);
+    fmtdesc->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmtdesc->pixelformat = pixelformat;
+    snprintf((char *)fmtdesc->description, sizeof(fmtdesc->description), "%s", fmt2desc(pixelformat));
+    cam->profile.format_count = 1;
+    LOGD("Support pixel format[0]: %s\n", fmtdesc->description);
+}
+
+static int replay_get_output_format(struct v4l2_camera *cam)
+{
+    cam->fmt = to_replay(cam)->hdr->fmt;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int replay_set_output_format(struct v4l2_camera *cam)
+{
+    struct v4l2_pix_format *pix = &to_replay(cam)->hdr->fmt.fmt.pix;
+
+    /* Like S_FMT the "driver" adjusts the request, here to what was recorded. */
+    if (cam->fmt.fmt.pix.width != pix->width || cam->fmt.fmt.pix.height != pix->height ||
+            cam->fmt.fmt.pix.pixelformat != pix->pixelformat)
+        LOGI("Use recorded format %ux%u %s\n", pix->width, pix->height, fmt2desc(pix->pixelformat));
+    cam->fmt = to_replay(cam)->hdr->fmt;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int replay_request_and_map_buffer(struct v4l2_camera *cam)
+{
+    struct replay *rp = to_replay(cam);
+    int i;
+
+    LOGI("Request and map buffer\n");
+    cam->bufq.buf = calloc(MAX_BUFFER_NUM, sizeof(struct buffer));
+    if (!cam->bufq.buf) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    cam->bufq.count = MAX_BUFFER_NUM;
+    for (i = 0; i < cam->bufq.count; i++)
+        cam->bufq.buf[i].size = rp->hdr->record_size;
+    if (rp->hdr->codec != RECORD_CODEC_RAW) {
+        rp->decode = malloc(rp->hdr->record_size * cam->bufq.count);
+        if (!rp->decode) {
+            LOGE(DUMP_NONE, "Out of memory\n");
+            free(cam->bufq.buf);
+            cam->bufq.buf = NULL;
+            return CAMERA_RETURN_FAILURE;
+        }
+    }
+    LOGI("Buffer count: %d\n", cam->bufq.count);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static void replay_return_and_unmap_buffer(struct v4l2_camera *cam)
+{
+    struct replay *rp = to_replay(cam);
+
+    LOGI("Return and unmap buffer\n");
+    free(rp->decode);
+    rp->decode = NULL;
+    free(cam->bufq.buf);
+    cam->bufq.buf = NULL;
+    cam->bufq.count = 0;
+}
+
+static void arm_timer(struct v4l2_camera *cam, struct replay *rp);
+
+/* Injected faults fail the way the V4L2 backend fails for the same errno. */
+static int replay_fault(unsigned int request)
+{
+    int error = fault_inject(request);
+
+    if (!error)
+        return CAMERA_RETURN_SUCCESS;
+    if (request != VIDIOC_DQBUF)
+        return CAMERA_RETURN_FAILURE;
+    switch (error) {
+        case EAGAIN:
+            return -EAGAIN;
+        case ENODEV:
+        case ENXIO:
+            return -ENODEV;
+    }
+    return -EIO;
+}
+
+static int replay_start_capturing(struct v4l2_camera *cam)
+{
+    struct replay *rp = to_replay(cam);
+
+    if (fault_on() && replay_fault(VIDIOC_STREAMON)) {
+        LOGE(DUMP_NONE, "Stream on failed\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    LOGI("Stream on\n");
+    rp->next = 0;
+    rp->queued = (1u << cam->bufq.count) - 1;
+    clock_gettime(CLOCK_MONOTONIC, &rp->start);
+    arm_timer(cam, rp);
+    prefetch(rp, 0, RECORD_PREFETCH);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static void replay_stop_capturing(struct v4l2_camera *cam)
+{
+    struct itimerspec its;
+
+    if (fault_on())
+        replay_fault(VIDIOC_STREAMOFF);
+    LOGI("Strem off\n");
+    ZAP(its);
+    timerfd_settime(to_replay(cam)->timer_fd, 0, &its, NULL);
+}
+
+/* Monotonic time frame n is due, relative to the first frame of the recording. */
+static void replay_due(struct v4l2_camera *cam, struct replay *rp, uint32_t n, struct timespec *due)
+{
+    struct record_frame *first = &rp->index[0], *frame = &rp->index[n];
+    int64_t delta_us;
+
+    *due = rp->start;
+    if (cam->replay_speed <= 0)
+        return;
+    delta_us = (frame->tv_sec - first->tv_sec) * 1000000 + (frame->tv_usec - first->tv_usec);
+    if (delta_us <= 0)
+        return;
+    delta_us /= cam->replay_speed;
+    due->tv_sec += delta_us / 1000000;
+    due->tv_nsec += (delta_us % 1000000) * 1000;
+    if (due->tv_nsec >= 1000000000) {
+        due->tv_sec++;
+        due->tv_nsec -= 1000000000;
+    }
+}
+
+static void replay_pace(struct v4l2_camera *cam, struct replay *rp, uint32_t n)
+{
+    struct timespec due;
+
+    if (cam->replay_speed <= 0)
+        return;
+    replay_due(cam, rp, n, &due);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+}
+
+/* Past the last frame the timer fires at once, so pollers see the end of the recording. */
+static void arm_timer(struct v4l2_camera *cam, struct replay *rp)
+{
+    struct itimerspec its;
+
+    ZAP(its);
+    if (rp->next < rp->hdr->frame_count)
+        replay_due(cam, rp, rp->next, &its.it_value);
+    else
+        its.it_value = rp->start;
+    if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+        its.it_value.tv_nsec = 1;
+    timerfd_settime(rp->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int decode_frame(struct v4l2_camera *cam, struct replay *rp, struct record_frame *frame, uint8_t *dst)
+{
+    struct v4l2_pix_format *pix = &rp->hdr->fmt.fmt.pix;
+
+    return lossless_decode_yuyv(rp->map + frame->offset, frame->size, pix->width, pix->height,
+            pix->bytesperline ? pix->bytesperline : pix->width * 2, dst);
+}
+
+static int replay_dequeue_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info)
+{
+    struct replay *rp = to_replay(cam);
+    struct record_frame *frame;
+    unsigned int index;
+    uint8_t *addr;
+    int ret;
+
+    if (fault_on() && (ret = replay_fault(VIDIOC_DQBUF)))
+        return ret;
+    if (rp->next >= rp->hdr->frame_count) {
+        LOGI("End of recording\n");
+        return -ENODATA;
+    }
+    if (!rp->queued)
+        return -EAGAIN;
+    index = __builtin_ctz(rp->queued);
+    replay_pace(cam, rp, rp->next);
+
+    frame = &rp->index[rp->next];
+    ZAP(*buffer_info);
+    buffer_info->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer_info->memory = V4L2_MEMORY_MMAP;
+    buffer_info->index = index;
+    buffer_info->sequence = frame->sequence;
+    buffer_info->timestamp.tv_sec = frame->tv_sec;
+    buffer_info->timestamp.tv_usec = frame->tv_usec;
+    buffer_info->bytesused = frame->bytesused;
+    buffer_info->flags = frame->flags;
+    buffer_info->field = frame->field;
+    buffer_info->length = rp->hdr->record_size;
+    addr = rp->map + frame->offset;
+    if (frame->codec == RECORD_CODEC_LOSSLESS) {
+        addr = rp->decode + rp->hdr->record_size * index;
+        if (decode_frame(cam, rp, frame, addr)) {
+            LOGE(DUMP_NONE, "Decode frame %u failed\n", rp->next);
+            return -EIO;
+        }
+    }
+    cam->bufq.buf[index].addr = addr;
+    rp->queued &= ~(1u << index);
+    rp->next++;
+    /* Re-arming also clears the expiration just consumed. */
+    arm_timer(cam, rp);
+    /* Keep a window ahead in page cache so replay runs at memory speed. */
+    prefetch(rp, rp->next + RECORD_PREFETCH - 1, 1);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int replay_buffer_ready(struct v4l2_camera *cam)
+{
+    struct replay *rp = to_replay(cam);
+    struct timespec due, now;
+
+    if (rp->next >= rp->hdr->frame_count || !rp->queued)
+        return 0;
+    replay_due(cam, rp, rp->next, &due);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec >= due.tv_nsec);
+}
+
+static int replay_poll_fd(struct v4l2_camera *cam)
+{
+    return to_replay(cam)->timer_fd;
+}
+
+static int replay_set_crop(struct v4l2_camera *cam, struct v4l2_rect *rect)
+{
+    if (!rect)
+        return CAMERA_RETURN_SUCCESS;   /* Always the whole recorded frame */
+    LOGD("Replay can't crop\n");
+    return CAMERA_RETURN_FAILURE;
+}
+
+static int replay_get_frame_interval(struct v4l2_camera *cam, struct v4l2_fract *interval)
+{
+    LOGD("Replay rate is set with the replay speed\n");
+    return CAMERA_RETURN_FAILURE;
+}
+
+static int replay_set_frame_interval(struct v4l2_camera *cam, struct v4l2_fract *interval)
+{
+    return CAMERA_RETURN_FAILURE;
+}
+
+static int replay_queue_buffer(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info)
+{
+    struct replay *rp = to_replay(cam);
+
+    if ((fault_on() && replay_fault(VIDIOC_QBUF)) ||
+            buffer_info->index >= cam->bufq.count || (rp->queued & (1u << buffer_info->index))) {
+        LOGE(DUMP_NONE, "Queue buffer failed\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    rp->queued |= 1u << buffer_info->index;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int replay_requeue_all(struct v4l2_camera *cam)
+{
+    struct replay *rp = to_replay(cam);
+
+    rp->queued = (1u << cam->bufq.count) - 1;
+    arm_timer(cam, rp);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* The recording plays again from the start once streaming resumes. */
+static int replay_reopen(struct v4l2_camera *cam)
+{
+    if (cam->source)
+        replay_close_device(cam);
+    return replay_open_device(cam);
+}
+
+static int replay_get_control(struct v4l2_camera *cam, struct v4l2_control *ctrl)
+{
+    LOGE(DUMP_NONE, "Get control failed\n");
+    return CAMERA_RETURN_FAILURE;
+}
+
+static int replay_set_control(struct v4l2_camera *cam, struct v4l2_control *ctrl)
+{
+    LOGE(DUMP_NONE, "Set control failed\n");
+    return CAMERA_RETURN_FAILURE;
+}
+
+const struct camera_ops replay_ops = {
+    .open_device                = replay_open_device,
+    .close_device               = replay_close_device,
+    .query_cap                  = replay_query_cap,
+    .query_support_control      = replay_query_support_control,
+    .query_support_format       = replay_query_support_format,
+    .get_output_format          = replay_get_output_format,
+    .set_output_format          = replay_set_output_format,
+    .request_and_map_buffer     = replay_request_and_map_buffer,
+    .return_and_unmap_buffer    = replay_return_and_unmap_buffer,
+    .start_capturing            = replay_start_capturing,
+    .stop_capturing             = replay_stop_capturing,
+    .dequeue_buffer             = replay_dequeue_buffer,
+    .buffer_ready               = replay_buffer_ready,
+    .poll_fd                    = replay_poll_fd,
+    .set_crop                   = replay_set_crop,
+    .get_frame_interval         = replay_get_frame_interval,
+    .set_frame_interval         = replay_set_frame_interval,
+    .queue_buffer               = replay_queue_buffer,
+    .requeue_all                = replay_requeue_all,
+    .reopen                     = replay_reopen,
+    .get_control                = replay_get_control,
+    .set_control                = replay_set_control,
+};
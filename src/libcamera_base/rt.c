@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "camera.h"
+#include "rt.h"
+#include "log.h"
+
+/*
+ * Real-time profile for the capture pipeline. Threads call rt_enter_thread
+ * with their role once they start, memory is locked and prefaulted before
+ * STREAMON so the first frames don't pay for page faults.
+ */
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE      (6)
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK    (0x01)
+#endif
+
+/* Not every libc exports sched_setattr, use the raw syscall. */
+struct rt_sched_attr {
+    uint32_t            size;
+    uint32_t            sched_policy;
+    uint64_t            sched_flags;
+    int32_t             sched_nice;
+    uint32_t            sched_priority;
+    uint64_t            sched_runtime;
+    uint64_t            sched_deadline;
+    uint64_t            sched_period;
+};
+
+static const char *role_name[RT_ROLE_MAX] = { "capture", "worker", "writer" };
+
+void rt_profile_init(struct rt_profile *profile)
+{
+    int i;
+
+    ZAP(*profile);
+    for (i = 0; i < RT_ROLE_MAX; i++)
+        profile->cpu[i] = -1;
+}
+
+int rt_profile_parse(struct rt_profile *profile, const char *spec)
+{
+    char *copy, *token, *save = NULL, *value;
+    int i, ret = CAMERA_RETURN_SUCCESS;
+
+    copy = strdup(spec);
+    if (!copy)
+        return CAMERA_RETURN_FAILURE;
+    for (token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        value = strchr(token, '=');
+        if (value)
+            *value++ = '\0';
+        for (i = 0; i < RT_ROLE_MAX; i++)
+            if (!strcmp(token, role_name[i]))
+                break;
+        if (i < RT_ROLE_MAX && value) {
+            profile->cpu[i] = atoi(value);
+        } else if (!strcmp(token, "fifo")) {
+            profile->policy = RT_POLICY_FIFO;
+            profile->priority = value ? atoi(value) : sched_get_priority_min(SCHED_FIFO);
+        } else if (!strcmp(token, "deadline") && value &&
+                sscanf(value, "%lu/%lu", &profile->runtime, &profile->period) == 2 &&
+                profile->runtime && profile->runtime <= profile->period) {
+            profile->policy = RT_POLICY_DEADLINE;
+        } else if (!strcmp(token, "lock")) {
+            profile->lock_memory = 1;
+        } else if (!strcmp(token, "prefault")) {
+            profile->prefault = 1;
+        } else {
+            LOGE(DUMP_NONE, "Unknown rt option '%s'\n", token);
+            ret = CAMERA_RETURN_FAILURE;
+            break;
+        }
+    }
+    free(copy);
+    return ret;
+}
+
+int rt_lock_memory(struct rt_profile *profile)
+{
+    if (!profile->lock_memory)
+        return CAMERA_RETURN_SUCCESS;
+    /* MCL_FUTURE also covers every buffer mapped from now on. */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        LOGE(DUMP_ERROR, "Lock memory failed, check RLIMIT_MEMLOCK\n");
+        return CAMERA_RETURN_FAILURE;
+    }
+    LOGI("Memory locked\n");
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int set_deadline(struct rt_profile *profile)
+{
+    struct rt_sched_attr attr;
+
+    ZAP(attr);
+    attr.size = sizeof(attr);
+    attr.sched_policy = SCHED_DEADLINE;
+    /* Deadline tasks can't fork, threads started later would fail to create without it. */
+    attr.sched_flags = SCHED_FLAG_RESET_ON_FORK;
+    attr.sched_runtime = profile->runtime * 1000;
+    attr.sched_deadline = attr.sched_period = profile->period * 1000;
+    return syscall(SYS_sched_setattr, 0, &attr, 0);
+}
+
+/*
+ * Pools may be created after the capture thread took its profile, their
+ * threads inherit the capture pin and policy unless they drop them.
+ */
+static void leave_capture_profile(struct rt_profile *profile, int role)
+{
+    struct sched_param param;
+    cpu_set_t set;
+    int i, policy;
+
+    if (profile->cpu[role] < 0 && profile->cpu[RT_ROLE_CAPTURE] >= 0) {
+        CPU_ZERO(&set);
+        for (i = 0; i < CPU_SETSIZE; i++)
+            CPU_SET(i, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            LOGE(DUMP_NONE, "Unpin %s thread failed\n", role_name[role]);
+    }
+    if (pthread_getschedparam(pthread_self(), &policy, &param) || policy == SCHED_OTHER)
+        return;
+    param.sched_priority = 0;
+    if (pthread_setschedparam(pthread_self(), SCHED_OTHER, &param))
+        LOGE(DUMP_NONE, "Reset %s thread to SCHED_OTHER failed\n", role_name[role]);
+}
+
+int rt_enter_thread(struct rt_profile *profile, int role)
+{
+    struct sched_param param;
+    cpu_set_t set;
+    int ret = CAMERA_RETURN_SUCCESS;
+
+    if (!profile)
+        return CAMERA_RETURN_SUCCESS;
+    /* Deadline tasks must be allowed on the whole root domain, so they are never pinned. */
+    if (profile->cpu[role] >= 0 && !(role == RT_ROLE_CAPTURE && profile->policy == RT_POLICY_DEADLINE)) {
+        CPU_ZERO(&set);
+        CPU_SET(profile->cpu[role], &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            LOGE(DUMP_NONE, "Pin %s thread to cpu %d failed\n", role_name[role], profile->cpu[role]);
+            ret = CAMERA_RETURN_FAILURE;
+        } else {
+            LOGI("Pin %s thread to cpu %d\n", role_name[role], profile->cpu[role]);
+        }
+    }
+    if (role != RT_ROLE_CAPTURE) {
+        leave_capture_profile(profile, role);
+        return ret;
+    }
+
+    switch (profile->policy) {
+        case RT_POLICY_FIFO:
+            param.sched_priority = profile->priority;
+            /* Acts on the calling thread only, later children start as SCHED_OTHER. */
+            if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param)) {
+                LOGE(DUMP_NONE, "Set SCHED_FIFO %d failed, need CAP_SYS_NICE\n", profile->priority);
+                return CAMERA_RETURN_FAILURE;
+            }
+            LOGI("Capture thread SCHED_FIFO %d\n", profile->priority);
+            break;
+        case RT_POLICY_DEADLINE:
+            if (set_deadline(profile)) {
+                LOGE(DUMP_ERROR, "Set SCHED_DEADLINE %lu/%lu us failed\n", profile->runtime, profile->period);
+                return CAMERA_RETURN_FAILURE;
+            }
+            LOGI("Capture thread SCHED_DEADLINE %lu/%lu us\n", profile->runtime, profile->period);
+            break;
+        default:
+            break;
+    }
+    return ret;
+}
+
+/* Touch every page so the first use doesn't fault, optionally pin it like MAP_LOCKED. */
+void rt_prefault(void *addr, size_t size, int lock)
+{
+    volatile uint8_t *p = addr;
+    size_t page = sysconf(_SC_PAGESIZE), i;
+
+    if (!addr || !size)
+        return;
+    if (lock && mlock(addr, size))
+        LOGE(DUMP_ERROR, "Lock %zu bytes failed\n", size);
+    for (i = 0; i < size; i += page)
+        (void) p[i];
+}
+
+void rt_prepare_buffers(struct rt_profile *profile, struct v4l2_camera *cam)
+{
+    int i;
+
+    if (!profile->prefault && !profile->lock_memory)
+        return;
+    for (i = 0; i < cam->bufq.count; i++)
+        rt_prefault(cam->bufq.buf[i].addr, cam->bufq.buf[i].size, profile->lock_memory);
+    for (i = 0; i < cam->alt_bufq.count; i++)
+        rt_prefault(cam->alt_bufq.buf[i].addr, cam->alt_bufq.buf[i].size, profile->lock_memory);
+    LOGI("Prepared %d queue buffers\n", cam->bufq.count + cam->alt_bufq.count);
+}
+
+static uint64_t elapsed_us(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000ULL + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void histogram_add(struct rt_histogram *h, uint64_t usec)
+{
+    uint64_t n = usec / RT_JITTER_RESOLUTION;
+
+    h->bucket[n < RT_JITTER_BUCKETS ? n : RT_JITTER_BUCKETS - 1]++;
+    h->count++;
+    if (usec > h->max)
+        h->max = usec;
+}
+
+static uint64_t histogram_percentile(struct rt_histogram *h, double p)
+{
+    uint64_t rank = h->count * p, seen = 0, bound;
+    int i;
+
+    for (i = 0; i < RT_JITTER_BUCKETS - 1; i++) {
+        seen += h->bucket[i];
+        if (seen > rank)
+            break;
+    }
+    bound = (uint64_t)(i + 1) * RT_JITTER_RESOLUTION;
+    return bound < h->max ? bound : h->max;
+}
+
+void rt_jitter_dequeue(struct rt_jitter *jitter)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (jitter->last_dequeue.tv_sec || jitter->last_dequeue.tv_nsec)
+        histogram_add(&jitter->interval, elapsed_us(&jitter->last_dequeue, &now));
+    jitter->last_dequeue = now;
+}
+
+void rt_jitter_queue(struct rt_jitter *jitter)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogram_add(&jitter->hold, elapsed_us(&jitter->last_dequeue, &now));
+}
+
+static void histogram_print(struct rt_histogram *h, const char *name)
+{
+    if (!h->count)
+        return;
+    LOGI("%-10s n=%-6llu p50=%-6llu p99=%-6llu p99.9=%-6llu max=%llu us\n", name,
+            (unsigned long long)h->count,
+            (unsigned long long)histogram_percentile(h, 0.5),
+            (unsigned long long)histogram_percentile(h, 0.99),
+            (unsigned long long)histogram_percentile(h, 0.999),
+            (unsigned long long)h->max);
+}
+
+void rt_jitter_report(struct rt_jitter *jitter)
+{
+    LOGI("Capture jitter, percentiles rounded up to %d us:\n", RT_JITTER_RESOLUTION);
+    histogram_print(&jitter->hold, "DQBUF-QBUF");
+    histogram_print(&jitter->interval, "Interval");
+}
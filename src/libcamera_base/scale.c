@@ -0,0 +1,193 @@
+#include "camera.h"
+#include "scale.h"
+#include "simd.h"
+#include "log.h"
+
+/*
+ * YUYV bilinear scaler with optional crop. Every output byte reads at most
+ * four source bytes, so the cost follows the preview size instead of the
+ * sensor size. The horizontal pass works from precomputed tables, the
+ * vertical blend is vectorized.
+ */
+
+#define WEIGHT_BITS     (8)
+#define WEIGHT_ONE      (1 << WEIGHT_BITS)
+
+/* Map dst coordinate i to src coordinate in 8-bit fixed point, pixel centers aligned. */
+static void map_coordinate(int i, int n_src, int n_dst, int *s0, int *s1, int *weight)
+{
+    int64_t pos = ((int64_t)(2 * i + 1) * n_src * WEIGHT_ONE) / (2 * n_dst) - WEIGHT_ONE / 2;
+
+    if (pos < 0)
+        pos = 0;
+    *s0 = pos >> WEIGHT_BITS;
+    *weight = pos & (WEIGHT_ONE - 1);
+    if (*s0 >= n_src - 1) {
+        *s0 = n_src - 1;
+        *weight = 0;
+    }
+    *s1 = (*s0 + 1 < n_src) ? *s0 + 1 : *s0;
+}
+
+static void build_x_table(struct scaler *s)
+{
+    int i, x0, x1, w;
+
+    /* Luma: one sample per pixel, 2 bytes apart. */
+    for (i = 0; i < s->dst_width; i++) {
+        map_coordinate(i, s->crop.width, s->dst_width, &x0, &x1, &w);
+        s->x_left[2 * i] = 2 * x0;
+        s->x_right[2 * i] = 2 * x1;
+        s->x_weight[2 * i] = w;
+    }
+    /* Chroma: one U/V pair per macropixel, 4 bytes apart. */
+    for (i = 0; i < s->dst_width / 2; i++) {
+        map_coordinate(i, s->crop.width / 2, s->dst_width / 2, &x0, &x1, &w);
+        s->x_left[4 * i + 1] = 4 * x0 + 1;
+        s->x_right[4 * i + 1] = 4 * x1 + 1;
+        s->x_weight[4 * i + 1] = w;
+        s->x_left[4 * i + 3] = 4 * x0 + 3;
+        s->x_right[4 * i + 3] = 4 * x1 + 3;
+        s->x_weight[4 * i + 3] = w;
+    }
+}
+
+static void scale_row(struct scaler *s, const uint8_t *src, uint8_t *dst)
+{
+    int i, n = s->dst_width * 2;
+
+    for (i = 0; i < n; i++) {
+        unsigned int w = s->x_weight[i];
+        dst[i] = (src[s->x_left[i]] * (WEIGHT_ONE - w) + src[s->x_right[i]] * w + WEIGHT_ONE / 2) >> WEIGHT_BITS;
+    }
+}
+
+SIMD_KERNEL
+static void blend_rows(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, unsigned int w)
+{
+    int i = 0;
+    vec_u16 wa = (vec_u16){} + (uint16_t)(WEIGHT_ONE - w);
+    vec_u16 wb = (vec_u16){} + (uint16_t)w;
+
+    for (; i + SIMD_BYTES <= n; i += SIMD_BYTES) {
+        vec_u16 r = vec_widen_u8(vec_load_u8(a + i)) * wa + vec_widen_u8(vec_load_u8(b + i)) * wb;
+        vec_store_u8(dst + i, vec_narrow_u16((r + WEIGHT_ONE / 2) >> WEIGHT_BITS));
+    }
+    for (; i < n; i++)
+        dst[i] = (a[i] * (WEIGHT_ONE - w) + b[i] * w + WEIGHT_ONE / 2) >> WEIGHT_BITS;
+}
+
+/* Return row[] slot holding horizontally scaled source line y, scaling it on a miss. */
+static uint8_t *get_row(struct scaler *s, const uint8_t *base, int y, int hint)
+{
+    int slot;
+
+    if (s->row_y[0] == y)
+        return s->row[0];
+    if (s->row_y[1] == y)
+        return s->row[1];
+    slot = hint;
+    scale_row(s, base + (size_t)y * s->src_stride, s->row[slot]);
+    s->row_y[slot] = y;
+    return s->row[slot];
+}
+
+struct scaler *scaler_create(struct v4l2_pix_format *pix, struct v4l2_rect *crop, int dst_width, int dst_height)
+{
+    struct scaler *s = NULL;
+    size_t n;
+
+    s = calloc(1, sizeof(struct scaler));
+    if (!s) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    s->src_stride = pix->bytesperline ? pix->bytesperline : pix->width * 2;
+    if (crop) {
+        s->crop = *crop;
+    } else {
+        s->crop.width = pix->width;
+        s->crop.height = pix->height;
+    }
+    /* YUYV shares chroma between pixel pairs, keep everything macropixel aligned. */
+    s->crop.left &= ~1;
+    s->crop.width &= ~1;
+    if (s->crop.left < 0 || s->crop.top < 0 || s->crop.width < 2 || s->crop.height < 1 ||
+            s->crop.left + s->crop.width > pix->width || s->crop.top + s->crop.height > pix->height) {
+        LOGE(DUMP_NONE, "Invalid crop %dx%d@(%d,%d)\n", s->crop.width, s->crop.height, s->crop.left, s->crop.top);
+        goto err_free;
+    }
+    s->dst_width = dst_width & ~1;
+    s->dst_height = dst_height;
+    if (s->dst_width < 2 || s->dst_height < 1) {
+        LOGE(DUMP_NONE, "Invalid scale size %dx%d\n", dst_width, dst_height);
+        goto err_free;
+    }
+
+    n = s->dst_width * 2;
+    s->x_left = malloc(n * sizeof(uint32_t));
+    s->x_right = malloc(n * sizeof(uint32_t));
+    s->x_weight = malloc(n * sizeof(uint16_t));
+    s->row[0] = malloc(n);
+    s->row[1] = malloc(n);
+    s->out_size = n * s->dst_height;
+    if (!s->x_left || !s->x_right || !s->x_weight || !s->row[0] || !s->row[1]) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        goto err_free;
+    }
+    s->row_y[0] = s->row_y[1] = -1;
+    build_x_table(s);
+    LOGD("Scaler %dx%d@(%d,%d) -> %dx%d\n", s->crop.width, s->crop.height,
+            s->crop.left, s->crop.top, s->dst_width, s->dst_height);
+    return s;
+
+err_free:
+    scaler_destroy(s);
+    return NULL;
+}
+
+int scaler_process(struct scaler *s, struct buffer src, struct buffer *dst)
+{
+    const uint8_t *base;
+    uint8_t *out = dst->addr;
+    size_t line = s->dst_width * 2;
+    int y, y0, y1, w;
+
+    if (!out || dst->size < s->out_size) {
+        LOGE(DUMP_NONE, "Destination buffer too small: %zu\n", dst->size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (src.size < (size_t)(s->crop.top + s->crop.height - 1) * s->src_stride + (s->crop.left + s->crop.width) * 2) {
+        LOGE(DUMP_NONE, "Source buffer too small: %zu\n", src.size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    base = (const uint8_t *)src.addr + (size_t)s->crop.top * s->src_stride + s->crop.left * 2;
+    /* Rows are cached per source line, a new frame invalidates them. */
+    s->row_y[0] = s->row_y[1] = -1;
+    for (y = 0; y < s->dst_height; y++, out += line) {
+        uint8_t *r0, *r1;
+
+        map_coordinate(y, s->crop.height, s->dst_height, &y0, &y1, &w);
+        r0 = get_row(s, base, y0, 0);
+        if (w == 0) {
+            memcpy(out, r0, line);
+            continue;
+        }
+        r1 = get_row(s, base, y1, r0 == s->row[0] ? 1 : 0);
+        blend_rows(out, r0, r1, line, w);
+    }
+    dst->size = s->out_size;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+void scaler_destroy(struct scaler *s)
+{
+    if (!s)
+        return;
+    free(s->x_left);
+    free(s->x_right);
+    free(s->x_weight);
+    free(s->row[0]);
+    free(s->row[1]);
+    free(s);
+}
@@ -0,0 +1,231 @@
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "camera.h"
+#include "api.h"
+#include "schedule.h"
+#include "metrics.h"
+#include "log.h"
+
+static int64_t now_us(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int schedule_parse(struct schedule *sched, const char *spec)
+{
+    char option[16];
+    const char *p;
+    double value;
+
+    ZAP(*sched);
+    if (sscanf(spec, "rate=%lf", &value) == 1 && value > 0) {
+        sched->mode = SCHEDULE_DECIMATE;
+        sched->rate = value;
+        return CAMERA_RETURN_SUCCESS;
+    }
+    if (sscanf(spec, "every=%lf", &value) != 1 || value <= 0)
+        goto err_spec;
+    sched->mode = SCHEDULE_TIMELAPSE;
+    sched->interval_us = value * 1000000;
+    for (p = strchr(spec, ','); p; p = strchr(p + 1, ',')) {
+        if (sscanf(p + 1, "%15[^,]", option) != 1)
+            goto err_spec;
+        if (!strcmp(option, "align"))
+            sched->align = 1;
+        else if (!strcmp(option, "keep"))
+            sched->policy = SCHEDULE_KEEP_STREAMING;
+        else if (!strcmp(option, "off"))
+            sched->policy = SCHEDULE_STREAM_OFF;
+        else
+            goto err_spec;
+    }
+    return CAMERA_RETURN_SUCCESS;
+
+err_spec:
+    LOGE(DUMP_NONE, "Invalid schedule '%s'\n", spec);
+    return CAMERA_RETURN_FAILURE;
+}
+
+/* Even spacing in media time, with half a source period of slack for timestamp jitter. */
+static int decimate(struct schedule *sched, struct v4l2_buffer *buffer_info)
+{
+    int64_t ts = buffer_info->timestamp.tv_sec * 1000000LL + buffer_info->timestamp.tv_usec;
+    int64_t period = 1000000 / sched->rate;
+
+    if (sched->last_us && ts > sched->last_us)
+        sched->source_us = sched->source_us ? (sched->source_us * 7 + ts - sched->last_us) / 8 : ts - sched->last_us;
+    sched->last_us = ts;
+    if (sched->next_us && ts + sched->source_us / 2 < sched->next_us)
+        return 0;
+    sched->next_us = (sched->next_us ? sched->next_us : ts) + period;
+    if (sched->next_us <= ts)
+        sched->next_us = ts + period;
+    return 1;
+}
+
+static int schedule_filter(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info, struct buffer buffer, void *priv)
+{
+    struct schedule *sched = priv;
+    int64_t now = now_us(CLOCK_MONOTONIC);
+    int accept;
+
+    if (sched->start_us) {
+        uint64_t cost = now - sched->start_us;
+
+        sched->restart_us = sched->restart_us ? (sched->restart_us * 3 + cost) / 4 : cost;
+        sched->start_us = 0;
+        metrics_observe(metrics_register("tiny_camera_stage_seconds", "Restart", "Per stage latency",
+                    METRIC_SUMMARY), cost);
+    }
+    switch (sched->mode) {
+        case SCHEDULE_DECIMATE:
+            accept = decimate(sched, buffer_info);
+            break;
+        case SCHEDULE_TIMELAPSE:
+            accept = !sched->accepted && now >= sched->due_us;
+            break;
+        default:
+            accept = 1;
+    }
+    if (!accept) {
+        sched->skipped++;
+        return CAMERA_RETURN_SUCCESS;
+    }
+    sched->accepted = 1;
+    sched->delivered++;
+    sched->ret = sched->func(cam, buffer_info, buffer, sched->priv);
+    return sched->ret;
+}
+
+/* Sleep on the stream fd, so camera_stream_wakeup() still ends the run. */
+static int wait_until(struct camera_stream *stream, int64_t due)
+{
+    struct epoll_event ev;
+    int64_t now;
+
+    while ((now = now_us(CLOCK_MONOTONIC)) < due) {
+        if (epoll_wait(camera_stream_get_fd(stream), &ev, 1, (due - now + 999) / 1000) > 0)
+            camera_stream_dispatch(stream, 1);
+        if (stream->woken)
+            return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static void next_shot(struct schedule *sched)
+{
+    int64_t now = now_us(CLOCK_MONOTONIC), wall, next;
+
+    if (sched->align) {
+        wall = now_us(CLOCK_REALTIME);
+        next = (wall / sched->interval_us + 1) * sched->interval_us;
+        sched->due_us = now + next - wall;
+        return;
+    }
+    if (!sched->due_us) {
+        sched->due_us = now;
+        return;
+    }
+    /* Shots that are already late are skipped, not taken back to back. */
+    do {
+        sched->due_us += sched->interval_us;
+    } while (sched->due_us <= now);
+}
+
+static int stream_off(struct schedule *sched)
+{
+    if (sched->policy != SCHEDULE_AUTO)
+        return sched->policy == SCHEDULE_STREAM_OFF;
+    /* Unmeasured yet, the first shot measures while it streams anyway. */
+    return !sched->restart_us || sched->interval_us > SCHEDULE_RESTART_FACTOR * sched->restart_us;
+}
+
+static int run_timelapse(struct schedule *sched, struct camera_stream *stream, uint64_t count)
+{
+    int streaming = 0, off, was_off = -1;
+
+    next_shot(sched);
+    while (sched->delivered < count && sched->ret == CAMERA_RETURN_SUCCESS) {
+        off = stream_off(sched);
+        if (off != was_off && sched->restarts)
+            LOGI("Restart takes %.1fms, %s between shots\n", sched->restart_us / 1000.0,
+                    off ? "stream off" : "keep streaming");
+        was_off = off;
+        if (off || !streaming) {
+            if (off && wait_until(stream, sched->due_us - sched->restart_us))
+                break;
+            if (!streaming) {
+                if (camera_stream_start(stream))
+                    return CAMERA_RETURN_FAILURE;
+                streaming = 1;
+                sched->start_us = now_us(CLOCK_MONOTONIC);
+                sched->restarts++;
+            }
+        }
+        sched->accepted = 0;
+        while (!sched->accepted && !stream->woken && sched->ret == CAMERA_RETURN_SUCCESS)
+            if (camera_stream_run(stream, 1))
+                goto out_stop;
+        if (stream->woken)
+            break;
+        if (stream_off(sched)) {
+            camera_stream_stop(stream);
+            streaming = 0;
+        }
+        next_shot(sched);
+    }
+
+out_stop:
+    if (streaming)
+        camera_stream_stop(stream);
+    return sched->ret;
+}
+
+static int run_continuous(struct schedule *sched, struct camera_stream *stream, uint64_t count)
+{
+    double fps = sched->rate;
+    int ret = CAMERA_RETURN_SUCCESS;
+
+    /* The sensor does what it can, decimation the rest. */
+    if (sched->mode == SCHEDULE_DECIMATE && camera_set_frame_rate(stream->cam, &fps) == CAMERA_RETURN_SUCCESS)
+        LOGI("Decimate %.2f to %.2f fps\n", fps, sched->rate);
+    if (camera_stream_start(stream))
+        return CAMERA_RETURN_FAILURE;
+    while (sched->delivered < count && !stream->woken && sched->ret == CAMERA_RETURN_SUCCESS) {
+        ret = camera_stream_run(stream, count - sched->delivered);
+        if (ret != CAMERA_RETURN_SUCCESS)
+            break;
+    }
+    camera_stream_stop(stream);
+    return ret;
+}
+
+/* Takes over the stream callback for the run, count is in delivered frames. */
+int schedule_run(struct schedule *sched, struct camera_stream *stream, uint64_t count)
+{
+    stream_frame_func func = stream->func;
+    void *priv = stream->priv;
+    int ret;
+
+    sched->func = func;
+    sched->priv = priv;
+    sched->ret = CAMERA_RETURN_SUCCESS;
+    sched->delivered = sched->skipped = sched->restarts = 0;
+    stream->func = schedule_filter;
+    stream->priv = sched;
+    if (sched->mode == SCHEDULE_TIMELAPSE)
+        ret = run_timelapse(sched, stream, count);
+    else
+        ret = run_continuous(sched, stream, count);
+    stream->func = func;
+    stream->priv = priv;
+    if (sched->mode != SCHEDULE_ALL)
+        LOGI("Schedule: %llu frames delivered, %llu skipped, %llu stream restarts\n",
+                (unsigned long long)sched->delivered, (unsigned long long)sched->skipped,
+                (unsigned long long)sched->restarts);
+    return ret;
+}
@@ -0,0 +1,118 @@
+#include "camera.h"
+#include "stats.h"
+#include "simd.h"
+#include "log.h"
+
+#define STATS_CHUNK     (128)               /* Vectors per flush, keeps u16 sums and u8 counts exact */
+
+void stats_default_config(struct stats_config *config)
+{
+    config->step_x = STATS_DEFAULT_STEP;
+    config->step_y = STATS_DEFAULT_STEP;
+    config->clip = STATS_DEFAULT_CLIP;
+}
+
+/*
+ * Sum and clip count of the luma bytes in one line. mask selects the luma
+ * lanes, all of them for planar formats, every other one for packed 4:2:2.
+ */
+SIMD_KERNEL
+static void luma_line(const uint8_t *row, size_t size, vec_u8 mask, uint8_t clip,
+        uint64_t *sum, uint64_t *clipped)
+{
+    const vec_u8 one = (vec_u8){ 0 } + 1, limit = (vec_u8){ 0 } + clip;
+    size_t i = 0;
+    int j, n;
+
+    while (i + SIMD_BYTES <= size) {
+        vec_u16 acc = { 0 };
+        vec_u8 hits = { 0 };
+
+        for (n = 0; n < STATS_CHUNK && i + SIMD_BYTES <= size; n++, i += SIMD_BYTES) {
+            vec_u8 v = vec_load_u8(row + i) & mask;
+
+            acc += vec_widen_u8(v);
+            hits += (vec_u8)(v >= limit) & mask & one;
+        }
+        for (j = 0; j < SIMD_BYTES; j++) {
+            *sum += acc[j];
+            *clipped += hits[j];
+        }
+    }
+    for (; i < size; i++) {
+        if (!mask[i % SIMD_BYTES])
+            continue;
+        *sum += row[i];
+        *clipped += row[i] >= clip;
+    }
+}
+
+int stats_luma(struct v4l2_pix_format *pix, struct buffer buffer, struct stats_config *config,
+        struct luma_stats *stats)
+{
+    static const vec_u8 even = { 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0 };
+    const vec_u8 all = (vec_u8){ 0 } + 0xff;
+    uint32_t hist[4][STATS_BINS];
+    const uint8_t *base = buffer.addr;
+    size_t stride, line, bpp, offset = 0;
+    unsigned int x, y;
+    int step_x = config->step_x > 0 ? config->step_x : 1;
+    int step_y = config->step_y > 0 ? config->step_y : 1;
+    vec_u8 mask;
+
+    switch (pix->pixelformat) {
+        case V4L2_PIX_FMT_YUYV:
+            bpp = 2;
+            mask = even;
+            break;
+        case V4L2_PIX_FMT_UYVY:
+            bpp = 2;
+            offset = 1;
+            mask = ~even;
+            break;
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_GREY:
+            bpp = 1;
+            mask = all;
+            break;
+        default:
+            LOGE(DUMP_NONE, "No luma statistics for format %c%c%c%c\n",
+                    pix->pixelformat & 0xff, (pix->pixelformat >> 8) & 0xff,
+                    (pix->pixelformat >> 16) & 0xff, pix->pixelformat >> 24);
+            return CAMERA_RETURN_FAILURE;
+    }
+    line = pix->width * bpp;
+    stride = pix->bytesperline ? pix->bytesperline : line;
+    if (!pix->height || buffer.size < stride * (pix->height - 1) + line) {
+        LOGE(DUMP_NONE, "Buffer too small for luma statistics: %zu\n", buffer.size);
+        return CAMERA_RETURN_FAILURE;
+    }
+
+    memset(stats, 0, sizeof(struct luma_stats));
+    memset(hist, 0, sizeof(hist));
+    for (y = 0; y < pix->height; y += step_y) {
+        const uint8_t *p = base + stride * y + offset, *end = p + pix->width * bpp;
+        size_t step = step_x * bpp;
+
+        luma_line(base + stride * y, line, mask, config->clip, &stats->sum, &stats->clipped);
+        stats->count += pix->width;
+
+        /* Four histograms so consecutive samples of one bin don't serialize on its counter. */
+        for (; p + step * 3 < end; p += step * 4) {
+            hist[0][p[0]]++;
+            hist[1][p[step]]++;
+            hist[2][p[step * 2]]++;
+            hist[3][p[step * 3]]++;
+        }
+        for (; p < end; p += step)
+            hist[0][*p]++;
+    }
+    for (x = 0; x < STATS_BINS; x++) {
+        stats->hist[x] = hist[0][x] + hist[1][x] + hist[2][x] + hist[3][x];
+        stats->hist_count += stats->hist[x];
+    }
+    stats->mean = (double)stats->sum / stats->count;
+    stats->clipped_ratio = (double)stats->clipped / stats->count;
+    return CAMERA_RETURN_SUCCESS;
+}
@@ -0,0 +1,329 @@
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "camera.h"
+#include "api.h"
+#include "stream.h"
+#include "metrics.h"
+#include "log.h"
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+struct camera_stream *camera_stream_create(struct v4l2_camera *cam, stream_frame_func func, void *priv, int flags)
+{
+    struct camera_stream *stream;
+    struct epoll_event ev;
+
+    stream = calloc(1, sizeof(struct camera_stream));
+    if (!stream) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    stream->cam = cam;
+    stream->func = func;
+    stream->priv = priv;
+    stream->flags = flags;
+    stream->cam_fd = -1;
+    stream->last_action = -1;
+    stream->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    stream->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stream->epoll_fd == -1 || stream->wake_fd == -1) {
+        LOGE(DUMP_ERROR, "Create stream fds failed\n");
+        goto err_free;
+    }
+    ZAP(ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = stream->wake_fd;
+    if (epoll_ctl(stream->epoll_fd, EPOLL_CTL_ADD, stream->wake_fd, &ev)) {
+        LOGE(DUMP_ERROR, "Watch wakeup fd failed\n");
+        goto err_free;
+    }
+    return stream;
+
+err_free:
+    camera_stream_destroy(stream);
+    return NULL;
+}
+
+int camera_stream_get_fd(struct camera_stream *stream)
+{
+    return stream->epoll_fd;
+}
+
+static int watch_camera(struct camera_stream *stream)
+{
+    struct epoll_event ev;
+
+    if (camera_get_poll_fd(stream->cam, &stream->cam_fd))
+        goto err_fd;
+    ZAP(ev);
+    ev.events = EPOLLIN | EPOLLPRI;
+    ev.data.fd = stream->cam_fd;
+    if (epoll_ctl(stream->epoll_fd, EPOLL_CTL_ADD, stream->cam_fd, &ev)) {
+        LOGE(DUMP_ERROR, "Watch camera fd failed\n");
+        goto err_fd;
+    }
+    stream->last_us = 0;
+    return CAMERA_RETURN_SUCCESS;
+
+err_fd:
+    stream->cam_fd = -1;
+    return CAMERA_RETURN_FAILURE;
+}
+
+static void unwatch_camera(struct camera_stream *stream)
+{
+    if (stream->cam_fd != -1) {
+        epoll_ctl(stream->epoll_fd, EPOLL_CTL_DEL, stream->cam_fd, NULL);
+        stream->cam_fd = -1;
+    }
+}
+
+int camera_stream_start(struct camera_stream *stream)
+{
+    if (camera_start_capturing(stream->cam))
+        return CAMERA_RETURN_FAILURE;
+    if (watch_camera(stream)) {
+        camera_stop_capturing(stream->cam);
+        return CAMERA_RETURN_FAILURE;
+    }
+    stream->woken = 0;
+    stream->last_action = -1;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Dequeue, hand out and requeue one frame, 0 if none was ready after all. */
+static int stream_frame(struct camera_stream *stream)
+{
+    struct v4l2_camera *cam = stream->cam;
+    struct v4l2_buffer buffer_info;
+    struct buffer buffer;
+    int64_t now;
+    int ret;
+
+    if (stream->flags & STREAM_LATEST)
+        ret = camera_dequeue_latest(cam, &buffer_info);
+    else
+        ret = camera_dequeue_buffer(cam, &buffer_info);
+    if (ret == -EAGAIN)
+        return 0;
+    if (ret != CAMERA_RETURN_SUCCESS)
+        return ret < 0 ? ret : -EIO;
+    now = now_us();
+    if (stream->last_us)
+        stream->interval_us = stream->interval_us ? (stream->interval_us * 7 + now - stream->last_us) / 8 :
+            now - stream->last_us;
+    stream->last_us = now;
+    stream->last_action = -1;
+    camera_get_buffer(cam, &buffer_info, &buffer);
+    if (buffer_info.flags & V4L2_BUF_FLAG_ERROR) {
+        /* Corrupt data, the driver still wants the buffer back. */
+        LOGD("Drop corrupt frame %u\n", buffer_info.sequence);
+        stream->errors++;
+        ret = CAMERA_RETURN_SUCCESS;
+    } else {
+        ret = stream->func(cam, &buffer_info, buffer, stream->priv);
+        stream->frames++;
+    }
+    if (camera_queue_buffer(cam, &buffer_info) != CAMERA_RETURN_SUCCESS)
+        return -EIO;
+    return ret == CAMERA_RETURN_SUCCESS ? 1 : -ECANCELED;
+}
+
+static int stream_dispatch(struct camera_stream *stream, struct epoll_event *ev, int nev, int max)
+{
+    uint64_t value;
+    int i, n = 0, ret, ready = 0, pending = 0, err = 0;
+
+    for (i = 0; i < nev; i++) {
+        if (ev[i].data.fd == stream->wake_fd) {
+            if (read(stream->wake_fd, &value, sizeof(value)) == sizeof(value))
+                stream->woken = 1;
+            continue;
+        }
+        if (ev[i].events & EPOLLPRI)
+            pending = 1;
+        if (ev[i].events & EPOLLIN)
+            ready = 1;
+        else if (ev[i].events & (EPOLLERR | EPOLLHUP))
+            err = ev[i].events & EPOLLHUP ? -ENODEV : -EPIPE;
+    }
+    if (stream->woken || stream->cam_fd == -1)
+        return 0;
+
+    /* Events first, a source change explains the error and makes the ready buffer stale. */
+    if (pending) {
+        ret = camera_dispatch_events(stream->cam);
+        if (ret < 0)
+            return ret;
+        if (ret & CAMERA_EVENT_SOURCE_CHANGE) {
+            stream->last_us = 0;
+            stream->interval_us = 0;
+            return 0;
+        }
+    }
+    if (err) {
+        LOGE(DUMP_NONE, "Camera stream error\n");
+        return err;
+    }
+
+    /* The first frame is known to be ready, the rest of the batch only if it already is. */
+    while (n < max && (ready || stream->cam->ops->buffer_ready(stream->cam))) {
+        ready = 0;
+        ret = stream_frame(stream);
+        if (ret < 0)
+            return ret;
+        if (!ret)
+            break;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Non blocking, handles whatever is pending and returns the number of frames
+ * handled. Pending V4L2 events go to camera_dispatch_events() first.
+ * -ECANCELED when a callback ended the stream, -ENODATA at the end of a
+ * recording or on V4L2_EVENT_EOS, -ENODEV when the device is gone, -EPIPE
+ * when the driver flags the queue and -EIO on other errors.
+ */
+int camera_stream_dispatch(struct camera_stream *stream, int max)
+{
+    struct epoll_event ev[2];
+    int nev;
+
+    nev = epoll_wait(stream->epoll_fd, ev, 2, 0);
+    if (nev < 0)
+        return errno == EINTR ? 0 : -EIO;
+    return stream_dispatch(stream, ev, nev, max > 0 ? max : STREAM_BATCH);
+}
+
+/* Timeout of the frame wait, in ms, the stream is taken as stalled after it. */
+static int stall_timeout(struct camera_stream *stream)
+{
+    int64_t ms;
+
+    if (!(stream->flags & STREAM_RECOVER))
+        return -1;
+    if (!stream->last_us || !stream->interval_us)
+        return STREAM_FIRST_FRAME;
+    ms = stream->interval_us * STREAM_STALL_FRAMES / 1000;
+    return ms < STREAM_STALL_MIN ? STREAM_STALL_MIN : ms;
+}
+
+/* Block until count frames are handled, 0 for no limit, or until woken up. */
+int camera_stream_run(struct camera_stream *stream, uint64_t count)
+{
+    struct epoll_event ev[2];
+    uint64_t end = stream->frames + count;
+    int nev, max, ret, timeout;
+
+    while (!stream->woken && (!count || stream->frames < end)) {
+        timeout = stall_timeout(stream);
+        nev = epoll_wait(stream->epoll_fd, ev, 2, timeout);
+        if (nev < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE(DUMP_ERROR, "Wait for frame failed\n");
+            return CAMERA_RETURN_FAILURE;
+        }
+        if (!nev) {
+            LOGE(DUMP_NONE, "No frame for %dms\n", timeout);
+            ret = -ETIMEDOUT;
+        } else {
+            max = count && end - stream->frames < STREAM_BATCH ? end - stream->frames : STREAM_BATCH;
+            ret = stream_dispatch(stream, ev, nev, max);
+        }
+        if (ret == -ECANCELED)
+            break;
+        if (ret < 0 && (ret == -ENODATA || !(stream->flags & STREAM_RECOVER) || camera_stream_recover(stream, ret)))
+            return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/*
+ * Back to streaming after err from camera_stream_dispatch(), or -ETIMEDOUT
+ * for a stall. Starts with the cheapest action that can fix err, escalates
+ * when the last recovery brought no frame, and keeps reopening a device
+ * that is gone for up to STREAM_RECONNECT. The time it took goes to
+ * tiny_camera_recovery_seconds.
+ */
+int camera_stream_recover(struct camera_stream *stream, int err)
+{
+    struct epoll_event ev;
+    int64_t start = now_us();
+    uint64_t value;
+    int action, done;
+
+    switch (err) {
+        case -ENODEV:
+            action = CAMERA_RECOVER_REOPEN;
+            break;
+        case -ETIMEDOUT:
+        case -EPIPE:
+            action = CAMERA_RECOVER_RESTART;
+            break;
+        default:
+            action = CAMERA_RECOVER_REQUEUE;
+    }
+    if (stream->last_action >= action)
+        action = stream->last_action < CAMERA_RECOVER_REOPEN ? stream->last_action + 1 : CAMERA_RECOVER_REOPEN;
+    /* A reopen closes the fd, and a dead one would end every wait below at once. */
+    unwatch_camera(stream);
+    while ((done = camera_recover(stream->cam, action)) < 0) {
+        action = CAMERA_RECOVER_REOPEN;
+        if (now_us() - start >= STREAM_RECONNECT * 1000LL) {
+            LOGE(DUMP_NONE, "Give up recovering %s\n", stream->cam->dev_name);
+            return CAMERA_RETURN_FAILURE;
+        }
+        if (epoll_wait(stream->epoll_fd, &ev, 1, STREAM_RETRY) > 0) {
+            if (read(stream->wake_fd, &value, sizeof(value)) == sizeof(value))
+                stream->woken = 1;
+            return CAMERA_RETURN_FAILURE;
+        }
+    }
+    if (watch_camera(stream))
+        return CAMERA_RETURN_FAILURE;
+    stream->last_action = done;
+    stream->recoveries++;
+    metrics_observe(metrics_register("tiny_camera_recovery_seconds", camera_recover_to_string(done),
+                "Stream error to streaming again", METRIC_SUMMARY), now_us() - start);
+    LOGI("Recovered by %s in %.1fms\n", camera_recover_to_string(done), (now_us() - start) / 1000.0);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Thread and async signal safe, makes camera_stream_run() return. */
+void camera_stream_wakeup(struct camera_stream *stream)
+{
+    uint64_t one = 1;
+    ssize_t ret;
+
+    /* Only fails once the counter is saturated, it is readable then anyway. */
+    ret = write(stream->wake_fd, &one, sizeof(one));
+    (void) ret;
+}
+
+int camera_stream_stop(struct camera_stream *stream)
+{
+    unwatch_camera(stream);
+    return camera_stop_capturing(stream->cam);
+}
+
+void camera_stream_destroy(struct camera_stream *stream)
+{
+    if (!stream)
+        return;
+    if (stream->epoll_fd != -1)
+        close(stream->epoll_fd);
+    if (stream->wake_fd != -1)
+        close(stream->wake_fd);
+    free(stream);
+}
@@ -0,0 +1,145 @@
+#include "camera.h"
+#include "tnr.h"
+#include "simd.h"
+#include "util.h"
+#include "log.h"
+
+int tnr_parse_config(struct tnr_config *config, const char *spec)
+{
+    config->strength = TNR_DEFAULT_STRENGTH;
+    config->threshold = TNR_DEFAULT_THRESHOLD;
+    if (sscanf(spec, "%d,%d", &config->strength, &config->threshold) < 1 ||
+            config->strength < 1 || config->strength > TNR_MAX_STRENGTH ||
+            config->threshold < 1 || config->threshold > 255) {
+        LOGE(DUMP_NONE, "Invalid noise reduction options '%s'\n", spec);
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+struct tnr *tnr_create(struct v4l2_pix_format *pix, size_t size, struct tnr_config *config)
+{
+    struct tnr *tnr;
+    int full = 1 << TNR_WEIGHT_BITS;
+
+    switch (pix->pixelformat) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_YVYU:
+        case V4L2_PIX_FMT_VYUY:
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_GREY:
+            break;
+        default:
+            LOGE(DUMP_NONE, "No noise reduction for %s frames\n", fmt2desc(pix->pixelformat));
+            return NULL;
+    }
+    tnr = calloc(1, sizeof(struct tnr));
+    if (!tnr) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        return NULL;
+    }
+    tnr->config = *config;
+    tnr->pixelformat = pix->pixelformat;
+    tnr->capacity = size;
+    tnr->base = full >> config->strength;
+    /* Rounded up, so the weight is full at the threshold. */
+    tnr->slope = (((full - tnr->base) << 4) + config->threshold - 1) / config->threshold;
+    tnr->history = aligned_alloc(64, (size * sizeof(uint16_t) + 63) & ~(size_t)63);
+    if (!tnr->history) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        goto err_free;
+    }
+    tnr->pool = frame_pool_create(size, 1, 0, FRAME_POOL_HUGEPAGE);
+    if (!tnr->pool)
+        goto err_free;
+    tnr->out = frame_pool_get(tnr->pool);
+    return tnr;
+
+err_free:
+    free(tnr->history);
+    free(tnr);
+    return NULL;
+}
+
+/* Scalar twin of the vector kernel for the tail. */
+static uint8_t blend_one(uint8_t src, uint16_t *history, int base, int slope, int threshold)
+{
+    int d = (src << TNR_FRACTION_BITS) - *history, ad = abs(d) >> TNR_FRACTION_BITS, w;
+
+    w = base + (((ad < threshold ? ad : threshold) * slope) >> 4);
+    if (w > 1 << TNR_WEIGHT_BITS)
+        w = 1 << TNR_WEIGHT_BITS;
+    *history += (d * w + (1 << (TNR_WEIGHT_BITS - 1))) >> TNR_WEIGHT_BITS;
+    return (*history + (1 << (TNR_FRACTION_BITS - 1))) >> TNR_FRACTION_BITS;
+}
+
+/* History values stay within 0..1020 and d * w within 16 bits. */
+SIMD_KERNEL
+static void blend(const uint8_t *src, uint8_t *dst, uint16_t *history, size_t size, int16_t base, int16_t slope,
+        int16_t threshold)
+{
+    const vec_s16 zero = { 0 }, full = zero + (1 << TNR_WEIGHT_BITS), limit = zero + threshold;
+    const vec_s16 vbase = zero + base, vslope = zero + slope;
+    vec_s16 cur, ref, d, ad, w;
+    size_t i;
+
+    for (i = 0; i + SIMD_BYTES <= size; i += SIMD_BYTES) {
+        cur = vec_widen_s16(vec_load_u8(src + i)) << TNR_FRACTION_BITS;
+        memcpy(&ref, history + i, sizeof(ref));
+        d = cur - ref;
+        ad = ((d ^ (d >> 15)) - (d >> 15)) >> TNR_FRACTION_BITS;
+        ad = vec_select(ad > limit, limit, ad);
+        w = vbase + ((ad * vslope) >> 4);
+        w = vec_select(w > full, full, w);
+        ref += (d * w + (1 << (TNR_WEIGHT_BITS - 1))) >> TNR_WEIGHT_BITS;
+        memcpy(history + i, &ref, sizeof(ref));
+        vec_store_u8(dst + i, vec_narrow_s16((ref + (1 << (TNR_FRACTION_BITS - 1))) >> TNR_FRACTION_BITS));
+    }
+    for (; i < size; i++)
+        dst[i] = blend_one(src[i], history + i, base, slope, threshold);
+}
+
+/* The first frame or a new frame size only seeds the history. */
+static void prime(struct tnr *tnr, const uint8_t *src, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        tnr->history[i] = src[i] << TNR_FRACTION_BITS;
+    memcpy(tnr->out, src, size);
+    tnr->size = size;
+    tnr->primed = 1;
+}
+
+/* Filters into the pooled output frame, buffer then points there until the next call. */
+int tnr_process(struct tnr *tnr, struct buffer *buffer)
+{
+    if (buffer->size > tnr->capacity) {
+        LOGE(DUMP_NONE, "Frame of %zu bytes exceeds the noise reduction history\n", buffer->size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (!tnr->primed || buffer->size != tnr->size)
+        prime(tnr, buffer->addr, buffer->size);
+    else
+        blend(buffer->addr, tnr->out, tnr->history, buffer->size, tnr->base, tnr->slope, tnr->config.threshold);
+    buffer->addr = tnr->out;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Forget the history, e.g. after a stream restart or a scene cut. */
+void tnr_reset(struct tnr *tnr)
+{
+    tnr->primed = 0;
+}
+
+void tnr_destroy(struct tnr *tnr)
+{
+    if (!tnr)
+        return;
+    frame_pool_put(tnr->pool, tnr->out);
+    frame_pool_destroy(tnr->pool);
+    free(tnr->history);
+    free(tnr);
+}
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include "camera.h"
+#include "trace.h"
+#include "log.h"
+
+#define TRACE_MAX_THREADS       (64)        /* Named in the dump, later threads show as bare ids */
+#define TRACE_THREAD_NAME       (16)
+
+/* Names are taken when a thread first records, its worker pool may be gone by the dump. */
+struct trace_thread {
+    uint32_t            tid;                /* Published last */
+    char                name[TRACE_THREAD_NAME];
+};
+
+int trace_enabled;
+
+static struct {
+    struct trace_event  *ring;
+    uint64_t            mask;
+    uint64_t            head;               /* Events ever written */
+    char                *path;
+    int64_t             realtime_offset;    /* CLOCK_REALTIME - CLOCK_MONOTONIC at start, in us */
+    struct trace_thread threads[TRACE_MAX_THREADS];
+    int                 thread_count;
+    pthread_t           thread;
+    sem_t               wakeup;
+    int                 running;
+    int                 stopping;
+    struct sigaction    old_sa;
+} tracer;
+
+static __thread uint32_t local_tid;
+static __thread int32_t local_frame = TRACE_NO_FRAME;
+
+static int64_t clock_us(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int64_t trace_now(void)
+{
+    return clock_us(CLOCK_MONOTONIC);
+}
+
+/* Later events of this thread belong to frame, until the next call. */
+void trace_set_frame(int32_t frame)
+{
+    local_frame = frame;
+}
+
+static void register_thread(void)
+{
+    struct trace_thread *thread;
+    int n;
+
+    local_tid = syscall(SYS_gettid);
+    n = __atomic_fetch_add(&tracer.thread_count, 1, __ATOMIC_RELAXED);
+    if (n >= TRACE_MAX_THREADS)
+        return;
+    thread = &tracer.threads[n];
+    prctl(PR_GET_NAME, thread->name);
+    __atomic_store_n(&thread->tid, local_tid, __ATOMIC_RELEASE);
+}
+
+static void record(const char *name, int64_t ts, int64_t dur, int instant)
+{
+    struct trace_event *ev;
+    uint64_t index;
+
+    if (!local_tid)
+        register_thread();
+    index = __atomic_fetch_add(&tracer.head, 1, __ATOMIC_RELAXED);
+    ev = &tracer.ring[index & tracer.mask];
+    /* The dumper skips a slot whose stamp changed while it copied it. */
+    __atomic_store_n(&ev->stamp, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->name = name;
+    ev->ts = ts;
+    ev->dur = dur > 0 ? (dur > UINT32_MAX ? UINT32_MAX : dur) : 0;
+    ev->frame = local_frame;
+    ev->tid = local_tid;
+    ev->instant = instant;
+    __atomic_store_n(&ev->stamp, index + 1, __ATOMIC_RELEASE);
+}
+
+void trace_span(const char *name, int64_t start, int64_t end)
+{
+    if (trace_on())
+        record(name, start, end - start, 0);
+}
+
+/* For time_recorder, which stamps with gettimeofday. */
+void trace_span_timeval(const char *name, const struct timeval *start, const struct timeval *end)
+{
+    int64_t us;
+
+    if (!trace_on())
+        return;
+    us = start->tv_sec * 1000000LL + start->tv_usec;
+    record(name, us - tracer.realtime_offset, (end->tv_sec - start->tv_sec) * 1000000LL +
+            (end->tv_usec - start->tv_usec), 0);
+}
+
+void trace_instant(const char *name, int64_t ts)
+{
+    if (trace_on())
+        record(name, ts, 0, 1);
+}
+
+static void write_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', fp);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void write_thread_names(FILE *fp, pid_t pid)
+{
+    int i, n = __atomic_load_n(&tracer.thread_count, __ATOMIC_RELAXED);
+    uint32_t tid;
+
+    for (i = 0; i < n && i < TRACE_MAX_THREADS; i++) {
+        tid = __atomic_load_n(&tracer.threads[i].tid, __ATOMIC_ACQUIRE);
+        if (!tid)
+            continue;
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":", pid, tid);
+        write_string(fp, tracer.threads[i].name);
+        fputs("}}", fp);
+    }
+}
+
+static void write_event(FILE *fp, pid_t pid, struct trace_event *ev)
+{
+    fputs(",\n{\"name\":", fp);
+    write_string(fp, ev->name);
+    if (ev->instant)
+        fprintf(fp, ",\"cat\":\"frame\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld", (long long)ev->ts);
+    else
+        fprintf(fp, ",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%u", (long long)ev->ts, ev->dur);
+    fprintf(fp, ",\"pid\":%d,\"tid\":%u", pid, ev->tid);
+    if (ev->frame != TRACE_NO_FRAME)
+        fprintf(fp, ",\"args\":{\"frame\":%d}", ev->frame);
+    fputc('}', fp);
+}
+
+/* The latest events in the ring, written to a temporary file then renamed over the trace. */
+int trace_dump(void)
+{
+    uint64_t head, first, i, stamp;
+    struct trace_event ev;
+    char tmp[PATH_MAX];
+    int count = 0;
+    pid_t pid = getpid();
+    FILE *fp;
+
+    if (!tracer.ring)
+        return CAMERA_RETURN_FAILURE;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", tracer.path);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        LOGE(DUMP_ERROR, "Can't open %s\n", tmp);
+        return CAMERA_RETURN_FAILURE;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"tiny_camera\"}}",
+            pid, pid);
+    write_thread_names(fp, pid);
+    head = __atomic_load_n(&tracer.head, __ATOMIC_ACQUIRE);
+    first = head > tracer.mask + 1 ? head - tracer.mask - 1 : 0;
+    for (i = first; i < head; i++) {
+        struct trace_event *slot = &tracer.ring[i & tracer.mask];
+
+        stamp = __atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE);
+        if (stamp != i + 1)
+            continue;
+        ev = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->stamp, __ATOMIC_RELAXED) != stamp)
+            continue;
+        write_event(fp, pid, &ev);
+        count++;
+    }
+    fputs("\n]}\n", fp);
+    if (fclose(fp) || rename(tmp, tracer.path)) {
+        LOGE(DUMP_ERROR, "Write %s failed\n", tracer.path);
+        unlink(tmp);
+        return CAMERA_RETURN_FAILURE;
+    }
+    LOGI("Trace of %d events written to %s%s\n", count, tracer.path,
+            head > tracer.mask + 1 ? ", older events were overwritten" : "");
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* sem_post is async signal safe, the dump itself runs on the tracer thread. */
+static void dump_signal(int sig)
+{
+    (void)sig;
+    sem_post(&tracer.wakeup);
+}
+
+static void *dump_thread(void *arg)
+{
+    (void)arg;
+    pthread_setname_np(pthread_self(), "trace-dump");
+    while (1) {
+        if (sem_wait(&tracer.wakeup) && errno == EINTR)
+            continue;
+        if (__atomic_load_n(&tracer.stopping, __ATOMIC_ACQUIRE))
+            break;
+        trace_dump();
+    }
+    return NULL;
+}
+
+/* events is rounded up to a power of two, 0 for TRACE_DEFAULT_EVENTS. */
+int trace_start(const char *path, uint32_t events)
+{
+    struct sigaction sa;
+    uint64_t size = 1;
+
+    if (!events)
+        events = TRACE_DEFAULT_EVENTS;
+    while (size < events)
+        size <<= 1;
+    tracer.ring = calloc(size, sizeof(struct trace_event));
+    tracer.path = strdup(path);
+    if (!tracer.ring || !tracer.path) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        goto err_free;
+    }
+    /* Fault the ring in now rather than on the capture path. */
+    memset(tracer.ring, 0, size * sizeof(struct trace_event));
+    tracer.mask = size - 1;
+    tracer.head = 0;
+    tracer.stopping = 0;
+    tracer.realtime_offset = clock_us(CLOCK_REALTIME) - clock_us(CLOCK_MONOTONIC);
+    if (sem_init(&tracer.wakeup, 0, 0)) {
+        LOGE(DUMP_ERROR, "Create semaphore failed\n");
+        goto err_free;
+    }
+    if (pthread_create(&tracer.thread, NULL, dump_thread, NULL)) {
+        LOGE(DUMP_NONE, "Create trace thread failed\n");
+        sem_destroy(&tracer.wakeup);
+        goto err_free;
+    }
+    tracer.running = 1;
+    ZAP(sa);
+    sa.sa_handler = dump_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(TRACE_DUMP_SIGNAL, &sa, &tracer.old_sa);
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+    LOGI("Trace %llu events to %s, dump with kill -USR1 %d\n", (unsigned long long)size, path,
+            getpid());
+    return CAMERA_RETURN_SUCCESS;
+
+err_free:
+    free(tracer.ring);
+    free(tracer.path);
+    tracer.ring = NULL;
+    tracer.path = NULL;
+    return CAMERA_RETURN_FAILURE;
+}
+
+/* Writes the final trace. Everything that records must have stopped. */
+void trace_stop(void)
+{
+    if (!tracer.running)
+        return;
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+    sigaction(TRACE_DUMP_SIGNAL, &tracer.old_sa, NULL);
+    __atomic_store_n(&tracer.stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&tracer.wakeup);
+    pthread_join(tracer.thread, NULL);
+    sem_destroy(&tracer.wakeup);
+    tracer.running = 0;
+    trace_dump();
+    free(tracer.ring);
+    free(tracer.path);
+    tracer.ring = NULL;
+    tracer.path = NULL;
+}
@@ -1,24 +1,50 @@
+#include <pthread.h>
 #include <time.h>
 
 #include "camera.h"
 #include "util.h"
+#include "metrics.h"
+#include "trace.h"
+#include "bayer.h"
 #include "log.h"
 
 void help(void)
 {
     fprintf(stderr, "Usage:\n");
     fprintf(stderr, "\t-g gui mode\n");
-    fprintf(stderr, "\t-p device path\n");
+    fprintf(stderr, "\t-p device path or recording file\n");
     fprintf(stderr, "\t-w width\n\t-h height\n");
     fprintf(stderr, "\t-f format\n");
+    fprintf(stderr, "\t-D bilinear|edge|half demosaic of saved raw Bayer frames, default edge\n");
+    fprintf(stderr, "\t-m widthxheight[,fourcc] still mode, 's' switches to it for one picture, gui mode only\n");
     fprintf(stderr, "\t-n output image number, noui mode only\n");
+    fprintf(stderr, "\t-b count[,MiB] burst of count frames to RAM, written after stream off, noui mode only, not with -S, -r or -j\n");
+    fprintf(stderr, "\t-S rate=fps decimate, or every=seconds[,align][,keep|off] time-lapse, noui mode only\n");
+    fprintf(stderr, "\t-c left,top,width,height preview crop, gui mode only\n");
+    fprintf(stderr, "\t-C left,top,width,height capture ROI, cropped on the sensor when the driver can\n");
+    fprintf(stderr, "\t-P unix socket path to publish frames to other processes\n");
+    fprintf(stderr, "\t-R record raw frames to file, noui mode only\n");
+    fprintf(stderr, "\t-L lossless compression of YUYV recordings on worker threads\n");
+    fprintf(stderr, "\t-F fast start, use cached device profile instead of enumerating\n");
+    fprintf(stderr, "\t-s replay speed when -p is a recording, 0 as fast as possible\n");
+    fprintf(stderr, "\t-J quality[,444|422|420] save YUYV as JPEG encoded on worker threads, noui mode only\n");
+    fprintf(stderr, "\t-W worker threads, default one per cpu\n");
+    fprintf(stderr, "\t-r rt profile, e.g. capture=2,worker=3,writer=4,fifo=80|deadline=5000/33333,lock,prefault\n");
+    fprintf(stderr, "\t-l low latency, drain ready buffers and only process the newest, always on in gui mode\n");
+    fprintf(stderr, "\t-e recover from stream errors, stalls and reconnects instead of exiting, noui mode only\n");
+    fprintf(stderr, "\t-j print capture jitter report on exit\n");
+    fprintf(stderr, "\t-A target[,interval[,step]] luma statistics and software auto exposure\n");
+    fprintf(stderr, "\t-N strength[,threshold] temporal noise reduction of packed YUV 4:2:2, NV12, NV21 and GREY frames, default 3,24\n");
+    fprintf(stderr, "\t-M export metrics to file, or unix:path to serve on a socket\n");
+    fprintf(stderr, "\t-T file[,events] per frame trace in Chrome trace event JSON, on exit and on SIGUSR1\n");
     fprintf(stderr, "\t-v verbose mode\n");
-    fprintf(stderr, "Format: 0 YUYV 1 MJPEG 2 H264\n");
+    fprintf(stderr, "Format: 0 YUYV 1 MJPEG 2 H264, or a fourcc such as GRBG or RG10 for raw Bayer\n");
 }
 
+/* Per thread, graph and worker threads name formats too. */
 char *fmt2desc(int fmt)
 {
-    static char desc[6];
+    static __thread char desc[6];
     sprintf(desc, "%c%c%c%c%c",
             fmt & 0xFF, (fmt >> 8) & 0xFF,
             (fmt >> 16) & 0xFF, (fmt >> 24) & 0xFF,
@@ -26,6 +52,64 @@ char *fmt2desc(int fmt)
     return desc;
 }
 
+/* rect of a frame in format pix, NULL for all of it, clamped to the frame. */
+int image_get_view(const struct v4l2_pix_format *pix, struct buffer buffer, const struct v4l2_rect *rect,
+        struct image_view *view)
+{
+    uint32_t bpp, stride, left = 0, top = 0, width = pix->width, height = pix->height;
+    uint8_t *base = buffer.addr;
+    struct bayer_format bayer;
+
+    switch (pix->pixelformat) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_YVYU:
+        case V4L2_PIX_FMT_VYUY:
+        case V4L2_PIX_FMT_RGB565:
+            bpp = 2;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_BGR24:
+            bpp = 3;
+            break;
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+            bpp = 1;
+            break;
+        default:
+            if (!bayer_lookup(pix->pixelformat, &bayer)) {
+                LOGE(DUMP_NONE, "No ROI view of %s frames\n", fmt2desc(pix->pixelformat));
+                return CAMERA_RETURN_FAILURE;
+            }
+            bpp = bayer.bits > 8 ? 2 : 1;
+    }
+    stride = pix->bytesperline ? pix->bytesperline : pix->width * bpp;
+    if (rect) {
+        left = rect->left;
+        top = rect->top;
+        if (rect->left < 0 || rect->top < 0 || left >= pix->width || top >= pix->height) {
+            LOGE(DUMP_NONE, "ROI is outside the %ux%u frame\n", pix->width, pix->height);
+            return CAMERA_RETURN_FAILURE;
+        }
+        width = rect->width < pix->width - left ? rect->width : pix->width - left;
+        height = rect->height < pix->height - top ? rect->height : pix->height - top;
+    }
+    if (buffer.size < (size_t)stride * (top + height - 1) + (left + width) * bpp) {
+        LOGE(DUMP_NONE, "Buffer too small for the ROI: %zu\n", buffer.size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    view->addr = base + (size_t)stride * top + left * bpp;
+    view->chroma = NULL;
+    if (pix->pixelformat == V4L2_PIX_FMT_NV12 || pix->pixelformat == V4L2_PIX_FMT_NV21)
+        view->chroma = base + (size_t)stride * pix->height + (size_t)stride * (top / 2) + left;
+    view->width = width;
+    view->height = height;
+    view->stride = stride;
+    view->pixelformat = pix->pixelformat;
+    return CAMERA_RETURN_SUCCESS;
+}
+
 int save_buffer(struct buffer buffer, char * ext)
 {
     char name[30] = { 0 };
@@ -38,14 +122,62 @@ int save_buffer(struct buffer buffer, char * ext)
         LOGE(DUMP_ERROR, "Can't open %s\n", name);
         return -EIO;
     }
-    fwrite(buffer.addr, buffer.size, 1, fp);
-    fclose(fp);
+    /* A full disk shows on fwrite or only on the flush in fclose. */
+    if ((fwrite(buffer.addr, buffer.size, 1, fp) != 1 && buffer.size) | fclose(fp)) {
+        LOGE(DUMP_ERROR, "Write %s failed\n", name);
+        unlink(name);
+        return -EIO;
+    }
     time_recorder_end(&tr);
     LOGI("Save buffer: %s\n", name);
     time_recorder_print_time(&tr, "Save buffer");
     return CAMERA_RETURN_SUCCESS;
 }
 
+/* Rows of the view only, the file holds a tightly packed width x height image. */
+int save_view(struct image_view *view, char *ext)
+{
+    char name[30] = { 0 };
+    FILE *fp = NULL;
+    struct time_recorder tr;
+    size_t line = (size_t)view->width * 2;
+    struct bayer_format bayer;
+    uint32_t y;
+
+    if (view->chroma || view->pixelformat == V4L2_PIX_FMT_GREY ||
+            (bayer_lookup(view->pixelformat, &bayer) && bayer.bits == 8))
+        line = view->width;
+    else if (view->pixelformat == V4L2_PIX_FMT_RGB24 || view->pixelformat == V4L2_PIX_FMT_BGR24)
+        line = (size_t)view->width * 3;
+    time_recorder_start(&tr);
+    sprintf(name, "image_%ld_%ld.%s", tr.start.tv_sec, tr.start.tv_usec, ext);
+    fp = fopen(name, "wb");
+    if (fp == NULL) {
+        LOGE(DUMP_ERROR, "Can't open %s\n", name);
+        return -EIO;
+    }
+    if (!strcmp(ext, "ppm"))
+        fprintf(fp, "P6\n%u %u\n255\n", view->width, view->height);
+    for (y = 0; y < view->height; y++)
+        fwrite(view->addr + (size_t)view->stride * y, line, 1, fp);
+    for (y = 0; view->chroma && y < view->height / 2; y++)
+        fwrite(view->chroma + (size_t)view->stride * y, line, 1, fp);
+    if (ferror(fp) | fclose(fp)) {
+        LOGE(DUMP_ERROR, "Write %s failed\n", name);
+        unlink(name);
+        return -EIO;
+    }
+    time_recorder_end(&tr);
+    LOGI("Save %ux%u view: %s\n", view->width, view->height, name);
+    time_recorder_print_time(&tr, "Save buffer");
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static long timeval_diff_us(struct timeval *end, struct timeval *start)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
 void time_recorder_start(struct time_recorder *tr)
 {
     gettimeofday(&tr->start, NULL);
@@ -62,13 +194,86 @@ void time_recorder_end(struct time_recorder *tr)
     tr->state = TR_END;
 }
 
+/*
+ * Stage names are string literals, so the metric is looked up by address
+ * rather than registered with a string search on every frame. Lookups take
+ * no lock, a full cache only falls back to metrics_register().
+ */
+#define STAGE_CACHE_SIZE        (32)
+
+static struct {
+    const char          *msg;               /* Published after id */
+    int                 id;
+} stage_cache[STAGE_CACHE_SIZE];
+static pthread_mutex_t stage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int stage_metric(const char *msg)
+{
+    const char *cached;
+    int i, id;
+
+    for (i = 0; i < STAGE_CACHE_SIZE; i++) {
+        cached = __atomic_load_n(&stage_cache[i].msg, __ATOMIC_ACQUIRE);
+        if (cached == msg)
+            return stage_cache[i].id;
+        if (!cached)
+            break;
+    }
+    id = metrics_register("tiny_camera_stage_seconds", msg, "Per stage latency", METRIC_SUMMARY);
+    pthread_mutex_lock(&stage_lock);
+    for (i = 0; i < STAGE_CACHE_SIZE; i++) {
+        cached = stage_cache[i].msg;
+        if (cached == msg)
+            break;
+        if (!cached) {
+            stage_cache[i].id = id;
+            __atomic_store_n(&stage_cache[i].msg, msg, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stage_lock);
+    return id;
+}
+
 void time_recorder_print_time(struct time_recorder *tr, const char *msg)
 {
     if (tr->state != TR_END) {
         LOGE(DUMP_NONE, "Time recorder haven't been stopped");
         return;
     }
+    metrics_observe(stage_metric(msg), timeval_diff_us(&tr->end, &tr->start));
+    trace_span_timeval(msg, &tr->start, &tr->end);
     LOGD("%s take %ld.%03lds\n", msg,
             tr->end.tv_sec - tr->start.tv_sec - ((tr->end.tv_usec < tr->start.tv_usec)? 1 : 0),
             (tr->end.tv_usec - tr->start.tv_usec)/1000 + ((tr->end.tv_usec < tr->start.tv_usec)? 1000 : 0));
 }
+
+void time_breakdown_start(struct time_breakdown *tb)
+{
+    gettimeofday(&tb->start, NULL);
+    tb->last = tb->start;
+    tb->count = 0;
+}
+
+void time_breakdown_mark(struct time_breakdown *tb, const char *name)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if (tb->count < TIME_BREAKDOWN_MAX) {
+        tb->name[tb->count] = name;
+        tb->usec[tb->count] = timeval_diff_us(&now, &tb->last);
+        tb->count++;
+    }
+    tb->last = now;
+}
+
+void time_breakdown_print(struct time_breakdown *tb, const char *msg)
+{
+    int i;
+
+    LOGI("%s take %ld.%03ldms\n", msg, timeval_diff_us(&tb->last, &tb->start) / 1000,
+            timeval_diff_us(&tb->last, &tb->start) % 1000);
+    for (i = 0; i < tb->count; i++)
+        LOGI("\t%-20s %ld.%03ldms\n", tb->name[i], tb->usec[i] / 1000, tb->usec[i] % 1000);
+}
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include "camera.h"
+#include "worker.h"
+#include "trace.h"
+#include "log.h"
+
+/*
+ * Fixed size thread pool with a bounded FIFO. A full queue blocks the
+ * submitter, which is the back pressure the capture loop wants instead of
+ * growing memory without bound.
+ */
+
+int worker_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        return 1;
+    return n > WORKER_MAX_THREADS ? WORKER_MAX_THREADS : n;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker_pool *pool = arg;
+    struct worker_task task;
+    char name[WORKER_NAME_SIZE];
+
+    /* Named before anything is traced, the tracer takes the name on the first event. */
+    snprintf(name, sizeof(name), "%.12s/%u", pool->name,
+            (unsigned)__atomic_fetch_add(&pool->named, 1, __ATOMIC_RELAXED) % WORKER_MAX_THREADS);
+    pthread_setname_np(pthread_self(), name);
+    rt_enter_thread(pool->rt, pool->role);
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->count && !pool->stopping)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        if (!pool->count)
+            break;
+        task = pool->task[pool->head];
+        pool->head = (pool->head + 1) % pool->depth;
+        pool->count--;
+        pool->busy++;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        trace_set_frame(task.info.sequence);
+        task.func(&task);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->busy--;
+        if (!pool->count && !pool->busy)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Threads are named name/N, name is cut to 12 characters to leave room for the number. */
+struct worker_pool *worker_pool_create(const char *name, int threads, int depth, struct rt_profile *rt, int role)
+{
+    struct worker_pool *pool;
+
+    if (threads < 1 || threads > WORKER_MAX_THREADS || depth < 1) {
+        LOGE(DUMP_NONE, "Invalid worker pool %d threads, depth %d\n", threads, depth);
+        return NULL;
+    }
+    pool = calloc(1, sizeof(struct worker_pool));
+    if (!pool || !(pool->task = calloc(depth, sizeof(struct worker_task)))) {
+        LOGE(DUMP_NONE, "Out of memory\n");
+        free(pool);
+        return NULL;
+    }
+    snprintf(pool->name, sizeof(pool->name), "%s", name);
+    pool->depth = depth;
+    pool->rt = rt;
+    pool->role = role;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (pool->threads = 0; pool->threads < threads; pool->threads++) {
+        if (pthread_create(&pool->thread[pool->threads], NULL, worker_thread, pool)) {
+            LOGE(DUMP_NONE, "Create worker thread failed\n");
+            worker_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    LOGI("Worker pool %s: %d threads, queue depth %d\n", pool->name, threads, depth);
+    return pool;
+}
+
+void worker_pool_submit(struct worker_pool *pool, struct worker_task *task)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == pool->depth)
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    pool->task[(pool->head + pool->count) % pool->depth] = *task;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void worker_pool_wait(struct worker_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count || pool->busy)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Runs everything still queued before the threads exit. */
+void worker_pool_destroy(struct worker_pool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->threads; i++)
+        pthread_join(pool->thread[i], NULL);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->task);
+    free(pool);
+}
@@ -1,14 +1,144 @@
+#include <poll.h>
+#include <signal.h>
+
 #include "camera.h"
 #include "api.h"
 #include "util.h"
 #include "log.h"
 #include "demo.h"
+#include "publish.h"
+#include "record.h"
+#include "metrics.h"
+#include "rt.h"
+#include "pool.h"
+#include "worker.h"
+#include "jpeg.h"
+#include "ae.h"
+#include "stream.h"
+#include "schedule.h"
+#include "graph.h"
+#include "bayer.h"
+#include "tnr.h"
+#include "burst.h"
+#include "trace.h"
 #ifdef __HAS_GUI__
 #include "window.h"
 #endif
 
-static int read_frame(struct v4l2_camera *cam, int (*func)(struct v4l2_camera *, struct buffer, void *), void *priv_data)
+#define SAVE_QUEUE_DEPTH        (4)
+
+static struct publisher *publisher;
+static struct graph *graph;
+#ifdef __HAS_GUI__
+static struct graph_node *save_node;
+static int display_failed;
+#endif
+static int save_failed;                     /* Set by the graph threads, ends the capture */
+static struct time_breakdown startup;
+static int startup_pending;
+static struct rt_profile rt, *rt_profile;
+static struct rt_jitter jitter;
+static int jitter_report;
+static int latest_only;
+static int recover;
+static struct auto_exposure ae, *auto_exposure;
+static struct tnr *tnr;
+static uint64_t tnr_recoveries;
+static struct camera_stream *active_stream;
+static struct schedule schedule;
+static int demosaic_method = DEMOSAIC_EDGE;
+static struct v4l2_pix_format consumer_pix;
+
+/* Taken when the graph is built, graph threads never read the camera. */
+struct frame_save {
+    struct v4l2_rect roi;                   /* Inside the frame, width 0 for all of it */
+    struct demosaic *demosaic;              /* Raw Bayer only */
+};
+static struct frame_save frame_save;
+
+typedef int (*frame_func)(struct v4l2_camera *, struct v4l2_buffer *, struct buffer, void *);
+
+struct frame_handler {
+    frame_func          func;
+    void                *priv;
+};
+
+/* Raw frames are copied into the pool and encoded on the workers. */
+struct jpeg_saver {
+    struct v4l2_pix_format  pix;
+    struct jpeg_options     opts;
+    struct frame_pool       *pool;
+    struct worker_pool      *workers;
+};
+
+/* Everything done to a frame between dequeue and requeue, wraps the mode specific func. */
+static int handle_frame(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info, struct buffer buffer, void *priv)
+{
+    struct frame_handler *handler = priv;
+    struct time_recorder tr;
+    int ret;
+
+    rt_jitter_dequeue(&jitter);
+    if (startup_pending) {
+        time_breakdown_mark(&startup, "First frame");
+        time_breakdown_print(&startup, "Time to first frame");
+        startup_pending = 0;
+    }
+    if (auto_exposure) {
+        time_recorder_start(&tr);
+        ae_process(auto_exposure, cam, buffer);
+        time_recorder_end(&tr);
+        time_recorder_print_time(&tr, "Luma stats");
+    }
+    /* Everything downstream sees the filtered frame. */
+    if (tnr) {
+        /*
+         * Stream on and mode switches restart the stats, recoveries are
+         * counted by the stream. The history is stale after either.
+         */
+        if (cam->stats.delivered == 1 || (active_stream && active_stream->recoveries != tnr_recoveries)) {
+            tnr_reset(tnr);
+            tnr_recoveries = active_stream ? active_stream->recoveries : 0;
+        }
+        time_recorder_start(&tr);
+        tnr_process(tnr, &buffer);
+        time_recorder_end(&tr);
+        time_recorder_print_time(&tr, "Denoise");
+    }
+    ret = handler->func ? handler->func(cam, buffer_info, buffer, handler->priv) : CAMERA_RETURN_SUCCESS;
+    if (graph)
+        graph_push(graph, buffer_info, buffer);
+    if (__atomic_load_n(&save_failed, __ATOMIC_RELAXED))
+        ret = CAMERA_RETURN_FAILURE;
+    rt_jitter_queue(&jitter);
+    return ret;
+}
+
+/* Consumers are sized at start up, a source change to anything they can't take ends the stream cleanly. */
+static int handle_event(struct v4l2_camera *cam, const struct v4l2_event *ev, void *priv)
+{
+    struct v4l2_pix_format *pix = priv, *now = &cam->fmt.fmt.pix;
+
+    switch (ev->type) {
+        case V4L2_EVENT_SOURCE_CHANGE:
+            if (now->width == pix->width && now->height == pix->height && now->pixelformat == pix->pixelformat &&
+                    now->bytesperline == pix->bytesperline && now->sizeimage <= pix->sizeimage)
+                return CAMERA_RETURN_SUCCESS;
+            LOGE(DUMP_NONE, "Source changed to %ux%u %s, the pipeline is built for %ux%u %s, restart to follow it\n",
+                    now->width, now->height, fmt2desc(now->pixelformat), pix->width, pix->height,
+                    fmt2desc(pix->pixelformat));
+            return CAMERA_RETURN_FAILURE;
+        case V4L2_EVENT_CTRL:
+            LOGD("Control 0x%x changed to %d\n", ev->id, ev->u.ctrl.value);
+            break;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+#ifdef __HAS_GUI__
+static int read_frame(struct v4l2_camera *cam, frame_func func, void *priv_data)
 {
+    struct frame_handler handler = { func, priv_data };
     struct v4l2_buffer buffer_info;
     struct buffer buffer;
     struct time_recorder tr;
@@ -16,49 +146,272 @@ static int read_frame(struct v4l2_camera *cam, int (*func)(struct v4l2_camera *,
 
     //Count the time of get one frame
     time_recorder_start(&tr);
-    ret = camera_dequeue_buffer(cam, &buffer_info);
+    if (latest_only)
+        ret = camera_dequeue_latest(cam, &buffer_info);
+    else
+        ret = camera_dequeue_buffer(cam, &buffer_info);
     if (ret != CAMERA_RETURN_SUCCESS)
         return ret;
     time_recorder_end(&tr);
     time_recorder_print_time(&tr, "Get frame");
     camera_get_buffer(cam, &buffer_info, &buffer);
-    ret = func(cam, buffer, priv_data);
+    ret = handle_frame(cam, &buffer_info, buffer, &handler);
     if (camera_queue_buffer(cam, &buffer_info) != CAMERA_RETURN_SUCCESS) {
         ret = CAMERA_RETURN_FAILURE;
     }
     return ret;
 }
-
+#endif
 
 #ifdef __HAS_GUI__
-static int display_frame(struct v4l2_camera *cam, struct buffer buffer, void * priv_data)
+/* Inline on the main thread, the frame is still the capture buffer. */
+static struct graph_frame *display_node(struct graph_node *node, struct graph_frame *frame)
 {
-    if (*(int *)priv_data)
-        if (save_buffer(buffer, fmt2desc(cam->fmt.fmt.pix.pixelformat)))
-            return CAMERA_RETURN_FAILURE;
-    return window_update_frame((struct window *)cam->priv, buffer.addr, buffer.size, cam->fmt.fmt.pix.pixelformat);
+    struct v4l2_camera *cam = node->priv;
+
+    /* Ends the main loop, as a failed draw did before the graph. */
+    if (window_update_frame((struct window *)cam->priv, frame->buffer.addr, frame->buffer.size,
+                frame->pix.pixelformat)) {
+        LOGE(DUMP_NONE, "Display %s frame failed\n", fmt2desc(frame->pix.pixelformat));
+        display_failed = 1;
+    }
+    return frame;
 }
 #endif
 
-static int save_frame(struct v4l2_camera *cam, struct buffer buffer, void * priv_data)
+/* Cut out unless the sensor crop is exactly the ROI, the driver may round it up. */
+static void frame_roi(struct v4l2_camera *cam, struct v4l2_rect *rect)
 {
-    (void) priv_data;
-    return save_buffer(buffer, fmt2desc(cam->fmt.fmt.pix.pixelformat));
+    ZAP(*rect);
+    if (!cam->roi.width || !memcmp(&cam->roi, &cam->sensor_crop, sizeof(cam->roi)))
+        return;
+    *rect = cam->roi;
+    rect->left -= cam->sensor_crop.left;
+    rect->top -= cam->sensor_crop.top;
 }
 
-static void mainloop_noui(struct v4l2_camera *cam, int count)
+static int save_image(const struct v4l2_pix_format *pix, struct buffer buffer, const struct v4l2_rect *roi)
 {
-    int i = 0, ret;
-    if (camera_start_capturing(cam))
+    struct image_view view;
+
+    if (!roi->width)
+        return save_buffer(buffer, fmt2desc(pix->pixelformat));
+    if (image_get_view(pix, buffer, roi, &view))
+        return CAMERA_RETURN_FAILURE;
+    return save_view(&view, fmt2desc(pix->pixelformat));
+}
+
+/* No picture is written after the first failure, as when the save stopped the capture loop itself. */
+static void set_save_failed(void)
+{
+    __atomic_store_n(&save_failed, 1, __ATOMIC_RELAXED);
+}
+
+static struct graph_frame *save_frame_node(struct graph_node *node, struct graph_frame *frame)
+{
+    struct frame_save *save = node->priv;
+
+    if (save_image(&frame->pix, frame->buffer, &save->roi))
+        set_save_failed();
+    return frame;
+}
+
+/* Raw frames stay raw for recording and publishing, only a saved picture is demosaiced, off the capture thread. */
+static struct graph_frame *demosaic_node(struct graph_node *node, struct graph_frame *frame)
+{
+    struct frame_save *save = node->priv;
+    struct demosaic *d = save->demosaic;
+    struct graph_frame *out;
+    struct image_view view;
+
+    if (image_get_view(&frame->pix, frame->buffer, save->roi.width ? &save->roi : NULL, &view)) {
+        set_save_failed();
+        return NULL;
+    }
+    out = graph_frame_alloc(node->graph, frame, d->out_size);
+    if (!out)
+        return NULL;
+    if (demosaic_process(d, &view, &out->buffer)) {
+        set_save_failed();
+        graph_frame_unref(out);
+        return NULL;
+    }
+    out->pix.pixelformat = V4L2_PIX_FMT_RGB24;
+    out->pix.width = d->out_width;
+    out->pix.height = d->out_height;
+    out->pix.bytesperline = d->out_width * 3;
+    out->pix.sizeimage = d->out_size;
+    return out;
+}
+
+static struct graph_frame *save_ppm_node(struct graph_node *node, struct graph_frame *frame)
+{
+    struct image_view view = {
+        .addr           = frame->buffer.addr,
+        .width          = frame->pix.width,
+        .height         = frame->pix.height,
+        .stride         = frame->pix.bytesperline,
+        .pixelformat    = frame->pix.pixelformat,
+    };
+
+    (void) node;
+    if (save_view(&view, "ppm"))
+        set_save_failed();
+    return frame;
+}
+
+/* The branch that saves pictures, raw Bayer goes through a demosaic node first. */
+static struct graph_node *add_save_node(struct graph *graph, struct v4l2_camera *cam, int policy)
+{
+    struct v4l2_pix_format *pix = &cam->fmt.fmt.pix;
+    uint32_t width = pix->width, height = pix->height;
+    struct graph_node *node;
+
+    frame_roi(cam, &frame_save.roi);
+    if (!bayer_lookup(pix->pixelformat, NULL))
+        return graph_add_node(graph, NULL, "Save", save_frame_node, &frame_save, SAVE_QUEUE_DEPTH, policy);
+    /* The size image_get_view clamps the ROI to, or every frame would be refused. */
+    if (frame_save.roi.width) {
+        if ((uint32_t)frame_save.roi.left >= width || (uint32_t)frame_save.roi.top >= height) {
+            LOGE(DUMP_NONE, "ROI is outside the %ux%u frame\n", width, height);
+            return NULL;
+        }
+        width = frame_save.roi.width < width - frame_save.roi.left ? frame_save.roi.width : width - frame_save.roi.left;
+        height = frame_save.roi.height < height - frame_save.roi.top ? frame_save.roi.height :
+            height - frame_save.roi.top;
+    }
+    frame_save.demosaic = demosaic_create(pix->pixelformat, width & ~1, height & ~1, demosaic_method,
+            V4L2_PIX_FMT_RGB24);
+    if (!frame_save.demosaic)
+        return NULL;
+    node = graph_add_node(graph, NULL, "Demosaic", demosaic_node, &frame_save, SAVE_QUEUE_DEPTH, policy);
+    if (!node || !graph_add_node(graph, node, "Save", save_ppm_node, NULL, 0, 0))
+        return NULL;
+    return node;
+}
+
+static struct graph_frame *publish_node(struct graph_node *node, struct graph_frame *frame)
+{
+    publisher_poll(node->priv);
+    publisher_publish(node->priv, &frame->info, frame->buffer);
+    return frame;
+}
+
+/* Only copies into reserved RAM, the disk waits until stream off. */
+static int burst_frame(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info, struct buffer buffer, void * priv_data)
+{
+    return burst_add(priv_data, buffer_info, buffer);
+}
+
+static int record_frame(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info, struct buffer buffer, void * priv_data)
+{
+    return recorder_write((struct recorder *)priv_data, buffer_info, buffer);
+}
+
+#ifdef __HAS_JPEG__
+static void encode_task(struct worker_task *task)
+{
+    struct jpeg_saver *saver = task->ctx;
+    struct time_recorder tr;
+    struct buffer jpeg;
+
+    time_recorder_start(&tr);
+    if (jpeg_encode_yuyv(&saver->pix, task->buffer, &saver->opts, &jpeg) == CAMERA_RETURN_SUCCESS) {
+        time_recorder_end(&tr);
+        time_recorder_print_time(&tr, "Encode jpeg");
+        if (save_buffer(jpeg, "jpg"))
+            set_save_failed();
+    } else {
+        set_save_failed();
+    }
+    frame_pool_put(saver->pool, task->buffer.addr);
+}
+
+static int encode_frame(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info, struct buffer buffer, void * priv_data)
+{
+    struct jpeg_saver *saver = priv_data;
+    struct worker_task task = {
+        .func   = encode_task,
+        .ctx    = saver,
+        .buffer = { NULL, buffer.size },
+        .info   = *buffer_info,
+    };
+
+    /* Checked before taking a slot, a slot taken and not submitted would never come back. */
+    if (buffer.size > saver->pool->frame_size) {
+        LOGE(DUMP_NONE, "Frame size %zu exceeds the encode pool\n", buffer.size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    task.buffer.addr = frame_pool_get(saver->pool);
+    if (!task.buffer.addr)
+        return CAMERA_RETURN_FAILURE;
+    memcpy(task.buffer.addr, buffer.addr, buffer.size);
+    worker_pool_submit(saver->workers, &task);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int jpeg_saver_init(struct jpeg_saver *saver, struct v4l2_camera *cam, int threads)
+{
+    if (cam->fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV) {
+        LOGE(DUMP_NONE, "JPEG save needs YUYV, got %s\n", fmt2desc(cam->fmt.fmt.pix.pixelformat));
+        return CAMERA_RETURN_FAILURE;
+    }
+    saver->pix = cam->fmt.fmt.pix;
+    /* Every worker busy, a full queue and the frame being copied. */
+    saver->pool = frame_pool_create(cam->bufq.buf[0].size, threads * 3 + 1, 0, 0);
+    if (!saver->pool)
+        return CAMERA_RETURN_FAILURE;
+    saver->workers = worker_pool_create("jpeg", threads, threads * 2, rt_profile, RT_ROLE_WORKER);
+    if (!saver->workers) {
+        frame_pool_destroy(saver->pool);
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static void jpeg_saver_destroy(struct jpeg_saver *saver)
+{
+    /* Drains the queue, so every captured frame is written. */
+    worker_pool_destroy(saver->workers);
+    frame_pool_destroy(saver->pool);
+}
+#endif
+
+static void stop_stream(int sig)
+{
+    if (active_stream)
+        camera_stream_wakeup(active_stream);
+}
+
+/* The library runs the capture cycle, Ctrl-C still finishes the recording cleanly. */
+static void mainloop_noui(struct v4l2_camera *cam, int count, frame_func func, void *priv_data)
+{
+    struct frame_handler handler = { func, priv_data };
+    struct sigaction sa, old_sa;
+
+    active_stream = camera_stream_create(cam, handle_frame, &handler,
+            (latest_only ? STREAM_LATEST : 0) | (recover ? STREAM_RECOVER : 0));
+    if (!active_stream)
         return;
-    while(i++ < count)
-    {
-        /* EAGAIN - continue select loop. */
-        while((ret = read_frame(cam, save_frame, NULL)) == -EAGAIN);
-        if (ret == CAMERA_RETURN_FAILURE)
-            break;
+    ZAP(sa);
+    sa.sa_handler = stop_stream;
+    sigaction(SIGINT, &sa, &old_sa);
+    if (schedule.mode != SCHEDULE_ALL) {
+        schedule_run(&schedule, active_stream, count);
+    } else if (camera_stream_start(active_stream) == CAMERA_RETURN_SUCCESS) {
+        time_breakdown_mark(&startup, "Stream on");
+        camera_stream_run(active_stream, count);
+        camera_stream_stop(active_stream);
     }
-    camera_stop_capturing(cam);
+    sigaction(SIGINT, &old_sa, NULL);
+    if (active_stream->errors)
+        LOGI("Dropped %llu corrupt frames\n", (unsigned long long)active_stream->errors);
+    if (active_stream->recoveries)
+        LOGI("Recovered the stream %llu times\n", (unsigned long long)active_stream->recoveries);
+    if (jitter_report)
+        rt_jitter_report(&jitter);
+    camera_stream_destroy(active_stream);
+    active_stream = NULL;
 }
 
 #ifdef __HAS_GUI__
@@ -78,15 +431,79 @@ static void edit_control(struct v4l2_camera *cam)
     set_log_level(cur_level);
 }
 
-static void mainloop(struct v4l2_camera *cam)
+/* Without a preallocated set the switch reallocated, the new buffers aren't prefaulted or locked yet. */
+static int switch_mode(struct v4l2_camera *cam)
+{
+    if (camera_switch_mode(cam))
+        return CAMERA_RETURN_FAILURE;
+    if (rt_profile && !cam->alt_bufq.count)
+        rt_prepare_buffers(rt_profile, cam);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* One frame in the still mode and back, the preview pipeline never sees it. */
+static int capture_still(struct v4l2_camera *cam)
+{
+    struct v4l2_buffer buffer_info;
+    struct buffer buffer;
+    struct v4l2_rect roi;
+    struct time_recorder tr;
+    int ret;
+
+    time_recorder_start(&tr);
+    if (switch_mode(cam))
+        return CAMERA_RETURN_FAILURE;
+    while ((ret = camera_dequeue_buffer(cam, &buffer_info)) == -EAGAIN);
+    if (ret == CAMERA_RETURN_SUCCESS) {
+        time_recorder_end(&tr);
+        time_recorder_print_time(&tr, "Still frame");
+        camera_get_buffer(cam, &buffer_info, &buffer);
+        frame_roi(cam, &roi);
+        ret = save_image(&cam->fmt.fmt.pix, buffer, &roi);
+        if (camera_queue_buffer(cam, &buffer_info))
+            ret = CAMERA_RETURN_FAILURE;
+    }
+    if (cam->state == CAMERA_STATE_ERROR || switch_mode(cam))
+        return CAMERA_RETURN_FAILURE;
+    return ret;
+}
+
+/* Events are handled while waiting, a source change would otherwise fail the dequeue. */
+static int wait_frame(struct v4l2_camera *cam)
+{
+    struct pollfd pfd = { .events = POLLIN | POLLPRI };
+
+    if (camera_get_poll_fd(cam, &pfd.fd))
+        return CAMERA_RETURN_FAILURE;
+    for (;;) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return CAMERA_RETURN_FAILURE;
+        }
+        if ((pfd.revents & POLLPRI) && camera_dispatch_events(cam) < 0)
+            return CAMERA_RETURN_FAILURE;
+        if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+            return CAMERA_RETURN_SUCCESS;
+    }
+}
+
+static void mainloop(struct v4l2_camera *cam, int still)
 {
     int ret;
     int save_flag = 0;
     int action, running = 1;
+
+    /* Preview and control edits always act on the freshest frame. */
+    latest_only = 1;
     camera_start_capturing(cam);
+    time_breakdown_mark(&startup, "Stream on");
     while (running) {
-        while((ret = read_frame(cam, display_frame, &save_flag)) == -EAGAIN);
-        if (ret != CAMERA_RETURN_SUCCESS)
+        graph_node_enable(save_node, save_flag);
+        if (wait_frame(cam))
+            break;
+        while((ret = read_frame(cam, NULL, NULL)) == -EAGAIN);
+        if (ret != CAMERA_RETURN_SUCCESS || display_failed || save_failed)
             break;
         action = window_get_event((struct window *)cam->priv);
         switch (action) {
@@ -94,7 +511,9 @@ static void mainloop(struct v4l2_camera *cam)
                 running = 0;
                 break;
             case ACTION_SAVE_PICTURE:
-                save_flag = 1;
+                if (still && capture_still(cam) && cam->state == CAMERA_STATE_ERROR)
+                    running = 0;
+                save_flag = !still;
                 break;
             case ACTION_EDIT_CONTROL:
                 edit_control(cam);
@@ -107,13 +526,35 @@ static void mainloop(struct v4l2_camera *cam)
 
     }
     camera_stop_capturing(cam);
+    if (jitter_report)
+        rt_jitter_report(&jitter);
 }
 #endif
 
 int main(int argc, char **argv)
 {
-    int opt, has_gui = 0, count = DEFAULT_FRAME_COUNT;
+    int opt, has_gui = 0, fast_start = 0, count = DEFAULT_FRAME_COUNT;
     struct v4l2_camera *cam = NULL;
+    struct v4l2_rect crop, *preview_crop = NULL, roi, *capture_roi = NULL;
+    char *publish_path = NULL, *record_path = NULL, *metrics_target = NULL;
+    int jpeg_save = 0, lossless = 0, threads = worker_default_threads();
+    struct recorder_options record_opts;
+    struct jpeg_saver saver;
+    struct recorder *recorder = NULL;
+    struct ae_config ae_config;
+    int ae_enable = 0;
+    size_t frame_size;
+    struct tnr_config tnr_config;
+    int tnr_enable = 0;
+    struct v4l2_pix_format still_pix;
+    char still_format[5] = { 0 };
+    int still = 0;
+    struct burst *burst = NULL;
+    uint32_t burst_count = 0;
+    uint64_t burst_budget = 0;
+    char *trace_path = NULL, *trace_arg;
+    uint32_t trace_events = 0;
+    int status = EXIT_SUCCESS;
 
     cam = camera_create_object();
     if (!cam) {
@@ -121,8 +562,9 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    rt_profile_init(&rt);
     LOGI("Parsing command line args:\n");
-    while ((opt = getopt(argc, argv, "?vgp:w:h:f:n:")) != -1) {
+    while ((opt = getopt(argc, argv, "?vgFjlLep:w:h:f:m:n:b:c:C:D:N:P:R:s:S:M:T:r:J:W:A:")) != -1) {
         switch(opt){
             case 'v':
                 LOGI("Verbose log\n");
@@ -132,6 +574,10 @@ int main(int argc, char **argv)
                 LOGI("Gui mode\n");
                 has_gui = 1;
                 break;
+            case 'F':
+                LOGI("Fast start\n");
+                fast_start = 1;
+                break;
             case 'p':
                 cam->dev_name = optarg;
                 LOGI("Device path: %s\n", cam->dev_name);
@@ -149,7 +595,141 @@ int main(int argc, char **argv)
                     count = DEFAULT_FRAME_COUNT;
                 LOGI("Frame total: %d\n", count);
                 break;
+            case 'c':
+                ZAP(crop);
+                if (sscanf(optarg, "%d,%d,%u,%u", &crop.left, &crop.top, &crop.width, &crop.height) != 4) {
+                    help();
+                    goto out_free;
+                }
+                preview_crop = &crop;
+                LOGI("Preview crop: %ux%u@(%d,%d)\n", crop.width, crop.height, crop.left, crop.top);
+                break;
+            case 'C':
+                ZAP(roi);
+                if (sscanf(optarg, "%d,%d,%u,%u", &roi.left, &roi.top, &roi.width, &roi.height) != 4) {
+                    help();
+                    goto out_free;
+                }
+                capture_roi = &roi;
+                LOGI("Capture ROI: %ux%u@(%d,%d)\n", roi.width, roi.height, roi.left, roi.top);
+                break;
+            case 'P':
+                publish_path = optarg;
+                LOGI("Publish path: %s\n", publish_path);
+                break;
+            case 'R':
+                record_path = optarg;
+                LOGI("Record path: %s\n", record_path);
+                break;
+            case 'r':
+                if (rt_profile_parse(&rt, optarg)) {
+                    help();
+                    goto out_free;
+                }
+                rt_profile = &rt;
+                LOGI("RT profile: %s\n", optarg);
+                break;
+            case 'j':
+                jitter_report = 1;
+                break;
+            case 'l':
+                LOGI("Latest frame only\n");
+                latest_only = 1;
+                break;
+            case 'e':
+                LOGI("Recover from stream errors\n");
+                recover = 1;
+                break;
+            case 'J':
+                ZAP(saver);
+                if (jpeg_parse_options(&saver.opts, optarg)) {
+                    help();
+                    goto out_free;
+                }
+                jpeg_save = 1;
+                LOGI("JPEG quality %d\n", saver.opts.quality);
+                break;
+            case 'b':
+                if (burst_parse_options(optarg, &burst_count, &burst_budget)) {
+                    help();
+                    goto out_free;
+                }
+                LOGI("Burst of %u frames\n", burst_count);
+                break;
+            case 'L':
+                LOGI("Lossless recording\n");
+                lossless = 1;
+                break;
+            case 'W':
+                threads = atoi(optarg);
+                LOGI("Worker threads: %d\n", threads);
+                break;
+            case 'A':
+                if (ae_parse_config(&ae_config, optarg)) {
+                    help();
+                    goto out_free;
+                }
+                ae_enable = 1;
+                LOGI("Auto exposure target: %d\n", ae_config.target);
+                break;
+            case 'N':
+                if (tnr_parse_config(&tnr_config, optarg)) {
+                    help();
+                    goto out_free;
+                }
+                tnr_enable = 1;
+                LOGI("Noise reduction strength %d, motion threshold %d\n", tnr_config.strength, tnr_config.threshold);
+                break;
+            case 'S':
+                if (schedule_parse(&schedule, optarg)) {
+                    help();
+                    goto out_free;
+                }
+                LOGI("Schedule: %s\n", optarg);
+                break;
+            case 'M':
+                metrics_target = optarg;
+                LOGI("Metrics target: %s\n", metrics_target);
+                break;
+            case 'T':
+                trace_path = optarg;
+                trace_arg = strrchr(optarg, ',');
+                if (trace_arg) {
+                    *trace_arg++ = '\0';
+                    trace_events = strtoul(trace_arg, NULL, 0);
+                }
+                LOGI("Trace: %s\n", trace_path);
+                break;
+            case 's':
+                cam->replay_speed = atof(optarg);
+                LOGI("Replay speed: %.2f\n", cam->replay_speed);
+                break;
+            case 'm':
+                ZAP(still_pix);
+                if (sscanf(optarg, "%ux%u,%4s", &still_pix.width, &still_pix.height, still_format) < 2 ||
+                        !still_pix.width || !still_pix.height || (still_format[0] && strlen(still_format) != 4)) {
+                    help();
+                    goto out_free;
+                }
+                still_pix.pixelformat = still_format[0] ? v4l2_fourcc(still_format[0], still_format[1],
+                        still_format[2], still_format[3]) : 0;
+                still = 1;
+                LOGI("Still mode %ux%u\n", still_pix.width, still_pix.height);
+                break;
+            case 'D':
+                demosaic_method = demosaic_parse_method(optarg);
+                if (demosaic_method < 0) {
+                    help();
+                    goto out_free;
+                }
+                LOGI("Demosaic: %s\n", optarg);
+                break;
             case 'f':
+                if (strlen(optarg) == 4) {
+                    cam->fmt.fmt.pix.pixelformat = v4l2_fourcc(optarg[0], optarg[1], optarg[2], optarg[3]);
+                    LOGI("Format: %s\n", optarg);
+                    break;
+                }
                 switch (*optarg) {
                     case '1':
                         cam->fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
@@ -170,10 +750,38 @@ int main(int argc, char **argv)
         }
     }
     LOGI("Parsing command line args done\n");
+    /* A burst keeps consecutive frames, a schedule would skip or restart in between. */
+    if (burst_count && schedule.mode != SCHEDULE_ALL) {
+        LOGE(DUMP_NONE, "-b can't be combined with -S\n");
+        status = EXIT_FAILURE;
+        goto out_free;
+    }
+    /*
+     * Bursts run from the noui loop only. They lock their own region within
+     * the budget, which -r locking everything would override, and the copies
+     * into it would show up as capture jitter in -j.
+     */
+    if (burst_count && (has_gui || rt_profile || jitter_report)) {
+        LOGE(DUMP_NONE, "-b can't be combined with -g, -r or -j\n");
+        status = EXIT_FAILURE;
+        goto out_free;
+    }
+    if (metrics_target && metrics_export_start(metrics_target))
+        goto out_free;
+    if (trace_path && trace_start(trace_path, trace_events))
+        goto out_free;
+    if (rt_profile) {
+        rt_lock_memory(rt_profile);
+        rt_enter_thread(rt_profile, RT_ROLE_CAPTURE);
+    }
+    time_breakdown_start(&startup);
+    startup_pending = 1;
     if (camera_open_device(cam))
         goto out_free;
+    time_breakdown_mark(&startup, "Open");
     if (camera_query_cap(cam))
         goto out_close;
+    time_breakdown_mark(&startup, "Query cap");
     if(!(cam->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
     {
         LOGE(DUMP_NONE, "%s is no video capture device\n", cam->dev_name);
@@ -184,35 +792,169 @@ int main(int argc, char **argv)
         LOGE(DUMP_NONE, "%s does not support streaming i/o\n", cam->dev_name);
         goto out_close;
     }
-    camera_query_support_control(cam);
-    camera_query_support_format(cam);
+    if (fast_start && camera_load_profile(cam, NULL) == CAMERA_RETURN_SUCCESS) {
+        time_breakdown_mark(&startup, "Load profile");
+    } else {
+        camera_query_support_control(cam);
+        camera_query_support_format(cam);
+        time_breakdown_mark(&startup, "Enumerate");
+        if (fast_start)
+            camera_save_profile(cam, NULL);
+    }
 
+    if (capture_roi && camera_set_roi(cam, capture_roi))
+        goto out_close;
     if (camera_set_output_format(cam))
         goto out_close;
+    time_breakdown_mark(&startup, "Set format");
 
-    /* Note VIDIOC_S_FMT may change width and height. */
-    camera_get_output_format(cam);
+    /* Note VIDIOC_S_FMT may change width and height, S_FMT already returns it in fast start. */
+    if (!fast_start) {
+        camera_get_output_format(cam);
+        time_breakdown_mark(&startup, "Get format");
+    }
 
     if (camera_request_and_map_buffer(cam))
         goto out_close;
+    time_breakdown_mark(&startup, "Request buffer");
+    consumer_pix = cam->fmt.fmt.pix;
+    camera_subscribe_events(cam, CAMERA_EVENT_ALL, handle_event, &consumer_pix);
+    if (still && has_gui) {
+        if (!still_pix.pixelformat)
+            still_pix.pixelformat = cam->fmt.fmt.pix.pixelformat;
+        if (camera_prepare_mode(cam, &still_pix))
+            goto out_unmap;
+    }
+    if (rt_profile)
+        rt_prepare_buffers(rt_profile, cam);
+    if (ae_enable) {
+        if (ae_init(&ae, cam, &ae_config))
+            goto out_unmap;
+        auto_exposure = &ae;
+    }
+    if (tnr_enable) {
+        tnr = tnr_create(&cam->fmt.fmt.pix, cam->bufq.buf[0].size, &tnr_config);
+        if (!tnr)
+            goto out_unmap;
+    }
+
+    if (publish_path) {
+        publisher = publisher_create(publish_path, &cam->fmt.fmt.pix, cam->bufq.buf[0].size);
+        if (!publisher)
+            goto out_unmap;
+    }
+
+    if (burst_count && !has_gui) {
+        burst = burst_create(&cam->fmt.fmt.pix, cam->bufq.buf[0].size, burst_count, burst_budget);
+        if (!burst)
+            goto out_unpublish;
+        count = burst_count;
+    }
+
+    if (record_path && !has_gui && !burst) {
+        record_opts.codec = lossless ? RECORD_CODEC_LOSSLESS : RECORD_CODEC_RAW;
+        record_opts.threads = threads;
+        record_opts.rt = rt_profile;
+        recorder = recorder_create(record_path, &cam->fmt, cam->bufq.buf[0].size, count, &record_opts);
+        if (!recorder)
+            goto out_unpublish;
+    }
+
+    /* Consumers that must not hold up the capture buffer run as graph branches. */
+    frame_size = cam->bufq.buf[0].size;
+    if (bayer_lookup(cam->fmt.fmt.pix.pixelformat, NULL) &&
+            frame_size < (size_t)cam->fmt.fmt.pix.width * cam->fmt.fmt.pix.height * 3)
+        frame_size = (size_t)cam->fmt.fmt.pix.width * cam->fmt.fmt.pix.height * 3;
+    graph = graph_create(&cam->fmt.fmt.pix, frame_size, rt_profile);
+    if (!graph)
+        goto out_record;
+    if (publisher && !graph_add_node(graph, NULL, "Publish", publish_node, publisher, 1, GRAPH_DROP_OLDEST))
+        goto out_graph;
+    if (has_gui) {
+#ifdef __HAS_GUI__
+        if (!graph_add_node(graph, NULL, "Display", display_node, cam, 0, 0))
+            goto out_graph;
+        /* Saving a picture never stalls the preview, a busy disk drops the request. */
+        save_node = add_save_node(graph, cam, GRAPH_DROP_NEWEST);
+        if (!save_node)
+            goto out_graph;
+#endif
+    } else if (!recorder && !jpeg_save && !burst) {
+        /* Every counted frame is saved, a full queue holds capture like the synchronous save did. */
+        if (!add_save_node(graph, cam, GRAPH_BLOCK))
+            goto out_graph;
+    }
+    if (graph_start(graph))
+        goto out_graph;
 
     if (!has_gui) {
-        mainloop_noui(cam, count);
+        if (burst) {
+            /* Every frame counts, the newest only mode would skip some on purpose. */
+            latest_only = 0;
+            mainloop_noui(cam, count, burst_frame, burst);
+            if (burst_flush(burst, fmt2desc(cam->fmt.fmt.pix.pixelformat), threads))
+                status = EXIT_FAILURE;
+        } else if (recorder) {
+            mainloop_noui(cam, count, record_frame, recorder);
+        } else if (jpeg_save) {
+#ifdef __HAS_JPEG__
+            if (jpeg_saver_init(&saver, cam, threads) == CAMERA_RETURN_SUCCESS) {
+                mainloop_noui(cam, count, encode_frame, &saver);
+                jpeg_saver_destroy(&saver);
+            }
+#else
+            LOGE(DUMP_NONE, "JPEG support is disabled\n");
+#endif
+        } else {
+            mainloop_noui(cam, count, NULL, NULL);
+        }
     } else {
 #ifdef __HAS_GUI__
-        cam->priv = window_create(cam->fmt.fmt.pix.width, cam->fmt.fmt.pix.height);
-        mainloop(cam);
-        window_destory((struct window *)cam->priv);
+        cam->priv = window_create(&cam->fmt.fmt.pix, preview_crop);
+        if (cam->priv) {
+            mainloop(cam, still);
+            window_destory((struct window *)cam->priv);
+        }
 #else
+        (void) preview_crop;
         LOGE(DUMP_NONE, "GUI build is disabled\n");
 #endif
     }
 
+    graph_stop(graph);
+    graph_dump_stats(graph);
+    if (save_failed) {
+        LOGE(DUMP_NONE, "Saving pictures failed\n");
+        status = EXIT_FAILURE;
+    }
+
+out_graph:
+    graph_destroy(graph);
+    graph = NULL;
+    demosaic_destroy(frame_save.demosaic);
+out_record:
+    if (recorder_close(recorder))
+        status = EXIT_FAILURE;
+
+out_unpublish:
+    burst_destroy(burst);
+    if (publisher) {
+        publisher_dump_stats(publisher);
+        publisher_destroy(publisher);
+    }
+
+out_unmap:
+    ae_destroy(auto_exposure, cam);
+    auto_exposure = NULL;
+    tnr_destroy(tnr);
+    tnr = NULL;
     camera_return_and_unmap_buffer(cam);
 
 out_close:
     camera_close_device(cam);
 out_free:
+    trace_stop();
+    metrics_export_stop();
     camera_free_object(cam);
-    return CAMERA_RETURN_SUCCESS;
+    return status;
 }
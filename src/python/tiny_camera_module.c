@@ -0,0 +1,609 @@
+/*
+ * Python binding. Frames expose the mapped capture buffer through the
+ * buffer protocol, so numpy.frombuffer(frame, numpy.uint8) wraps it with
+ * no copy. The buffer goes back to the driver when the frame is released,
+ * explicitly or with its last reference, so arrays must not outlive it.
+ * Like the C state machine only one frame is held at a time. The GIL is
+ * dropped while waiting for and dequeuing a frame.
+ *
+ *     import numpy, tiny_camera
+ *     with tiny_camera.Camera("/dev/video0", width=640, height=480) as cam:
+ *         cam.start()
+ *         for frame in cam:
+ *             luma = numpy.frombuffer(frame, numpy.uint8)[::2].mean()
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+#include <poll.h>
+#include <time.h>
+
+#include "camera.h"
+#include "api.h"
+#include "util.h"
+#include "log.h"
+
+typedef struct {
+    PyObject_HEAD
+    struct v4l2_camera  *cam;
+    char                *device;            /* cam->dev_name points here */
+    PyObject            *held;              /* Frame not yet requeued, borrowed */
+    int                 busy;               /* A thread is in dequeue without the GIL */
+} CameraObject;
+
+typedef struct {
+    PyObject_HEAD
+    CameraObject        *camera;            /* NULL once requeued */
+    struct v4l2_buffer  info;
+    struct buffer       buffer;
+    Py_ssize_t          exports;            /* Live buffer protocol views */
+    unsigned int        width;
+    unsigned int        height;
+    unsigned int        bytesperline;
+    unsigned int        pixelformat;
+} FrameObject;
+
+static PyObject *camera_error;
+static PyTypeObject FrameType;
+
+/* Frame */
+
+static int frame_requeue(FrameObject *self)
+{
+    CameraObject *camera = self->camera;
+    int ret;
+
+    if (!camera)
+        return CAMERA_RETURN_SUCCESS;
+    ret = camera_queue_buffer(camera->cam, &self->info);
+    camera->held = NULL;
+    self->camera = NULL;
+    Py_DECREF(camera);
+    return ret;
+}
+
+static PyObject *frame_release(FrameObject *self, PyObject *unused)
+{
+    if (self->exports) {
+        PyErr_SetString(PyExc_BufferError, "Frame is still exported, drop the arrays over it first");
+        return NULL;
+    }
+    if (frame_requeue(self) != CAMERA_RETURN_SUCCESS) {
+        PyErr_SetString(camera_error, "camera_queue_buffer failed");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *frame_enter(FrameObject *self, PyObject *unused)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *frame_exit(FrameObject *self, PyObject *args)
+{
+    return frame_release(self, NULL);
+}
+
+/* Views keep the frame alive, so no export is left by the time it goes. */
+static void frame_dealloc(FrameObject *self)
+{
+    frame_requeue(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Read only, a replayed frame may point into a read only file mapping. */
+static int frame_getbuffer(FrameObject *self, Py_buffer *view, int flags)
+{
+    if (!self->camera) {
+        PyErr_SetString(PyExc_BufferError, "Frame already released");
+        view->obj = NULL;
+        return -1;
+    }
+    if (PyBuffer_FillInfo(view, (PyObject *)self, self->buffer.addr, self->buffer.size, 1, flags))
+        return -1;
+    self->exports++;
+    return 0;
+}
+
+static void frame_releasebuffer(FrameObject *self, Py_buffer *view)
+{
+    self->exports--;
+}
+
+static Py_ssize_t frame_length(FrameObject *self)
+{
+    return self->camera ? (Py_ssize_t)self->buffer.size : 0;
+}
+
+static PyObject *frame_get_timestamp(FrameObject *self, void *closure)
+{
+    return PyFloat_FromDouble(self->info.timestamp.tv_sec + self->info.timestamp.tv_usec / 1e6);
+}
+
+static PyObject *frame_get_fourcc(FrameObject *self, void *closure)
+{
+    return PyUnicode_FromString(fmt2desc(self->pixelformat));
+}
+
+static PyObject *frame_get_released(FrameObject *self, void *closure)
+{
+    return PyBool_FromLong(!self->camera);
+}
+
+static PyMethodDef frame_methods[] = {
+    { "release", (PyCFunction)frame_release, METH_NOARGS, "Requeue the buffer, fails while it is still exported." },
+    { "__enter__", (PyCFunction)frame_enter, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction)frame_exit, METH_VARARGS, NULL },
+    { NULL }
+};
+
+static PyMemberDef frame_members[] = {
+    { "sequence", T_UINT, offsetof(FrameObject, info.sequence), READONLY, "Driver frame counter" },
+    { "index", T_UINT, offsetof(FrameObject, info.index), READONLY, "V4L2 buffer index" },
+    { "flags", T_UINT, offsetof(FrameObject, info.flags), READONLY, "V4L2_BUF_FLAG_*" },
+    { "width", T_UINT, offsetof(FrameObject, width), READONLY, NULL },
+    { "height", T_UINT, offsetof(FrameObject, height), READONLY, NULL },
+    { "bytesperline", T_UINT, offsetof(FrameObject, bytesperline), READONLY, "Row stride, 0 for compressed formats" },
+    { NULL }
+};
+
+static PyGetSetDef frame_getset[] = {
+    { "timestamp", (getter)frame_get_timestamp, NULL, "Capture time in seconds", NULL },
+    { "fourcc", (getter)frame_get_fourcc, NULL, NULL, NULL },
+    { "released", (getter)frame_get_released, NULL, NULL, NULL },
+    { NULL }
+};
+
+static PyBufferProcs frame_as_buffer = {
+    .bf_getbuffer       = (getbufferproc)frame_getbuffer,
+    .bf_releasebuffer   = (releasebufferproc)frame_releasebuffer,
+};
+
+static PySequenceMethods frame_as_sequence = {
+    .sq_length          = (lenfunc)frame_length,
+};
+
+static PyTypeObject FrameType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name            = "tiny_camera.Frame",
+    .tp_doc             = "A dequeued capture buffer, requeued on release.",
+    .tp_basicsize       = sizeof(FrameObject),
+    .tp_flags           = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc         = (destructor)frame_dealloc,
+    .tp_as_buffer       = &frame_as_buffer,
+    .tp_as_sequence     = &frame_as_sequence,
+    .tp_methods         = frame_methods,
+    .tp_members         = frame_members,
+    .tp_getset          = frame_getset,
+};
+
+/* Camera */
+
+static int camera_check(CameraObject *self)
+{
+    if (!self->cam) {
+        PyErr_SetString(camera_error, "Camera is closed");
+        return CAMERA_RETURN_FAILURE;
+    }
+    if (self->busy) {
+        PyErr_SetString(camera_error, "Camera is busy in another thread");
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Mirrors the C++ binding, any state the camera got to is unwound, errors included. */
+static void camera_release(CameraObject *self)
+{
+    struct v4l2_camera *cam = self->cam;
+
+    if (!cam)
+        return;
+    camera_shutdown(cam);
+    camera_free_object(cam);
+    self->cam = NULL;
+}
+
+static int camera_init(CameraObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "device", "width", "height", "fourcc", "replay_speed", "events", NULL };
+    const char *device, *fourcc = "YUYV";
+    unsigned int width = DEFAULT_IMAGE_WIDTH, height = DEFAULT_IMAGE_HEIGHT;
+    float replay_speed = 1.0;
+    int events = 1;
+    struct v4l2_camera *cam;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|IIsfp", kwlist, &device, &width, &height, &fourcc,
+                &replay_speed, &events))
+        return -1;
+    if (strlen(fourcc) != 4) {
+        PyErr_Format(PyExc_ValueError, "fourcc must be 4 characters, got '%s'", fourcc);
+        return -1;
+    }
+    if (self->held) {
+        PyErr_SetString(camera_error, "A frame is still held");
+        return -1;
+    }
+    camera_release(self);
+    PyMem_Free(self->device);
+    self->device = PyMem_Malloc(strlen(device) + 1);
+    if (!self->device) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    strcpy(self->device, device);
+    cam = self->cam = camera_create_object();
+    if (!cam) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    cam->dev_name = self->device;
+    cam->fmt.fmt.pix.width = width;
+    cam->fmt.fmt.pix.height = height;
+    cam->fmt.fmt.pix.pixelformat = v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+    cam->replay_speed = replay_speed;
+    if (camera_open_device(cam) || camera_query_cap(cam))
+        goto err_release;
+    if (!(cam->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(cam->cap.capabilities & V4L2_CAP_STREAMING)) {
+        PyErr_Format(camera_error, "%s is no streaming capture device", device);
+        camera_release(self);
+        return -1;
+    }
+    if (events)
+        camera_query_support_control(cam);
+    if (camera_set_output_format(cam))
+        goto err_release;
+    camera_get_output_format(cam);
+    if (camera_request_and_map_buffer(cam))
+        goto err_release;
+    /* No callback, a source change only shows in the size of the next frames. */
+    if (events)
+        camera_subscribe_events(cam, CAMERA_EVENT_ALL, NULL, NULL);
+    return 0;
+
+err_release:
+    PyErr_Format(camera_error, "Setting up %s failed", device);
+    camera_release(self);
+    return -1;
+}
+
+static void camera_dealloc(CameraObject *self)
+{
+    camera_release(self);
+    PyMem_Free(self->device);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *camera_start(CameraObject *self, PyObject *unused)
+{
+    if (camera_check(self))
+        return NULL;
+    if (camera_start_capturing(self->cam)) {
+        PyErr_SetString(camera_error, "camera_start_capturing failed");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *camera_stop(CameraObject *self, PyObject *unused)
+{
+    if (camera_check(self))
+        return NULL;
+    if (self->held) {
+        PyErr_SetString(camera_error, "A frame is still held");
+        return NULL;
+    }
+    if (camera_stop_capturing(self->cam)) {
+        PyErr_SetString(camera_error, "camera_stop_capturing failed");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *camera_close(CameraObject *self, PyObject *unused)
+{
+    if (self->busy) {
+        PyErr_SetString(camera_error, "Camera is busy in another thread");
+        return NULL;
+    }
+    if (self->held) {
+        PyErr_SetString(camera_error, "A frame is still held");
+        return NULL;
+    }
+    camera_release(self);
+    Py_RETURN_NONE;
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait without the GIL until a frame is ready, handling V4L2 events on
+ * the way. 1 when ready, 0 on timeout, or a negative errno like
+ * camera_dispatch_events(), with -EINTR to let signal handlers run.
+ */
+static int wait_frame(struct v4l2_camera *cam, int64_t deadline)
+{
+    struct pollfd pfd = { .events = POLLIN | POLLPRI };
+    int n, ret;
+
+    if (camera_get_poll_fd(cam, &pfd.fd))
+        return -EIO;
+    for (;;) {
+        n = poll(&pfd, 1, deadline < 0 ? -1 : deadline > now_ms() ? deadline - now_ms() : 0);
+        if (n < 0)
+            return errno == EINTR ? -EINTR : -EIO;
+        if (!n)
+            return 0;
+        if (pfd.revents & POLLPRI) {
+            ret = camera_dispatch_events(cam);
+            if (ret < 0)
+                return ret;
+        }
+        if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+            return 1;
+    }
+}
+
+/* deadline in now_ms() time, -1 to wait for ever. */
+static PyObject *dequeue_frame(CameraObject *self, int latest, int64_t deadline)
+{
+    struct v4l2_camera *cam = self->cam;
+    FrameObject *frame;
+    struct v4l2_buffer info;
+    int ret;
+
+    if (camera_check(self))
+        return NULL;
+    if (self->held) {
+        PyErr_SetString(camera_error, "Release the previous frame first");
+        return NULL;
+    }
+    self->busy = 1;
+    do {
+        Py_BEGIN_ALLOW_THREADS
+        ret = wait_frame(cam, deadline);
+        if (ret > 0)
+            ret = latest ? camera_dequeue_latest(cam, &info) : camera_dequeue_buffer(cam, &info);
+        else if (!ret)
+            ret = -ETIMEDOUT;
+        Py_END_ALLOW_THREADS
+    } while ((ret == -EINTR && !PyErr_CheckSignals()) || ret == -EAGAIN);
+    self->busy = 0;
+
+    switch (ret) {
+        case CAMERA_RETURN_SUCCESS:
+            break;
+        case -EINTR:
+            return NULL;
+        case -ETIMEDOUT:
+            Py_RETURN_NONE;
+        case -ENODATA:
+            PyErr_SetString(PyExc_EOFError, "End of stream");
+            return NULL;
+        default:
+            PyErr_Format(camera_error, "Dequeue from %s failed: %s", cam->dev_name, strerror(ret < 0 ? -ret : EIO));
+            return NULL;
+    }
+
+    frame = PyObject_New(FrameObject, &FrameType);
+    if (!frame) {
+        camera_queue_buffer(cam, &info);
+        return NULL;
+    }
+    frame->info = info;
+    camera_get_buffer(cam, &info, &frame->buffer);
+    frame->exports = 0;
+    frame->width = cam->fmt.fmt.pix.width;
+    frame->height = cam->fmt.fmt.pix.height;
+    frame->bytesperline = cam->fmt.fmt.pix.bytesperline;
+    frame->pixelformat = cam->fmt.fmt.pix.pixelformat;
+    Py_INCREF(self);
+    frame->camera = self;
+    self->held = (PyObject *)frame;
+    return (PyObject *)frame;
+}
+
+static PyObject *camera_dequeue(CameraObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "latest", "timeout", NULL };
+    PyObject *timeout = Py_None;
+    int64_t deadline = -1;
+    double seconds;
+    int latest = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pO", kwlist, &latest, &timeout))
+        return NULL;
+    if (timeout != Py_None) {
+        seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1 && PyErr_Occurred())
+            return NULL;
+        deadline = now_ms() + (seconds > 0 ? (int64_t)(seconds * 1000) : 0);
+    }
+    return dequeue_frame(self, latest, deadline);
+}
+
+/* Like the C++ generator, moving on requeues the previous frame, unless arrays still use it. */
+static PyObject *camera_iternext(CameraObject *self)
+{
+    PyObject *frame, *ret;
+
+    if (self->held) {
+        ret = frame_release((FrameObject *)self->held, NULL);
+        if (!ret)
+            return NULL;
+        Py_DECREF(ret);
+    }
+    frame = dequeue_frame(self, 0, -1);
+
+    if (!frame && PyErr_ExceptionMatches(PyExc_EOFError))
+        PyErr_Clear();
+    return frame;
+}
+
+static PyObject *camera_get_control_value(CameraObject *self, PyObject *args)
+{
+    struct v4l2_control ctrl;
+
+    if (!PyArg_ParseTuple(args, "I", &ctrl.id) || camera_check(self))
+        return NULL;
+    if (camera_get_control(self->cam, &ctrl)) {
+        PyErr_Format(camera_error, "Get control 0x%x failed", ctrl.id);
+        return NULL;
+    }
+    return PyLong_FromLong(ctrl.value);
+}
+
+static PyObject *camera_set_control_value(CameraObject *self, PyObject *args)
+{
+    struct v4l2_control ctrl;
+
+    if (!PyArg_ParseTuple(args, "Ii", &ctrl.id, &ctrl.value) || camera_check(self))
+        return NULL;
+    if (camera_set_control(self->cam, &ctrl)) {
+        PyErr_Format(camera_error, "Set control 0x%x failed", ctrl.id);
+        return NULL;
+    }
+    return PyLong_FromLong(ctrl.value);
+}
+
+static PyObject *camera_enter(CameraObject *self, PyObject *unused)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *camera_exit(CameraObject *self, PyObject *args)
+{
+    return camera_close(self, NULL);
+}
+
+static struct v4l2_pix_format *camera_pix(CameraObject *self)
+{
+    static struct v4l2_pix_format none;
+
+    return self->cam ? &self->cam->fmt.fmt.pix : &none;
+}
+
+static PyObject *camera_get_width(CameraObject *self, void *closure)
+{
+    return PyLong_FromUnsignedLong(camera_pix(self)->width);
+}
+
+static PyObject *camera_get_height(CameraObject *self, void *closure)
+{
+    return PyLong_FromUnsignedLong(camera_pix(self)->height);
+}
+
+static PyObject *camera_get_bytesperline(CameraObject *self, void *closure)
+{
+    return PyLong_FromUnsignedLong(camera_pix(self)->bytesperline);
+}
+
+static PyObject *camera_get_fourcc(CameraObject *self, void *closure)
+{
+    return PyUnicode_FromString(fmt2desc(camera_pix(self)->pixelformat));
+}
+
+static PyObject *camera_get_streaming(CameraObject *self, void *closure)
+{
+    return PyBool_FromLong(self->cam && (self->cam->state == CAMREA_STATE_STREAM_ON ||
+                self->cam->state == CAMREA_STATE_BUFFER_LOCKED));
+}
+
+static PyMethodDef camera_methods[] = {
+    { "start", (PyCFunction)camera_start, METH_NOARGS, "Queue all buffers and stream on." },
+    { "stop", (PyCFunction)camera_stop, METH_NOARGS, "Stream off, no frame may be held." },
+    { "close", (PyCFunction)camera_close, METH_NOARGS, "Unmap the buffers and close the device." },
+    { "dequeue", (PyCFunction)camera_dequeue, METH_VARARGS | METH_KEYWORDS,
+        "dequeue(latest=False, timeout=None)\n\n"
+            "Next frame, or the newest one with latest. None on timeout, EOFError at the end of the stream." },
+    { "get_control", (PyCFunction)camera_get_control_value, METH_VARARGS, "get_control(id) -> value" },
+    { "set_control", (PyCFunction)camera_set_control_value, METH_VARARGS,
+        "set_control(id, value) -> value the driver settled on" },
+    { "__enter__", (PyCFunction)camera_enter, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction)camera_exit, METH_VARARGS, NULL },
+    { NULL }
+};
+
+static PyGetSetDef camera_getset[] = {
+    { "width", (getter)camera_get_width, NULL, NULL, NULL },
+    { "height", (getter)camera_get_height, NULL, NULL, NULL },
+    { "bytesperline", (getter)camera_get_bytesperline, NULL, NULL, NULL },
+    { "fourcc", (getter)camera_get_fourcc, NULL, NULL, NULL },
+    { "streaming", (getter)camera_get_streaming, NULL, NULL, NULL },
+    { NULL }
+};
+
+static PyTypeObject CameraType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name            = "tiny_camera.Camera",
+    .tp_doc             = "Camera(device, width=1920, height=1280, fourcc='YUYV', replay_speed=1.0, events=True)\n\n"
+        "Opened, configured and mapped on construction. device may be a recording.",
+    .tp_basicsize       = sizeof(CameraObject),
+    .tp_flags           = Py_TPFLAGS_DEFAULT,
+    .tp_new             = PyType_GenericNew,
+    .tp_init            = (initproc)camera_init,
+    .tp_dealloc         = (destructor)camera_dealloc,
+    .tp_iter            = PyObject_SelfIter,
+    .tp_iternext        = (iternextfunc)camera_iternext,
+    .tp_methods         = camera_methods,
+    .tp_getset          = camera_getset,
+};
+
+/* Module */
+
+static PyObject *module_set_log_level(PyObject *module, PyObject *args)
+{
+    int level;
+
+    if (!PyArg_ParseTuple(args, "i", &level))
+        return NULL;
+    set_log_level(level);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+    { "set_log_level", module_set_log_level, METH_VARARGS, "set_log_level(DEBUG | INFO | ERROR)" },
+    { NULL }
+};
+
+static struct PyModuleDef tiny_camera_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name             = "tiny_camera",
+    .m_doc              = "Zero copy V4L2 capture over libcamera_base.",
+    .m_size             = -1,
+    .m_methods          = module_methods,
+};
+
+PyMODINIT_FUNC PyInit_tiny_camera(void)
+{
+    PyObject *module;
+
+    if (PyType_Ready(&FrameType) < 0 || PyType_Ready(&CameraType) < 0)
+        return NULL;
+    module = PyModule_Create(&tiny_camera_module);
+    if (!module)
+        return NULL;
+    camera_error = PyErr_NewException("tiny_camera.error", PyExc_RuntimeError, NULL);
+    Py_XINCREF(camera_error);
+    Py_INCREF(&CameraType);
+    Py_INCREF(&FrameType);
+    if (PyModule_AddObject(module, "error", camera_error) ||
+            PyModule_AddObject(module, "Camera", (PyObject *)&CameraType) ||
+            PyModule_AddObject(module, "Frame", (PyObject *)&FrameType) ||
+            PyModule_AddIntConstant(module, "DEBUG", DEBUG) ||
+            PyModule_AddIntConstant(module, "INFO", INFO) ||
+            PyModule_AddIntConstant(module, "ERROR", ERROR)) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
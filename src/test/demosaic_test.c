@@ -0,0 +1,222 @@
+#include "test.h"
+#include "bayer.h"
+
+/* Odd widths in vectors, so every kernel runs a partial last vector. */
+#define WIDTH       (38)
+#define HEIGHT      (22)
+#define PAD         (6)                     /* Extra bytes per line, the stride is not the width */
+
+static const uint32_t patterns[][2] = {
+    { V4L2_PIX_FMT_SRGGB8, V4L2_PIX_FMT_SRGGB10 },
+    { V4L2_PIX_FMT_SGRBG8, V4L2_PIX_FMT_SGRBG10 },
+    { V4L2_PIX_FMT_SGBRG8, V4L2_PIX_FMT_SGBRG10 },
+    { V4L2_PIX_FMT_SBGGR8, V4L2_PIX_FMT_SBGGR10 },
+};
+
+/* Scalar reference, written from the description of each method rather than the vector code. */
+struct reference {
+    struct bayer_format format;
+    uint8_t raw[HEIGHT][WIDTH];             /* Normalized to 8 bits */
+    uint8_t green[HEIGHT][WIDTH];
+};
+
+static int reflect(int i, int n)
+{
+    return i < 0 ? -i : i >= n ? 2 * (n - 1) - i : i;
+}
+
+static int clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static int raw(struct reference *r, int x, int y)
+{
+    return r->raw[reflect(y, HEIGHT)][reflect(x, WIDTH)];
+}
+
+static int green(struct reference *r, int x, int y)
+{
+    return r->green[reflect(y, HEIGHT)][reflect(x, WIDTH)];
+}
+
+/* Red or blue sits at (x, y). */
+static int color_site(struct reference *r, int x, int y)
+{
+    int red_line = (y & 1) == r->format.red_y;
+
+    return (x & 1) == (red_line ? r->format.red_x : !r->format.red_x);
+}
+
+/* Hamilton-Adams green, along the smaller gradient with a second order correction. */
+static void reference_green(struct reference *r)
+{
+    int x, y, c, lh, lv, gh, gv, dh, dv, g;
+
+    for (y = 0; y < HEIGHT; y++) {
+        for (x = 0; x < WIDTH; x++) {
+            c = raw(r, x, y);
+            if (!color_site(r, x, y)) {
+                r->green[y][x] = c;
+                continue;
+            }
+            lh = 2 * c - raw(r, x - 2, y) - raw(r, x + 2, y);
+            lv = 2 * c - raw(r, x, y - 2) - raw(r, x, y + 2);
+            gh = ((raw(r, x - 1, y) + raw(r, x + 1, y)) * 2 + lh + 2) >> 2;
+            gv = ((raw(r, x, y - 1) + raw(r, x, y + 1)) * 2 + lv + 2) >> 2;
+            dh = abs(raw(r, x - 1, y) - raw(r, x + 1, y)) + abs(lh);
+            dv = abs(raw(r, x, y - 1) - raw(r, x, y + 1)) + abs(lv);
+            g = dh < dv ? gh : dv < dh ? gv : (gh + gv + 1) >> 1;
+            r->green[y][x] = clamp(g);
+        }
+    }
+}
+
+/* Difference of the raw sample to the full green at (x, y). */
+static int diff(struct reference *r, int x, int y)
+{
+    return raw(r, x, y) - green(r, x, y);
+}
+
+static void reference_pixel(struct reference *r, int method, int x, int y, uint8_t rgb[3])
+{
+    int red_line = (y & 1) == r->format.red_y, site = color_site(r, x, y);
+    int own, g, other, c = raw(r, x, y), top, bottom;
+
+    switch (method) {
+        case DEMOSAIC_HALF:
+            top = 2 * y + r->format.red_y;
+            bottom = 2 * y + !r->format.red_y;
+            rgb[0] = raw(r, 2 * x + r->format.red_x, top);
+            rgb[1] = (raw(r, 2 * x + !r->format.red_x, top) + raw(r, 2 * x + r->format.red_x, bottom) + 1) >> 1;
+            rgb[2] = raw(r, 2 * x + !r->format.red_x, bottom);
+            return;
+        case DEMOSAIC_BILINEAR:
+            if (site) {
+                own = c;
+                g = (raw(r, x, y - 1) + raw(r, x, y + 1) + raw(r, x - 1, y) + raw(r, x + 1, y) + 2) >> 2;
+                other = (raw(r, x - 1, y - 1) + raw(r, x + 1, y - 1) + raw(r, x - 1, y + 1) +
+                        raw(r, x + 1, y + 1) + 2) >> 2;
+            } else {
+                own = (raw(r, x - 1, y) + raw(r, x + 1, y) + 1) >> 1;
+                g = c;
+                other = (raw(r, x, y - 1) + raw(r, x, y + 1) + 1) >> 1;
+            }
+            break;
+        default:
+            g = green(r, x, y);
+            if (site) {
+                own = c;
+                other = clamp(g + ((diff(r, x - 1, y - 1) + diff(r, x + 1, y - 1) + diff(r, x - 1, y + 1) +
+                                diff(r, x + 1, y + 1)) >> 2));
+            } else {
+                own = clamp(g + ((diff(r, x - 1, y) + diff(r, x + 1, y)) >> 1));
+                other = clamp(g + ((diff(r, x, y - 1) + diff(r, x, y + 1)) >> 1));
+            }
+    }
+    rgb[0] = red_line ? own : other;
+    rgb[1] = g;
+    rgb[2] = red_line ? other : own;
+}
+
+static void reference_yuv(const uint8_t rgb[3], uint8_t yuv[3])
+{
+    yuv[0] = ((rgb[0] * 66 + rgb[1] * 129 + rgb[2] * 25 + 128) >> 8) + 16;
+    yuv[1] = (rgb[2] * 112 + 32896 - rgb[0] * 38 - rgb[1] * 74) >> 8;
+    yuv[2] = (rgb[0] * 112 + 32896 - rgb[1] * 94 - rgb[2] * 18) >> 8;
+}
+
+static void check_method(struct reference *r, struct image_view *view, int method, uint32_t out_format)
+{
+    struct demosaic *d = demosaic_create(view->pixelformat, WIDTH, HEIGHT, method, out_format);
+    uint8_t rgb[2][3], yuv[2][3], *p;
+    struct buffer out;
+    uint32_t x, y, i;
+
+    CHECK(d);
+    out.size = d->out_size;
+    out.addr = malloc(out.size);
+    CHECK(out.addr);
+    CHECK(demosaic_process(d, view, &out) == CAMERA_RETURN_SUCCESS);
+    for (y = 0; y < d->out_height; y++) {
+        if (out_format == V4L2_PIX_FMT_RGB24) {
+            for (x = 0; x < d->out_width; x++) {
+                p = (uint8_t *)out.addr + ((size_t)y * d->out_width + x) * 3;
+                reference_pixel(r, method, x, y, rgb[0]);
+                for (i = 0; i < 3; i++)
+                    CHECK(p[i] == rgb[0][i]);
+            }
+            continue;
+        }
+        for (x = 0; x < d->out_width; x += 2) {
+            p = (uint8_t *)out.addr + ((size_t)y * d->out_width + x) * 2;
+            reference_pixel(r, method, x, y, rgb[0]);
+            reference_pixel(r, method, x + 1, y, rgb[1]);
+            reference_yuv(rgb[0], yuv[0]);
+            reference_yuv(rgb[1], yuv[1]);
+            CHECK(p[0] == yuv[0][0] && p[2] == yuv[1][0]);
+            CHECK(p[1] == (yuv[0][1] + yuv[1][1] + 1) >> 1);
+            CHECK(p[3] == (yuv[0][2] + yuv[1][2] + 1) >> 1);
+        }
+    }
+    free(out.addr);
+    demosaic_destroy(d);
+}
+
+/* xorshift32, a fixed sequence so a failure reproduces. */
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/* Every pattern and method, 8 and 10 bit, with smooth ramps, sharp edges and noise in one frame. */
+int main(void)
+{
+    static const uint32_t outputs[] = { V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_YUYV };
+    static const int methods[] = { DEMOSAIC_BILINEAR, DEMOSAIC_EDGE, DEMOSAIC_HALF };
+    struct reference r;
+    struct image_view view;
+    uint8_t *frame;
+    uint16_t sample;
+    uint32_t x, y, state = 1, bpp, p, b, m, o;
+
+    frame = malloc((WIDTH * 2 + PAD) * HEIGHT);
+    CHECK(frame);
+    for (p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        for (b = 0; b < 2; b++) {
+            CHECK(bayer_lookup(patterns[p][b], &r.format));
+            bpp = b ? 2 : 1;
+            for (y = 0; y < HEIGHT; y++) {
+                for (x = 0; x < WIDTH; x++) {
+                    if (x < WIDTH / 3)
+                        sample = ((x * 37 + y * 11) & 255) << 2;
+                    else if (x < WIDTH * 2 / 3)
+                        sample = ((x + y) & 4) ? 1023 : 0;
+                    else
+                        sample = next_random(&state) & 1023;
+                    /* 8 bit frames take the top bits, as the normalization of 10 bit ones does. */
+                    r.raw[y][x] = sample >> 2;
+                    if (bpp == 1)
+                        frame[(WIDTH + PAD) * y + x] = sample >> 2;
+                    else
+                        memcpy(frame + (WIDTH * 2 + PAD) * y + x * 2, &sample, 2);
+                }
+            }
+            reference_green(&r);
+            view.addr = frame;
+            view.chroma = NULL;
+            view.width = WIDTH;
+            view.height = HEIGHT;
+            view.stride = WIDTH * bpp + PAD;
+            view.pixelformat = r.format.pixelformat;
+            for (m = 0; m < sizeof(methods) / sizeof(methods[0]); m++)
+                for (o = 0; o < sizeof(outputs) / sizeof(outputs[0]); o++)
+                    check_method(&r, &view, methods[m], outputs[o]);
+        }
+    }
+    free(frame);
+    return EXIT_SUCCESS;
+}
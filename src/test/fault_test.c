@@ -0,0 +1,64 @@
+#include "test.h"
+#include "stream.h"
+#include "fault.h"
+
+#define FRAMES      (40)
+
+static int count_frame(struct v4l2_camera *cam, struct v4l2_buffer *buffer_info, struct buffer buffer, void *priv)
+{
+    uint32_t *seen = priv;
+
+    CHECK(buffer_info->sequence == *seen);
+    CHECK(((uint8_t *)buffer.addr)[0] == (uint8_t)buffer_info->sequence);
+    (*seen)++;
+    return CAMERA_RETURN_SUCCESS;
+}
+
+/* Sporadic EAGAIN from DQBUF is no frame yet, not a stream error. */
+int main(void)
+{
+    const char *path = "fault_test.raw";
+    struct camera_stream *stream;
+    struct v4l2_buffer info;
+    struct v4l2_camera *cam;
+    uint32_t seen = 0, again = 0;
+    int ret;
+
+    test_make_recording(path, 64, 48, FRAMES);
+    CHECK(fault_parse("DQBUF,error=EAGAIN,p=0.3") == CAMERA_RETURN_SUCCESS);
+
+    /* Direct dequeue keeps the camera streaming. */
+    cam = test_open_replay(path);
+    CHECK(camera_start_capturing(cam) == CAMERA_RETURN_SUCCESS);
+    while (seen < FRAMES / 2) {
+        ret = camera_dequeue_buffer(cam, &info);
+        if (ret == -EAGAIN) {
+            CHECK(cam->state == CAMREA_STATE_STREAM_ON);
+            again++;
+            continue;
+        }
+        CHECK(ret == CAMERA_RETURN_SUCCESS);
+        CHECK(info.sequence == seen);
+        CHECK(camera_queue_buffer(cam, &info) == CAMERA_RETURN_SUCCESS);
+        seen++;
+    }
+    CHECK(again > 0);
+    test_close(cam);
+
+    /* The stream loop delivers every frame without recovery. */
+    seen = 0;
+    cam = test_open_replay(path);
+    stream = camera_stream_create(cam, count_frame, &seen, 0);
+    CHECK(stream);
+    CHECK(camera_stream_start(stream) == CAMERA_RETURN_SUCCESS);
+    CHECK(camera_stream_run(stream, FRAMES) == CAMERA_RETURN_SUCCESS);
+    CHECK(seen == FRAMES);
+    CHECK(stream->recoveries == 0);
+    CHECK(camera_stream_stop(stream) == CAMERA_RETURN_SUCCESS);
+    camera_stream_destroy(stream);
+    test_close(cam);
+
+    CHECK(fault_parse("") == CAMERA_RETURN_SUCCESS);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "test.h"
+#include "lossless.h"
+
+#define PAD         (10)                    /* Extra bytes per line, the stride is not the line */
+#define GUARD       (64)                    /* Bytes past the output that must stay untouched */
+
+enum {
+    FRAME_FLAT,
+    FRAME_NOISE,
+    FRAME_SATURATED,                        /* 0 and 255 alternating, the largest residuals */
+    FRAME_RAMP,
+    FRAME_TYPES,
+};
+
+/* xorshift32, a fixed sequence so a failure reproduces. */
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void fill(uint8_t *frame, int type, int width, int height, size_t stride, uint32_t *state)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width * 2; x++) {
+            uint8_t *p = frame + stride * y + x;
+            switch (type) {
+                case FRAME_FLAT:
+                    *p = 0x80;
+                    break;
+                case FRAME_NOISE:
+                    *p = next_random(state);
+                    break;
+                case FRAME_SATURATED:
+                    *p = ((x >> 1) + y) & 1 ? 255 : 0;
+                    break;
+                default:
+                    *p = x * 3 + y * 5;
+            }
+        }
+    }
+}
+
+/* Encodes into a buffer the size of the raw frame, as the recorder does, and decodes it back. */
+static void check_round_trip(int type, int width, int height, uint32_t *state)
+{
+    size_t stride = width * 2 + PAD, size = stride * height, out_size = 0;
+    uint8_t *frame = malloc(size), *decoded = malloc(size), *out = malloc(size + GUARD);
+    int ret, y, i;
+
+    CHECK(frame && decoded && out);
+    memset(frame, 0xa5, size);
+    fill(frame, type, width, height, stride, state);
+    memset(out, 0x5a, size + GUARD);
+    ret = lossless_encode_yuyv(frame, width, height, stride, out, size, &out_size);
+    for (i = 0; i < GUARD; i++)
+        CHECK(out[size + i] == 0x5a);
+    /* Noise may not fit, the recorder then stores the frame raw. */
+    if (ret != CAMERA_RETURN_SUCCESS) {
+        CHECK(type == FRAME_NOISE || type == FRAME_SATURATED);
+        free(out);
+        out = malloc(size * 2 + GUARD);
+        CHECK(out);
+        CHECK(lossless_encode_yuyv(frame, width, height, stride, out, size * 2, &out_size) == CAMERA_RETURN_SUCCESS);
+    }
+    CHECK(out_size && out_size <= size * 2);
+    /* A flat frame compresses well once the coder has adapted. */
+    if (type == FRAME_FLAT && width * height >= 4096)
+        CHECK(out_size * 4 < (size_t)width * 2 * height);
+
+    memset(decoded, 0xa5, size);
+    CHECK(lossless_decode_yuyv(out, out_size, width, height, stride, decoded) == CAMERA_RETURN_SUCCESS);
+    for (y = 0; y < height; y++)
+        CHECK(!memcmp(decoded + stride * y, frame + stride * y, stride));
+    /* Cut short, the decoder reports it instead of reading past the end. */
+    if (out_size > 1)
+        CHECK(lossless_decode_yuyv(out, out_size / 2, width, height, stride, decoded) == CAMERA_RETURN_FAILURE);
+
+    free(frame);
+    free(decoded);
+    free(out);
+}
+
+int main(void)
+{
+    /* Odd widths, so every length of partial vector comes up, up to the longest line. */
+    static const int widths[] = { 1, 2, 3, 15, 17, 31, 33, 63, 65, 641, LOSSLESS_MAX_LINE / 2 };
+    static const int heights[] = { 1, 2, 7 };
+    uint32_t state = 1;
+    size_t w, h;
+    int type;
+
+    for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+        for (h = 0; h < sizeof(heights) / sizeof(heights[0]); h++)
+            for (type = 0; type < FRAME_TYPES; type++)
+                check_round_trip(type, widths[w], heights[h], &state);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+#include <pthread.h>
+
+#include "test.h"
+#include "pool.h"
+
+#define CACHE       (4)
+#define DEPTH       (4)
+#define FRAMES      (100000)
+#define THREADS     (3)
+
+/* Frames handed from the main thread to a consumer, which frees them into its own cache. */
+static struct {
+    struct frame_pool   *pool;
+    void                *frame[DEPTH];
+    int                 head;
+    int                 count;
+    int                 done;
+    pthread_mutex_t     lock;
+    pthread_cond_t      changed;
+} queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
+static void *consume(void *arg)
+{
+    void *frame;
+
+    (void) arg;
+    pthread_mutex_lock(&queue.lock);
+    while (1) {
+        while (!queue.count && !queue.done)
+            pthread_cond_wait(&queue.changed, &queue.lock);
+        if (!queue.count)
+            break;
+        frame = queue.frame[queue.head];
+        queue.head = (queue.head + 1) % DEPTH;
+        queue.count--;
+        pthread_cond_broadcast(&queue.changed);
+        pthread_mutex_unlock(&queue.lock);
+        frame_pool_put(queue.pool, frame);
+        pthread_mutex_lock(&queue.lock);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return NULL;
+}
+
+/* Leaves a full cache behind, the thread exit must give it back. */
+static void *hoard(void *arg)
+{
+    struct frame_pool *pool = arg;
+    void *frame[CACHE];
+    int i;
+
+    for (i = 0; i < CACHE; i++)
+        frame[i] = frame_pool_get(pool);
+    for (i = 0; i < CACHE; i++)
+        frame_pool_put(pool, frame[i]);
+    return NULL;
+}
+
+int main(void)
+{
+    struct frame_pool *pool;
+    void *frame[THREADS * CACHE];
+    pthread_t thread[THREADS];
+    int i;
+
+    /* The queue, one frame on each side and a full cache per thread. */
+    pool = frame_pool_create(4096, DEPTH + 2 + 2 * CACHE, CACHE, 0);
+    CHECK(pool && pool->cache_size == CACHE);
+    queue.pool = pool;
+    CHECK(!pthread_create(&thread[0], NULL, consume, NULL));
+    for (i = 0; i < FRAMES; i++) {
+        void *f = frame_pool_get(pool);
+
+        CHECK(f);
+        memset(f, i, 64);
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == DEPTH)
+            pthread_cond_wait(&queue.changed, &queue.lock);
+        queue.frame[(queue.head + queue.count) % DEPTH] = f;
+        queue.count++;
+        pthread_cond_broadcast(&queue.changed);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    pthread_mutex_lock(&queue.lock);
+    queue.done = 1;
+    pthread_cond_broadcast(&queue.changed);
+    pthread_mutex_unlock(&queue.lock);
+    pthread_join(thread[0], NULL);
+    CHECK(frame_pool_heap_allocs(pool) == 0);
+    frame_pool_flush(pool);
+    frame_pool_destroy(pool);
+
+    /* Exited threads strand nothing, every frame is there for one more thread. */
+    pool = frame_pool_create(4096, THREADS * CACHE, CACHE, 0);
+    CHECK(pool);
+    for (i = 0; i < THREADS; i++)
+        CHECK(!pthread_create(&thread[i], NULL, hoard, pool));
+    for (i = 0; i < THREADS; i++)
+        pthread_join(thread[i], NULL);
+    for (i = 0; i < THREADS * CACHE; i++)
+        frame[i] = frame_pool_get(pool);
+    CHECK(frame_pool_heap_allocs(pool) == 0);
+    for (i = 0; i < THREADS * CACHE; i++)
+        frame_pool_put(pool, frame[i]);
+    frame_pool_flush(pool);
+    frame_pool_destroy(pool);
+    return EXIT_SUCCESS;
+}
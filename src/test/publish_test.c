@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "test.h"
+#include "publish.h"
+
+#define WIDTH       (64)
+#define HEIGHT      (48)
+#define FRAME_SIZE  (WIDTH * HEIGHT * 2)
+
+static struct buffer frame_buffer;
+
+static void *connect_thread(void *arg)
+{
+    return subscriber_connect(arg);
+}
+
+/* The handshake needs the publisher to accept, so connect from another thread. */
+static struct subscriber *connect_subscriber(struct publisher *pub, const char *path)
+{
+    pthread_t thread;
+    void *sub;
+
+    CHECK(!pthread_create(&thread, NULL, connect_thread, (void *)path));
+    while (pub->client_fd[0] == -1) {
+        publisher_poll(pub);
+        usleep(1000);
+    }
+    CHECK(!pthread_join(thread, &sub));
+    CHECK(sub);
+    return sub;
+}
+
+static void publish(struct publisher *pub, uint32_t n)
+{
+    struct v4l2_buffer info;
+
+    ZAP(info);
+    info.sequence = n;
+    info.timestamp.tv_sec = n;
+    info.timestamp.tv_usec = n * 10;
+    memset(frame_buffer.addr, n, frame_buffer.size);
+    CHECK(publisher_publish(pub, &info, frame_buffer) == CAMERA_RETURN_SUCCESS);
+}
+
+/* Acquires the next frame and checks it carries what publish(n) wrote. */
+static void check_frame(struct subscriber *sub, uint32_t n)
+{
+    struct publish_frame frame;
+    uint8_t *data;
+    size_t i;
+
+    CHECK(subscriber_acquire(sub, &frame) == CAMERA_RETURN_SUCCESS);
+    CHECK(frame.sequence == n);
+    CHECK(frame.timestamp.tv_sec == n && frame.timestamp.tv_usec == n * 10);
+    CHECK(frame.buffer.size == FRAME_SIZE);
+    data = frame.buffer.addr;
+    for (i = 0; i < frame.buffer.size; i++)
+        CHECK(data[i] == (uint8_t)n);
+    CHECK(subscriber_release(sub, &frame) == CAMERA_RETURN_SUCCESS);
+}
+
+static int count_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    int n = 0;
+
+    CHECK(dir);
+    while (readdir(dir))
+        n++;
+    closedir(dir);
+    return n;
+}
+
+static int connect_raw(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    ZAP(addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    CHECK(fd != -1 && !connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+    return fd;
+}
+
+/* Receives the hello and both fds the way a subscriber that doesn't play by the rules would. */
+static void check_hostile_subscriber(struct publisher *pub, const char *path)
+{
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct publish_hello hello;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    int fd, fds[2];
+
+    fd = connect_raw(path);
+    while (pub->client_fd[0] == -1) {
+        publisher_poll(pub);
+        usleep(1000);
+    }
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    ZAP(msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    CHECK(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) == sizeof(hello));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    CHECK(cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(fds)));
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    /* The ring can't be written or resized, the stats page is ours. */
+    CHECK(mmap(NULL, hello.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0) == MAP_FAILED);
+    CHECK(ftruncate(fds[0], 0) && ftruncate(fds[0], hello.map_size * 2));
+    CHECK(write(fds[0], "x", 1) == -1);
+    CHECK(fcntl(fds[0], F_ADD_SEALS, 0) == -1);
+    CHECK(mmap(NULL, sizeof(struct publish_subscriber_stat), PROT_READ | PROT_WRITE, MAP_SHARED, fds[1], 0)
+            != MAP_FAILED);
+    close(fds[0]);
+    close(fds[1]);
+    close(fd);
+    publisher_poll(pub);
+    CHECK(pub->client_fd[0] == -1 && !pub->stat[0]);
+}
+
+/* A subscriber refuses a bad hello and keeps none of the fds that came with it. */
+static void check_bad_hello(uint32_t magic, uint32_t index, uint64_t map_size)
+{
+    const char *path = "publish_test_bad.sock";
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct publish_hello hello;
+    struct sockaddr_un addr;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    pthread_t thread;
+    int listen_fd, fd, fds[2], before;
+    void *sub;
+
+    ZAP(addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK(listen_fd != -1 && !bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) && !listen(listen_fd, 1));
+    before = count_fds();
+    CHECK(!pthread_create(&thread, NULL, connect_thread, (void *)path));
+    fd = accept(listen_fd, NULL, NULL);
+    CHECK(fd != -1);
+    fds[0] = memfd_create("publish_test", MFD_CLOEXEC);
+    fds[1] = memfd_create("publish_test", MFD_CLOEXEC);
+    CHECK(fds[0] != -1 && fds[1] != -1 && !ftruncate(fds[0], 4096) && !ftruncate(fds[1], 4096));
+
+    ZAP(hello);
+    hello.magic = magic;
+    hello.index = index;
+    hello.map_size = map_size;
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    ZAP(msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    CHECK(sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(hello));
+    close(fds[0]);
+    close(fds[1]);
+    close(fd);
+    CHECK(!pthread_join(thread, &sub));
+    CHECK(!sub);
+    CHECK(count_fds() == before);
+    close(listen_fd);
+    unlink(path);
+}
+
+int main(void)
+{
+    const char *path = "publish_test.sock";
+    struct publish_subscriber_stat *stat;
+    struct v4l2_pix_format pix;
+    struct publish_frame frame;
+    struct publisher *pub;
+    struct subscriber *sub;
+    uint32_t n, i;
+
+    ZAP(pix);
+    pix.width = WIDTH;
+    pix.height = HEIGHT;
+    pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    pix.sizeimage = FRAME_SIZE;
+    frame_buffer.size = FRAME_SIZE;
+    frame_buffer.addr = malloc(frame_buffer.size);
+    CHECK(frame_buffer.addr);
+
+    pub = publisher_create(path, &pix, FRAME_SIZE);
+    CHECK(pub);
+    sub = connect_subscriber(pub, path);
+    stat = sub->stat;
+    CHECK(sub->hdr->pix.pixelformat == V4L2_PIX_FMT_YUYV);
+    CHECK(stat->active);
+
+    /* Nothing published yet. */
+    CHECK(subscriber_wait(sub, 0) == -EAGAIN);
+    CHECK(subscriber_acquire(sub, &frame) == -EAGAIN);
+
+    /* Every frame read in order while keeping up. */
+    for (n = 1; n <= 3 * PUBLISH_SLOT_NUM; n++) {
+        publish(pub, n);
+        CHECK(subscriber_wait(sub, 1000) == CAMERA_RETURN_SUCCESS);
+        check_frame(sub, n);
+        CHECK(subscriber_acquire(sub, &frame) == -EAGAIN);
+    }
+    CHECK(stat->frames == 3 * PUBLISH_SLOT_NUM && !stat->drops);
+
+    /* A subscriber that falls behind skips to the oldest slot not under write. */
+    for (i = 0; i < 2 * PUBLISH_SLOT_NUM; i++)
+        publish(pub, n++);
+    for (i = n - PUBLISH_SLOT_NUM + 1; i < n; i++)
+        check_frame(sub, i);
+    CHECK(stat->drops == PUBLISH_SLOT_NUM + 1);
+    CHECK(stat->last_frame == sub->hdr->frame);
+
+    /* A slot overwritten while held fails its release. */
+    publish(pub, n++);
+    CHECK(subscriber_acquire(sub, &frame) == CAMERA_RETURN_SUCCESS);
+    for (i = 0; i < PUBLISH_SLOT_NUM; i++)
+        publish(pub, n++);
+    CHECK(subscriber_release(sub, &frame) == CAMERA_RETURN_FAILURE);
+    CHECK(stat->drops == PUBLISH_SLOT_NUM + 2);
+
+    /* The publisher notices a hang up on its next poll. */
+    subscriber_disconnect(sub);
+    publisher_poll(pub);
+    CHECK(pub->client_fd[0] == -1 && !pub->stat[0]);
+    check_hostile_subscriber(pub, path);
+
+    /* And a subscriber notices the publisher going away once it has read everything. */
+    sub = connect_subscriber(pub, path);
+    publish(pub, n);
+    publisher_destroy(pub);
+    CHECK(subscriber_wait(sub, 1000) == CAMERA_RETURN_SUCCESS);
+    check_frame(sub, n);
+    for (i = 0; i < 4 && subscriber_wait(sub, 1000) == CAMERA_RETURN_SUCCESS; i++)
+        ;
+    CHECK(i < 4);
+    subscriber_disconnect(sub);
+
+    /* Bad magic, an index out of range, and a ring smaller than the header or larger than the memfd. */
+    check_bad_hello(0, 0, 4096);
+    check_bad_hello(PUBLISH_MAGIC, PUBLISH_MAX_SUBSCRIBER, 4096);
+    check_bad_hello(PUBLISH_MAGIC, 0, 8);
+    check_bad_hello(PUBLISH_MAGIC, 0, 8192);
+    /* A zeroed ring maps but has no valid header. */
+    check_bad_hello(PUBLISH_MAGIC, 0, 4096);
+
+    free(frame_buffer.addr);
+    return EXIT_SUCCESS;
+}
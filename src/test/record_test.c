@@ -0,0 +1,159 @@
+#include <sys/wait.h>
+
+#include "test.h"
+
+#define WIDTH       (64)
+#define HEIGHT      (48)
+#define FRAMES      (5)
+#define PAGE        (4096)
+
+/* The version 1 layout, from before the codec and the frame offsets. */
+struct header_v1 {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            frame_count;
+    uint32_t            frame_capacity;
+    uint64_t            record_size;
+    uint64_t            index_offset;
+    uint64_t            data_offset;
+    struct v4l2_format  fmt;
+};
+
+struct frame_v1 {
+    int64_t             tv_sec;
+    int64_t             tv_usec;
+    uint32_t            sequence;
+    uint32_t            bytesused;
+    uint32_t            flags;
+    uint32_t            field;
+};
+
+static void make_recording_v1(const char *path)
+{
+    struct header_v1 hdr;
+    struct frame_v1 frame;
+    uint8_t data[WIDTH * HEIGHT * 2];
+    FILE *fp = fopen(path, "wb");
+    uint32_t i;
+
+    CHECK(fp);
+    ZAP(hdr);
+    hdr.magic = RECORD_MAGIC;
+    hdr.version = 1;
+    hdr.frame_count = FRAMES;
+    hdr.frame_capacity = FRAMES;
+    hdr.record_size = 2 * PAGE;
+    hdr.index_offset = PAGE;
+    hdr.data_offset = 2 * PAGE;
+    hdr.fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    hdr.fmt.fmt.pix.width = WIDTH;
+    hdr.fmt.fmt.pix.height = HEIGHT;
+    hdr.fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    hdr.fmt.fmt.pix.bytesperline = WIDTH * 2;
+    hdr.fmt.fmt.pix.sizeimage = sizeof(data);
+    CHECK(fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+    for (i = 0; i < FRAMES; i++) {
+        ZAP(frame);
+        frame.tv_sec = i;
+        frame.tv_usec = i * 10;
+        frame.sequence = 100 + i;
+        frame.bytesused = sizeof(data);
+        CHECK(!fseek(fp, hdr.index_offset + sizeof(frame) * i, SEEK_SET));
+        CHECK(fwrite(&frame, sizeof(frame), 1, fp) == 1);
+        memset(data, i + 1, sizeof(data));
+        CHECK(!fseek(fp, hdr.data_offset + hdr.record_size * i, SEEK_SET));
+        CHECK(fwrite(data, sizeof(data), 1, fp) == 1);
+    }
+    CHECK(!fseek(fp, hdr.data_offset + hdr.record_size * FRAMES - 1, SEEK_SET));
+    CHECK(fputc(0, fp) == 0);
+    CHECK(!fclose(fp));
+}
+
+/* Records like make_recording_v1, in a child that dies before recorder_close. */
+static void make_recording_unclosed(const char *path, uint32_t frames)
+{
+    struct v4l2_format fmt;
+    struct v4l2_buffer info;
+    struct recorder *rec;
+    struct buffer buffer;
+    uint8_t data[WIDTH * HEIGHT * 2];
+    int status;
+    uint32_t i;
+    pid_t pid;
+
+    pid = fork();
+    CHECK(pid != -1);
+    if (!pid) {
+        ZAP(fmt);
+        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        fmt.fmt.pix.width = WIDTH;
+        fmt.fmt.pix.height = HEIGHT;
+        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+        fmt.fmt.pix.bytesperline = WIDTH * 2;
+        fmt.fmt.pix.sizeimage = sizeof(data);
+        rec = recorder_create(path, &fmt, sizeof(data), FRAMES * 2, NULL);
+        CHECK(rec);
+        buffer.addr = data;
+        buffer.size = sizeof(data);
+        for (i = 0; i < frames; i++) {
+            ZAP(info);
+            info.sequence = 100 + i;
+            info.timestamp.tv_sec = i;
+            info.timestamp.tv_usec = i * 10;
+            memset(data, i + 1, sizeof(data));
+            CHECK(recorder_write(rec, &info, buffer) == CAMERA_RETURN_SUCCESS);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+/* Replays every frame and checks it against what the recordings above wrote. */
+static void check_replay(const char *path, uint32_t frames)
+{
+    struct v4l2_camera *cam = test_open_replay(path);
+    struct v4l2_buffer info;
+    struct buffer buffer;
+    uint32_t n = 0, i;
+    uint8_t *data;
+    int ret;
+
+    CHECK(cam->fmt.fmt.pix.width == WIDTH && cam->fmt.fmt.pix.height == HEIGHT);
+    CHECK(cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV);
+    CHECK(camera_start_capturing(cam) == CAMERA_RETURN_SUCCESS);
+    while ((ret = camera_dequeue_buffer(cam, &info)) == CAMERA_RETURN_SUCCESS || ret == -EAGAIN) {
+        if (ret != CAMERA_RETURN_SUCCESS)
+            continue;
+        CHECK(info.sequence == 100 + n);
+        CHECK(info.timestamp.tv_sec == n && info.timestamp.tv_usec == n * 10);
+        CHECK(info.bytesused == WIDTH * HEIGHT * 2);
+        CHECK(camera_get_buffer(cam, &info, &buffer) == CAMERA_RETURN_SUCCESS);
+        data = buffer.addr;
+        for (i = 0; i < info.bytesused; i++)
+            CHECK(data[i] == n + 1);
+        CHECK(camera_queue_buffer(cam, &info) == CAMERA_RETURN_SUCCESS);
+        n++;
+    }
+    CHECK(ret == -ENODATA);
+    CHECK(n == frames);
+    camera_shutdown(cam);
+    camera_free_object(cam);
+}
+
+int main(void)
+{
+    const char *path = "record_test.raw";
+
+    /* Recordings made before the lossless codec still replay. */
+    make_recording_v1(path);
+    check_replay(path, FRAMES);
+
+    /* A recorder that never closed left frame_count at zero, the index still has them. */
+    make_recording_unclosed(path, FRAMES);
+    check_replay(path, FRAMES);
+    make_recording_unclosed(path, 0);
+    check_replay(path, 0);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,46 @@
+#include <fcntl.h>
+
+#include "test.h"
+
+#define FRAMES      (4)
+
+static void check_closed(int fd)
+{
+    CHECK(fcntl(fd, F_GETFD) == -1 && errno == EBADF);
+}
+
+/* The end of a recording leaves the camera in CAMERA_STATE_ERROR, which must still close. */
+int main(void)
+{
+    const char *path = "shutdown_test.raw";
+    struct v4l2_buffer info;
+    struct v4l2_camera *cam;
+    int fd, ret;
+
+    test_make_recording(path, 64, 48, FRAMES);
+
+    cam = test_open_replay(path);
+    fd = cam->fd;
+    CHECK(camera_start_capturing(cam) == CAMERA_RETURN_SUCCESS);
+    while ((ret = camera_dequeue_buffer(cam, &info)) == CAMERA_RETURN_SUCCESS || ret == -EAGAIN)
+        if (ret == CAMERA_RETURN_SUCCESS)
+            CHECK(camera_queue_buffer(cam, &info) == CAMERA_RETURN_SUCCESS);
+    CHECK(ret == -ENODATA);
+    CHECK(cam->state == CAMERA_STATE_ERROR);
+    CHECK(camera_shutdown(cam) == CAMERA_RETURN_SUCCESS);
+    CHECK(cam->state == CAMREA_STATE_INIT);
+    CHECK(!cam->bufq.count && !cam->source);
+    check_closed(fd);
+    camera_free_object(cam);
+
+    /* And from a state that never got as far as the device. */
+    cam = camera_create_object();
+    CHECK(cam);
+    cam->dev_name = "/nonexistent/video";
+    CHECK(camera_open_device(cam) != CAMERA_RETURN_SUCCESS);
+    CHECK(camera_shutdown(cam) == CAMERA_RETURN_SUCCESS);
+    camera_free_object(cam);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
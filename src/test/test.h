@@ -0,0 +1,75 @@
+#ifndef _TEST_
+#define _TEST_
+
+#include "camera.h"
+#include "api.h"
+#include "record.h"
+
+/* Each test is its own executable, the first failed check ends it. */
+#define CHECK(x) do { \
+    if (!(x)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+        exit(EXIT_FAILURE); \
+    } \
+} while (0)
+
+/* A raw YUYV recording of count frames at 30fps, frame n filled with byte n. */
+static inline void test_make_recording(const char *path, uint32_t width, uint32_t height, uint32_t count)
+{
+    struct v4l2_format fmt;
+    struct v4l2_buffer info;
+    struct recorder *rec;
+    struct buffer buffer;
+    uint32_t i;
+
+    ZAP(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.bytesperline = width * 2;
+    fmt.fmt.pix.sizeimage = width * height * 2;
+    buffer.size = fmt.fmt.pix.sizeimage;
+    buffer.addr = malloc(buffer.size);
+    CHECK(buffer.addr);
+    rec = recorder_create(path, &fmt, buffer.size, count, NULL);
+    CHECK(rec);
+    for (i = 0; i < count; i++) {
+        ZAP(info);
+        info.sequence = i;
+        info.bytesused = buffer.size;
+        info.timestamp.tv_sec = i / 30;
+        info.timestamp.tv_usec = i % 30 * 33333;
+        memset(buffer.addr, i, buffer.size);
+        CHECK(recorder_write(rec, &info, buffer) == CAMERA_RETURN_SUCCESS);
+    }
+    CHECK(recorder_close(rec) == CAMERA_RETURN_SUCCESS);
+    free(buffer.addr);
+}
+
+/* Opened, configured and mapped, ready for camera_start_capturing(). */
+static inline struct v4l2_camera *test_open_replay(const char *path)
+{
+    struct v4l2_camera *cam = camera_create_object();
+
+    CHECK(cam);
+    cam->dev_name = (char *)path;
+    cam->replay_speed = 0;
+    CHECK(camera_open_device(cam) == CAMERA_RETURN_SUCCESS);
+    CHECK(camera_query_cap(cam) == CAMERA_RETURN_SUCCESS);
+    CHECK(camera_set_output_format(cam) == CAMERA_RETURN_SUCCESS);
+    CHECK(camera_get_output_format(cam) == CAMERA_RETURN_SUCCESS);
+    CHECK(camera_request_and_map_buffer(cam) == CAMERA_RETURN_SUCCESS);
+    return cam;
+}
+
+static inline void test_close(struct v4l2_camera *cam)
+{
+    if (cam->state == CAMREA_STATE_STREAM_ON)
+        CHECK(camera_stop_capturing(cam) == CAMERA_RETURN_SUCCESS);
+    CHECK(camera_return_and_unmap_buffer(cam) == CAMERA_RETURN_SUCCESS);
+    CHECK(camera_close_device(cam) == CAMERA_RETURN_SUCCESS);
+    camera_free_object(cam);
+}
+
+#endif
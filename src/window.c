@@ -6,19 +6,22 @@
 #include "camera.h"
 #include "util.h"
 #include "demo.h"
+#include "bayer.h"
+#include "trace.h"
 
-struct window * window_create(int width, int height)
+struct window * window_create(struct v4l2_pix_format *pix, struct v4l2_rect *crop)
 {
     struct window *window = NULL;
+    size_t frame_size;
 
     LOGI("Create window\n");
 
-    if (width <= 0 || height <= 0) {
+    if (pix->width <= 0 || pix->height <= 0) {
         LOGE(DUMP_NONE, "Width or height is invaild.\n");
         goto err_return;
     }
 
-    window = malloc(sizeof(struct window));
+    window = calloc(1, sizeof(struct window));
     if (window == NULL) {
         LOGE(DUMP_NONE, "Out of memory\n");
         goto err_return;
@@ -44,11 +47,55 @@ struct window * window_create(int width, int height)
         goto free_sdl_window;
     }
 
-    window->width = width;
-    window->height = height;
+    window->width = pix->width;
+    window->height = pix->height;
+    window->pix = *pix;
+    if (crop) {
+        window->crop = *crop;
+    } else {
+        window->crop.width = pix->width;
+        window->crop.height = pix->height;
+    }
+    /* Raw Bayer previews at half size, one YUYV pixel per 2x2 tile. */
+    if (bayer_lookup(pix->pixelformat, NULL)) {
+        window->bayer = demosaic_create(pix->pixelformat, pix->width & ~1, pix->height & ~1,
+                DEMOSAIC_HALF, V4L2_PIX_FMT_YUYV);
+        if (window->bayer == NULL)
+            goto free_sdl_renderer;
+        /* Taken from the raw frame here, window->pix describes the demosaiced output from now on. */
+        window->bayer_stride = pix->bytesperline ? pix->bytesperline :
+            pix->width * (window->bayer->format.bits > 8 ? 2 : 1);
+        window->pix.pixelformat = V4L2_PIX_FMT_YUYV;
+        window->pix.width = window->bayer->out_width;
+        window->pix.height = window->bayer->out_height;
+        window->pix.bytesperline = window->pix.width * 2;
+        window->pix.sizeimage = window->bayer->out_size;
+        window->crop.left /= 2;
+        window->crop.top /= 2;
+        window->crop.width = window->crop.width / 2 ? window->crop.width / 2 : 1;
+        window->crop.height = window->crop.height / 2 ? window->crop.height / 2 : 1;
+        pix = &window->pix;
+    }
+
+    /* fit_preview_size() never goes past the crop, whatever the window grows to. */
+    if (window->bayer) {
+        window->bayer_pool = frame_pool_create(window->bayer->out_size, WINDOW_POOL_FRAMES, 0, 0);
+        if (window->bayer_pool == NULL)
+            goto free_demosaic;
+    }
+    frame_size = (size_t)window->crop.width * 2 * window->crop.height;
+    window->pool = frame_pool_create(frame_size, WINDOW_POOL_FRAMES, 0, 0);
+    if (window->pool == NULL)
+        goto free_demosaic;
+    IMG_Init(IMG_INIT_JPG);
 
     return window;
 
+free_demosaic:
+    frame_pool_destroy(window->bayer_pool);
+    demosaic_destroy(window->bayer);
+free_sdl_renderer:
+    SDL_DestroyRenderer(window->sdl_renderer);
 free_sdl_window:
     SDL_DestroyWindow(window->sdl_window);
 free_window:
@@ -57,43 +104,133 @@ err_return:
     return NULL;
 }
 
-static int draw_yuyv(struct window *window, void *addr, size_t size)
+/* Fit the crop into the window keeping aspect, never larger than the crop itself. */
+static void fit_preview_size(struct window *window, int *width, int *height)
+{
+    int w, h;
+
+    SDL_GetWindowSize(window->sdl_window, &w, &h);
+    if ((long)window->crop.width * h > (long)w * window->crop.height)
+        h = (long)w * window->crop.height / window->crop.width;
+    else
+        w = (long)h * window->crop.width / window->crop.height;
+    if (w > window->crop.width || h > window->crop.height) {
+        w = window->crop.width;
+        h = window->crop.height;
+    }
+    *width = (w < 2) ? 2 : (w & ~1);
+    *height = (h < 1) ? 1 : h;
+}
+
+/* Scaler and texture are rebuilt only when the window size changes. */
+static int update_preview(struct window *window)
 {
-    void *pixels;
-    int pitch, ret = CAMERA_RETURN_SUCCESS;
-    struct SDL_Texture *texture = NULL;
-    texture = SDL_CreateTexture(window->sdl_renderer, SDL_PIXELFORMAT_YUY2,
-            SDL_TEXTUREACCESS_STREAMING, window->width, window->height);
-    if (texture == NULL) {
+    int width, height;
+
+    fit_preview_size(window, &width, &height);
+    if (window->scaler && width == window->preview_width && height == window->preview_height)
+        return CAMERA_RETURN_SUCCESS;
+
+    scaler_destroy(window->scaler);
+    if (window->preview_texture)
+        SDL_DestroyTexture(window->preview_texture);
+    window->preview_texture = NULL;
+    window->scaler = scaler_create(&window->pix, &window->crop, width, height);
+    if (window->scaler == NULL)
+        return CAMERA_RETURN_FAILURE;
+    window->preview_width = window->scaler->dst_width;
+    window->preview_height = window->scaler->dst_height;
+    window->preview_texture = SDL_CreateTexture(window->sdl_renderer, SDL_PIXELFORMAT_YUY2,
+            SDL_TEXTUREACCESS_STREAMING, window->preview_width, window->preview_height);
+    if (window->preview_texture == NULL) {
         LOGE(DUMP_NONE, "%s", SDL_GetError());
+        scaler_destroy(window->scaler);
+        window->scaler = NULL;
         return CAMERA_RETURN_FAILURE;
     }
-    if (SDL_LockTexture(texture, NULL, &pixels, &pitch)) {
+    LOGI("Preview size %dx%d\n", window->preview_width, window->preview_height);
+    return CAMERA_RETURN_SUCCESS;
+}
+
+static int draw_yuyv(struct window *window, void *addr, size_t size)
+{
+    struct buffer frame = { addr, size }, preview;
+    int ret = CAMERA_RETURN_FAILURE;
+
+    if (update_preview(window))
+        return CAMERA_RETURN_FAILURE;
+    preview.addr = frame_pool_get(window->pool);
+    preview.size = window->pool->frame_size;
+    if (scaler_process(window->scaler, frame, &preview))
+        goto out;
+    if (SDL_UpdateTexture(window->preview_texture, NULL, preview.addr, window->preview_width * 2)) {
         LOGE(DUMP_NONE, "%s", SDL_GetError());
-        ret = CAMERA_RETURN_FAILURE;
         goto out;
     }
-    memcpy(pixels, addr, size);
-    SDL_UnlockTexture(texture);
-    if (SDL_RenderCopy(window->sdl_renderer, texture, NULL, NULL)) {
+    if (SDL_RenderCopy(window->sdl_renderer, window->preview_texture, NULL, NULL)) {
         LOGE(DUMP_NONE, "%s", SDL_GetError());
-        ret = CAMERA_RETURN_FAILURE;
         goto out;
     }
     SDL_RenderPresent(window->sdl_renderer);
+    trace_instant("Present", trace_now());
+    ret = CAMERA_RETURN_SUCCESS;
 out:
-    SDL_DestroyTexture(texture);
+    frame_pool_put(window->pool, preview.addr);
     return ret;
 }
 
+static int draw_bayer(struct window *window, void *addr, size_t size)
+{
+    struct v4l2_pix_format *pix = &window->pix;
+    struct image_view view = {
+        .addr           = addr,
+        .width          = window->bayer->width,
+        .height         = window->bayer->height,
+        .pixelformat    = window->bayer->format.pixelformat,
+    };
+    struct buffer frame;
+    int ret;
+
+    view.stride = window->bayer_stride;
+    if (size < (size_t)view.stride * view.height) {
+        LOGE(DUMP_NONE, "Bayer frame too small: %zu\n", size);
+        return CAMERA_RETURN_FAILURE;
+    }
+    frame.addr = frame_pool_get(window->bayer_pool);
+    frame.size = (size_t)pix->bytesperline * pix->height;
+    ret = demosaic_process(window->bayer, &view, &frame);
+    if (ret == CAMERA_RETURN_SUCCESS)
+        ret = draw_yuyv(window, frame.addr, frame.size);
+    frame_pool_put(window->bayer_pool, frame.addr);
+    return ret;
+}
+
+/* Decoded size rarely changes, so the texture is kept and only updated. */
+static int update_mjpeg_texture(struct window *window, SDL_Surface *image)
+{
+    Uint32 format;
+    int w, h;
+
+    if (window->mjpeg_texture &&
+            !SDL_QueryTexture(window->mjpeg_texture, &format, NULL, &w, &h) &&
+            format == image->format->format && w == image->w && h == image->h)
+        return CAMERA_RETURN_SUCCESS;
+    if (window->mjpeg_texture)
+        SDL_DestroyTexture(window->mjpeg_texture);
+    window->mjpeg_texture = SDL_CreateTexture(window->sdl_renderer, image->format->format,
+            SDL_TEXTUREACCESS_STREAMING, image->w, image->h);
+    if (window->mjpeg_texture == NULL) {
+        LOGE(DUMP_NONE, "%s", SDL_GetError());
+        return CAMERA_RETURN_FAILURE;
+    }
+    return CAMERA_RETURN_SUCCESS;
+}
+
 static int draw_mjpeg(struct window *window, void *addr, size_t size)
 {
     int ret = CAMERA_RETURN_SUCCESS;
     SDL_RWops *rw = NULL;
     SDL_Surface *image = NULL;
-    struct SDL_Texture *texture = NULL;
-
-    IMG_Init(IMG_INIT_JPG);
 
     rw = SDL_RWFromMem(addr, size);
     if (rw == NULL) {
@@ -106,23 +243,23 @@ static int draw_mjpeg(struct window *window, void *addr, size_t size)
         ret = CAMERA_RETURN_FAILURE;
         goto out;
     }
-    texture = SDL_CreateTextureFromSurface(window->sdl_renderer, image);
-    if (texture == NULL) {
+    if (update_mjpeg_texture(window, image)) {
+        ret = CAMERA_RETURN_FAILURE;
+        goto out;
+    }
+    if (SDL_UpdateTexture(window->mjpeg_texture, NULL, image->pixels, image->pitch)) {
         LOGE(DUMP_NONE, "%s", SDL_GetError());
         ret = CAMERA_RETURN_FAILURE;
         goto out;
     }
-    if (SDL_RenderCopy(window->sdl_renderer, texture, NULL, NULL)) {
+    if (SDL_RenderCopy(window->sdl_renderer, window->mjpeg_texture, NULL, NULL)) {
         LOGE(DUMP_NONE, "%s", SDL_GetError());
         ret = CAMERA_RETURN_FAILURE;
         goto out;
     }
     SDL_RenderPresent(window->sdl_renderer);
+    trace_instant("Present", trace_now());
 out:
-    IMG_Quit();
-
-    if (texture != NULL)
-        SDL_DestroyTexture(texture);
     if (rw != NULL)
         SDL_RWclose(rw);
     if (image != NULL)
@@ -153,7 +290,10 @@ int window_update_frame(struct window *window, void *addr, size_t size, int form
             ret = draw_mjpeg(window, addr, size);
             break;
         default:
-            ret = CAMERA_RETURN_FAILURE;
+            if (window->bayer && (uint32_t)format == window->bayer->format.pixelformat)
+                ret = draw_bayer(window, addr, size);
+            else
+                ret = CAMERA_RETURN_FAILURE;
     }
     time_recorder_end(&tr);
     time_recorder_print_time(&tr, "Display frame");
@@ -186,6 +326,15 @@ int window_get_event(struct window * window)
 void window_destory(struct window *window)
 {
     LOGI("Destory window\n");
+    scaler_destroy(window->scaler);
+    demosaic_destroy(window->bayer);
+    frame_pool_destroy(window->bayer_pool);
+    frame_pool_destroy(window->pool);
+    if (window->preview_texture)
+        SDL_DestroyTexture(window->preview_texture);
+    if (window->mjpeg_texture)
+        SDL_DestroyTexture(window->mjpeg_texture);
+    IMG_Quit();
     SDL_DestroyRenderer(window->sdl_renderer);
     SDL_DestroyWindow(window->sdl_window);
     SDL_Quit();
@@ -3,18 +3,35 @@
 #define __WINDOW_TC__
 
 #include <SDL.h>
+#include <linux/videodev2.h>
+
+#include "scale.h"
+#include "pool.h"
+#include "bayer.h"
 
 #define WINDOW_DEFAULT_WIDTH    (720)
 #define WINDOW_DEFAULT_HEIGHT   (480)
+#define WINDOW_POOL_FRAMES      (1)         /* Per pool, frames are drawn one at a time */
 
 struct window {
     int width;
     int height;
+    struct v4l2_pix_format pix;
+    struct v4l2_rect crop;
+    int preview_width;
+    int preview_height;
+    struct scaler *scaler;
+    struct frame_pool *pool;                /* Scaled previews, at most the crop */
+    struct frame_pool *bayer_pool;          /* Demosaiced frames */
+    struct demosaic *bayer;                 /* Half size preview of raw Bayer frames */
+    uint32_t bayer_stride;
     SDL_Window *sdl_window;
     SDL_Renderer *sdl_renderer;
+    SDL_Texture *preview_texture;
+    SDL_Texture *mjpeg_texture;
 };
 
-struct window *window_create(int width, int height);
+struct window *window_create(struct v4l2_pix_format *pix, struct v4l2_rect *crop);
 int window_update_frame(struct window *window, void *addr, size_t size, int format);
 int window_get_event(struct window *window);
 void window_destory(struct window *window);